@@ -21,14 +21,14 @@
 **   ->   insertNoData: if true, replace any value of NoData (-9999) in filterMatrix by NoData.
 */
 
-void mcFilterMatrix(int **inMatrix, int **filterMatrix, bool filterNoData, bool filterOnes, bool insertNoData)
+void mcFilterMatrix(mcContext *ctx, int **inMatrix, int **filterMatrix, bool filterNoData, bool filterOnes, bool insertNoData)
 {
   int i, j;
 
   /* Set any value < 0 to 0 (removes NoData) */
   if(filterNoData){
-    for (i = 0; i < nrRows; i++){
-    for (j = 0; j < nrCols; j++){
+    for (i = 0; i < ctx->nrRows; i++){
+    for (j = 0; j < ctx->nrCols; j++){
       if (inMatrix[i][j] < 0) inMatrix[i][j] = 0;
     }
     }
@@ -36,8 +36,8 @@ void mcFilterMatrix(int **inMatrix, int **filterMatrix, bool filterNoData, bool
 
   /* Filter the input matrix for values of 1. */
   if(filterOnes){
-    for (i = 0; i < nrRows; i++){
-    for (j = 0; j < nrCols; j++){
+    for (i = 0; i < ctx->nrRows; i++){
+    for (j = 0; j < ctx->nrCols; j++){
       if (filterMatrix[i][j] == 1) inMatrix[i][j] = 0;
     }
     }
@@ -45,8 +45,8 @@ void mcFilterMatrix(int **inMatrix, int **filterMatrix, bool filterNoData, bool
   
   /* Add NoData where it is present in filterMatrix. */
   if(insertNoData){
-    for (i = 0; i < nrRows; i++){
-    for (j = 0; j < nrCols; j++){
+    for (i = 0; i < ctx->nrRows; i++){
+    for (j = 0; j < ctx->nrCols; j++){
       if (filterMatrix[i][j] == -9999) inMatrix[i][j] = -9999;
     }
     }
@@ -72,13 +72,14 @@ void mcFilterMatrix(int **inMatrix, int **filterMatrix, bool filterNoData, bool
 **   Otherwise:             False.
 */
 
-bool mcIntersectsBarrier (int snkX, int snkY, int srcX, int srcY,
+bool mcIntersectsBarrier (mcContext *ctx, int snkX, int snkY, int srcX, int srcY,
 			              int **barriers)
 {
   int  dstX, dstY, i, pxlX, pxlY, distMax, barCounter;
   bool barFound;
 
   barFound = false;
+  PRF_COUNT (barrierCalls, 1);
   
   /*
   ** Calculate the distance in both dimensions between the source and sink
@@ -99,7 +100,7 @@ bool mcIntersectsBarrier (int snkX, int snkY, int srcX, int srcY,
   ** Check the possible paths from source to sink and see if there is a path
   ** without barriers.
   */
-  if (barrierType == WEAK_BARRIER)
+  if (ctx->barrierType == WEAK_BARRIER)
   {
     /*
     ** Weak barrier: If there is at least one free path we're good.
@@ -107,6 +108,7 @@ bool mcIntersectsBarrier (int snkX, int snkY, int srcX, int srcY,
     ** BARRIER MIDDLE
     */
     barFound = false;
+    PRF_COUNT (raysWalked, 1);
     for (i = 1; i <= distMax; i++)
     {
       pxlX = (int)round (snkX + (1.0 * i / distMax * dstX));
@@ -125,6 +127,7 @@ bool mcIntersectsBarrier (int snkX, int snkY, int srcX, int srcY,
     ** BARRIER TOP_LEFT
     */
     barFound = false;
+    PRF_COUNT (raysWalked, 1);
     for (i = 1; i <= distMax; i++)
     {
       pxlX = (int)round (snkX - 0.49 + (1.0 * i / distMax * dstX));
@@ -143,6 +146,7 @@ bool mcIntersectsBarrier (int snkX, int snkY, int srcX, int srcY,
     ** BARRIER TOP_RIGHT
     */
     barFound = false;
+    PRF_COUNT (raysWalked, 1);
     for (i = 1; i <= distMax; i++)
     {
       pxlX = (int)round (snkX + 0.49 + (1.0 * i / distMax * dstX));
@@ -161,6 +165,7 @@ bool mcIntersectsBarrier (int snkX, int snkY, int srcX, int srcY,
     ** Barrier DOWN_LEFT
     */
     barFound = false;
+    PRF_COUNT (raysWalked, 1);
     for (i = 1; i <= distMax; i++)
     {
       pxlX = (int)round (snkX - 0.49 + (1.0 * i / distMax * dstX));
@@ -179,6 +184,7 @@ bool mcIntersectsBarrier (int snkX, int snkY, int srcX, int srcY,
     ** Barrier DOWN_RIGHT
     */
     barFound = false;
+    PRF_COUNT (raysWalked, 1);
     for (i = 1; i <= distMax; i++)
     {
       pxlX = (int)round (snkX + 0.49 + (1.0 * i / distMax * dstX));
@@ -194,7 +200,7 @@ bool mcIntersectsBarrier (int snkX, int snkY, int srcX, int srcY,
       goto End_of_Routine;
     }
   }
-  else if (barrierType == STRONG_BARRIER)
+  else if (ctx->barrierType == STRONG_BARRIER)
   {
     /*
     ** Strong barrier: If more than one way is blocked by a barrier then
@@ -205,6 +211,7 @@ bool mcIntersectsBarrier (int snkX, int snkY, int srcX, int srcY,
     /*
     ** BARRIER MIDDLE
     */
+    PRF_COUNT (raysWalked, 1);
     for (i = 1; i <= distMax; i++)
     {
       pxlX = (int)round (snkX + (1.0 * i / distMax * dstX));
@@ -218,6 +225,7 @@ bool mcIntersectsBarrier (int snkX, int snkY, int srcX, int srcY,
     /*
     ** BARRIER TOP_LEFT
     */
+    PRF_COUNT (raysWalked, 1);
     for (i = 1; i <= distMax; i++)
     {
       pxlX = (int)round (snkX - 0.49 + (((i-1.0) / distMax * dstX) +
@@ -238,6 +246,7 @@ bool mcIntersectsBarrier (int snkX, int snkY, int srcX, int srcY,
     /*    
     ** BARRIER TOP_RIGHT
     */
+    PRF_COUNT (raysWalked, 1);
     for (i = 1; i <= distMax; i++)
     {
       pxlX = (int)round (snkX + 0.49 + (((i-1.0) / distMax * dstX) +
@@ -258,6 +267,7 @@ bool mcIntersectsBarrier (int snkX, int snkY, int srcX, int srcY,
     /*
     ** BARRIER DOWN_LEFT
     */
+    PRF_COUNT (raysWalked, 1);
     for (i = 1; i <= distMax; i++)
     {
       pxlX = (int)round (snkX - 0.49 + (((i-1.0) / distMax * dstX) +
@@ -278,6 +288,7 @@ bool mcIntersectsBarrier (int snkX, int snkY, int srcX, int srcY,
     /*
     ** BARRIER DOWN_RIGHT
     */
+    PRF_COUNT (raysWalked, 1);
     for (i = 1; i <= distMax; i++)
     {
       pxlX = (int)round (snkX + 0.49 + (((i-1.0) / distMax * dstX) +
@@ -0,0 +1,1143 @@
+/*
+** benchmark.c: Benchmark suite for the MigClim methods. Synthetic landscapes
+**              are generated for a range of grid sizes, dispersal distances,
+**              barrier densities and occupancy fractions. The hot paths of the
+**              simulation are then timed in isolation, as well as complete
+**              'mcMigrate' runs, and the results are written to a JSON file.
+**
+** Note: All data files are written to the current working directory, which is
+**       expected to be a scratch directory that contains an (empty) "mcBench"
+**       subdirectory for the 'mcMigrate' outputs (see MigClim.benchmark()).
+*/
+
+#include "migclim.h"
+#include <zlib.h>
+
+
+/*
+** Defines.
+**
+** BENCH_NAME:       The simulation name used for the 'mcMigrate' runs.
+** BENCH_THRESHOLD:  The suitability threshold used by 'genClust'.
+** BENCH_ENV_STEPS:  The number of environmental change steps (and of
+**                   'genClust' iterations).
+** BENCH_DISP_STEPS: The number of dispersal steps per environmental step.
+** BENCH_NR_CLUST:   The number of genetic clusters.
+** BENCH_NR_POINTS:  The number of observed points used by 'validate'.
+** BENCH_NR_RAYS:    The number of 'mcIntersectsBarrier' calls per repetition.
+** BENCH_NR_VALID:   The number of stochastic replicates the mean-field engine
+**                   is validated against.
+** BENCH_TIFF_*:     The TIFF layouts of the raster round trip (see
+**                   'benchWriteTiff').
+*/
+#define BENCH_NAME       "mcBench"
+#define BENCH_THRESHOLD  500
+#define BENCH_ENV_STEPS  2
+#define BENCH_DISP_STEPS 5
+#define BENCH_NR_CLUST   4
+#define BENCH_NR_POINTS  100
+#define BENCH_NR_RAYS    100000
+#define BENCH_NR_VALID   64
+#define BENCH_TIFF_STRIPED 0
+#define BENCH_TIFF_TILED   1
+#define BENCH_TIFF_LZW     2
+#define BENCH_TIFF_DEFLATE 3
+#define BENCH_TIFF_LAYOUTS 4
+
+
+/*
+** Function prototypes.
+*/
+static void   benchResult    (mcContext *ctx, FILE *fp, bool *first, char *name, int dist,
+			      double barDens, double occup, long calls,
+			      int reps, int64_t *times);
+static int    benchWriteData (mcContext *ctx);
+static int    benchWriteParams (mcContext *ctx, char *fileName, char *suitName, char *barrName,
+				double *kernel, double prod, char *options);
+static int    benchCompare   (mcContext *ctx, FILE *fp, bool *first, int dist, double barDens,
+			      double occup, int **probMat, int **freqMat);
+static size_t benchLzw       (unsigned char *src, size_t srcLen, unsigned char *dst);
+static void   benchTiffEntry (FILE *fp, int tag, int type, int count, uint32_t value);
+static int    benchWriteTiff (mcContext *ctx, char *fName, int **mat, int layout);
+
+
+/*
+** mcSynthLandscape: Generate a synthetic landscape with the current
+**                   dimensions (nrRows x nrCols). The habitat suitability is
+**                   a smooth, noisy, periodic field that moves towards the
+**                   east with each environmental change step, the species
+**                   initially occupies the suitable cells of a band of
+**                   columns on the western side, and barriers are random
+**                   linear features (think of rivers and roads).
+**
+** Parameters:
+**   - hsMat:   The habitat suitability matrix to fill (values in [0;1000]).
+**   - iniMat:  The initial distribution matrix to fill (0 or 1).
+**   - barMat:  The barrier matrix to fill (0 or 1).
+**   - step:    The environmental change step (shifts the suitability).
+**   - barDens: The fraction of cells that are barriers.
+**   - occup:   The fraction of columns in the initially occupied band.
+*/
+
+void mcSynthLandscape (mcContext *ctx, int **hsMat, int **iniMat, int **barMat, int step,
+		       double barDens, double occup)
+{
+  int    i, j, k, len, nrBarriers, dirX, dirY, row, col;
+  double v;
+
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      v = 500.0 + 450.0 * sin (6.283185 * i / (ctx->nrRows / 2.0 + 1.0)) *
+	cos (6.283185 * (j - step * ctx->nrCols / 10.0) / (ctx->nrCols / 1.5 + 1.0)) +
+	(UNIF01 - 0.5) * 300.0;
+      hsMat[i][j] = (v < 0.0) ? 0 : ((v > 1000.0) ? 1000 : (int)v);
+      iniMat[i][j] = ((j < (int)ceil (occup * ctx->nrCols)) &&
+		      (hsMat[i][j] >= BENCH_THRESHOLD)) ? 1 : 0;
+      barMat[i][j] = 0;
+    }
+  }
+
+  /*
+  ** Draw random straight barriers until the requested density is reached.
+  */
+  nrBarriers = 0;
+  len = (ctx->nrRows < ctx->nrCols ? ctx->nrRows : ctx->nrCols) / 4 + 1;
+  while (nrBarriers < barDens * ctx->nrRows * ctx->nrCols)
+  {
+    row = mcRandom (ctx) % ctx->nrRows;
+    col = mcRandom (ctx) % ctx->nrCols;
+    dirX = (int)(mcRandom (ctx) % 3) - 1;
+    dirY = (int)(mcRandom (ctx) % 3) - 1;
+    if ((dirX == 0) && (dirY == 0))
+    {
+      dirY = 1;
+    }
+    for (k = 0; k < len; k++)
+    {
+      if ((row < 0) || (row >= ctx->nrRows) || (col < 0) || (col >= ctx->nrCols))
+      {
+	break;
+      }
+      if (barMat[row][col] == 0)
+      {
+	barMat[row][col] = 1;
+	nrBarriers++;
+      }
+      row += dirX;
+      col += dirY;
+    }
+  }
+}
+
+
+/*
+** mcBenchmark: Run the benchmark suite.
+**
+** Parameters:
+**   - outFile:   The name of the JSON file to write the results to.
+**   - sizes:     The grid sizes (number of rows and columns) to use.
+**   - nrSizes:   The number of grid sizes.
+**   - dists:     The dispersal distances to use.
+**   - nrDists:   The number of dispersal distances.
+**   - barDens:   The barrier densities to use (fraction of barrier cells).
+**   - nrBarDens: The number of barrier densities.
+**   - occup:     The occupancy fractions to use.
+**   - nrOccup:   The number of occupancy fractions.
+**   - nrReps:    The number of repetitions of each measurement.
+**   - status:    A pointer to an integer to contain 0 if everything went
+**                fine, or -1 if an error occurred.
+*/
+
+void mcBenchmark (char **outFile, int *sizes, int *nrSizes, int *dists,
+		  int *nrDists, double *barDens, int *nrBarDens, double *occup,
+		  int *nrOccup, int *nrReps, int *status)
+{
+  int      s, d, b, o, r, i, j, k, reps, loopID, ncls, niter, thrs, npts, geo,
+           store, nrFiles, *rays, **hsMat, **iniMat, **barMat, **state, **age, **tmpState,
+          **tmpAge;
+  long     calls;
+  int64_t  t0, *times;
+  double  *kernel, prod[1], score[2];
+  uint64_t *sources;
+  bool     first;
+  char     fileName[128], options[64], *name, *suitName, *barrName, *outName,
+          *initName, *obsName, *simName;
+  static char *engines[3] = {"mcMigrate", "mcBitSliced", "mcMeanField"};
+  static char *layouts[BENCH_TIFF_LAYOUTS] = {"readTiff_striped", "readTiff_tiled",
+					      "readTiff_lzw", "readTiff_deflate"};
+  FILE    *fp;
+  mcContext context, *ctx;
+
+  /*
+  ** Initialize the variables. The benchmark has its own context for the
+  ** methods it calls directly; the file based methods have theirs.
+  */
+  ctx = &context;
+  mcInitContext (ctx);
+  *status = 0;
+  reps = (*nrReps < 1) ? 1 : *nrReps;
+  first = true;
+  fp = NULL;
+  rays = NULL;
+  kernel = NULL;
+  sources = NULL;
+  hsMat = iniMat = barMat = state = age = tmpState = tmpAge = NULL;
+  suitName = "bench_hs";
+  barrName = "bench_bar";
+  outName = "bench_out";
+  initName = "";
+  store = 0;
+  obsName = "bench_obs.txt";
+  ctx->xllCorner = 0.0;
+  ctx->yllCorner = 0.0;
+  ctx->cellSize = 1.0;
+  ctx->noData = -9999;
+  times = (int64_t *)malloc (reps * sizeof (int64_t));
+  rays = (int *)malloc (4 * BENCH_NR_RAYS * sizeof (int));
+  if ((times == NULL) || (rays == NULL))
+  {
+    *status = -1;
+    Rprintf ("Not enough memory for the benchmark.\n");
+    goto End_of_Routine;
+  }
+
+  if ((fp = fopen (*outFile, "w")) == NULL)
+  {
+    *status = -1;
+    Rprintf ("Can't open benchmark output file %s for writing.\n", *outFile);
+    goto End_of_Routine;
+  }
+  fprintf (fp, "{\n  \"suite\": \"MigClim\",\n  \"results\": [");
+
+  for (s = 0; s < *nrSizes; s++)
+  {
+    ctx->nrRows = sizes[s];
+    ctx->nrCols = sizes[s];
+    Rprintf ("Benchmarking %d x %d grids...\n", ctx->nrRows, ctx->nrCols);
+    mcSeedRandom (ctx, (uint64_t)sizes[s]);
+    hsMat = mcAllocMat (ctx);
+    iniMat = mcAllocMat (ctx);
+    barMat = mcAllocMat (ctx);
+    state = mcAllocMat (ctx);
+    age = mcAllocMat (ctx);
+    tmpState = mcAllocMat (ctx);
+    tmpAge = mcAllocMat (ctx);
+    sources = (uint64_t *)malloc (ctx->nrRows * ((ctx->nrCols + 63) / 64) * sizeof (uint64_t));
+    if ((hsMat == NULL) || (iniMat == NULL) || (barMat == NULL) || (state == NULL) ||
+	(age == NULL) || (tmpState == NULL) || (tmpAge == NULL) || (sources == NULL))
+    {
+      *status = -1;
+      Rprintf ("Not enough memory for the benchmark of %d x %d grids.\n", ctx->nrRows,
+	       ctx->nrCols);
+      goto End_of_Routine;
+    }
+
+    /*
+    ** Raster input/output, which only depends on the grid size.
+    */
+    mcSynthLandscape (ctx, hsMat, iniMat, barMat, 1, barDens[0], occup[0]);
+    for (r = 0; r < reps; r++)
+    {
+      t0 = mcClockNs ();
+      if (writeMat (ctx, "bench_tmp.asc", hsMat) == -1)
+      {
+	*status = -1;
+	goto End_of_Routine;
+      }
+      times[r] = mcClockNs () - t0;
+    }
+    benchResult (ctx, fp, &first, "writeMat", 0, barDens[0], occup[0], 1, reps,
+		 times);
+    for (r = 0; r < reps; r++)
+    {
+      t0 = mcClockNs ();
+      if (readMat (ctx, "bench_tmp.asc", tmpState) == -1)
+      {
+	*status = -1;
+	goto End_of_Routine;
+      }
+      times[r] = mcClockNs () - t0;
+    }
+    benchResult (ctx, fp, &first, "readMat", 0, barDens[0], occup[0], 1, reps,
+		 times);
+
+    /*
+    ** The same matrix as a (Geo)TIFF file, in each of the layouts. Reading it
+    ** back must give the matrix and the georeference that were written.
+    */
+    for (k = 0; k < BENCH_TIFF_LAYOUTS; k++)
+    {
+      if (benchWriteTiff (ctx, "bench_tmp.tif", hsMat, k) == -1)
+      {
+	*status = -1;
+	goto End_of_Routine;
+      }
+      for (r = 0; r < reps; r++)
+      {
+	ctx->xllCorner = ctx->yllCorner = -1.0;
+	t0 = mcClockNs ();
+	if (readMat (ctx, "bench_tmp.tif", tmpState) == -1)
+	{
+	  *status = -1;
+	  goto End_of_Routine;
+	}
+	times[r] = mcClockNs () - t0;
+      }
+      for (i = 0; (i < ctx->nrRows) && (*status == 0); i++)
+      {
+	for (j = 0; (j < ctx->nrCols) && (*status == 0); j++)
+	{
+	  *status = (tmpState[i][j] == hsMat[i][j]) ? 0 : -1;
+	}
+      }
+      if ((*status == -1) || (ctx->xllCorner != 0.0) || (ctx->yllCorner != 0.0) ||
+	  (ctx->cellSize != 1.0))
+      {
+	*status = -1;
+	Rprintf ("Reading back the TIFF file of %s doesn't give the data written.\n",
+		 layouts[k]);
+	goto End_of_Routine;
+      }
+      benchResult (ctx, fp, &first, layouts[k], 0, barDens[0], occup[0], 1, reps,
+		   times);
+    }
+
+    for (b = 0; b < *nrBarDens; b++)
+    {
+      for (o = 0; o < *nrOccup; o++)
+      {
+	/*
+	** Generate the landscape and write it to file for the file based
+	** methods (seeding the generator to get the same landscapes for every
+	** run of the benchmark).
+	*/
+	mcSeedRandom (ctx, (uint64_t)(sizes[s] * 10000 + b * 100 + o));
+	for (k = 1; k <= BENCH_ENV_STEPS; k++)
+	{
+	  mcSynthLandscape (ctx, hsMat, iniMat, barMat, k, barDens[b], occup[o]);
+	  sprintf (fileName, "%s%d.asc", suitName, k);
+	  if (writeMat (ctx, fileName, hsMat) == -1)
+	  {
+	    *status = -1;
+	    goto End_of_Routine;
+	  }
+	  sprintf (fileName, "%s%d.asc", barrName, k);
+	  if (writeMat (ctx, fileName, barMat) == -1)
+	  {
+	    *status = -1;
+	    goto End_of_Routine;
+	  }
+	}
+	mcSynthLandscape (ctx, hsMat, iniMat, barMat, 1, barDens[b], occup[o]);
+	if ((writeMat (ctx, "bench_ini.asc", iniMat) == -1) ||
+	    (benchWriteData (ctx) == -1))
+	{
+	  *status = -1;
+	  goto End_of_Routine;
+	}
+
+	/*
+	** The genetic clusters methods (these do not depend on the
+	** dispersal distance or the occupancy).
+	*/
+	if (o == 0)
+	{
+	  ncls = BENCH_NR_CLUST;
+	  niter = BENCH_ENV_STEPS;
+	  thrs = BENCH_THRESHOLD;
+	  npts = BENCH_NR_POINTS;
+	  for (geo = 1; geo >= 0; geo--)
+	  {
+	    for (r = 0; r < reps; r++)
+	    {
+	      t0 = mcClockNs ();
+	      genClust (&ctx->nrRows, &ctx->nrCols, &ncls, &niter, &thrs, &suitName,
+			&barrName, &outName, &initName, &geo, &store);
+	      times[r] = mcClockNs () - t0;
+	    }
+	    benchResult (ctx, fp, &first, (geo == 1) ? "genClustGeodesic" : "genClust",
+			 0, barDens[b], occup[o], 1, reps, times);
+	  }
+	  sprintf (fileName, "%s%d.asc", outName, BENCH_ENV_STEPS);
+	  simName = fileName;
+	  for (r = 0; r < reps; r++)
+	  {
+	    t0 = mcClockNs ();
+	    validate (&obsName, &npts, &simName, &ncls, score);
+	    times[r] = mcClockNs () - t0;
+	  }
+	  benchResult (ctx, fp, &first, "validate", 0, barDens[b], occup[o], 1,
+		       reps, times);
+	}
+
+	for (d = 0; d < *nrDists; d++)
+	{
+	  /*
+	  ** Set the model parameters for each configuration.
+	  */
+	  ctx->dispDist = dists[d];
+	  if ((kernel = (double *)malloc (ctx->dispDist * sizeof (double))) == NULL)
+	  {
+	    *status = -1;
+	    Rprintf ("Not enough memory for the benchmark.\n");
+	    goto End_of_Routine;
+	  }
+	  for (k = 0; k < ctx->dispDist; k++)
+	  {
+	    kernel[k] = exp (-1.0 * k / ctx->dispDist);
+	  }
+	  ctx->dispKernel = kernel;
+	  prod[0] = 0.5;
+	  ctx->propaguleProd = prod;
+	  ctx->iniMatAge = 1;
+	  ctx->fullMatAge = 2;
+	  ctx->lddFreq = 0.1;
+	  ctx->lddMinDist = ctx->dispDist + 1;
+	  ctx->lddMaxDist = ctx->dispDist + 10;
+	  ctx->useBarrier = (barDens[b] > 0.0);
+	  ctx->barrierType = STRONG_BARRIER;
+	  loopID = 101;
+
+	  /*
+	  ** Prepare the state of the simulation as 'mcMigrate' does.
+	  */
+	  for (i = 0; i < ctx->nrRows; i++)
+	  {
+	    for (j = 0; j < ctx->nrCols; j++)
+	    {
+	      state[i][j] = (barMat[i][j] == 1) ? 0 : iniMat[i][j];
+	      age[i][j] = (state[i][j] == 1) ? ctx->fullMatAge : 0;
+	      if (barMat[i][j] == 1)
+	      {
+		hsMat[i][j] = 0;
+	      }
+	    }
+	  }
+
+	  /*
+	  ** Source cell search over all potential sink cells.
+	  */
+	  mcBuildSources (ctx, sources, state, age, loopID);
+	  calls = 0;
+	  for (r = 0; r < reps; r++)
+	  {
+	    calls = 0;
+	    t0 = mcClockNs ();
+	    for (i = 0; i < ctx->nrRows; i++)
+	    {
+	      for (j = 0; j < ctx->nrCols; j++)
+	      {
+		if ((hsMat[i][j] > 0) && (state[i][j] <= 0))
+		{
+		  mcSrcCell (ctx, i, j, sources, age, hsMat[i][j], barMat);
+		  calls++;
+		}
+	      }
+	    }
+	    times[r] = mcClockNs () - t0;
+	  }
+	  benchResult (ctx, fp, &first, "mcSrcCell", ctx->dispDist, barDens[b],
+		       occup[o], calls, reps, times);
+
+	  /*
+	  ** Barrier checks between random sink and source cells within the
+	  ** dispersal distance.
+	  */
+	  if (ctx->useBarrier)
+	  {
+	    for (k = 0; k < BENCH_NR_RAYS; k++)
+	    {
+	      rays[4*k] = mcRandom (ctx) % ctx->nrRows;
+	      rays[4*k+1] = mcRandom (ctx) % ctx->nrCols;
+	      rays[4*k+2] = rays[4*k] + (int)(mcRandom (ctx) % (2*ctx->dispDist+1)) - ctx->dispDist;
+	      rays[4*k+3] = rays[4*k+1] + (int)(mcRandom (ctx) % (2*ctx->dispDist+1)) - ctx->dispDist;
+	      rays[4*k+2] = (rays[4*k+2] < 0) ? 0 : ((rays[4*k+2] >= ctx->nrRows) ? ctx->nrRows-1 : rays[4*k+2]);
+	      rays[4*k+3] = (rays[4*k+3] < 0) ? 0 : ((rays[4*k+3] >= ctx->nrCols) ? ctx->nrCols-1 : rays[4*k+3]);
+	    }
+	    for (ctx->barrierType = WEAK_BARRIER; ctx->barrierType <= STRONG_BARRIER;
+		 ctx->barrierType++)
+	    {
+	      for (r = 0; r < reps; r++)
+	      {
+		t0 = mcClockNs ();
+		for (k = 0; k < BENCH_NR_RAYS; k++)
+		{
+		  mcIntersectsBarrier (ctx, rays[4*k], rays[4*k+1], rays[4*k+2],
+				       rays[4*k+3], barMat);
+		}
+		times[r] = mcClockNs () - t0;
+	      }
+	      name = (ctx->barrierType == WEAK_BARRIER) ?
+		"mcIntersectsBarrier_weak" : "mcIntersectsBarrier_strong";
+	      benchResult (ctx, fp, &first, name, ctx->dispDist, barDens[b], occup[o],
+			   BENCH_NR_RAYS, reps, times);
+	    }
+	    ctx->barrierType = STRONG_BARRIER;
+	  }
+
+	  /*
+	  ** The long-distance dispersal loop (on a copy of the state, so that
+	  ** every repetition starts from the same state).
+	  */
+	  for (r = 0; r < reps; r++)
+	  {
+	    for (i = 0; i < ctx->nrRows; i++)
+	    {
+	      memcpy (tmpState[i], state[i], ctx->nrCols * sizeof (int));
+	      memcpy (tmpAge[i], age[i], ctx->nrCols * sizeof (int));
+	    }
+	    t0 = mcClockNs ();
+	    mcLddDispersal (ctx, tmpState, tmpAge, hsMat, loopID, NULL);
+	    times[r] = mcClockNs () - t0;
+	  }
+	  benchResult (ctx, fp, &first, "mcLddDispersal", ctx->dispDist, barDens[b],
+		       occup[o], 1, reps, times);
+
+	  /*
+	  ** The complete simulation, followed by the bit-sliced engine (with
+	  ** BENCH_NR_VALID replicates) and the mean-field engine. The
+	  ** simulation parameters are written to file first, as 'mcMigrate'
+	  ** (re)reads them.
+	  */
+	  sprintf (fileName, "%s/%s_params.txt", BENCH_NAME, BENCH_NAME);
+	  name = fileName;
+	  for (k = 0; k < 3; k++)
+	  {
+	    sprintf (options, "replicateNb %d\n%s", (k == 1) ? BENCH_NR_VALID : 1,
+		     (k == 1) ? "bitSliced true\n" : ((k == 2) ? "meanField true\n" : ""));
+	    if (benchWriteParams (ctx, fileName, suitName, barrName, kernel, prod[0],
+				  options) == -1)
+	    {
+	      *status = -1;
+	      goto End_of_Routine;
+	    }
+	    for (r = 0; r < reps; r++)
+	    {
+	      t0 = mcClockNs ();
+	      mcMigrate (&name, &nrFiles);
+	      times[r] = mcClockNs () - t0;
+	      if (nrFiles == -1)
+	      {
+		*status = -1;
+		goto End_of_Routine;
+	      }
+	    }
+	    benchResult (ctx, fp, &first, engines[k], dists[d], barDens[b],
+			 occup[o], 1, reps, times);
+	  }
+	  ctx->dispKernel = NULL;
+	  ctx->propaguleProd = NULL;
+	  free (kernel);
+	  kernel = NULL;
+
+	  /*
+	  ** Validate the mean-field occupancy probabilities against the
+	  ** occupancy frequencies of the stochastic replicates.
+	  */
+	  if (benchCompare (ctx, fp, &first, dists[d], barDens[b], occup[o],
+			    tmpState, tmpAge) == -1)
+	  {
+	    *status = -1;
+	    goto End_of_Routine;
+	  }
+	}
+      }
+    }
+
+    mcFreeMat (ctx, hsMat);
+    mcFreeMat (ctx, iniMat);
+    mcFreeMat (ctx, barMat);
+    mcFreeMat (ctx, state);
+    mcFreeMat (ctx, age);
+    mcFreeMat (ctx, tmpState);
+    mcFreeMat (ctx, tmpAge);
+    free (sources);
+    sources = NULL;
+    hsMat = iniMat = barMat = state = age = tmpState = tmpAge = NULL;
+  }
+  fprintf (fp, "\n  ]\n}\n");
+  Rprintf ("Benchmark results written to %s\n", *outFile);
+
+ End_of_Routine:
+  /*
+  ** Close the files and free the allocated memory.
+  */
+  if (fp != NULL)
+  {
+    fclose (fp);
+  }
+  if (kernel != NULL)
+  {
+    free (kernel);
+  }
+  mcFreeMat (ctx, hsMat);
+  mcFreeMat (ctx, iniMat);
+  mcFreeMat (ctx, barMat);
+  mcFreeMat (ctx, state);
+  mcFreeMat (ctx, age);
+  mcFreeMat (ctx, tmpState);
+  mcFreeMat (ctx, tmpAge);
+  if (sources != NULL)
+  {
+    free (sources);
+  }
+  free (times);
+  free (rays);
+}
+
+
+/*
+** benchResult: Write the result of one measurement as a JSON object.
+**
+** Parameters:
+**   - fp:      The JSON output file.
+**   - first:   Whether this is the first result (no separator needed).
+**   - name:    The name of the benchmarked function.
+**   - dist:    The dispersal distance (0 if not relevant).
+**   - barDens: The barrier density of the landscape.
+**   - occup:   The occupancy fraction of the landscape.
+**   - calls:   The number of calls to the function per repetition.
+**   - reps:    The number of repetitions.
+**   - times:   The time taken by each repetition (in nanoseconds).
+*/
+
+static void benchResult (mcContext *ctx, FILE *fp, bool *first, char *name, int dist,
+			 double barDens, double occup, long calls, int reps,
+			 int64_t *times)
+{
+  int     r;
+  int64_t minNs;
+  double  meanNs;
+
+  minNs = times[0];
+  meanNs = 0.0;
+  for (r = 0; r < reps; r++)
+  {
+    if (times[r] < minNs)
+    {
+      minNs = times[r];
+    }
+    meanNs += (double)times[r] / reps;
+  }
+  fprintf (fp, "%s\n    {\"name\": \"%s\", \"nrRows\": %d, \"nrCols\": %d, "
+	   "\"dispDist\": %d, \"barrierDensity\": %g, \"occupancy\": %g, "
+	   "\"calls\": %ld, \"reps\": %d, \"minNs\": %.0f, \"meanNs\": %.0f, "
+	   "\"nsPerCall\": %.3f}", (*first ? "" : ","), name, ctx->nrRows, ctx->nrCols,
+	   dist, barDens, occup, calls, reps, (double)minNs, meanNs,
+	   (calls > 0) ? (double)minNs / calls : 0.0);
+  *first = false;
+}
+
+
+/*
+** benchWriteData: Write a synthetic observed genetic clusters file in the
+**                 format expected by 'validate'.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+static int benchWriteData (mcContext *ctx)
+{
+  int   k;
+  FILE *fp;
+
+  if ((fp = fopen ("bench_obs.txt", "w")) == NULL)
+  {
+    Rprintf ("Can't open data file bench_obs.txt for writing.\n");
+    return (-1);
+  }
+  fprintf (fp, "N X Y C\n");
+  for (k = 0; k < BENCH_NR_POINTS; k++)
+  {
+    fprintf (fp, "%d %f %f %d\n", k + 1,
+	     ctx->xllCorner + UNIF01 * ctx->nrCols * ctx->cellSize,
+	     ctx->yllCorner + UNIF01 * ctx->nrRows * ctx->cellSize,
+	     (k % BENCH_NR_CLUST) + 1);
+  }
+  fclose (fp);
+  return (0);
+}
+
+
+/*
+** benchWriteParams: Write the parameter file of a complete simulation with
+**                   the current parameters.
+**
+** Parameters:
+**   - fileName: The name of the parameter file.
+**   - suitName: The base name of the habitat suitability files.
+**   - barrName: The base name of the barrier files.
+**   - kernel:   The dispersal kernel.
+**   - prod:     The propagule production of the only immature age.
+**   - options:  Extra lines to add to the file (e.g. the number of
+**               replicates and the engine).
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+static int benchWriteParams (mcContext *ctx, char *fileName, char *suitName, char *barrName,
+			     double *kernel, double prod, char *options)
+{
+  int   k;
+  FILE *fp;
+
+  if ((fp = fopen (fileName, "w")) == NULL)
+  {
+    Rprintf ("Can't open parameter file %s for writing.\n", fileName);
+    return (-1);
+  }
+  fprintf (fp, "nrRows %d\nnrCols %d\niniDist bench_ini\nhsMap %s\n",
+	   ctx->nrRows, ctx->nrCols, suitName);
+  fprintf (fp, "rcThreshold 0\nenvChgSteps %d\ndispSteps %d\n",
+	   BENCH_ENV_STEPS, BENCH_DISP_STEPS);
+  fprintf (fp, "dispDist %d\ndispKernel", ctx->dispDist);
+  for (k = 0; k < ctx->dispDist; k++)
+  {
+    fprintf (fp, " %f", kernel[k]);
+  }
+  fprintf (fp, "\n");
+  if (ctx->useBarrier)
+  {
+    fprintf (fp, "barrier %s1\nbarrierType strong\n", barrName);
+  }
+  fprintf (fp, "iniMatAge %d\nfullMatAge %d\npropaguleProd %f\n",
+	   ctx->iniMatAge, ctx->fullMatAge, prod);
+  fprintf (fp, "lddFreq %f\nlddMinDist %d\nlddMaxDist %d\n",
+	   ctx->lddFreq, ctx->lddMinDist, ctx->lddMaxDist);
+  fprintf (fp, "fullOutput false\n%ssimulName %s\n", options, BENCH_NAME);
+  fclose (fp);
+  return (0);
+}
+
+
+/*
+** benchCompare: Compare the occupancy probabilities of the mean-field engine
+**               with the occupancy frequencies of the BENCH_NR_VALID
+**               replicates of the bit-sliced engine (as written by the last
+**               runs), and write the mean absolute difference per cell and
+**               the expected and mean numbers of occupied cells to the JSON
+**               file.
+**
+** Parameters:
+**   - fp:      The JSON output file.
+**   - first:   Whether this is the first result (no separator needed).
+**   - dist:    The dispersal distance.
+**   - barDens: The barrier density of the landscape.
+**   - occup:   The occupancy fraction of the landscape.
+**   - probMat: A matrix to read the occupancy probabilities into.
+**   - freqMat: A matrix to read the occupancy frequencies into.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+static int benchCompare (mcContext *ctx, FILE *fp, bool *first, int dist, double barDens,
+			 double occup, int **probMat, int **freqMat)
+{
+  int    i, j, nrCells;
+  double diff, expected, mean;
+  char   fileName[128];
+
+  sprintf (fileName, "%s/%s_probability.asc", BENCH_NAME, BENCH_NAME);
+  if (readMat (ctx, fileName, probMat) == -1)
+  {
+    return (-1);
+  }
+  sprintf (fileName, "%s/%s_frequency.asc", BENCH_NAME, BENCH_NAME);
+  if (readMat (ctx, fileName, freqMat) == -1)
+  {
+    return (-1);
+  }
+  nrCells = 0;
+  diff = expected = mean = 0.0;
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      if ((probMat[i][j] < 0) || (freqMat[i][j] < 0))
+      {
+	continue;
+      }
+      nrCells++;
+      expected += probMat[i][j] / 1000.0;
+      mean += (double)freqMat[i][j] / BENCH_NR_VALID;
+      diff += fabs (probMat[i][j] / 1000.0 - (double)freqMat[i][j] / BENCH_NR_VALID);
+    }
+  }
+  fprintf (fp, "%s\n    {\"name\": \"mcMeanField_validation\", \"nrRows\": %d, "
+	   "\"nrCols\": %d, \"dispDist\": %d, \"barrierDensity\": %g, "
+	   "\"occupancy\": %g, \"replicates\": %d, \"meanAbsDiff\": %.4f, "
+	   "\"expectedOccupied\": %.2f, \"meanOccupied\": %.2f}",
+	   (*first ? "" : ","), ctx->nrRows, ctx->nrCols, dist, barDens, occup,
+	   BENCH_NR_VALID, (nrCells > 0) ? diff / nrCells : 0.0, expected, mean);
+  *first = false;
+  return (0);
+}
+
+
+/*
+** benchLzw: Compress a buffer with the TIFF flavour of LZW, as libtiff does
+**           (the codes are packed from the most significant bit onwards, and
+**           their width grows one code early).
+**
+** Parameters:
+**   - src:    The data to compress.
+**   - srcLen: The number of bytes in 'src'.
+**   - dst:    The buffer for the compressed data (which needs room for
+**             2 * srcLen + 8 bytes).
+**
+** Returns:
+**   - The number of bytes in 'dst', or 0 if there is not enough memory.
+*/
+
+static size_t benchLzw (unsigned char *src, size_t srcLen, unsigned char *dst)
+{
+  int       h, code, nextCode, width, nrBits, *keys, *codes;
+  size_t    k, n;
+  uint32_t  bits;
+
+  /*
+  ** The string table is a hash table of the (prefix code, byte) pairs.
+  */
+  keys = (int *)malloc (8192 * sizeof (int));
+  codes = (int *)malloc (8192 * sizeof (int));
+  if ((keys == NULL) || (codes == NULL))
+  {
+    free (keys);
+    free (codes);
+    return (0);
+  }
+  memset (keys, -1, 8192 * sizeof (int));
+  n = 0;
+  bits = 0;
+  nrBits = 0;
+  width = 9;
+  nextCode = 258;
+#define BENCH_PUT(c) \
+  { \
+    bits = (bits << width) | (uint32_t)(c); \
+    nrBits += width; \
+    while (nrBits >= 8) \
+    { \
+      dst[n++] = (unsigned char)(bits >> (nrBits - 8)); \
+      nrBits -= 8; \
+    } \
+  }
+  BENCH_PUT (256);
+  code = (srcLen > 0) ? src[0] : -1;
+  for (k = 1; k < srcLen; k++)
+  {
+    h = (int)((((uint32_t)code << 8) | src[k]) * 2654435761u >> 19);
+    while ((keys[h] != -1) && (keys[h] != ((code << 8) | src[k])))
+    {
+      h = (h + 1) & 8191;
+    }
+    if (keys[h] != -1)
+    {
+      code = codes[h];
+      continue;
+    }
+    BENCH_PUT (code);
+    keys[h] = (code << 8) | src[k];
+    codes[h] = nextCode++;
+    code = src[k];
+    if (nextCode == 4094)
+    {
+      /*
+      ** The table is full: clear it.
+      */
+      BENCH_PUT (256);
+      memset (keys, -1, 8192 * sizeof (int));
+      nextCode = 258;
+      width = 9;
+    }
+    else if (nextCode > (1 << width) - 1)
+    {
+      width++;
+    }
+  }
+
+  /*
+  ** The last code, which makes the decoder add an entry (so the width may
+  ** have to grow before the end of information code), and the end of
+  ** information code.
+  */
+  if (code != -1)
+  {
+    BENCH_PUT (code);
+    if (++nextCode == 4094)
+    {
+      BENCH_PUT (256);
+      width = 9;
+    }
+    else if (nextCode > (1 << width) - 1)
+    {
+      width++;
+    }
+  }
+  BENCH_PUT (257);
+#undef BENCH_PUT
+  if (nrBits > 0)
+  {
+    dst[n++] = (unsigned char)(bits << (8 - nrBits));
+  }
+  free (keys);
+  free (codes);
+  return (n);
+}
+
+
+/*
+** benchTiffEntry: Write a (little endian) TIFF IFD entry.
+**
+** Parameters:
+**   - fp:    The TIFF file.
+**   - tag:   The tag.
+**   - type:  The type of the values (3: SHORT, 4: LONG, 12: DOUBLE).
+**   - count: The number of values.
+**   - value: The value, or the offset of the values if they do not fit in
+**            the entry.
+*/
+
+static void benchTiffEntry (FILE *fp, int tag, int type, int count, uint32_t value)
+{
+  int           k;
+  unsigned char entry[12];
+
+  memset (entry, 0, 12);
+  entry[0] = (unsigned char)tag;
+  entry[1] = (unsigned char)(tag >> 8);
+  entry[2] = (unsigned char)type;
+  for (k = 0; k < 4; k++)
+  {
+    entry[4 + k] = (unsigned char)((uint32_t)count >> (8 * k));
+    entry[8 + k] = (unsigned char)(value >> (8 * k));
+  }
+  fwrite (entry, 1, 12, fp);
+}
+
+
+/*
+** benchWriteTiff: Write a data matrix to a little endian GeoTIFF file with
+**                 32-bit signed integer samples, in one of the layouts:
+**                 - BENCH_TIFF_STRIPED: strips of 16 rows, no compression.
+**                 - BENCH_TIFF_TILED:   32 x 32 tiles, no compression.
+**                 - BENCH_TIFF_LZW:     strips of 16 rows, LZW compression
+**                                       and the horizontal differencing
+**                                       predictor.
+**                 - BENCH_TIFF_DEFLATE: strips of 16 rows, Deflate
+**                                       compression.
+**
+** Parameters:
+**   - fName:  The name of the file.
+**   - mat:    The data matrix to write.
+**   - layout: The layout (BENCH_TIFF_*).
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+static int benchWriteTiff (mcContext *ctx, char *fName, int **mat, int layout)
+{
+  int            c, i, j, k, chunkWidth, chunkHeight, nrChunkCols, nrChunks,
+                 nrRowsInChunk, row, col, status;
+  uint32_t       v, prev, ifdOffset, *offsets, *byteCounts;
+  uint64_t       d;
+  size_t         rawLen, bufLen, len;
+  uLongf         zLen;
+  double         geo[9];
+  unsigned char *raw, *buf, head[8];
+  FILE          *fp;
+
+#define BENCH_LE(p, v, n) \
+  for (k = 0; k < (n); k++) \
+  { \
+    (p)[k] = (unsigned char)((uint64_t)(v) >> (8 * k)); \
+  }
+
+  status = -1;
+  raw = buf = NULL;
+  offsets = byteCounts = NULL;
+  chunkWidth = (layout == BENCH_TIFF_TILED) ? 32 : ctx->nrCols;
+  chunkHeight = (layout == BENCH_TIFF_TILED) ? 32 : 16;
+  nrChunkCols = (ctx->nrCols + chunkWidth - 1) / chunkWidth;
+  nrChunks = nrChunkCols * ((ctx->nrRows + chunkHeight - 1) / chunkHeight);
+  rawLen = (size_t)chunkWidth * chunkHeight * 4;
+  if ((fp = fopen (fName, "wb")) == NULL)
+  {
+    Rprintf ("Can't open data file %s for writing.\n", fName);
+    return (-1);
+  }
+  raw = (unsigned char *)malloc (rawLen);
+  bufLen = ((2 * rawLen + 64) > (size_t)8 * nrChunks + 72) ? 2 * rawLen + 64 :
+    (size_t)8 * nrChunks + 72;
+  buf = (unsigned char *)malloc (bufLen);
+  offsets = (uint32_t *)malloc (nrChunks * sizeof (uint32_t));
+  byteCounts = (uint32_t *)malloc (nrChunks * sizeof (uint32_t));
+  if ((raw == NULL) || (buf == NULL) || (offsets == NULL) || (byteCounts == NULL))
+  {
+    Rprintf ("Not enough memory to write data file %s.\n", fName);
+    goto End_of_Routine;
+  }
+
+  /*
+  ** The header (the offset of the IFD is set at the end), then the chunks.
+  ** Tiles are padded with zeros; the last strip only has the rows that are
+  ** left, as libtiff writes it.
+  */
+  memcpy (head, "II*\0\0\0\0\0", 8);
+  fwrite (head, 1, 8, fp);
+  for (c = 0; c < nrChunks; c++)
+  {
+    nrRowsInChunk = chunkHeight;
+    if ((layout != BENCH_TIFF_TILED) && ((c + 1) * chunkHeight > ctx->nrRows))
+    {
+      nrRowsInChunk = ctx->nrRows - c * chunkHeight;
+    }
+    memset (raw, 0, rawLen);
+    for (i = 0; i < nrRowsInChunk; i++)
+    {
+      prev = 0;
+      for (j = 0; j < chunkWidth; j++)
+      {
+	row = (c / nrChunkCols) * chunkHeight + i;
+	col = (c % nrChunkCols) * chunkWidth + j;
+	v = ((row < ctx->nrRows) && (col < ctx->nrCols)) ? (uint32_t)mat[row][col] : 0;
+	if (layout == BENCH_TIFF_LZW)
+	{
+	  /*
+	  ** The horizontal differencing predictor.
+	  */
+	  v -= prev;
+	  prev += v;
+	}
+	BENCH_LE (raw + ((size_t)i * chunkWidth + j) * 4, v, 4);
+      }
+    }
+    len = (size_t)chunkWidth * nrRowsInChunk * 4;
+    if (layout == BENCH_TIFF_LZW)
+    {
+      len = benchLzw (raw, len, buf);
+    }
+    else if (layout == BENCH_TIFF_DEFLATE)
+    {
+      zLen = bufLen;
+      len = (compress (buf, &zLen, raw, (uLong)len) == Z_OK) ? (size_t)zLen : 0;
+    }
+    else
+    {
+      memcpy (buf, raw, len);
+    }
+    if (len == 0)
+    {
+      Rprintf ("Can't compress TIFF strip %d of data file %s.\n", c, fName);
+      goto End_of_Routine;
+    }
+    offsets[c] = (uint32_t)ftell (fp);
+    byteCounts[c] = (uint32_t)len;
+    if (fwrite (buf, 1, len, fp) != len)
+    {
+      Rprintf ("Can't write data file %s.\n", fName);
+      goto End_of_Routine;
+    }
+  }
+
+  /*
+  ** The arrays that do not fit in an IFD entry: the chunk offsets and byte
+  ** counts, the pixel scale and the tie point (of the upper left corner).
+  */
+  geo[0] = ctx->cellSize;
+  geo[1] = ctx->cellSize;
+  geo[2] = 0.0;
+  geo[3] = geo[4] = geo[5] = geo[8] = 0.0;
+  geo[6] = ctx->xllCorner;
+  geo[7] = ctx->yllCorner + ctx->nrRows * ctx->cellSize;
+  len = (size_t)ftell (fp);
+  for (c = 0; c < nrChunks; c++)
+  {
+    BENCH_LE (buf + 4 * c, offsets[c], 4);
+    BENCH_LE (buf + 4 * (nrChunks + c), byteCounts[c], 4);
+  }
+  for (i = 0; i < 9; i++)
+  {
+    memcpy (&d, geo + i, sizeof (double));
+    BENCH_LE (buf + 8 * nrChunks + 8 * i, d, 8);
+  }
+  fwrite (buf, 1, 8 * nrChunks + 72, fp);
+
+  /*
+  ** The IFD, with its entries in increasing tag order (a single chunk offset
+  ** or byte count goes in the entry itself).
+  */
+  ifdOffset = (uint32_t)ftell (fp);
+  BENCH_LE (head, (layout == BENCH_TIFF_TILED) ? 15 : 14, 2);
+  fwrite (head, 1, 2, fp);
+  benchTiffEntry (fp, 256, 4, 1, (uint32_t)ctx->nrCols);
+  benchTiffEntry (fp, 257, 4, 1, (uint32_t)ctx->nrRows);
+  benchTiffEntry (fp, 258, 3, 1, 32);
+  benchTiffEntry (fp, 259, 3, 1, (layout == BENCH_TIFF_LZW) ? 5 :
+		  ((layout == BENCH_TIFF_DEFLATE) ? 8 : 1));
+  benchTiffEntry (fp, 262, 3, 1, 1);
+  if (layout != BENCH_TIFF_TILED)
+  {
+    benchTiffEntry (fp, 273, 4, nrChunks, (nrChunks == 1) ? offsets[0] : (uint32_t)len);
+  }
+  benchTiffEntry (fp, 277, 3, 1, 1);
+  if (layout != BENCH_TIFF_TILED)
+  {
+    benchTiffEntry (fp, 278, 4, 1, (uint32_t)chunkHeight);
+    benchTiffEntry (fp, 279, 4, nrChunks, (nrChunks == 1) ? byteCounts[0] :
+		    (uint32_t)(len + 4 * nrChunks));
+  }
+  benchTiffEntry (fp, 284, 3, 1, 1);
+  benchTiffEntry (fp, 317, 3, 1, (layout == BENCH_TIFF_LZW) ? 2 : 1);
+  if (layout == BENCH_TIFF_TILED)
+  {
+    benchTiffEntry (fp, 322, 4, 1, (uint32_t)chunkWidth);
+    benchTiffEntry (fp, 323, 4, 1, (uint32_t)chunkHeight);
+    benchTiffEntry (fp, 324, 4, nrChunks, (nrChunks == 1) ? offsets[0] : (uint32_t)len);
+    benchTiffEntry (fp, 325, 4, nrChunks, (nrChunks == 1) ? byteCounts[0] :
+		    (uint32_t)(len + 4 * nrChunks));
+  }
+  benchTiffEntry (fp, 339, 3, 1, 2);
+  benchTiffEntry (fp, 33550, 12, 3, (uint32_t)(len + 8 * nrChunks));
+  benchTiffEntry (fp, 33922, 12, 6, (uint32_t)(len + 8 * nrChunks + 24));
+  memset (head, 0, 4);
+  fwrite (head, 1, 4, fp);
+  BENCH_LE (head, ifdOffset, 4);
+  if ((fseek (fp, 4, SEEK_SET) != 0) || (fwrite (head, 1, 4, fp) != 4))
+  {
+    Rprintf ("Can't write data file %s.\n", fName);
+    goto End_of_Routine;
+  }
+  status = 0;
+#undef BENCH_LE
+
+ End_of_Routine:
+  /*
+  ** Close the file and free the allocated memory.
+  */
+  if (fclose (fp) != 0)
+  {
+    Rprintf ("Can't write data file %s.\n", fName);
+    status = -1;
+  }
+  free (raw);
+  free (buf);
+  free (offsets);
+  free (byteCounts);
+  return (status);
+}
+
+
+/*
+** EoF: benchmark.c
+*/
@@ -0,0 +1,659 @@
+/*
+** bitslice.c: A bit-sliced MigClim engine, which simulates up to 64
+**             replicates in a single pass over the grid.
+**
+** The replicates only differ in their random draws: the habitat suitability
+** and barriers are the same for all of them. So the occupied/empty state of
+** 64 replicates ("lanes") is kept in one 64-bit word per cell, the cell ages
+** in a few bit planes (a saturating binary counter per lane, as only ages up
+** to the full maturity age matter), and the colonization draws of all lanes
+** are made at once with per-lane random bit streams (see 'bsBernoulli'). The
+** barrier check between a sink and a source cell is done only once for all
+** lanes. Each replicate follows the same model as in 'mcMigrate', with the
+** same distributions, but the random numbers are used differently, so the
+** results for a given seed are not those of 'mcMigrate'.
+**
+** As the colonization time of the cells is not tracked, no final raster is
+** written per replicate. Instead, the number of replicates in which each cell
+** is occupied at the end of the simulation is written to a "frequency" raster.
+*/
+
+#include "migclim.h"
+
+
+/*
+** BS_LANES: The number of replicates simulated at once.
+*/
+#define BS_LANES 64
+
+
+/*
+** The pixel counters of a replicate (see 'mcMigrate'), and its statistics
+** file.
+*/
+typedef struct _bsLane
+{
+  int   colonized, absent, totColonized, totDecolonized, totLDDSuccess,
+        stepColonized, stepDecolonized, stepLDDSuccess;
+  FILE *fp;
+} bsLane;
+
+
+/*
+** bsBernoulli: Draw a Bernoulli(p) variable for each lane of a mask. A lane
+**              is set in the result if its uniform random number is below p,
+**              which is decided bit by bit (most significant first) with one
+**              random word for all lanes; on average, about log2(64) + 2
+**              words are needed, whatever the number of lanes.
+**
+** Parameters:
+**   - p:     The probability of success.
+**   - lanes: The lanes to draw for.
+**
+** Returns:
+**   The lanes that succeeded.
+*/
+
+static uint64_t bsBernoulli (mcContext *ctx, double p, uint64_t lanes)
+{
+  int      b;
+  uint64_t r, result, pBits;
+
+  if (p >= 1.0)
+  {
+    return (lanes);
+  }
+  if (p <= 0.0)
+  {
+    return (0);
+  }
+  pBits = (uint64_t)(p * 4294967296.0);
+  result = 0;
+  for (b = 31; (b >= 0) && (lanes != 0); b--)
+  {
+    r = mcRandom (ctx);
+    if ((pBits >> b) & 1)
+    {
+      result |= lanes & ~r;
+      lanes &= r;
+    }
+    else
+    {
+      lanes &= ~r;
+    }
+  }
+  return (result);
+}
+
+
+/*
+** bsAgeEquals: The lanes of a cell whose age equals a given value.
+**
+** Parameters:
+**   - age:      The age planes of the cell.
+**   - nrPlanes: The number of planes.
+**   - value:    The age.
+*/
+
+static uint64_t bsAgeEquals (uint64_t *age, int nrPlanes, int value)
+{
+  int      b;
+  uint64_t m;
+
+  m = ~(uint64_t)0;
+  for (b = 0; b < nrPlanes; b++)
+  {
+    m &= ((value >> b) & 1) ? age[b] : ~age[b];
+  }
+  return (m);
+}
+
+
+/*
+** bsAgeSet: Set the age of some lanes of a cell to a given value.
+*/
+
+static void bsAgeSet (uint64_t *age, int nrPlanes, uint64_t lanes, int value)
+{
+  int b;
+
+  for (b = 0; b < nrPlanes; b++)
+  {
+    age[b] = ((value >> b) & 1) ? (age[b] | lanes) : (age[b] & ~lanes);
+  }
+}
+
+
+/*
+** bsAgeIncrement: Increment the age of some lanes of a cell, up to the full
+**                 maturity age.
+*/
+
+static void bsAgeIncrement (mcContext *ctx, uint64_t *age, int nrPlanes, uint64_t lanes)
+{
+  int      b;
+  uint64_t carry, t;
+
+  carry = lanes & ~bsAgeEquals (age, nrPlanes, ctx->fullMatAge);
+  for (b = 0; (b < nrPlanes) && (carry != 0); b++)
+  {
+    t = age[b] & carry;
+    age[b] ^= carry;
+    carry = t;
+  }
+}
+
+
+/*
+** bsMatureDraw: Make the draws of a source cell for some lanes, where the
+**               probability of success of a lane depends on its age: 'prob'
+**               for fully mature lanes, and 'prob' times the propagule
+**               production for the others (lanes younger than the initial
+**               maturity age fail).
+*/
+
+static uint64_t bsMatureDraw (mcContext *ctx, uint64_t *age, int nrPlanes, uint64_t lanes, double prob)
+{
+  int      a;
+  uint64_t m, won;
+
+  won = 0;
+  for (a = ctx->iniMatAge; (a <= ctx->fullMatAge) && (lanes != 0); a++)
+  {
+    m = lanes & bsAgeEquals (age, nrPlanes, a);
+    if (m != 0)
+    {
+      won |= bsBernoulli (ctx, (a < ctx->fullMatAge) ? prob * ctx->propaguleProd[a - ctx->iniMatAge] : prob, m);
+      lanes &= ~m;
+    }
+  }
+  return (won);
+}
+
+
+/*
+** mcBitSliced: Run all replicates of the simulation with the bit-sliced
+**              engine, 64 at a time. The parameter values must have been
+**              read with 'mcInit'.
+**
+**              For each replicate, the statistics and summary files of
+**              'mcMigrate' are written (with the same names), and the
+**              occupancy frequency of each cell to a 'simulName_frequency.asc'
+**              raster.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+int mcBitSliced (mcContext *ctx)
+{
+  int       i, j, k, l, c, s, r, q, lane, nrLanes, first, nrPlanes, status,
+            envChgStep, dispStep, loopID, realDist, simulTime, nrInitial,
+            nrAbsent, nrNoDispersal, nrUnivDispersal, **iniMat, **barriers,
+            **habSuit, **noDisp, **freq;
+  uint64_t  laneMask, pending, src, won, bit, *occ, *fresh, *age;
+  double    rndDist, rndAngle;
+  char      fileName[512], simulName2[256];
+  FILE     *fp;
+  time_t    startTime;
+  bsLane    lanes[BS_LANES];
+
+  status = -1;
+  occ = fresh = age = NULL;
+  iniMat = barriers = habSuit = noDisp = freq = NULL;
+  for (lane = 0; lane < BS_LANES; lane++)
+  {
+    lanes[lane].fp = NULL;
+  }
+  if ((ctx->checkpointFreq > 0) || ctx->resumeSimul || ctx->fullOutput || ctx->resultStore || (strlen (ctx->sweepFile) > 0))
+  {
+    Rprintf ("Checkpoints, full output, result stores and sweeps are not supported by the bit-sliced engine.\n");
+    goto End_of_Routine;
+  }
+
+  /*
+  ** Allocate the necessary memory. The age planes of a cell are stored next
+  ** to each other.
+  */
+  for (nrPlanes = 1; (1 << nrPlanes) <= ctx->fullMatAge; nrPlanes++);
+  occ = (uint64_t *)malloc (ctx->nrRows * ctx->nrCols * sizeof (uint64_t));
+  fresh = (uint64_t *)malloc (ctx->nrRows * ctx->nrCols * sizeof (uint64_t));
+  age = (uint64_t *)malloc (ctx->nrRows * ctx->nrCols * nrPlanes * sizeof (uint64_t));
+  iniMat = (int **)calloc (ctx->nrRows, sizeof (int *));
+  barriers = (int **)calloc (ctx->nrRows, sizeof (int *));
+  habSuit = (int **)calloc (ctx->nrRows, sizeof (int *));
+  noDisp = (int **)calloc (ctx->nrRows, sizeof (int *));
+  freq = (int **)calloc (ctx->nrRows, sizeof (int *));
+  if ((occ == NULL) || (fresh == NULL) || (age == NULL) || (iniMat == NULL) ||
+      (barriers == NULL) || (habSuit == NULL) || (noDisp == NULL) || (freq == NULL))
+  {
+    Rprintf ("Not enough memory for the bit-sliced simulation.\n");
+    goto End_of_Routine;
+  }
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    iniMat[i] = (int *)malloc (ctx->nrCols * sizeof (int));
+    barriers[i] = (int *)malloc (ctx->nrCols * sizeof (int));
+    habSuit[i] = (int *)malloc (ctx->nrCols * sizeof (int));
+    noDisp[i] = (int *)malloc (ctx->nrCols * sizeof (int));
+    freq[i] = (int *)calloc (ctx->nrCols, sizeof (int));
+    if ((iniMat[i] == NULL) || (barriers[i] == NULL) || (habSuit[i] == NULL) ||
+	(noDisp[i] == NULL) || (freq[i] == NULL))
+    {
+      Rprintf ("Not enough memory for the bit-sliced simulation.\n");
+      goto End_of_Routine;
+    }
+  }
+
+  /*
+  ** Load and filter the initial distribution and barriers (see 'mcMigrate').
+  */
+  if (mcFileName (fileName, sizeof (fileName), "%s.asc", ctx->iniDist) == -1)
+  {
+    goto End_of_Routine;
+  }
+  if (readMat (ctx, fileName, iniMat) == -1)
+  {
+    goto End_of_Routine;
+  }
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      barriers[i][j] = 0;
+    }
+  }
+  if (ctx->useBarrier)
+  {
+    if (mcFileName (fileName, sizeof (fileName), "%s.asc", ctx->barrier) == -1)
+    {
+      goto End_of_Routine;
+    }
+    if (readMat (ctx, fileName, barriers) == -1)
+    {
+      goto End_of_Routine;
+    }
+  }
+  mcFilterMatrix (ctx, barriers, iniMat, true, false, true);
+  if (ctx->useBarrier)
+  {
+    mcFilterMatrix (ctx, iniMat, barriers, false, true, false);
+  }
+  nrInitial = 0;
+  nrAbsent = 0;
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      if (iniMat[i][j] == 1)
+      {
+	nrInitial++;
+      }
+      if (iniMat[i][j] == 0)
+      {
+	nrAbsent++;
+      }
+    }
+  }
+
+  /*
+  ** Simulate the replicates in batches of (at most) 64 lanes.
+  */
+  for (first = 0; first < ctx->replicateNb; first += BS_LANES)
+  {
+    startTime = time (NULL);
+    nrLanes = (ctx->replicateNb - first < BS_LANES) ? ctx->replicateNb - first : BS_LANES;
+    laneMask = (nrLanes == BS_LANES) ? ~(uint64_t)0 : (((uint64_t)1 << nrLanes) - 1);
+
+    /*
+    ** The initial state of all lanes.
+    */
+    for (c = 0; c < ctx->nrRows * ctx->nrCols; c++)
+    {
+      i = c / ctx->nrCols;
+      j = c % ctx->nrCols;
+      occ[c] = (iniMat[i][j] == 1) ? laneMask : 0;
+      noDisp[i][j] = iniMat[i][j];
+      bsAgeSet (age + c * nrPlanes, nrPlanes, ~(uint64_t)0, 0);
+      bsAgeSet (age + c * nrPlanes, nrPlanes, occ[c], ctx->fullMatAge);
+    }
+    nrNoDispersal = nrInitial;
+    nrUnivDispersal = nrInitial;
+    for (lane = 0; lane < nrLanes; lane++)
+    {
+      memset (&lanes[lane], 0, sizeof (bsLane));
+      lanes[lane].colonized = nrInitial;
+      lanes[lane].absent = nrAbsent;
+      if (ctx->replicateNb == 1)
+      {
+	strcpy (simulName2, ctx->simulName);
+      }
+      else
+      {
+	if (mcFileName (simulName2, sizeof (simulName2), "%s%d", ctx->simulName,
+			first + lane + 1) == -1)
+	{
+	  goto End_of_Routine;
+	}
+      }
+      if (mcFileName (fileName, sizeof (fileName), "%s/%s_stats.txt", ctx->simulName,
+		      simulName2) == -1)
+      {
+	goto End_of_Routine;
+      }
+      if ((lanes[lane].fp = fopen (fileName, "w")) == NULL)
+      {
+	Rprintf ("Could not open statistics file for writing.\n");
+	goto End_of_Routine;
+      }
+      fprintf (lanes[lane].fp, "envChgStep\tdispStep\tstepID\tunivDispersal\tNoDispersal\toccupied\tabsent\tstepColonized\tstepDecolonized\tstepLDDsuccess\n");
+      fprintf (lanes[lane].fp, "0\t0\t1\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", nrUnivDispersal,
+	       nrNoDispersal, nrInitial, nrAbsent, 0, 0, 0);
+    }
+
+    Rprintf ("Running MigClim simulation %s (replicates %d to %d, bit-sliced).\n",
+	     ctx->simulName, first + 1, first + nrLanes);
+    for (envChgStep = 1; envChgStep <= ctx->envChgSteps; envChgStep++)
+    {
+      Rprintf ("  %d...\n", envChgStep);
+
+      /*
+      ** Load, reclassify and filter the habitat suitability (from memory
+      ** after the first batch).
+      */
+      if (mcReadHabitat (ctx, ctx->hsMap, envChgStep, habSuit, ctx->replicateNb > BS_LANES) == -1)
+      {
+	goto End_of_Routine;
+      }
+      if (ctx->rcThreshold > 0)
+      {
+	for (i = 0; i < ctx->nrRows; i++)
+	{
+	  for (j = 0; j < ctx->nrCols; j++)
+	  {
+	    habSuit[i][j] = (habSuit[i][j] < ctx->rcThreshold) ? 0 : 1000;
+	  }
+	}
+      }
+      mcFilterMatrix (ctx, habSuit, barriers, true, true, true);
+      nrUnivDispersal = mcUnivDispCnt (ctx, habSuit);
+      updateNoDispMat (ctx, habSuit, noDisp, &nrNoDispersal);
+      loopID = envChgStep * 100;
+
+      /*
+      ** Occupied cells that became unsuitable are temporarily resilient:
+      ** they stay occupied until the end of this environmental change step.
+      */
+      for (lane = 0; lane < nrLanes; lane++)
+      {
+	lanes[lane].stepDecolonized = 0;
+      }
+      for (c = 0; c < ctx->nrRows * ctx->nrCols; c++)
+      {
+	if (habSuit[c / ctx->nrCols][c % ctx->nrCols] == 0)
+	{
+	  for (won = occ[c]; won != 0; won &= won - 1)
+	  {
+	    lanes[mcCtz (won)].stepDecolonized++;
+	  }
+	}
+      }
+
+      for (dispStep = 1; dispStep <= ctx->dispSteps; dispStep++)
+      {
+	loopID++;
+	for (lane = 0; lane < nrLanes; lane++)
+	{
+	  lanes[lane].stepColonized = 0;
+	  lanes[lane].stepLDDSuccess = 0;
+	  if (dispStep > 1)
+	  {
+	    lanes[lane].stepDecolonized = 0;
+	  }
+	}
+	memset (fresh, 0, ctx->nrRows * ctx->nrCols * sizeof (uint64_t));
+
+	/*
+	** Sink cells: search the dispersal window once for all the lanes in
+	** which the cell is empty, until each of them is colonized.
+	*/
+	for (i = 0; i < ctx->nrRows; i++)
+	{
+	  for (j = 0; j < ctx->nrCols; j++)
+	  {
+	    c = i * ctx->nrCols + j;
+	    if (habSuit[i][j] <= 0)
+	    {
+	      continue;
+	    }
+	    pending = ~occ[c] & laneMask;
+	    for (k = i - ctx->dispDist; (k <= i + ctx->dispDist) && (pending != 0); k++)
+	    {
+	      if ((k < 0) || (k >= ctx->nrRows))
+	      {
+		continue;
+	      }
+	      for (l = j - ctx->dispDist; (l <= j + ctx->dispDist) && (pending != 0); l++)
+	      {
+		if ((l < 0) || (l >= ctx->nrCols))
+		{
+		  continue;
+		}
+		s = k * ctx->nrCols + l;
+		src = occ[s] & ~fresh[s] & pending;
+		if (src == 0)
+		{
+		  continue;
+		}
+		realDist = (int)round (sqrt ((k-i)*(k-i) + (l-j)*(l-j)));
+		if ((realDist == 0) || (realDist > ctx->dispDist))
+		{
+		  continue;
+		}
+		won = bsMatureDraw (ctx, age + s * nrPlanes, nrPlanes, src,
+				    ctx->dispKernel[realDist-1] * (habSuit[i][j] / 1000.0));
+		if ((won == 0) || (ctx->useBarrier && mcIntersectsBarrier (ctx, i, j, k, l, barriers)))
+		{
+		  continue;
+		}
+		pending &= ~won;
+		occ[c] |= won;
+		fresh[c] |= won;
+		bsAgeSet (age + c * nrPlanes, nrPlanes, won, 0);
+		for (; won != 0; won &= won - 1)
+		{
+		  lanes[mcCtz (won)].stepColonized++;
+		}
+	      }
+	    }
+	  }
+	}
+
+	/*
+	** Long distance dispersal: the target cell is drawn for each lane
+	** separately.
+	*/
+	if (ctx->lddFreq > 0.0)
+	{
+	  for (c = 0; c < ctx->nrRows * ctx->nrCols; c++)
+	  {
+	    src = occ[c] & ~fresh[c];
+	    if (src == 0)
+	    {
+	      continue;
+	    }
+	    won = bsMatureDraw (ctx, age + c * nrPlanes, nrPlanes, src, ctx->lddFreq);
+	    for (; won != 0; won &= won - 1)
+	    {
+	      lane = mcCtz (won);
+	      bit = (uint64_t)1 << lane;
+	      rndDist = (UNIF01 * (ctx->lddMaxDist - ctx->lddMinDist)) + ctx->lddMinDist;
+	      rndAngle = UNIF01 * 6.283185;
+	      r = c / ctx->nrCols + (int)(rndDist * cos (rndAngle));
+	      q = c % ctx->nrCols + (int)(rndDist * sin (rndAngle));
+	      if ((r < 0) || (r >= ctx->nrRows) || (q < 0) || (q >= ctx->nrCols) ||
+		  (occ[r * ctx->nrCols + q] & bit) || (habSuit[r][q] <= 0) ||
+		  ((habSuit[r][q] < 1000) && (UNIF01 * 1000 > habSuit[r][q])))
+	      {
+		continue;
+	      }
+	      occ[r * ctx->nrCols + q] |= bit;
+	      fresh[r * ctx->nrCols + q] |= bit;
+	      bsAgeSet (age + (r * ctx->nrCols + q) * nrPlanes, nrPlanes, bit, 0);
+	      lanes[lane].stepLDDSuccess++;
+	      lanes[lane].stepColonized++;
+	    }
+	  }
+	}
+
+	/*
+	** Aging and statistics.
+	*/
+	for (c = 0; c < ctx->nrRows * ctx->nrCols; c++)
+	{
+	  if (occ[c] != 0)
+	  {
+	    bsAgeIncrement (ctx, age + c * nrPlanes, nrPlanes, occ[c]);
+	  }
+	}
+	for (lane = 0; lane < nrLanes; lane++)
+	{
+	  lanes[lane].colonized += lanes[lane].stepColonized - lanes[lane].stepDecolonized;
+	  lanes[lane].absent += lanes[lane].stepDecolonized - lanes[lane].stepColonized;
+	  lanes[lane].totColonized += lanes[lane].stepColonized;
+	  lanes[lane].totDecolonized += lanes[lane].stepDecolonized;
+	  lanes[lane].totLDDSuccess += lanes[lane].stepLDDSuccess;
+	  fprintf (lanes[lane].fp, "%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", envChgStep,
+		   dispStep, loopID, nrUnivDispersal, nrNoDispersal, lanes[lane].colonized,
+		   lanes[lane].absent, lanes[lane].stepColonized,
+		   lanes[lane].stepDecolonized, lanes[lane].stepLDDSuccess);
+	}
+      }
+
+      /*
+      ** The temporarily resilient cells are decolonized.
+      */
+      for (c = 0; c < ctx->nrRows * ctx->nrCols; c++)
+      {
+	if (habSuit[c / ctx->nrCols][c % ctx->nrCols] == 0)
+	{
+	  bsAgeSet (age + c * nrPlanes, nrPlanes, occ[c], 0);
+	  occ[c] = 0;
+	}
+      }
+    }
+
+    /*
+    ** Occupancy frequencies and the summary of each replicate.
+    */
+    simulTime = time (NULL) - startTime;
+    for (c = 0; c < ctx->nrRows * ctx->nrCols; c++)
+    {
+      for (won = occ[c]; won != 0; won &= won - 1)
+      {
+	freq[c / ctx->nrCols][c % ctx->nrCols]++;
+      }
+    }
+    for (lane = 0; lane < nrLanes; lane++)
+    {
+      fclose (lanes[lane].fp);
+      lanes[lane].fp = NULL;
+      if (ctx->replicateNb == 1)
+      {
+	strcpy (simulName2, ctx->simulName);
+      }
+      else
+      {
+	if (mcFileName (simulName2, sizeof (simulName2), "%s%d", ctx->simulName,
+			first + lane + 1) == -1)
+	{
+	  goto End_of_Routine;
+	}
+      }
+      if (mcFileName (fileName, sizeof (fileName), "%s/%s_summary.txt", ctx->simulName,
+		      simulName2) == -1)
+      {
+	goto End_of_Routine;
+      }
+      if ((fp = fopen (fileName, "w")) == NULL)
+      {
+	Rprintf ("Could not write summary output to file.\n");
+	goto End_of_Routine;
+      }
+      fprintf (fp, "simulName\tiniCount\tnoDispCount\tunivDispCount\toccupiedCount\tabsentCount\ttotColonized\ttotDecolonized\ttotLDDsuccess\trunTime\n");
+      fprintf (fp, "%s\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", simulName2, nrInitial,
+	       nrNoDispersal, nrUnivDispersal, lanes[lane].colonized, lanes[lane].absent,
+	       lanes[lane].totColonized, lanes[lane].totDecolonized,
+	       lanes[lane].totLDDSuccess, simulTime);
+      fclose (fp);
+    }
+  }
+
+  /*
+  ** Write the occupancy frequency raster (NoData where the last habitat
+  ** suitability layer has NoData).
+  */
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      if (habSuit[i][j] == -9999)
+      {
+	freq[i][j] = -9999;
+      }
+    }
+  }
+  if (mcFileName (fileName, sizeof (fileName), "%s/%s_frequency.asc", ctx->simulName,
+		  ctx->simulName) == -1)
+  {
+    goto End_of_Routine;
+  }
+  if (writeMat (ctx, fileName, freq) == -1)
+  {
+    goto End_of_Routine;
+  }
+  status = 0;
+
+ End_of_Routine:
+  for (lane = 0; lane < BS_LANES; lane++)
+  {
+    if (lanes[lane].fp != NULL)
+    {
+      fclose (lanes[lane].fp);
+    }
+  }
+  if (occ != NULL)
+  {
+    free (occ);
+  }
+  if (fresh != NULL)
+  {
+    free (fresh);
+  }
+  if (age != NULL)
+  {
+    free (age);
+  }
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    if (iniMat != NULL) free (iniMat[i]);
+    if (barriers != NULL) free (barriers[i]);
+    if (habSuit != NULL) free (habSuit[i]);
+    if (noDisp != NULL) free (noDisp[i]);
+    if (freq != NULL) free (freq[i]);
+  }
+  if (iniMat != NULL) free (iniMat);
+  if (barriers != NULL) free (barriers);
+  if (habSuit != NULL) free (habSuit);
+  if (noDisp != NULL) free (noDisp);
+  if (freq != NULL) free (freq);
+  mcClearLayerCache (ctx);
+
+  return (status);
+}
+
+
+/*
+** EoF: bitslice.c
+*/
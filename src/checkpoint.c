@@ -0,0 +1,257 @@
+/*
+** checkpoint.c: Functions for saving and restoring the state of a MigClim
+**               simulation at environmental change step boundaries, so that
+**               long simulations can be resumed after an interruption.
+**
+** The checkpoint file is a compact binary file with the following layout:
+**   - The magic string "MCCKPT01".
+**   - nrRows, nrCols, repLoop, nextStep, nrCounters, elapsed (int32).
+**   - The offset of the statistics file (int64).
+**   - The random number generator state (MC_RNG_STATE_SIZE x uint64).
+**   - The pixel counters (nrCounters x int32).
+**   - The currentState, pixelAge and noDispersal matrices (int32, by row).
+**
+** The file is in native byte order, i.e. a checkpoint is meant to be resumed
+** on the same (kind of) machine it was written on.
+*/
+
+#include "migclim.h"
+
+#define MC_CKPT_MAGIC "MCCKPT01"
+
+
+/*
+** mcWriteCheckpoint: Write the state of the simulation to a checkpoint file.
+**                    The data is first written to a temporary file which then
+**                    replaces the previous checkpoint, so that an interruption
+**                    while writing never destroys the last valid checkpoint.
+**
+** Parameters:
+**   - fName:       The name of the checkpoint file.
+**   - repLoop:     The current replicate.
+**   - nextStep:    The environmental change step to resume from (a value
+**                  larger than envChgSteps means the replicate is finished).
+**   - counters:    The pixel counters.
+**   - nrCounters:  The number of pixel counters.
+**   - statsOffset: The current offset in the statistics file.
+**   - elapsed:     The simulation time elapsed so far (in seconds).
+**   - curState:    The current state matrix.
+**   - pxlAge:      The pixel age matrix.
+**   - noDispMat:   The no-dispersal matrix.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+int mcWriteCheckpoint (mcContext *ctx, char *fName, int repLoop, int nextStep, int *counters,
+		       int nrCounters, long statsOffset, int elapsed,
+		       int **curState, int **pxlAge, int **noDispMat)
+{
+  int      i, status, header[6];
+  int64_t  offset;
+  uint64_t rng[MC_RNG_STATE_SIZE];
+  char     tmpName[256];
+  FILE    *fp;
+
+  status = 0;
+  if (mcFileName (tmpName, sizeof (tmpName), "%s.tmp", fName) == -1)
+  {
+    return (-1);
+  }
+  if ((fp = fopen (tmpName, "wb")) == NULL)
+  {
+    status = -1;
+    Rprintf ("Can't open checkpoint file %s for writing.\n", tmpName);
+    goto End_of_Routine;
+  }
+
+  header[0] = ctx->nrRows;
+  header[1] = ctx->nrCols;
+  header[2] = repLoop;
+  header[3] = nextStep;
+  header[4] = nrCounters;
+  header[5] = elapsed;
+  offset = statsOffset;
+  mcGetRandomState (ctx, rng);
+  if ((fwrite (MC_CKPT_MAGIC, 1, 8, fp) != 8) ||
+      (fwrite (header, sizeof (int), 6, fp) != 6) ||
+      (fwrite (&offset, sizeof (int64_t), 1, fp) != 1) ||
+      (fwrite (rng, sizeof (uint64_t), MC_RNG_STATE_SIZE, fp) != MC_RNG_STATE_SIZE) ||
+      (fwrite (counters, sizeof (int), nrCounters, fp) != (size_t)nrCounters))
+  {
+    status = -1;
+  }
+  for (i = 0; (i < ctx->nrRows) && (status == 0); i++)
+  {
+    if ((fwrite (curState[i], sizeof (int), ctx->nrCols, fp) != (size_t)ctx->nrCols) ||
+	(fwrite (pxlAge[i], sizeof (int), ctx->nrCols, fp) != (size_t)ctx->nrCols) ||
+	(fwrite (noDispMat[i], sizeof (int), ctx->nrCols, fp) != (size_t)ctx->nrCols))
+    {
+      status = -1;
+    }
+  }
+  if (fclose (fp) != 0)
+  {
+    status = -1;
+  }
+  if (status == -1)
+  {
+    Rprintf ("Could not write checkpoint file %s.\n", tmpName);
+    remove (tmpName);
+    goto End_of_Routine;
+  }
+
+  /*
+  ** Replace the previous checkpoint ('rename' does not overwrite existing
+  ** files on Windows).
+  */
+  remove (fName);
+  if (rename (tmpName, fName) != 0)
+  {
+    status = -1;
+    Rprintf ("Could not rename checkpoint file %s.\n", tmpName);
+  }
+
+ End_of_Routine:
+  return (status);
+}
+
+
+/*
+** mcReadCheckpoint: Restore the state of a simulation from a checkpoint file.
+**                   The random number generator state is restored as well.
+**
+** Parameters:
+**   See 'mcWriteCheckpoint' above. All scalar values are returned through
+**   pointers, and the matrices are assumed to be allocated already.
+**
+** Returns:
+**   - If everything went fine:        0.
+**   - If the file does not exist:     1.
+**   - If the file could not be read: -1.
+*/
+
+int mcReadCheckpoint (mcContext *ctx, char *fName, int *repLoop, int *nextStep, int *counters,
+		      int nrCounters, long *statsOffset, int *elapsed,
+		      int **curState, int **pxlAge, int **noDispMat)
+{
+  int      i, status, header[6];
+  int64_t  offset;
+  uint64_t rng[MC_RNG_STATE_SIZE];
+  char     magic[8];
+  FILE    *fp;
+
+  status = 0;
+  if ((fp = fopen (fName, "rb")) == NULL)
+  {
+    status = 1;
+    goto End_of_Routine;
+  }
+
+  if ((fread (magic, 1, 8, fp) != 8) ||
+      (memcmp (magic, MC_CKPT_MAGIC, 8) != 0) ||
+      (fread (header, sizeof (int), 6, fp) != 6) ||
+      (header[0] != ctx->nrRows) || (header[1] != ctx->nrCols) ||
+      (header[4] != nrCounters) ||
+      (fread (&offset, sizeof (int64_t), 1, fp) != 1) ||
+      (fread (rng, sizeof (uint64_t), MC_RNG_STATE_SIZE, fp) != MC_RNG_STATE_SIZE) ||
+      (fread (counters, sizeof (int), nrCounters, fp) != (size_t)nrCounters))
+  {
+    status = -1;
+    Rprintf ("Invalid checkpoint file %s.\n", fName);
+    goto End_of_Routine;
+  }
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    if ((fread (curState[i], sizeof (int), ctx->nrCols, fp) != (size_t)ctx->nrCols) ||
+	(fread (pxlAge[i], sizeof (int), ctx->nrCols, fp) != (size_t)ctx->nrCols) ||
+	(fread (noDispMat[i], sizeof (int), ctx->nrCols, fp) != (size_t)ctx->nrCols))
+    {
+      status = -1;
+      Rprintf ("Truncated checkpoint file %s.\n", fName);
+      goto End_of_Routine;
+    }
+  }
+  *repLoop = header[2];
+  *nextStep = header[3];
+  *elapsed = header[5];
+  *statsOffset = (long)offset;
+  mcSetRandomState (ctx, rng);
+
+ End_of_Routine:
+  if (fp != NULL)
+  {
+    fclose (fp);
+  }
+  return (status);
+}
+
+
+/*
+** mcTruncateFile: Truncate a (text) file to a given length. This is used to
+**                 discard the statistics written after the last checkpoint
+**                 before appending to the file again.
+**
+** Parameters:
+**   - fName:  The name of the file.
+**   - length: The length (in bytes) to keep.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+int mcTruncateFile (char *fName, long length)
+{
+  int   status;
+  char *buffer;
+  FILE *fp;
+
+  status = 0;
+  buffer = NULL;
+  fp = NULL;
+
+  /*
+  ** Read the part of the file we want to keep and write it back. This is
+  ** portable, and statistics files are small.
+  */
+  if ((buffer = (char *)malloc (length + 1)) == NULL)
+  {
+    status = -1;
+    goto End_of_Routine;
+  }
+  if (((fp = fopen (fName, "rb")) == NULL) ||
+      (fread (buffer, 1, length, fp) != (size_t)length))
+  {
+    status = -1;
+    goto End_of_Routine;
+  }
+  fclose (fp);
+  if (((fp = fopen (fName, "wb")) == NULL) ||
+      (fwrite (buffer, 1, length, fp) != (size_t)length))
+  {
+    status = -1;
+    goto End_of_Routine;
+  }
+
+ End_of_Routine:
+  if (status == -1)
+  {
+    Rprintf ("Could not truncate file %s.\n", fName);
+  }
+  if (fp != NULL)
+  {
+    fclose (fp);
+  }
+  if (buffer != NULL)
+  {
+    free (buffer);
+  }
+  return (status);
+}
+
+
+/*
+** EoF: checkpoint.c
+*/
@@ -0,0 +1,700 @@
+/*
+** community.c: Simulate the migration of several species (a community) over
+**              the same grid and barriers at once. Each species has its own
+**              initial distribution, habitat suitability maps and dispersal
+**              parameters, read from a community manifest (see sweep.c).
+**
+** The states of the species are kept in separate planes (one matrix per
+** species), and the sink cells of all species are handled in a single pass
+** over the grid: for every cell, the dispersal window is traversed only once
+** for all the species for which the cell is a suitable sink, and the result
+** of a barrier check between the sink and a source cell is shared by all these
+** species. For a community of a single species, the results are exactly those
+** of 'mcMigrate' (for the same random numbers).
+*/
+
+#include "migclim.h"
+
+
+/*
+** The result of a barrier check in the current window traversal.
+*/
+#define CM_BAR_UNKNOWN 0
+#define CM_BAR_FREE    1
+#define CM_BAR_BLOCKED 2
+
+
+/*
+** The pixel counters of a species (see 'mcMigrate'), and its statistics file.
+*/
+typedef struct _cmCounters
+{
+  int   initial, colonized, absent, noDispersal, univDispersal, totColonized,
+        totDecolonized, totLDDSuccess, stepColonized, stepDecolonized,
+        stepLDDSuccess;
+  FILE *fp;
+} cmCounters;
+
+
+/*
+** cmSelect: Make the dispersal parameters of a species the current ones, for
+**           the functions that use the parameter values of the context.
+*/
+
+static void cmSelect (mcContext *ctx, mcScenario *species)
+{
+  ctx->dispDist = species->dispDist;
+  ctx->dispKernel = species->dispKernel;
+  ctx->iniMatAge = species->iniMatAge;
+  ctx->fullMatAge = species->fullMatAge;
+  ctx->propaguleProd = species->propaguleProd;
+  ctx->lddFreq = species->lddFreq;
+  ctx->rcThreshold = species->rcThreshold;
+}
+
+
+/*
+** cmSinkStep: Colonize the suitable sink cells of all species in one pass
+**             over the grid (see 'mcSrcCell' for the conditions).
+**
+** Parameters:
+**   - species:   The species.
+**   - nrSpecies: The number of species.
+**   - maxDist:   The largest dispersal distance of all species.
+**   - state:     The current state matrices of the species.
+**   - age:       The pixel age matrices of the species.
+**   - habSuit:   The habitat suitability matrices of the species.
+**   - barriers:  The barriers matrix.
+**   - loopID:    The ID of the current loop.
+**   - pending:   An array of nrSpecies elements (work space).
+**   - counters:  The counters of the species (the number of colonized cells
+**                is updated).
+*/
+
+static void cmSinkStep (mcContext *ctx, mcScenario *species, int nrSpecies, int maxDist,
+			int ***state, int ***age, int ***habSuit, int **barriers,
+			int loopID, int *pending, cmCounters *counters)
+{
+  int         i, j, k, l, p, q, s, nrPending, realDist, barState;
+  double      probCol, rnd;
+  mcScenario *sp;
+
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      /*
+      ** The species for which this is a suitable sink (habitat is suitable
+      ** and the cell is not occupied).
+      */
+      nrPending = 0;
+      for (s = 0; s < nrSpecies; s++)
+      {
+	if ((habSuit[s][i][j] > 0) && (state[s][i][j] <= 0))
+	{
+	  pending[nrPending++] = s;
+	}
+      }
+
+      /*
+      ** Traverse the dispersal window once for all these species, until
+      ** each of them has found a source cell.
+      */
+      for (k = i - maxDist; (k <= i + maxDist) && (nrPending > 0); k++)
+      {
+	if ((k < 0) || (k >= ctx->nrRows))
+	{
+	  continue;
+	}
+	for (l = j - maxDist; (l <= j + maxDist) && (nrPending > 0); l++)
+	{
+	  if ((l < 0) || (l >= ctx->nrCols))
+	  {
+	    continue;
+	  }
+	  realDist = (int)round (sqrt ((k-i)*(k-i) + (l-j)*(l-j)));
+	  if ((realDist == 0) || (realDist > maxDist))
+	  {
+	    continue;
+	  }
+	  barState = CM_BAR_UNKNOWN;
+	  for (p = 0; p < nrPending; p++)
+	  {
+	    s = pending[p];
+	    sp = &species[s];
+	    if ((realDist > sp->dispDist) || (state[s][k][l] <= 0) ||
+		(state[s][k][l] == loopID) || (age[s][k][l] < sp->iniMatAge))
+	    {
+	      continue;
+	    }
+	    if (age[s][k][l] >= sp->fullMatAge)
+	    {
+	      probCol = sp->dispKernel[realDist-1] * (habSuit[s][i][j] / 1000.0);
+	    }
+	    else
+	    {
+	      probCol = sp->dispKernel[realDist-1] *
+			sp->propaguleProd[age[s][k][l] - sp->iniMatAge] *
+			(habSuit[s][i][j] / 1000.0);
+	    }
+	    rnd = UNIF01;
+	    if ((rnd >= probCol) && (probCol != 1.0))
+	    {
+	      continue;
+	    }
+
+	    /*
+	    ** The barrier check is done at most once per source cell.
+	    */
+	    if (ctx->useBarrier)
+	    {
+	      if (barState == CM_BAR_UNKNOWN)
+	      {
+		barState = mcIntersectsBarrier (ctx, i, j, k, l, barriers) ?
+			   CM_BAR_BLOCKED : CM_BAR_FREE;
+	      }
+	      if (barState == CM_BAR_BLOCKED)
+	      {
+		continue;
+	      }
+	    }
+
+	    /*
+	    ** Colonize the sink cell and drop the species from the list.
+	    */
+	    state[s][i][j] = loopID;
+	    age[s][i][j] = 0;
+	    counters[s].stepColonized++;
+	    for (q = p; q < nrPending - 1; q++)
+	    {
+	      pending[q] = pending[q+1];
+	    }
+	    nrPending--;
+	    p--;
+	  }
+	}
+      }
+    }
+  }
+}
+
+
+/*
+** mcCommunity: Run the migration simulation for a community of species.
+**              The general parameter values (grid size, barriers, number of
+**              steps, long distance dispersal distances, replicates, ...)
+**              are read from a parameter file, the species from the community
+**              manifest given in it ('communityFile').
+**
+**              For each species and replicate, the statistics, final raster
+**              and summary files of 'mcMigrate' are written, with output
+**              names "simulName_species" (+ "_" and the replicate number),
+**              and the summaries of all species are collected into one
+**              "simulName_community.txt" table.
+**
+** Parameters:
+**   - paramFile: The name of the parameter file.
+**   - nrFiles:   A pointer to an integer to contain the number of
+**                environmental change steps done. A value of -1 is returned
+**                if an error occurred.
+*/
+
+void mcCommunity (char **paramFile, int *nrFiles)
+{
+  int          i, j, s, RepLoop, envChgStep, dispStep, loopID, nrSpecies,
+               maxDist, simulTime, *pending, ***state, ***age, ***habSuit,
+               ***noDisp, **barriers;
+  char         fileName[512], simulName2[256];
+  FILE        *fp;
+  time_t       startTime;
+  cmCounters  *cnt;
+  mcScenario  *species;
+  mcContext    context, *ctx;
+
+  /*
+  ** Initialize the variables.
+  */
+  ctx = &context;
+  mcInitContext (ctx);
+  nrSpecies = 0;
+  species = NULL;
+  state = age = habSuit = noDisp = NULL;
+  barriers = NULL;
+  pending = NULL;
+  cnt = NULL;
+  *nrFiles = mcInit (ctx, *paramFile);
+
+  /*
+  ** The dispersal parameters are those of the species (any given in the
+  ** parameter file are ignored).
+  */
+  if (ctx->dispKernel != NULL)
+  {
+    free (ctx->dispKernel);
+  }
+  if (ctx->propaguleProd != NULL)
+  {
+    free (ctx->propaguleProd);
+  }
+  ctx->dispKernel = ctx->propaguleProd = NULL;
+  if (*nrFiles == -1)
+  {
+    goto End_of_Routine;
+  }
+  if (strlen (ctx->communityFile) == 0)
+  {
+    *nrFiles = -1;
+    Rprintf ("No community file specified in parameter file %s\n", *paramFile);
+    goto End_of_Routine;
+  }
+  if ((ctx->checkpointFreq > 0) || ctx->resumeSimul || ctx->resultStore)
+  {
+    *nrFiles = -1;
+    Rprintf ("Checkpoints and result stores are not supported for community simulations.\n");
+    goto End_of_Routine;
+  }
+  if (mcReadSweep (ctx, ctx->communityFile, true, &species, &nrSpecies) == -1)
+  {
+    *nrFiles = -1;
+    goto End_of_Routine;
+  }
+  mcSeedRandom (ctx, (uint64_t)time (NULL));
+
+  /*
+  ** Allocate the necessary memory (the matrices of all species first, so
+  ** that they can be freed whatever happens).
+  */
+  state = (int ***)calloc (nrSpecies, sizeof (int **));
+  age = (int ***)calloc (nrSpecies, sizeof (int **));
+  habSuit = (int ***)calloc (nrSpecies, sizeof (int **));
+  noDisp = (int ***)calloc (nrSpecies, sizeof (int **));
+  cnt = (cmCounters *)calloc (nrSpecies, sizeof (cmCounters));
+  pending = (int *)malloc (nrSpecies * sizeof (int));
+  if ((state == NULL) || (age == NULL) || (habSuit == NULL) || (noDisp == NULL) ||
+      (cnt == NULL) || (pending == NULL) || ((barriers = mcAllocMat (ctx)) == NULL))
+  {
+    *nrFiles = -1;
+    Rprintf ("Not enough memory for the community simulation.\n");
+    goto End_of_Routine;
+  }
+  maxDist = 0;
+  for (s = 0; s < nrSpecies; s++)
+  {
+    state[s] = mcAllocMat (ctx);
+    age[s] = mcAllocMat (ctx);
+    habSuit[s] = mcAllocMat (ctx);
+    noDisp[s] = mcAllocMat (ctx);
+    if ((state[s] == NULL) || (age[s] == NULL) || (habSuit[s] == NULL) ||
+	(noDisp[s] == NULL))
+    {
+      *nrFiles = -1;
+      Rprintf ("Not enough memory for the community simulation.\n");
+      goto End_of_Routine;
+    }
+    if (species[s].dispDist > maxDist)
+    {
+      maxDist = species[s].dispDist;
+    }
+  }
+
+  for (RepLoop = 1; RepLoop <= ctx->replicateNb; RepLoop++)
+  {
+    startTime = time (NULL);
+
+    /*
+    ** Load and filter the initial distributions and the barriers (the
+    ** layers are read from disk for the first replicate only).
+    */
+    for (s = 0; s < nrSpecies; s++)
+    {
+      if (mcFileName (fileName, sizeof (fileName), "%s.asc", species[s].iniDist) == -1)
+      {
+	*nrFiles = -1;
+	goto End_of_Routine;
+      }
+      if (mcReadLayer (ctx, fileName, state[s], true) == -1)
+      {
+	*nrFiles = -1;
+	goto End_of_Routine;
+      }
+    }
+    for (i = 0; i < ctx->nrRows; i++)
+    {
+      for (j = 0; j < ctx->nrCols; j++)
+      {
+	barriers[i][j] = 0;
+      }
+    }
+    if (ctx->useBarrier)
+    {
+      if (mcFileName (fileName, sizeof (fileName), "%s.asc", ctx->barrier) == -1)
+      {
+	*nrFiles = -1;
+	goto End_of_Routine;
+      }
+      if (mcReadLayer (ctx, fileName, barriers, true) == -1)
+      {
+	*nrFiles = -1;
+	goto End_of_Routine;
+      }
+    }
+    for (s = 0; s < nrSpecies; s++)
+    {
+      mcFilterMatrix (ctx, barriers, state[s], true, false, true);
+    }
+    for (s = 0; s < nrSpecies; s++)
+    {
+      if (ctx->useBarrier)
+      {
+	mcFilterMatrix (ctx, state[s], barriers, false, true, false);
+      }
+
+      /*
+      ** Ages, the "no dispersal" matrix and the counters of each species.
+      */
+      memset (&cnt[s], 0, sizeof (cmCounters));
+      for (i = 0; i < ctx->nrRows; i++)
+      {
+	for (j = 0; j < ctx->nrCols; j++)
+	{
+	  age[s][i][j] = (state[s][i][j] == 1) ? species[s].fullMatAge : 0;
+	  noDisp[s][i][j] = state[s][i][j];
+	  if (state[s][i][j] == 1)
+	  {
+	    cnt[s].initial++;
+	  }
+	  if (state[s][i][j] == 0)
+	  {
+	    cnt[s].absent++;
+	  }
+	}
+      }
+      cnt[s].colonized = cnt[s].initial;
+      cnt[s].noDispersal = cnt[s].initial;
+      cnt[s].univDispersal = cnt[s].initial;
+
+      /*
+      ** Write the initial state to the statistics file.
+      */
+      if (ctx->replicateNb == 1)
+      {
+	if (mcFileName (simulName2, sizeof (simulName2), "%s_%s", ctx->simulName,
+			species[s].name) == -1)
+	{
+	  *nrFiles = -1;
+	  goto End_of_Routine;
+	}
+      }
+      else
+      {
+	if (mcFileName (simulName2, sizeof (simulName2), "%s_%s_%d", ctx->simulName,
+			species[s].name, RepLoop) == -1)
+	{
+	  *nrFiles = -1;
+	  goto End_of_Routine;
+	}
+      }
+      if (mcFileName (fileName, sizeof (fileName), "%s/%s_stats.txt", ctx->simulName,
+		      simulName2) == -1)
+      {
+	*nrFiles = -1;
+	goto End_of_Routine;
+      }
+      if ((cnt[s].fp = fopen (fileName, "w")) == NULL)
+      {
+	*nrFiles = -1;
+	Rprintf ("Could not open statistics file for writing.\n");
+	goto End_of_Routine;
+      }
+      fprintf (cnt[s].fp, "envChgStep\tdispStep\tstepID\tunivDispersal\tNoDispersal\toccupied\tabsent\tstepColonized\tstepDecolonized\tstepLDDsuccess\n");
+      fprintf (cnt[s].fp, "0\t0\t1\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", cnt[s].univDispersal,
+	       cnt[s].noDispersal, cnt[s].colonized, cnt[s].absent, 0, 0, 0);
+    }
+
+    Rprintf ("Running MigClim community simulation %s (replicate %d).\n", ctx->simulName, RepLoop);
+    for (envChgStep = 1; envChgStep <= ctx->envChgSteps; envChgStep++)
+    {
+      Rprintf ("  %d...\n", envChgStep);
+      loopID = envChgStep * 100;
+
+      /*
+      ** Load, reclassify and filter the habitat suitability of each species,
+      ** and update its temporarily resilient cells (see 'mcMigrate').
+      */
+      for (s = 0; s < nrSpecies; s++)
+      {
+	if (mcReadHabitat (ctx, species[s].hsMap, envChgStep, habSuit[s], true) == -1)
+	{
+	  *nrFiles = -1;
+	  goto End_of_Routine;
+	}
+	if (species[s].rcThreshold > 0)
+	{
+	  for (i = 0; i < ctx->nrRows; i++)
+	  {
+	    for (j = 0; j < ctx->nrCols; j++)
+	    {
+	      habSuit[s][i][j] = (habSuit[s][i][j] < species[s].rcThreshold) ? 0 : 1000;
+	    }
+	  }
+	}
+	mcFilterMatrix (ctx, habSuit[s], barriers, true, true, true);
+	cnt[s].univDispersal = mcUnivDispCnt (ctx, habSuit[s]);
+	updateNoDispMat (ctx, habSuit[s], noDisp[s], &cnt[s].noDispersal);
+	cnt[s].stepDecolonized = 0;
+	for (i = 0; i < ctx->nrRows; i++)
+	{
+	  for (j = 0; j < ctx->nrCols; j++)
+	  {
+	    if ((habSuit[s][i][j] == 0) && (state[s][i][j] > 0))
+	    {
+	      state[s][i][j] = 29900;
+	      cnt[s].stepDecolonized++;
+	    }
+	  }
+	}
+      }
+
+      for (dispStep = 1; dispStep <= ctx->dispSteps; dispStep++)
+      {
+	loopID++;
+	for (s = 0; s < nrSpecies; s++)
+	{
+	  cnt[s].stepColonized = 0;
+	  cnt[s].stepLDDSuccess = 0;
+	  if (dispStep > 1)
+	  {
+	    cnt[s].stepDecolonized = 0;
+	  }
+	}
+
+	/*
+	** Sink cells of all species, then long distance dispersal, aging and
+	** statistics of each species.
+	*/
+	cmSinkStep (ctx, species, nrSpecies, maxDist, state, age, habSuit, barriers,
+		    loopID, pending, cnt);
+	for (s = 0; s < nrSpecies; s++)
+	{
+	  if (species[s].lddFreq > 0.0)
+	  {
+	    cmSelect (ctx, &species[s]);
+	    cnt[s].stepLDDSuccess = mcLddDispersal (ctx, state[s], age[s], habSuit[s], loopID, NULL);
+	    cnt[s].stepColonized += cnt[s].stepLDDSuccess;
+	  }
+	  for (i = 0; i < ctx->nrRows; i++)
+	  {
+	    for (j = 0; j < ctx->nrCols; j++)
+	    {
+	      if (state[s][i][j] > 0)
+	      {
+		age[s][i][j] += 1;
+	      }
+	      if (state[s][i][j] >= 29900)
+	      {
+		state[s][i][j] += 1;
+	      }
+	    }
+	  }
+	  cnt[s].colonized += cnt[s].stepColonized - cnt[s].stepDecolonized;
+	  cnt[s].absent += cnt[s].stepDecolonized - cnt[s].stepColonized;
+	  cnt[s].totColonized += cnt[s].stepColonized;
+	  cnt[s].totDecolonized += cnt[s].stepDecolonized;
+	  cnt[s].totLDDSuccess += cnt[s].stepLDDSuccess;
+	  fprintf (cnt[s].fp, "%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", envChgStep,
+		   dispStep, loopID, cnt[s].univDispersal, cnt[s].noDispersal,
+		   cnt[s].colonized, cnt[s].absent, cnt[s].stepColonized,
+		   cnt[s].stepDecolonized, cnt[s].stepLDDSuccess);
+	  if (ctx->fullOutput)
+	  {
+	    if (ctx->replicateNb == 1)
+	    {
+	      if (mcFileName (fileName, sizeof (fileName), "%s/%s_%s_step_%d.asc%s",
+			      ctx->simulName, ctx->simulName,
+							species[s].name, loopID, ctx->compressOutput ? ".gz" : "") == -1)
+	      {
+		*nrFiles = -1;
+		goto End_of_Routine;
+	      }
+	    }
+	    else
+	    {
+	      if (mcFileName (fileName, sizeof (fileName), "%s/%s_%s%d_step_%d.asc%s",
+			      ctx->simulName, ctx->simulName,
+							species[s].name, RepLoop, loopID, ctx->compressOutput ? ".gz" : "") == -1)
+	      {
+		*nrFiles = -1;
+		goto End_of_Routine;
+	      }
+	    }
+	    if (writeMat (ctx, fileName, state[s]) == -1)
+	    {
+	      *nrFiles = -1;
+	      goto End_of_Routine;
+	    }
+	  }
+	}
+      }
+
+      /*
+      ** Temporarily resilient cells are decolonized at the end of the
+      ** environmental change step.
+      */
+      for (s = 0; s < nrSpecies; s++)
+      {
+	for (i = 0; i < ctx->nrRows; i++)
+	{
+	  for (j = 0; j < ctx->nrCols; j++)
+	  {
+	    if (state[s][i][j] >= 29900)
+	    {
+	      state[s][i][j] = ctx->dispSteps - loopID - 1;
+	      age[s][i][j] = 0;
+	    }
+	  }
+	}
+      }
+    }
+
+    /*
+    ** Final output of each species.
+    */
+    simulTime = time (NULL) - startTime;
+    for (s = 0; s < nrSpecies; s++)
+    {
+      for (i = 0; i < ctx->nrRows; i++)
+      {
+	for (j = 0; j < ctx->nrCols; j++)
+	{
+	  if ((habSuit[s][i][j] > 0) && (state[s][i][j] <= 0))
+	  {
+	    state[s][i][j] = 30000;
+	  }
+	}
+      }
+      if (ctx->replicateNb == 1)
+      {
+	if (mcFileName (simulName2, sizeof (simulName2), "%s_%s", ctx->simulName,
+			species[s].name) == -1)
+	{
+	  *nrFiles = -1;
+	  goto End_of_Routine;
+	}
+      }
+      else
+      {
+	if (mcFileName (simulName2, sizeof (simulName2), "%s_%s_%d", ctx->simulName,
+			species[s].name, RepLoop) == -1)
+	{
+	  *nrFiles = -1;
+	  goto End_of_Routine;
+	}
+      }
+      if (mcFileName (fileName, sizeof (fileName), "%s/%s_raster.asc", ctx->simulName,
+		      simulName2) == -1)
+      {
+	*nrFiles = -1;
+	goto End_of_Routine;
+      }
+      if (writeMat (ctx, fileName, state[s]) == -1)
+      {
+	*nrFiles = -1;
+	goto End_of_Routine;
+      }
+      if (mcFileName (fileName, sizeof (fileName), "%s/%s_summary.txt", ctx->simulName,
+		      simulName2) == -1)
+      {
+	*nrFiles = -1;
+	goto End_of_Routine;
+      }
+      if ((fp = fopen (fileName, "w")) == NULL)
+      {
+	*nrFiles = -1;
+	Rprintf ("Could not write summary output to file.\n");
+	goto End_of_Routine;
+      }
+      fprintf (fp, "simulName\tiniCount\tnoDispCount\tunivDispCount\toccupiedCount\tabsentCount\ttotColonized\ttotDecolonized\ttotLDDsuccess\trunTime\n");
+      fprintf (fp, "%s\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", simulName2, cnt[s].initial,
+	       cnt[s].noDispersal, cnt[s].univDispersal, cnt[s].colonized, cnt[s].absent,
+	       cnt[s].totColonized, cnt[s].totDecolonized, cnt[s].totLDDSuccess, simulTime);
+      fclose (fp);
+      fclose (cnt[s].fp);
+      cnt[s].fp = NULL;
+    }
+  }
+
+  /*
+  ** Collect the summaries of all species into one table.
+  */
+  if (mcWriteSweepSummary (ctx, species, nrSpecies, "community", "species") == -1)
+  {
+    *nrFiles = -1;
+    goto End_of_Routine;
+  }
+  *nrFiles = ctx->envChgSteps;
+
+ End_of_Routine:
+  /*
+  ** Close the files and free the allocated memory.
+  */
+  for (s = 0; s < nrSpecies; s++)
+  {
+    if ((cnt != NULL) && (cnt[s].fp != NULL))
+    {
+      fclose (cnt[s].fp);
+    }
+    if (state != NULL)
+    {
+      mcFreeMat (ctx, state[s]);
+    }
+    if (age != NULL)
+    {
+      mcFreeMat (ctx, age[s]);
+    }
+    if (habSuit != NULL)
+    {
+      mcFreeMat (ctx, habSuit[s]);
+    }
+    if (noDisp != NULL)
+    {
+      mcFreeMat (ctx, noDisp[s]);
+    }
+  }
+  mcFreeMat (ctx, barriers);
+  if (state != NULL)
+  {
+    free (state);
+  }
+  if (age != NULL)
+  {
+    free (age);
+  }
+  if (habSuit != NULL)
+  {
+    free (habSuit);
+  }
+  if (noDisp != NULL)
+  {
+    free (noDisp);
+  }
+  if (cnt != NULL)
+  {
+    free (cnt);
+  }
+  if (pending != NULL)
+  {
+    free (pending);
+  }
+  ctx->dispKernel = ctx->propaguleProd = NULL;
+  mcFreeSweep (species, nrSpecies);
+  mcFreeContext (ctx);
+  if (*nrFiles == -1)
+  {
+    Rprintf ("MigClim community simulation aborted...\n");
+  }
+}
+
+
+/*
+** EoF: community.c
+*/
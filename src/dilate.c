@@ -0,0 +1,302 @@
+/*
+** dilate.c: A deterministic fast path for the source cell search. When the
+**           habitat suitability is reclassified into 0 and 1000 and all the
+**           values of the dispersal kernel and the propagule production are
+**           1.0, every colonization probability computed in 'mcSrcCell' is
+**           1.0. A sink cell is then colonized as soon as there is a mature
+**           source cell within the dispersal distance (and no barrier in
+**           between), so that a dispersal step is just a dilation of the
+**           mature source cells by a disc, masked by the suitable sinks.
+**
+** The dilation is done on rows of bits (64 cells per word). A disc is the
+** union of horizontal segments, one per row offset, so it is separable into a
+** dilation of each row by the half width of a segment, followed by an OR over
+** the rows of the disc. The cost is thus proportional to the number of words
+** times the dispersal distance, instead of the number of cells times the
+** squared dispersal distance. If there are barriers, the ray tests are only
+** done for the sinks that are reached by the dilation, i.e., at the front of
+** the distribution.
+*/
+
+#include "migclim.h"
+
+
+/*
+** dlShiftOr: OR a row of bits, shifted by 'shift' cells (towards higher column
+**            numbers if positive, lower ones if negative), into another row.
+*/
+
+static void dlShiftOr (uint64_t *dst, uint64_t *src, int nrWords, int shift)
+{
+  int w, s, n;
+
+  n = abs (shift) / 64;
+  s = abs (shift) % 64;
+  if (shift >= 0)
+  {
+    for (w = nrWords - 1; w >= n; w--)
+    {
+      dst[w] |= src[w-n] << s;
+      if ((s > 0) && (w - n > 0))
+      {
+	dst[w] |= src[w-n-1] >> (64 - s);
+      }
+    }
+  }
+  else
+  {
+    for (w = 0; w < nrWords - n; w++)
+    {
+      dst[w] |= src[w+n] >> s;
+      if ((s > 0) && (w + n + 1 < nrWords))
+      {
+	dst[w] |= src[w+n+1] << (64 - s);
+      }
+    }
+  }
+}
+
+
+/*
+** mcDilationCase: Check whether the current parameters allow the dilation
+**                 fast path (see above).
+**
+** Returns:
+**   If all colonization probabilities are 1.0: true.
+**   Otherwise:                                 false.
+*/
+
+bool mcDilationCase (mcContext *ctx)
+{
+  int i;
+
+  if ((ctx->rcThreshold <= 0) || (ctx->dispKernel == NULL))
+  {
+    return (false);
+  }
+  for (i = 0; i < ctx->dispDist; i++)
+  {
+    if (ctx->dispKernel[i] != 1.0)
+    {
+      return (false);
+    }
+  }
+  for (i = 0; i < ctx->fullMatAge - ctx->iniMatAge; i++)
+  {
+    if (ctx->propaguleProd[i] != 1.0)
+    {
+      return (false);
+    }
+  }
+  return (true);
+}
+
+
+/*
+** mcInitDilate: Allocate the buffers of the dilation fast path that only
+**               depend on the size of the grid (the ones that depend on the
+**               dispersal distance are allocated by the first
+**               'mcDilateStep' that needs them).
+**
+** Parameters:
+**   - buf: The buffers.
+**
+** Returns:
+**   -  0 if everything went fine.
+**   - -1 if there is not enough memory.
+*/
+
+int mcInitDilate (mcContext *ctx, mcDilateBuf *buf)
+{
+  int nrWords;
+
+  nrWords = (ctx->nrCols + 63) / 64;
+  buf->maxDist = -1;
+  buf->halfWidth = NULL;
+  buf->seg = NULL;
+  buf->src = (uint64_t *)malloc (ctx->nrRows * nrWords * sizeof (uint64_t));
+  buf->reach = (uint64_t *)malloc (nrWords * sizeof (uint64_t));
+  if ((buf->src == NULL) || (buf->reach == NULL))
+  {
+    Rprintf ("Not enough memory for the dilation buffers.\n");
+    mcFreeDilate (buf);
+    return (-1);
+  }
+  return (0);
+}
+
+
+/*
+** mcFreeDilate: Free the buffers of the dilation fast path.
+**
+** Parameters:
+**   - buf: The buffers.
+*/
+
+void mcFreeDilate (mcDilateBuf *buf)
+{
+  free (buf->halfWidth);
+  free (buf->src);
+  free (buf->reach);
+  free (buf->seg);
+  buf->halfWidth = NULL;
+  buf->src = buf->reach = buf->seg = NULL;
+  buf->maxDist = -1;
+}
+
+
+/*
+** mcDilateStep: Colonize all the suitable sink cells that are within the
+**               dispersal distance of a mature source cell, i.e., do the
+**               source cell search of one dispersal step for all the cells
+**               at once. The result is the same as that of calling
+**               'mcSrcCell' for every sink when 'mcDilationCase' holds.
+**
+** Parameters:
+**   - buf:      The buffers (see 'mcInitDilate'). In a parameter sweep the
+**               dispersal distance changes with the scenario, so the ones
+**               that depend on it are grown when it exceeds buf->maxDist.
+**   - curState: The matrix that contains the current state of the cellular
+**               automaton.
+**   - pxlAge:   A matrix giving the "age" of each colonized pixel.
+**   - habSuit:  The habitat suitability matrix.
+**   - barriers: A pointer to the barriers matrix.
+**   - loopID:   The ID of the current dispersal loop.
+**
+** Returns:
+**   - If everything went fine: The number of colonized cells.
+**   - If out of memory:        -1.
+*/
+
+int mcDilateStep (mcContext *ctx, mcDilateBuf *buf, int **curState, int **pxlAge, int **habSuit,
+		  int **barriers, int loopID)
+{
+  int       i, j, k, l, r, w, dy, nrWords, nrSlots, slotSize, maxDist2,
+            nrColonized, *halfWidth;
+  uint64_t *src, *seg, *slot, *reach, cand, bit;
+  bool      found;
+
+  nrWords = (ctx->nrCols + 63) / 64;
+  nrSlots = 2 * ctx->dispDist + 1;
+  slotSize = (ctx->dispDist + 1) * nrWords;
+  if (ctx->dispDist > buf->maxDist)
+  {
+    free (buf->halfWidth);
+    free (buf->seg);
+    buf->halfWidth = (int *)malloc ((ctx->dispDist + 1) * sizeof (int));
+    buf->seg = (uint64_t *)malloc (nrSlots * slotSize * sizeof (uint64_t));
+    if ((buf->halfWidth == NULL) || (buf->seg == NULL))
+    {
+      buf->maxDist = -1;
+      Rprintf ("Not enough memory for the dispersal step.\n");
+      return (-1);
+    }
+    buf->maxDist = ctx->dispDist;
+  }
+  halfWidth = buf->halfWidth;
+  src = buf->src;
+  seg = buf->seg;
+  reach = buf->reach;
+  memset (src, 0, ctx->nrRows * nrWords * sizeof (uint64_t));
+
+  /*
+  ** The source cells: colonized (but not during the current loop) and
+  ** mature. The distance test in 'mcSrcCell' is round(sqrt(d2)) <= dispDist,
+  ** which for integer d2 is the same as d2 <= dispDist * (dispDist + 1).
+  */
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      if ((curState[i][j] > 0) && (curState[i][j] != loopID) &&
+	  (pxlAge[i][j] >= ctx->iniMatAge))
+      {
+	src[i * nrWords + j / 64] |= (uint64_t)1 << (j % 64);
+      }
+    }
+  }
+  maxDist2 = ctx->dispDist * (ctx->dispDist + 1);
+  for (dy = 0; dy <= ctx->dispDist; dy++)
+  {
+    for (w = 0; (w + 1) * (w + 1) + dy * dy <= maxDist2; w++);
+    halfWidth[dy] = w;
+  }
+
+  /*
+  ** Dilate each row over the rows of the disc and colonize the reached
+  ** sinks: suitable, unoccupied and (with barriers) visible from at least
+  ** one source cell. The source rows dilated by segments of all half widths
+  ** w are kept for the rows of one disc only: row r is in the slot r modulo
+  ** the number of rows of a disc.
+  */
+  nrColonized = 0;
+  for (i = -ctx->dispDist; i < ctx->nrRows; i++)
+  {
+    r = i + ctx->dispDist;
+    if (r < ctx->nrRows)
+    {
+      slot = seg + (r % nrSlots) * slotSize;
+      memcpy (slot, src + r * nrWords, nrWords * sizeof (uint64_t));
+      for (w = 1; w <= ctx->dispDist; w++)
+      {
+	memcpy (slot + w * nrWords, slot + (w - 1) * nrWords, nrWords * sizeof (uint64_t));
+	dlShiftOr (slot + w * nrWords, src + r * nrWords, nrWords, w);
+	dlShiftOr (slot + w * nrWords, src + r * nrWords, nrWords, -w);
+      }
+    }
+    if (i < 0)
+    {
+      continue;
+    }
+    memset (reach, 0, nrWords * sizeof (uint64_t));
+    for (dy = -ctx->dispDist; dy <= ctx->dispDist; dy++)
+    {
+      if ((i + dy >= 0) && (i + dy < ctx->nrRows))
+      {
+	for (w = 0; w < nrWords; w++)
+	{
+	  reach[w] |= seg[((i + dy) % nrSlots) * slotSize +
+			  halfWidth[abs (dy)] * nrWords + w];
+	}
+      }
+    }
+    for (w = 0; w < nrWords; w++)
+    {
+      for (cand = reach[w]; cand != 0; cand &= cand - 1)
+      {
+	for (j = w * 64, bit = 1; (cand & bit) == 0; j++, bit <<= 1);
+	if ((j >= ctx->nrCols) || (habSuit[i][j] <= 0) || (curState[i][j] > 0))
+	{
+	  continue;
+	}
+	found = !ctx->useBarrier;
+	for (k = i - ctx->dispDist; !found && (k <= i + ctx->dispDist); k++)
+	{
+	  for (l = j - ctx->dispDist; !found && (l <= j + ctx->dispDist); l++)
+	  {
+	    if ((k >= 0) && (k < ctx->nrRows) && (l >= 0) && (l < ctx->nrCols) &&
+		((src[k * nrWords + l / 64] >> (l % 64)) & 1) &&
+		((k-i)*(k-i) + (l-j)*(l-j) <= maxDist2) &&
+		!mcIntersectsBarrier (ctx, i, j, k, l, barriers))
+	    {
+	      found = true;
+	    }
+	  }
+	}
+	if (found)
+	{
+	  curState[i][j] = loopID;
+	  pxlAge[i][j] = 0;
+	  nrColonized++;
+	}
+      }
+    }
+  }
+
+  return (nrColonized);
+}
+
+
+/*
+** EoF: dilate.c
+*/
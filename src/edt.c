@@ -0,0 +1,167 @@
+/*
+** edt.c: An exact Euclidean feature transform, which gives every cell of a
+**        matrix the coordinates of its nearest "feature" (i.e. occupied) cell
+**        in time linear in the number of cells.
+**
+** The transform is separable (Meijster et al. 2000, Felzenszwalb &
+** Huttenlocher 2004): a first pass along the columns finds, for every cell,
+** the nearest feature in its own column, and a second pass along the rows
+** takes the lower envelope of the parabolas (q - col)^2 + (i - row)^2 of
+** these column features. The columns (and the rows) are independent of each
+** other, so both passes are run in parallel when OpenMP is available.
+*/
+
+#include "migclim.h"
+
+
+/*
+** mcFeatureTransform: Find the nearest occupied cell (value > 0) of every
+**                     cell of a matrix.
+**
+** Parameters:
+**   - mat:     The matrix (of nrRows x nrCols cells).
+**   - nearest: An array of nrRows x nrCols elements, which will contain
+**              the index (row * nrCols + col) of the nearest occupied cell
+**              of every cell, or -1 if there are no occupied cells at all.
+**              When several occupied cells are at the same distance, any of
+**              them may be returned.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - If out of memory:        -1.
+*/
+
+int mcFeatureTransform (mcContext *ctx, int **mat, int *nearest)
+{
+  int     i, j, status;
+
+  status = 0;
+
+  /*
+  ** Column pass: store the row of the nearest occupied cell in the same
+  ** column (or -1) in 'nearest', first downwards, then upwards.
+  */
+#pragma omp parallel for private(i)
+  for (j = 0; j < ctx->nrCols; j++)
+  {
+    int last;
+
+    last = -1;
+    for (i = 0; i < ctx->nrRows; i++)
+    {
+      if (mat[i][j] > 0)
+      {
+	last = i;
+      }
+      nearest[i * ctx->nrCols + j] = last;
+    }
+    last = -1;
+    for (i = ctx->nrRows - 1; i >= 0; i--)
+    {
+      if (mat[i][j] > 0)
+      {
+	last = i;
+      }
+      if ((last != -1) && ((nearest[i * ctx->nrCols + j] == -1) ||
+			   (last - i < i - nearest[i * ctx->nrCols + j])))
+      {
+	nearest[i * ctx->nrCols + j] = last;
+      }
+    }
+  }
+
+  /*
+  ** Row pass: for every row, build the lower envelope of the parabolas of
+  ** the column features and read the nearest feature of each cell from it.
+  */
+#pragma omp parallel private(j)
+  {
+    int    *v, *row, k, q;
+    double *z, *f, s;
+
+    v = (int *)malloc (ctx->nrCols * sizeof (int));
+    row = (int *)malloc (ctx->nrCols * sizeof (int));
+    z = (double *)malloc ((ctx->nrCols + 1) * sizeof (double));
+    f = (double *)malloc (ctx->nrCols * sizeof (double));
+    if ((v == NULL) || (row == NULL) || (z == NULL) || (f == NULL))
+    {
+#pragma omp atomic write
+      status = -1;
+    }
+
+#pragma omp for
+    for (i = 0; i < ctx->nrRows; i++)
+    {
+      if ((v == NULL) || (row == NULL) || (z == NULL) || (f == NULL))
+      {
+	continue;
+      }
+
+      /*
+      ** Squared vertical distance to the column feature (columns without
+      ** any feature are left out of the envelope).
+      */
+      k = -1;
+      for (q = 0; q < ctx->nrCols; q++)
+      {
+	row[q] = nearest[i * ctx->nrCols + q];
+	if (row[q] == -1)
+	{
+	  continue;
+	}
+	f[q] = (double)(i - row[q]) * (double)(i - row[q]);
+	while (k >= 0)
+	{
+	  s = ((f[q] + (double)q * q) - (f[v[k]] + (double)v[k] * v[k])) /
+	      (2.0 * (q - v[k]));
+	  if (s > z[k])
+	  {
+	    break;
+	  }
+	  k--;
+	}
+	k++;
+	v[k] = q;
+	z[k] = (k == 0) ? -HUGE_VAL : s;
+	z[k + 1] = HUGE_VAL;
+      }
+
+      /*
+      ** Fill in the nearest feature of each cell in the row.
+      */
+      if (k == -1)
+      {
+	for (q = 0; q < ctx->nrCols; q++)
+	{
+	  nearest[i * ctx->nrCols + q] = -1;
+	}
+	continue;
+      }
+      k = 0;
+      for (q = 0; q < ctx->nrCols; q++)
+      {
+	while (z[k + 1] < q)
+	{
+	  k++;
+	}
+	nearest[i * ctx->nrCols + q] = row[v[k]] * ctx->nrCols + v[k];
+      }
+    }
+
+    free (v);
+    free (row);
+    free (z);
+    free (f);
+  }
+
+  if (status == -1)
+  {
+    Rprintf ("Not enough memory for the distance transform.\n");
+  }
+  return (status);
+}
+
+
+/*
+** EoF: edt.c
+*/
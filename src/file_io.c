@@ -5,13 +5,96 @@
 */
 
 #include "migclim.h"
+#include <ctype.h>
+#include <stdarg.h>
+#include <zlib.h>
+
+
+/*
+** mcInitContext: Initialize an empty simulation context (no parameters, no
+**                random generator state, empty layer caches).
+**
+** Parameters:
+**   - ctx: The context to initialize.
+*/
+
+void mcInitContext (mcContext *ctx)
+{
+  memset (ctx, 0, sizeof (mcContext));
+}
+
+
+/*
+** mcFreeContext: Free all the memory held by a simulation context: its
+**                dispersal kernel, propagule production probabilities and
+**                key steps, and its layer caches (and it closes its NetCDF
+**                cube).
+**
+** Parameters:
+**   - ctx: The context to free.
+*/
+
+void mcFreeContext (mcContext *ctx)
+{
+  free (ctx->dispKernel);
+  free (ctx->propaguleProd);
+  free (ctx->hsKeySteps);
+  ctx->dispKernel = NULL;
+  ctx->propaguleProd = NULL;
+  ctx->nrKeySteps = 0;
+  mcClearLayerCache (ctx);
+  mcClearKeyLayers (ctx);
+  mcCloseCube (&ctx->cube);
+}
+
+
+/*
+** mcAllocMat / mcFreeMat: Allocate or free an nrRows x nrCols matrix
+**                         ('mcAllocMat' returns NULL if there is not enough
+**                         memory, without leaking the rows already
+**                         allocated).
+*/
+
+int **mcAllocMat (mcContext *ctx)
+{
+  int i, **mat;
+
+  if ((mat = (int **)calloc (ctx->nrRows, sizeof (int *))) == NULL)
+  {
+    return (NULL);
+  }
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    if ((mat[i] = (int *)malloc (ctx->nrCols * sizeof (int))) == NULL)
+    {
+      mcFreeMat (ctx, mat);
+      return (NULL);
+    }
+  }
+  return (mat);
+}
+
+void mcFreeMat (mcContext *ctx, int **mat)
+{
+  int i;
+
+  if (mat != NULL)
+  {
+    for (i = 0; i < ctx->nrRows; i++)
+    {
+      free (mat[i]);
+    }
+    free (mat);
+  }
+}
 
 
 /*
 ** mcInit: Initialize the MigClim model by reading the parameter values from
-**         file.
+**         file into a simulation context.
 **
 ** Parameters:
+**   - ctx:       The context (see 'mcInitContext').
 **   - paramFile: The name of the file from which to read the parameter values.
 **
 ** Returns:
@@ -19,10 +102,11 @@
 **   - Otherwise:               -1.
 */
 
-int mcInit (char *paramFile)
+int mcInit (mcContext *ctx, char *paramFile)
 {
   int    i, age, status, lineNr;
-  char   line[1024], param[64];
+  long   key;
+  char   line[1024], param[64], *s, *end;
   float  p;
   FILE  *fp;
 
@@ -32,25 +116,38 @@ int mcInit (char *paramFile)
   /*
   ** Set default parameter values.
   */
-  nrRows = 0;
-  nrCols = 0;
-  strcpy (iniDist, "");
-  strcpy (hsMap, "");
-  strcpy (barrier, "");
-  useBarrier = false;
-  barrierType = STRONG_BARRIER;
-  envChgSteps = 0;
-  dispSteps = 0;
-  dispDist = 0;
-  iniMatAge = 0;
-  fullMatAge = 0;
-  rcThreshold = 0;
-  lddMinDist = 10;
-  lddMaxDist = 15;
-  lddFreq = 0.0;
-  fullOutput = false;
-  replicateNb = 1;
-  strcpy (simulName, "MigClimTest");
+  ctx->nrRows = 0;
+  ctx->nrCols = 0;
+  strcpy (ctx->iniDist, "");
+  strcpy (ctx->hsMap, "");
+  strcpy (ctx->barrier, "");
+  strcpy (ctx->sweepFile, "");
+  strcpy (ctx->communityFile, "");
+  ctx->useBarrier = false;
+  ctx->barrierType = STRONG_BARRIER;
+  ctx->envChgSteps = 0;
+  ctx->dispSteps = 0;
+  ctx->dispDist = 0;
+  ctx->iniMatAge = 0;
+  ctx->fullMatAge = 0;
+  ctx->rcThreshold = 0;
+  ctx->lddMinDist = 10;
+  ctx->lddMaxDist = 15;
+  ctx->lddFreq = 0.0;
+  ctx->fullOutput = false;
+  ctx->replicateNb = 1;
+  ctx->checkpointFreq = 0;
+  ctx->resumeSimul = false;
+  ctx->profiling = false;
+  ctx->bitSliced = false;
+  ctx->meanField = false;
+  ctx->compressOutput = false;
+  ctx->resultStore = false;
+  ctx->deltaLayers = false;
+  ctx->hsKeySteps = NULL;
+  ctx->nrKeySteps = 0;
+  ctx->useDilation = false;
+  strcpy (ctx->simulName, "MigClimTest");
   
   /*
   ** Open the file for reading.
@@ -74,7 +171,7 @@ int mcInit (char *paramFile)
     /* nrRows */
     if (strcmp (param, "nrRows") == 0)
     {
-      if ((sscanf (line, "nrRows %d", &nrRows) != 1) || (nrRows < 1))
+      if ((sscanf (line, "nrRows %d", &ctx->nrRows) != 1) || (ctx->nrRows < 1))
       {
 	status = -1;
 	Rprintf ("Invalid number of rows on line %d in parameter file %s\n",
@@ -85,7 +182,7 @@ int mcInit (char *paramFile)
     /* nrCols */
     else if (strcmp (param, "nrCols") == 0)
     {
-      if ((sscanf (line, "nrCols %d", &nrCols) != 1) || (nrCols < 1))
+      if ((sscanf (line, "nrCols %d", &ctx->nrCols) != 1) || (ctx->nrCols < 1))
       {
 	status = -1;
 	Rprintf ("Invalid number of columns on line %d in parameter file %s\n",
@@ -96,7 +193,7 @@ int mcInit (char *paramFile)
     /* iniDist */
     else if (strcmp (param, "iniDist") == 0)
     {
-      if (sscanf (line, "iniDist %s", iniDist) != 1)
+      if (sscanf (line, "iniDist %255[^\r\n]", ctx->iniDist) != 1)
       {
 	status = -1;
 	Rprintf ("Invalid initial distribution file name on line %d in parameter file %s\n",
@@ -107,7 +204,7 @@ int mcInit (char *paramFile)
     /* hsMap */
     else if (strcmp (param, "hsMap") == 0)
     {
-      if (sscanf (line, "hsMap %s", hsMap) != 1)
+      if (sscanf (line, "hsMap %255[^\r\n]", ctx->hsMap) != 1)
       {
 	status = -1;
 	Rprintf ("Invalid habitat suitability map file name on line %d in parameter file %s\n",
@@ -118,14 +215,14 @@ int mcInit (char *paramFile)
     /* barrier */
     else if (strcmp (param, "barrier") == 0)
     {
-      if (sscanf (line, "barrier %s", barrier) != 1)
+      if (sscanf (line, "barrier %255[^\r\n]", ctx->barrier) != 1)
       {
 	status = -1;
 	Rprintf ("Invalid barrier file name on line %d in parameter file %s\n",
 		 lineNr, paramFile);
 	goto End_of_Routine;
       }
-      useBarrier = true;
+      ctx->useBarrier = true;
     }
     /* barrierType */
     else if (strcmp (param, "barrierType") == 0)
@@ -139,11 +236,11 @@ int mcInit (char *paramFile)
       }
       if (strcmp (param, "weak") == 0)
       {
-	barrierType = WEAK_BARRIER;
+	ctx->barrierType = WEAK_BARRIER;
       }
       else if (strcmp (param, "strong") == 0)
       {
-	barrierType = STRONG_BARRIER;
+	ctx->barrierType = STRONG_BARRIER;
       }
       else
       {
@@ -156,8 +253,8 @@ int mcInit (char *paramFile)
     /* envChgSteps */
     else if (strcmp (param, "envChgSteps") == 0)
     {
-      if ((sscanf (line, "envChgSteps %d", &envChgSteps) != 1) ||
-	  (envChgSteps < 1))
+      if ((sscanf (line, "envChgSteps %d", &ctx->envChgSteps) != 1) ||
+	  (ctx->envChgSteps < 1))
       {
 	status = -1;
 	Rprintf ("Invalid number of environmental change steps on line %d in parameter file %s\n",
@@ -168,8 +265,8 @@ int mcInit (char *paramFile)
     /* dispSteps */
     else if (strcmp (param, "dispSteps") == 0)
     {
-      if ((sscanf (line, "dispSteps %d", &dispSteps) != 1) ||
-	  (dispSteps < 1))
+      if ((sscanf (line, "dispSteps %d", &ctx->dispSteps) != 1) ||
+	  (ctx->dispSteps < 1))
       {
 	status = -1;
 	Rprintf ("Invalid number of dispersal steps on line %d in parameter file %s\n",
@@ -180,8 +277,8 @@ int mcInit (char *paramFile)
     /* dispDist & dispKernel */
     else if (strcmp (param, "dispDist") == 0)
     {
-      if ((sscanf (line, "dispDist %d", &dispDist) != 1) ||
-	  (dispDist < 1))
+      if ((sscanf (line, "dispDist %d", &ctx->dispDist) != 1) ||
+	  (ctx->dispDist < 1))
       {
 	status = -1;
 	Rprintf ("Invalid dispersal distance on line %d in parameter file %s\n",
@@ -189,33 +286,33 @@ int mcInit (char *paramFile)
 	goto End_of_Routine;
       }
       lineNr++;
-      dispKernel = (double *)malloc (dispDist * sizeof (double));
+      ctx->dispKernel = (double *)malloc (ctx->dispDist * sizeof (double));
       if (fscanf (fp, "dispKernel %f", &p) != 1)
       {
 	status = -1;
 	Rprintf ("Dispersal kernel expected on line %d in parameter file %s\n",
-		 line, paramFile);
+		 lineNr, paramFile);
 	goto End_of_Routine;
       }
-      dispKernel[0] = p;
-      for (i = 1; i < dispDist; i++)
+      ctx->dispKernel[0] = p;
+      for (i = 1; i < ctx->dispDist; i++)
       {
 	if (fscanf (fp, "%f", &p) != 1)
 	{
 	  status = -1;
 	  Rprintf ("Invalid dispersal kernel values on line %d in parameter file %s.\n",
-		   line, paramFile);
+		   lineNr, paramFile);
 	  goto End_of_Routine;
 	}
-	dispKernel[i] = p;
+	ctx->dispKernel[i] = p;
       }
       p = fscanf (fp, "\n");
     }
     /* iniMatAge */
     else if (strcmp (param, "iniMatAge") == 0)
     {
-      if ((sscanf (line, "iniMatAge %d", &iniMatAge) != 1) ||
-	  (iniMatAge < 1))
+      if ((sscanf (line, "iniMatAge %d", &ctx->iniMatAge) != 1) ||
+	  (ctx->iniMatAge < 1))
       {
 	status = -1;
 	Rprintf ("Invalid initial maturity age on line %d in parameter file %s\n",
@@ -226,8 +323,8 @@ int mcInit (char *paramFile)
     /* fullMatAge */
     else if (strcmp (param, "fullMatAge") == 0)
     {
-      if ((sscanf (line, "fullMatAge %d", &fullMatAge) != 1) ||
-	  (fullMatAge < 1))
+      if ((sscanf (line, "fullMatAge %d", &ctx->fullMatAge) != 1) ||
+	  (ctx->fullMatAge < 1))
       {
 	status = -1;
 	Rprintf ("Invalid full maturity age on line %d in parameter file %s\n",
@@ -235,12 +332,12 @@ int mcInit (char *paramFile)
 	goto End_of_Routine;
       }
       lineNr++;
-      age = fullMatAge - iniMatAge;
+      age = ctx->fullMatAge - ctx->iniMatAge;
       if (age == 0)
       {
 	age = 1;
       }
-      propaguleProd = (double *)malloc (age * sizeof (double));
+      ctx->propaguleProd = (double *)malloc (age * sizeof (double));
       if (fscanf (fp, "propaguleProd %f", &p) != 1)
       {
 	status = -1;
@@ -248,7 +345,7 @@ int mcInit (char *paramFile)
 		 lineNr, paramFile);
 	goto End_of_Routine;
       }
-      propaguleProd[0] = p;
+      ctx->propaguleProd[0] = p;
       for (i = 1; i < age; i++)
       {
 	if (fscanf (fp, "%f", &p) != 1)
@@ -258,15 +355,15 @@ int mcInit (char *paramFile)
 		   lineNr, paramFile);
 	  goto End_of_Routine;
 	}
-	propaguleProd[i] = p;
+	ctx->propaguleProd[i] = p;
       }
       p = fscanf (fp, "\n");
     }
     /* rcThreshold */
     else if (strcmp (param, "rcThreshold") == 0)
     {
-      if ((sscanf (line, "rcThreshold %d", &rcThreshold) != 1) ||
-	  (rcThreshold < 0) || (rcThreshold > 1000))
+      if ((sscanf (line, "rcThreshold %d", &ctx->rcThreshold) != 1) ||
+	  (ctx->rcThreshold < 0) || (ctx->rcThreshold > 1000))
       {
 	status = -1;
 	Rprintf ("Invalid reclassification threshold on line %d in parameter file %s\n",
@@ -285,12 +382,12 @@ int mcInit (char *paramFile)
 		 lineNr, paramFile);
 	goto End_of_Routine;
       }
-      lddFreq = p;
+      ctx->lddFreq = p;
     }
     /* lddMinDist */
     else if (strcmp (param, "lddMinDist") == 0)
     {
-      if ((sscanf (line, "lddMinDist %d", &lddMinDist) != 1) || (lddMinDist < 0))
+      if ((sscanf (line, "lddMinDist %d", &ctx->lddMinDist) != 1) || (ctx->lddMinDist < 0))
       {
 	status = -1;
 	Rprintf ("Invalid minimum long-distance dispersal value on line %d in parameter file %s\n",
@@ -301,7 +398,7 @@ int mcInit (char *paramFile)
     /* lddMaxDist */
     else if (strcmp (param, "lddMaxDist") == 0)
     {
-      if ((sscanf (line, "lddMaxDist %d", &lddMaxDist) != 1) || (lddMaxDist <= lddMinDist))
+      if ((sscanf (line, "lddMaxDist %d", &ctx->lddMaxDist) != 1) || (ctx->lddMaxDist <= ctx->lddMinDist))
       {
 	status = -1;
 	Rprintf ("Invalid maximum long-distance dispersal value on line %d in parameter file %s\n",
@@ -321,11 +418,11 @@ int mcInit (char *paramFile)
       }
       if (strcmp (param, "true") == 0)
       {
-	fullOutput = true;
+	ctx->fullOutput = true;
       }
       else if (strcmp (param, "false") == 0)
       {
-	fullOutput = false;
+	ctx->fullOutput = false;
       }
       else
       {
@@ -337,18 +434,265 @@ int mcInit (char *paramFile)
     /* replicateNb */
     else if (strcmp (param, "replicateNb") == 0)  /* if both strings are equal, strcmp returns 0 */
     {
-      if(sscanf(line, "replicateNb %d", &replicateNb) != 1)  /* On success, the function returns the number of variables filled.  */
+      if(sscanf(line, "replicateNb %d", &ctx->replicateNb) != 1)  /* On success, the function returns the number of variables filled.  */
       {
 	    status = -1;
 	    Rprintf ("Invalid value for replicateNb parameter on line %d in parameter file %s\n", lineNr, paramFile);
 	    goto End_of_Routine;
       }   
     }
+    /* checkpointFreq */
+    else if (strcmp (param, "checkpointFreq") == 0)
+    {
+      if ((sscanf (line, "checkpointFreq %d", &ctx->checkpointFreq) != 1) ||
+	  (ctx->checkpointFreq < 0))
+      {
+	status = -1;
+	Rprintf ("Invalid checkpoint frequency on line %d in parameter file %s\n",
+		 lineNr, paramFile);
+	goto End_of_Routine;
+      }
+    }
+    /* resume */
+    else if (strcmp (param, "resume") == 0)
+    {
+      if (sscanf (line, "resume %s", param) != 1)
+      {
+	status = -1;
+	Rprintf ("Incomplete 'resume' argument on line %d in parameter file %s\n",
+		 lineNr, paramFile);
+	goto End_of_Routine;
+      }
+      if (strcmp (param, "true") == 0)
+      {
+	ctx->resumeSimul = true;
+      }
+      else if (strcmp (param, "false") == 0)
+      {
+	ctx->resumeSimul = false;
+      }
+      else
+      {
+	status = -1;
+	Rprintf ("Invalid value for argument 'resume' on line %d in parameter file %s\n", lineNr, paramFile);
+	goto End_of_Routine;
+      }
+    }
+    /* profile */
+    else if (strcmp (param, "profile") == 0)
+    {
+      if (sscanf (line, "profile %s", param) != 1)
+      {
+	status = -1;
+	Rprintf ("Incomplete 'profile' argument on line %d in parameter file %s\n",
+		 lineNr, paramFile);
+	goto End_of_Routine;
+      }
+      if (strcmp (param, "true") == 0)
+      {
+	ctx->profiling = true;
+      }
+      else if (strcmp (param, "false") == 0)
+      {
+	ctx->profiling = false;
+      }
+      else
+      {
+	status = -1;
+	Rprintf ("Invalid value for argument 'profile' on line %d in parameter file %s\n", lineNr, paramFile);
+	goto End_of_Routine;
+      }
+    }
+    /* bitSliced */
+    else if (strcmp (param, "bitSliced") == 0)
+    {
+      if (sscanf (line, "bitSliced %s", param) != 1)
+      {
+	status = -1;
+	Rprintf ("Incomplete 'bitSliced' argument on line %d in parameter file %s\n",
+		 lineNr, paramFile);
+	goto End_of_Routine;
+      }
+      if (strcmp (param, "true") == 0)
+      {
+	ctx->bitSliced = true;
+      }
+      else if (strcmp (param, "false") == 0)
+      {
+	ctx->bitSliced = false;
+      }
+      else
+      {
+	status = -1;
+	Rprintf ("Invalid value for argument 'bitSliced' on line %d in parameter file %s\n", lineNr, paramFile);
+	goto End_of_Routine;
+      }
+    }
+    /* compressOutput */
+    else if (strcmp (param, "compressOutput") == 0)
+    {
+      if (sscanf (line, "compressOutput %s", param) != 1)
+      {
+	status = -1;
+	Rprintf ("Incomplete 'compressOutput' argument on line %d in parameter file %s\n",
+		 lineNr, paramFile);
+	goto End_of_Routine;
+      }
+      if (strcmp (param, "true") == 0)
+      {
+	ctx->compressOutput = true;
+      }
+      else if (strcmp (param, "false") == 0)
+      {
+	ctx->compressOutput = false;
+      }
+      else
+      {
+	status = -1;
+	Rprintf ("Invalid value for argument 'compressOutput' on line %d in parameter file %s\n", lineNr, paramFile);
+	goto End_of_Routine;
+      }
+    }
+    /* resultStore */
+    else if (strcmp (param, "resultStore") == 0)
+    {
+      if (sscanf (line, "resultStore %s", param) != 1)
+      {
+	status = -1;
+	Rprintf ("Incomplete 'resultStore' argument on line %d in parameter file %s\n",
+		 lineNr, paramFile);
+	goto End_of_Routine;
+      }
+      if (strcmp (param, "true") == 0)
+      {
+	ctx->resultStore = true;
+      }
+      else if (strcmp (param, "false") == 0)
+      {
+	ctx->resultStore = false;
+      }
+      else
+      {
+	status = -1;
+	Rprintf ("Invalid value for argument 'resultStore' on line %d in parameter file %s\n", lineNr, paramFile);
+	goto End_of_Routine;
+      }
+    }
+    /* deltaLayers */
+    else if (strcmp (param, "deltaLayers") == 0)
+    {
+      if (sscanf (line, "deltaLayers %s", param) != 1)
+      {
+	status = -1;
+	Rprintf ("Incomplete 'deltaLayers' argument on line %d in parameter file %s\n",
+		 lineNr, paramFile);
+	goto End_of_Routine;
+      }
+      if (strcmp (param, "true") == 0)
+      {
+	ctx->deltaLayers = true;
+      }
+      else if (strcmp (param, "false") == 0)
+      {
+	ctx->deltaLayers = false;
+      }
+      else
+      {
+	status = -1;
+	Rprintf ("Invalid value for argument 'deltaLayers' on line %d in parameter file %s\n", lineNr, paramFile);
+	goto End_of_Routine;
+      }
+    }
+    /* hsKeySteps */
+    else if (strcmp (param, "hsKeySteps") == 0)
+    {
+      free (ctx->hsKeySteps);
+      ctx->nrKeySteps = 0;
+      if ((ctx->hsKeySteps = (int *)malloc ((strlen (line) / 2 + 1) * sizeof (int))) == NULL)
+      {
+	status = -1;
+	Rprintf ("Not enough memory for the key steps on line %d in parameter file %s\n",
+		 lineNr, paramFile);
+	goto End_of_Routine;
+      }
+      for (s = line + strlen ("hsKeySteps"); ; s = end)
+      {
+	key = strtol (s, &end, 10);
+	if (end == s)
+	{
+	  break;
+	}
+	if ((key < 0) || ((ctx->nrKeySteps > 0) && (key <= ctx->hsKeySteps[ctx->nrKeySteps - 1])))
+	{
+	  ctx->nrKeySteps = 0;
+	  break;
+	}
+	ctx->hsKeySteps[ctx->nrKeySteps++] = (int)key;
+      }
+      while (isspace ((unsigned char)*s))
+      {
+	s++;
+      }
+      if ((ctx->nrKeySteps == 0) || (*s != '\0'))
+      {
+	status = -1;
+	Rprintf ("Invalid key steps (increasing step numbers expected) on line %d in parameter file %s\n",
+		 lineNr, paramFile);
+	goto End_of_Routine;
+      }
+    }
+    /* meanField */
+    else if (strcmp (param, "meanField") == 0)
+    {
+      if (sscanf (line, "meanField %s", param) != 1)
+      {
+	status = -1;
+	Rprintf ("Incomplete 'meanField' argument on line %d in parameter file %s\n",
+		 lineNr, paramFile);
+	goto End_of_Routine;
+      }
+      if (strcmp (param, "true") == 0)
+      {
+	ctx->meanField = true;
+      }
+      else if (strcmp (param, "false") == 0)
+      {
+	ctx->meanField = false;
+      }
+      else
+      {
+	status = -1;
+	Rprintf ("Invalid value for argument 'meanField' on line %d in parameter file %s\n", lineNr, paramFile);
+	goto End_of_Routine;
+      }
+    }
+    /* sweepFile */
+    else if (strcmp (param, "sweepFile") == 0)
+    {
+      if (sscanf (line, "sweepFile %s", ctx->sweepFile) != 1)
+      {
+	status = -1;
+	Rprintf ("Invalid sweep file name on line %d in parameter file %s\n",
+		 lineNr, paramFile);
+	goto End_of_Routine;
+      }
+    }
+    /* communityFile */
+    else if (strcmp (param, "communityFile") == 0)
+    {
+      if (sscanf (line, "communityFile %s", ctx->communityFile) != 1)
+      {
+	status = -1;
+	Rprintf ("Invalid community file name on line %d in parameter file %s\n",
+		 lineNr, paramFile);
+	goto End_of_Routine;
+      }
+    }
     
     /* simulName */
     else if (strcmp (param, "simulName") == 0)
     {
-      if (sscanf (line, "simulName %s", simulName) != 1)
+      if (sscanf (line, "simulName %s", ctx->simulName) != 1)
       {
 	status = -1;
 	Rprintf ("Invalid output file name on line %d in parameter file %s\n",
@@ -369,75 +713,89 @@ int mcInit (char *paramFile)
   /*
   ** Check the parameter values for validity.
   */
-  if (nrRows == 0)
+  if (ctx->nrRows == 0)
   {
     status = -1;
     Rprintf ("No number of rows specified in parameter file %s\n", paramFile);
     goto End_of_Routine;
   }
-  if (nrCols == 0)
+  if (ctx->nrCols == 0)
   {
     status = -1;
     Rprintf ("No number of columns specified in parameter file %s\n",
 	     paramFile);
     goto End_of_Routine;
   }
-  if (strlen (iniDist) == 0)
+  if ((strlen (ctx->iniDist) == 0) && (strlen (ctx->communityFile) == 0))
   {
     status = -1;
     Rprintf ("No initial distribution file name specified in parameter file %s\n",
 	     paramFile);
     goto End_of_Routine;
   }
-  if (strlen (hsMap) == 0)
+  if ((strlen (ctx->hsMap) == 0) && (strlen (ctx->communityFile) == 0))
   {
     status = -1;
     Rprintf ("No habitat suitability map file name specified in parameter file %s\n",
 	     paramFile);
     goto End_of_Routine;
   }
-  if (useBarrier && (strlen (barrier) == 0))
+  if (ctx->useBarrier && (strlen (ctx->barrier) == 0))
   {
     status = -1;
     Rprintf ("No barrier file name specified in parameter file %s\n",
 	     paramFile);
     goto End_of_Routine;
   }
-  if (envChgSteps == 0)
+  if (ctx->envChgSteps == 0)
   {
     status = -1;
     Rprintf ("No number of environmental change steps specified in parameter file %s\n",
 	     paramFile);
     goto End_of_Routine;
   }
-  if (dispSteps == 0)
+  if ((ctx->nrKeySteps > 0) &&
+      ((ctx->hsKeySteps[0] > 1) || (ctx->hsKeySteps[ctx->nrKeySteps - 1] < ctx->envChgSteps)))
+  {
+    status = -1;
+    Rprintf ("The key steps in parameter file %s must span the environmental change steps 1 to %d\n",
+	     paramFile, ctx->envChgSteps);
+    goto End_of_Routine;
+  }
+  if (ctx->dispSteps == 0)
   {
     status = -1;
     Rprintf ("No number of dispersal steps specified in parameter file %s\n",
 	     paramFile);
     goto End_of_Routine;
   }
-  if (dispDist == 0)
+  if ((ctx->dispDist == 0) && (strlen (ctx->communityFile) == 0))
   {
     status = -1;
     Rprintf ("No dispersal distance specified in parameter file %s\n",
 	     paramFile);
     goto End_of_Routine;
   }
-  if (iniMatAge == 0)
+  if ((ctx->iniMatAge == 0) && (strlen (ctx->communityFile) == 0))
   {
     status = -1;
     Rprintf ("No initial maturity age specified in parameter file %s\n",
 	     paramFile);
     goto End_of_Routine;
   }
-  if (fullMatAge == 0)
+  if ((ctx->fullMatAge == 0) && (strlen (ctx->communityFile) == 0))
   {
     status = -1;
     Rprintf ("No full maturity age specified in parameter file %s\n",
 	     paramFile);
     goto End_of_Routine;
   }
+
+  /*
+  ** If all colonization probabilities are 1.0, the source cell search can
+  ** be done as a dilation (see dilate.c).
+  */
+  ctx->useDilation = mcDilationCase (ctx);
   
  End_of_Routine:
   /*
@@ -452,123 +810,278 @@ int mcInit (char *paramFile)
 
 
 /*
-** readMat: Read a data matrix from an ESRI ascii grid file.
+** The size of the buffer of 'mcReadGrid': the values of a grid are parsed
+** from blocks of this many (decompressed) bytes.
+*/
+#define GRID_BUFFER_SIZE 262144
+
+
+/*
+** grNextInt: Parse the next integer value of a grid file, refilling the
+**            buffer from the file when it runs out. A value may straddle
+**            two blocks, so the unparsed tail of a block is moved to the
+**            front of the buffer before the next block is read after it.
 **
-** Note: This should eventually be merged with the above "mcReadMatrix"
-**       function, but we'll keep it separate for now just to make sure
-**       the basic functionality works fine.
+** Returns:
+**   - If a value was read:           1.
+**   - At the end of the file or if
+**     the next token is no integer:  0.
+*/
+
+static int grNextInt (gzFile fp, char *buf, int *pos, int *len, int *val)
+{
+  int   n;
+  long  v;
+  char *end;
+  bool  eof;
+
+  eof = false;
+  for (;;)
+  {
+    while ((*pos < *len) && isspace ((unsigned char)buf[*pos]))
+    {
+      (*pos)++;
+    }
+
+    /*
+    ** A complete token must be followed by a separator within the buffer
+    ** (unless the file is exhausted).
+    */
+    for (n = *pos; (n < *len) && !isspace ((unsigned char)buf[n]); n++);
+    if ((n < *len) || ((*pos < *len) && eof))
+    {
+      buf[*len] = '\0';
+      v = strtol (buf + *pos, &end, 10);
+      if ((end == buf + *pos) || (!isspace ((unsigned char)*end) && (*end != '\0')))
+      {
+	return (0);
+      }
+      *val = (int)v;
+      *pos = end - buf;
+      return (1);
+    }
+    if (eof)
+    {
+      return (0);
+    }
+    memmove (buf, buf + *pos, *len - *pos);
+    *len -= *pos;
+    *pos = 0;
+    if ((n = gzread (fp, buf + *len, GRID_BUFFER_SIZE - *len)) <= 0)
+    {
+      eof = true;
+    }
+    else
+    {
+      *len += n;
+    }
+  }
+}
+
+
+/*
+** mcReadGrid: Read a data matrix from an ESRI ascii grid file (or from a
+**             (Geo)TIFF file, see 'mcReadTiff' in tiff.c). The grid file may
+**             be compressed with gzip; it is then decompressed on the fly,
+**             one block at a time, while it is parsed. Unlike
+**             'readMat', this function does not use a simulation context
+**             and does not print anything, so it can be called from several
+**             threads at the same time.
 **
 ** Parameters:
-**   - fName:  The name of the file to read from.
+**   - fName:  The name of the file to read from. A layer given as
+**             "name.asc" may also be stored as "name.tif" or "name.asc.gz",
+**             and a layer of a NetCDF cube is named "cube.nc[:var]#step".
 **   - mat:    The matrix to put the data in (assumed to be large enough).
+**             If NULL, only the header is read and the number of rows and
+**             columns of the file are returned in 'grid'.
+**   - grid:   The grid properties. The numbers of rows and columns must be
+**             set (unless 'mat' is NULL), the georeference and the NoData
+**             value are read from the file.
+**   - cube:   Where to keep a NetCDF cube open between the reads of its
+**             steps (see 'mcReadCube'), or NULL to close it after reading.
+**   - errMsg: A string of at least 256 characters to put an error message in.
 **
 ** Returns:
 **   - If everything went fine:  0.
 **   - Otherwise:               -1.
 */
 
-int readMat (char *fName, int **mat)
+int mcReadGrid (char *fName, int **mat, mcGrid *grid, mcCube **cube, char *errMsg)
 {
-  int   i, j, intVal, status;
-  char  line[1024], param[128], dblVal[128];
-  FILE *fp;
+  int     i, j, k, intVal, status, pos, len, step;
+  char    line[1024], param[128], dblVal[128], magic[4], altName[1024], *buf,
+          *p, *varName, c;
+  size_t  nameLen;
+  gzFile  fp;
+  const char *altExt[2] = {".tif", ".asc.gz"};
 
   status = 0;
   fp = NULL;
+  buf = NULL;
+  errMsg[0] = '\0';
+
+  /*
+  ** A layer of a NetCDF cube (see 'mcLayerName') is read by 'mcReadCube'.
+  */
+  if (((p = strrchr (fName, '#')) != NULL) && (p - fName < 1000) &&
+      (sscanf (p + 1, "%d%c", &step, &c) == 1))
+  {
+    strncpy (altName, fName, p - fName);
+    altName[p - fName] = '\0';
+    varName = "";
+    if ((p = strstr (altName, ".nc:")) != NULL)
+    {
+      p[3] = '\0';
+      varName = p + 4;
+    }
+    if (((nameLen = strlen (altName)) > 3) && (strcmp (altName + nameLen - 3, ".nc") == 0))
+    {
+      return (mcReadCube (altName, varName, step, mat, grid, cube, errMsg));
+    }
+  }
   
   /*
-  ** Open the file for reading.
+  ** Open the file for reading (gzopen also reads uncompressed files). A
+  ** layer given as "name.asc" that does not exist is looked for under the
+  ** other supported names.
   */
-  if ((fp = fopen(fName, "r")) == NULL)
+  if (((fp = gzopen (fName, "rb")) == NULL) &&
+      ((nameLen = strlen (fName)) > 4) && (nameLen < 1000) &&
+      (strcmp (fName + nameLen - 4, ".asc") == 0))
+  {
+    for (k = 0; (k < 2) && (fp == NULL); k++)
+    {
+      strcpy (altName, fName);
+      strcpy (altName + nameLen - 4, altExt[k]);
+      if ((fp = gzopen (altName, "rb")) != NULL)
+      {
+	fName = altName;
+      }
+    }
+  }
+  if (fp == NULL)
   {
     status = -1;
-    Rprintf ("Can't open data file %s\n", fName);
+    snprintf (errMsg, 256, "Can't open data file %s\n", fName);
     goto End_of_Routine;
   }
+  gzbuffer (fp, GRID_BUFFER_SIZE);
+  if ((gzread (fp, magic, 4) == 4) &&
+      ((memcmp (magic, "II*\0", 4) == 0) || (memcmp (magic, "MM\0*", 4) == 0)))
+  {
+    if (!gzdirect (fp))
+    {
+      status = -1;
+      snprintf (errMsg, 256, "Compressed TIFF files are not supported (%s)\n", fName);
+      goto End_of_Routine;
+    }
+    gzclose (fp);
+    return (mcReadTiff (fName, mat, grid, errMsg));
+  }
+  gzrewind (fp);
 
   /*
   ** Get the 'meta data'.
   */
-  if ((fgets (line, 1024, fp) == NULL) ||
+  if ((gzgets (fp, line, 1024) == NULL) ||
       (sscanf (line, "%s %d\n", param, &intVal) != 2) ||
       (strcasecmp (param, "ncols") != 0))
   {
     status = -1;
-    Rprintf ("'ncols' expected in data file %s.\n", fName);
+    snprintf (errMsg, 256, "'ncols' expected in data file %s.\n", fName);
     goto End_of_Routine;
   }
-  if (intVal != nrCols)
+  if (mat == NULL)
+  {
+    grid->nrCols = intVal;
+  }
+  else if (intVal != grid->nrCols)
   {
     status = -1;
-    Rprintf ("Invalid number of columns in data file %s\n", fName);
+    snprintf (errMsg, 256, "Invalid number of columns in data file %s\n", fName);
     goto End_of_Routine;
   }
-  if ((fgets (line, 1024, fp) == NULL) ||
+  if ((gzgets (fp, line, 1024) == NULL) ||
       (sscanf (line, "%s %d\n", param, &intVal) != 2) ||
       (strcasecmp (param, "nrows") != 0))
   {
     status = -1;
-    Rprintf ("'nrows' expected in data file %s\n", fName);
+    snprintf (errMsg, 256, "'nrows' expected in data file %s\n", fName);
     goto End_of_Routine;
   }
-  if (intVal != nrRows)
+  if (mat == NULL)
+  {
+    grid->nrRows = intVal;
+  }
+  else if (intVal != grid->nrRows)
   {
     status = -1;
-    Rprintf ("Invalid number of rows in data file %s.\n", fName);
+    snprintf (errMsg, 256, "Invalid number of rows in data file %s.\n", fName);
     goto End_of_Routine;
   }
-  if ((fgets (line, 1024, fp) == NULL) ||
+  if ((gzgets (fp, line, 1024) == NULL) ||
       (sscanf (line, "%s %s\n", param, dblVal) != 2) ||
       (strcasecmp (param, "xllcorner") != 0))
   {
     status = -1;
-    Rprintf ("'xllcorner' expected in data file %s\n", fName);
+    snprintf (errMsg, 256, "'xllcorner' expected in data file %s\n", fName);
     goto End_of_Routine;
   }
-  xllCorner = strtod (dblVal, NULL);
-  if ((fgets (line, 1024, fp) == NULL) ||
+  grid->xllCorner = strtod (dblVal, NULL);
+  if ((gzgets (fp, line, 1024) == NULL) ||
       (sscanf (line, "%s %s\n", param, dblVal) != 2) ||
       (strcasecmp (param, "yllcorner") != 0))
   {
     status = -1;
-    Rprintf ("'yllcorner' expected in data file %s\n", fName);
+    snprintf (errMsg, 256, "'yllcorner' expected in data file %s\n", fName);
     goto End_of_Routine;
   }
-  yllCorner = strtod (dblVal, NULL);
-  if ((fgets (line, 1024, fp) == NULL) ||
+  grid->yllCorner = strtod (dblVal, NULL);
+  if ((gzgets (fp, line, 1024) == NULL) ||
       (sscanf (line, "%s %s\n", param, dblVal) != 2) ||
       (strcasecmp (param, "cellsize") != 0))
   {
     status = -1;
-    Rprintf ("'cellsize' expected in data file %s\n", fName);
+    snprintf (errMsg, 256, "'cellsize' expected in data file %s\n", fName);
     goto End_of_Routine;
   }
-  cellSize = strtod (dblVal, NULL);
-  if ((fgets (line, 1024, fp) == NULL) ||
-      (sscanf (line, "%s %d\n", param, &noData) != 2) ||
+  grid->cellSize = strtod (dblVal, NULL);
+  if ((gzgets (fp, line, 1024) == NULL) ||
+      (sscanf (line, "%s %d\n", param, &grid->noData) != 2) ||
       (strcasecmp (param, "nodata_value") != 0))
   {
     status = -1;
-    Rprintf ("'NODATA_value' expected in data file %s\n", fName);
+    snprintf (errMsg, 256, "'NODATA_value' expected in data file %s\n", fName);
+    goto End_of_Routine;
+  }
+  if (mat == NULL)
+  {
     goto End_of_Routine;
   }
   
   /*
   ** Read the values into the matrix.
   */
-  for (i = 0; i < nrRows; i++)
+  if ((buf = (char *)malloc (GRID_BUFFER_SIZE + 1)) == NULL)
+  {
+    status = -1;
+    snprintf (errMsg, 256, "Not enough memory to read data file %s\n", fName);
+    goto End_of_Routine;
+  }
+  pos = len = 0;
+  for (i = 0; i < grid->nrRows; i++)
   {
-    for (j = 0; j < nrCols; j++)
+    for (j = 0; j < grid->nrCols; j++)
     {
-      if (fscanf(fp, "%d", &intVal) != 1)
+      if (grNextInt (fp, buf, &pos, &len, &intVal) != 1)
       {
-	    status = -1;
-        Rprintf ("Invalid value in data file %s\n", fName);
-        goto End_of_Routine;
+	status = -1;
+	snprintf (errMsg, 256, "Invalid value in data file %s\n", fName);
+	goto End_of_Routine;
       }
       mat[i][j] = intVal;
     }
-    intVal = fscanf (fp, "\n");
   }
 
  End_of_Routine:
@@ -577,7 +1090,115 @@ int readMat (char *fName, int **mat)
   */
   if (fp != NULL)
   {
-    fclose (fp);
+    gzclose (fp);
+  }
+  if (buf != NULL)
+  {
+    free (buf);
+  }
+  return (status);
+}
+
+
+/*
+** mcLayerName: Build the name of the habitat suitability layer of an
+**              environmental change step: "<hsMap><step>.asc", or
+**              "<hsMap>#<step>" if 'hsMap' is a NetCDF cube, i.e., a file
+**              name ending in ".nc", optionally followed by ":variable"
+**              (see 'mcReadCube' in netcdf.c).
+**
+** Parameters:
+**   - fileName:  A string to put the name in.
+**   - hsMapName: The base name of the habitat suitability layers.
+**   - step:      The environmental change step.
+*/
+
+void mcLayerName (char *fileName, char *hsMapName, int step)
+{
+  size_t len;
+
+  len = strlen (hsMapName);
+  if ((strstr (hsMapName, ".nc:") != NULL) ||
+      ((len > 3) && (strcmp (hsMapName + len - 3, ".nc") == 0)))
+  {
+    sprintf (fileName, "%s#%d", hsMapName, step);
+  }
+  else
+  {
+    sprintf (fileName, "%s%d.asc", hsMapName, step);
+  }
+}
+
+
+/*
+** mcFileName: Put a file (or simulation) name, composed as by 'sprintf',
+**             into a buffer of a given size. A name that does not fit is
+**             reported rather than written past the end of the buffer.
+**
+** Parameters:
+**   - fileName: The buffer to put the name in.
+**   - size:     The size of the buffer.
+**   - format:   The format of the name, followed by its arguments.
+**
+** Returns:
+**   -  0 if the name fits in the buffer.
+**   - -1 if it is too long (the buffer then holds the truncated name).
+*/
+
+int mcFileName (char *fileName, size_t size, const char *format, ...)
+{
+  int     len;
+  va_list args;
+
+  va_start (args, format);
+  len = vsnprintf (fileName, size, format, args);
+  va_end (args);
+  if ((len < 0) || ((size_t)len >= size))
+  {
+    Rprintf ("The name %s... is too long.\n", fileName);
+    return (-1);
+  }
+  return (0);
+}
+
+
+/*
+** readMat: Read a data matrix from an ESRI ascii grid file, which must have
+**          'nrRows' rows and 'nrCols' columns. The georeference and NoData
+**          value of the file are stored in the simulation context, which
+**          also keeps a NetCDF cube open between the reads of its steps.
+**
+** Note: This should eventually be merged with the above "mcReadMatrix"
+**       function, but we'll keep it separate for now just to make sure
+**       the basic functionality works fine.
+**
+** Parameters:
+**   - fName:  The name of the file to read from.
+**   - mat:    The matrix to put the data in (assumed to be large enough).
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+int readMat (mcContext *ctx, char *fName, int **mat)
+{
+  int    status;
+  char   errMsg[256];
+  mcGrid grid;
+
+  grid.nrRows = ctx->nrRows;
+  grid.nrCols = ctx->nrCols;
+  if ((status = mcReadGrid (fName, mat, &grid, &ctx->cube, errMsg)) == -1)
+  {
+    Rprintf ("%s", errMsg);
+  }
+  else
+  {
+    ctx->xllCorner = grid.xllCorner;
+    ctx->yllCorner = grid.yllCorner;
+    ctx->cellSize = grid.cellSize;
+    ctx->noData = grid.noData;
   }
   return (status);
 }
@@ -591,7 +1212,8 @@ int readMat (char *fName, int **mat)
 **       the basic functionality works fine.
 **
 ** Parameters:
-**   - fName:  The name of the file to write to.
+**   - fName:  The name of the file to write to (compressed with gzip if
+**             the name ends with ".gz").
 **   - mat:    The data matrix to write.
 **
 ** Returns:
@@ -599,53 +1221,77 @@ int readMat (char *fName, int **mat)
 **   - Otherwise:               -1.
 */
 
-int writeMat (char *fName, int **mat)
+int writeMat (mcContext *ctx, char *fName, int **mat)
 {
-  int   i, j, status;
-  FILE *fp;
+  int     i, j, status, len;
+  char   *row;
+  size_t  nameLen;
+  gzFile  fp;
 
   status = 0;
   fp = NULL;
+  row = NULL;
   
   /*
-  ** Open the file for writing.
+  ** Open the file for writing: compressed with gzip if its name ends with
+  ** ".gz", uncompressed ("transparent") otherwise.
   */
-  if ((fp = fopen(fName, "w")) == NULL)
+  nameLen = strlen (fName);
+  if ((fp = gzopen (fName, ((nameLen > 3) && (strcmp (fName + nameLen - 3, ".gz") == 0)) ?
+		    "wb" : "wbT")) == NULL)
   {
     status = -1;
     Rprintf ("Can't open data file %s for writing.\n", fName);
     goto End_of_Routine;
   }
+  if ((row = (char *)malloc (ctx->nrCols * 12 + 2)) == NULL)
+  {
+    status = -1;
+    Rprintf ("Not enough memory to write data file %s.\n", fName);
+    goto End_of_Routine;
+  }
 
   /*
   ** Write the 'meta data'.
   */
-  fprintf (fp, "ncols %d\n", nrCols);
-  fprintf (fp, "nrows %d\n", nrRows);
-  fprintf (fp, "xllcorner %.9f\n", xllCorner);
-  fprintf (fp, "yllcorner %.9f\n", yllCorner);
-  fprintf (fp, "cellsize %.9f\n", cellSize);
-  fprintf (fp, "NODATA_value %d\n", noData);
+  gzprintf (fp, "ncols %d\n", ctx->nrCols);
+  gzprintf (fp, "nrows %d\n", ctx->nrRows);
+  gzprintf (fp, "xllcorner %.9f\n", ctx->xllCorner);
+  gzprintf (fp, "yllcorner %.9f\n", ctx->yllCorner);
+  gzprintf (fp, "cellsize %.9f\n", ctx->cellSize);
+  gzprintf (fp, "NODATA_value %d\n", ctx->noData);
   
   /*
-  ** Write the data to file.
+  ** Write the data to file, one row at a time.
   */
-  for (i = 0; i < nrRows; i++)
+  for (i = 0; i < ctx->nrRows; i++)
   {
-    for (j = 0; j < nrCols; j++)
+    len = 0;
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      len += sprintf (row + len, "%d ", mat[i][j]);
+    }
+    row[len++] = '\n';
+    if (gzwrite (fp, row, len) != len)
     {
-      fprintf(fp, "%d ", mat[i][j]);
+      status = -1;
+      Rprintf ("Can't write to data file %s.\n", fName);
+      goto End_of_Routine;
     }
-    fprintf (fp, "\n");
   }
 
   /*
   ** Close the file and return the status.
   */
  End_of_Routine:
-  if (fp != NULL)
+  if ((fp != NULL) && (gzclose (fp) != Z_OK) && (status == 0))
   {
-    fclose (fp);
+    status = -1;
+    Rprintf ("Can't write to data file %s.\n", fName);
+  }
+  if (row != NULL)
+  {
+    free (row);
   }
   return (status);
 }
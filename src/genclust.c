@@ -7,12 +7,227 @@
 
 #include "migclim.h"
 
+/*
+** The largest ring radius searched around a cell for its nearest occupied
+** cell before falling back to a feature transform of the whole matrix.
+*/
+#define GC_MAX_RING 16
+
+
+/*
+** gcRingNearest: Find the nearest occupied cell (value > 0) of a cell by
+**                searching square rings of increasing radius around it. This
+**                is fast when the matrix is densely occupied, which is the
+**                case after the first iteration.
+**
+** Parameters:
+**   - state:     The state matrix.
+**   - i, j:      The row and column of the cell.
+**   - maxRadius: The largest ring radius to search.
+**
+** Returns:
+**   - The index (row * nrCols + col) of the nearest occupied cell (the first
+**     one in row-major order if there are several).
+**   - -1 if there are no occupied cells at all.
+**   - -2 if the nearest occupied cell is further than 'maxRadius' rings.
+*/
+
+static int gcRingNearest (mcContext *ctx, int **state, int i, int j, int maxRadius)
+{
+  int x, y, r, d, step, best, bestDist;
+
+  best = -1;
+  bestDist = INT_MAX;
+  for (r = 0; ; r++)
+  {
+    /*
+    ** All cells of ring r are at least r cells away.
+    */
+    if ((best != -1) && (r * r > bestDist))
+    {
+      break;
+    }
+    if ((r > i) && (r > ctx->nrRows - 1 - i) && (r > j) && (r > ctx->nrCols - 1 - j))
+    {
+      break;
+    }
+    if (r > maxRadius)
+    {
+      return (-2);
+    }
+    for (x = i - r; x <= i + r; x++)
+    {
+      if ((x < 0) || (x >= ctx->nrRows))
+      {
+	continue;
+      }
+      step = ((x == i - r) || (x == i + r)) ? 1 : 2 * r;
+      for (y = j - r; y <= j + r; y += step)
+      {
+	if ((y < 0) || (y >= ctx->nrCols) || (state[x][y] <= 0))
+	{
+	  continue;
+	}
+	d = (x - i) * (x - i) + (y - j) * (y - j);
+	if ((d < bestDist) ||
+	    ((d == bestDist) && (x * ctx->nrCols + y < best)))
+	{
+	  best = x * ctx->nrCols + y;
+	  bestDist = d;
+	}
+      }
+    }
+  }
+
+  return (best);
+}
+
+
+/*
+** mcGenClustStart: Pick random starting points for the genetic clusters.
+**
+** Parameters:
+**   - state:       The state matrix (0 in all cells that can be picked).
+**   - suitability: The habitat suitability matrix.
+**   - barrier:     The barrier matrix.
+**   - nrClusters:  The number of genetic clusters.
+**   - threshold:   The suitability threshold.
+*/
+
+void mcGenClustStart (mcContext *ctx, int **state, int **suitability, int **barrier,
+		      int nrClusters, int threshold)
+{
+  int  i, x, y;
+  bool done;
+
+  for (i = 1; i <= nrClusters; i++)
+  {
+    done = false;
+    while (!done)
+    {
+      x = mcRandom (ctx) % ctx->nrRows;
+      y = mcRandom (ctx) % ctx->nrCols;
+      if ((state[x][y] == 0) && (suitability[x][y] >= threshold) &&
+	  (barrier[x][y] != 1))
+      {
+	state[x][y] = i;
+	done = true;
+      }
+    }
+  }
+}
+
 
 /*
-** Global variables.
+** mcGenClustStep: Perform one iteration of the genetic clusters migration:
+**                 every suitable cell keeps its cluster if it was occupied,
+**                 and otherwise gets the cluster of the nearest occupied cell
+**                 in the previous state.
+**
+** Parameters:
+**   - prevState:   The previous state matrix.
+**   - curState:    The current state matrix (all cells are set).
+**   - suitability: The habitat suitability matrix of the iteration.
+**   - barrier:     The barrier matrix of the iteration.
+**   - threshold:   The suitability threshold.
+**   - geodesic:    If 1, use the geodesic propagation (see 'genClust').
+**   - nearest:     A work array of nrRows x nrCols elements.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - If out of memory:        -1.
 */
-int    nrRows, nrCols, noData;
-double xllCorner, yllCorner, cellSize;
+
+int mcGenClustStep (mcContext *ctx, int **prevState, int **curState, int **suitability,
+		    int **barrier, int threshold, int geodesic, int *nearest)
+{
+  int  i, j, k;
+  bool transformDone;
+
+  /*
+  ** In geodesic mode, find the label of the nearest occupied cell that can
+  ** be reached without crossing a barrier for all cells at once. Otherwise,
+  ** the nearest occupied cell is only searched for the cells that need it
+  ** (the newly suitable ones), first in their neighbourhood, and with a
+  ** feature transform of the whole previous state if any of them is too
+  ** far from all occupied cells (as in the first iteration).
+  */
+  transformDone = false;
+  if (geodesic == 1)
+  {
+    if (mcGeodesicLabels (ctx, prevState, suitability, barrier, threshold,
+			  nearest) == -1)
+    {
+      return (-1);
+    }
+  }
+
+  /*
+  ** For each suitable cell in the current state, find the nearest occupied
+  ** cell in the previous state and copy the cluster number to the current
+  ** cell.
+  */
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      if (suitability[i][j] == ctx->noData)
+      {
+	curState[i][j] = ctx->noData;
+      }
+      else
+      {
+	curState[i][j] = 0;
+      }
+      /*
+      ** Check if the current cell is suitable.
+      */
+      if ((curState[i][j] == 0) && (suitability[i][j] >= threshold) &&
+	  (barrier[i][j] != 1))
+      {
+	if (prevState[i][j] > 0)
+	{
+	  /*
+	  ** If the current cell was already occupied, keep the cluster
+	  ** number.
+	  */
+	  curState[i][j] = prevState[i][j];
+	}
+	else
+	{
+	  /*
+	  ** Copy the cluster number of the closest occupied cell in the
+	  ** previous state to the current cell.
+	  */
+	  if (geodesic == 1)
+	  {
+	    curState[i][j] = nearest[i * ctx->nrCols + j];
+	    continue;
+	  }
+	  k = transformDone ? -2 : gcRingNearest (ctx, prevState, i, j, GC_MAX_RING);
+	  if (k == -2)
+	  {
+	    if (!transformDone)
+	    {
+	      if (mcFeatureTransform (ctx, prevState, nearest) == -1)
+	      {
+		return (-1);
+	      }
+	      transformDone = true;
+	    }
+	    k = nearest[i * ctx->nrCols + j];
+	  }
+	  if (k != -1)
+	  {
+	    curState[i][j] = prevState[k / ctx->nrCols][k % ctx->nrCols];
+	  }
+	}
+      }
+    }
+  }
+
+  return (0);
+}
 
 
 /*
@@ -33,23 +248,32 @@ double xllCorner, yllCorner, cellSize;
 **   - initFile:     The name of the file to read the initial cluster
 **                   distribution (starting points) from. If empty, it will
 **                   be generated at random and written to a file.
+**   - geodesic:     If 1, the clusters are propagated along the shortest
+**                   paths through suitable, non-barrier cells (see
+**                   'mcGeodesicLabels') instead of to the straight-line
+**                   nearest cells.
+**   - store:        If 1, the output is also written to the result store
+**                   "outBaseName.mcs" (see store.c), with the iteration
+**                   numbers as steps.
 */
 
 void genClust (int *nrow, int *ncol, int *ncls, int *niter, int *thrs,
 	       char **suitBaseName, char **barrBaseName, char **outBaseName,
-	       char **initFile)
+	       char **initFile, int *geodesic, int *store)
 {
-  int    i, j, x, y, **curState, **prevState, **suitability, **barrier, iter,
-         nrClusters, nrIterations, threshold;
-  double minDist, dist;
-  bool   done;
-  char   fileName[128];
+  int     i, j, **curState, **prevState, **suitability, **barrier, iter,
+          nrClusters, nrIterations, threshold, *nearest, **tmpState;
+  char    fileName[128];
+  mcStore results;
+  mcContext context, *ctx;
 
   /*
   ** Initialize the variables.
   */
-  nrRows = *nrow;
-  nrCols = *ncol;
+  ctx = &context;
+  mcInitContext (ctx);
+  ctx->nrRows = *nrow;
+  ctx->nrCols = *ncol;
   nrClusters = *ncls;
   nrIterations = *niter;
   threshold = *thrs;
@@ -57,44 +281,74 @@ void genClust (int *nrow, int *ncol, int *ncls, int *niter, int *thrs,
   prevState = NULL;
   suitability = NULL;
   barrier = NULL;
-  srand (time(NULL));
+  nearest = NULL;
+  results.fp = NULL;
+  results.index = NULL;
+  mcSeedRandom (ctx, (uint64_t)time (NULL));
   
   /*
   ** Allocate the necessary memory.
   */
-  curState = (int **)malloc (nrRows * sizeof (int *));
-  prevState = (int **)malloc (nrRows * sizeof (int *));
-  suitability = (int **)malloc (nrRows * sizeof (int *));
-  barrier = (int **)malloc (nrRows * sizeof (int *));
-  for (i = 0; i < nrRows; i++)
+  curState = (int **)malloc (ctx->nrRows * sizeof (int *));
+  prevState = (int **)malloc (ctx->nrRows * sizeof (int *));
+  suitability = (int **)malloc (ctx->nrRows * sizeof (int *));
+  barrier = (int **)malloc (ctx->nrRows * sizeof (int *));
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    curState[i] = (int *)malloc (ctx->nrCols * sizeof (int));
+    prevState[i] = (int *)malloc (ctx->nrCols * sizeof (int));
+    suitability[i] = (int *)malloc (ctx->nrCols * sizeof (int));
+    barrier[i] = (int *)malloc (ctx->nrCols * sizeof (int));
+  }
+  nearest = (int *)malloc (ctx->nrRows * ctx->nrCols * sizeof (int));
+  if (nearest == NULL)
   {
-    curState[i] = (int *)malloc (nrCols * sizeof (int));
-    prevState[i] = (int *)malloc (nrCols * sizeof (int));
-    suitability[i] = (int *)malloc (nrCols * sizeof (int));
-    barrier[i] = (int *)malloc (nrCols * sizeof (int));
+    Rprintf ("Not enough memory for the genetic clusters simulation.\n");
+    goto End_of_Routine;
+  }
+
+  /*
+  ** Open the result store.
+  */
+  if (*store == 1)
+  {
+    if (mcFileName (fileName, sizeof (fileName), "%s.mcs", *outBaseName) == -1)
+    {
+      goto End_of_Routine;
+    }
+    if (mcStoreOpen (ctx, fileName, false, &results) == -1)
+    {
+      goto End_of_Routine;
+    }
   }
 
   /*
   ** Read the first suitability and barrier data files and initialize the
   ** state matrices.
   */
-  sprintf (fileName, "%s1.asc", *suitBaseName);
-  if (readMat (fileName, suitability) == -1)
+  if (mcFileName (fileName, sizeof (fileName), "%s1.asc", *suitBaseName) == -1)
+  {
+    goto End_of_Routine;
+  }
+  if (readMat (ctx, fileName, suitability) == -1)
   {
     goto End_of_Routine;
   }
-  sprintf (fileName, "%s1.asc", *barrBaseName);
-  if (readMat (fileName, barrier) == -1)
+  if (mcFileName (fileName, sizeof (fileName), "%s1.asc", *barrBaseName) == -1)
   {
     goto End_of_Routine;
   }
-  for (i = 0; i < nrRows; i++)
+  if (readMat (ctx, fileName, barrier) == -1)
   {
-    for (j = 0; j < nrCols; j++)
+    goto End_of_Routine;
+  }
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
     {
-      if (suitability[i][j] == noData)
+      if (suitability[i][j] == ctx->noData)
       {
-	curState[i][j] = prevState[i][j] = noData;
+	curState[i][j] = prevState[i][j] = ctx->noData;
       }
       else
       {
@@ -113,7 +367,7 @@ void genClust (int *nrow, int *ncol, int *ncls, int *niter, int *thrs,
     /*
     ** Read the initial state from file.
     */
-    if (readMat (*initFile, prevState) == -1)
+    if (readMat (ctx, *initFile, prevState) == -1)
     {
       goto End_of_Routine;
     }
@@ -123,26 +377,16 @@ void genClust (int *nrow, int *ncol, int *ncls, int *niter, int *thrs,
     /*
     ** Generate starting points at random.
     */
-    for (i = 1; i <= nrClusters; i++)
-    {
-      done = false;
-      while (!done)
-      {
-	x = rand () % nrRows;
-	y = rand () % nrCols;
-	if ((prevState[x][y] == 0) && (suitability[x][y] >= threshold) &&
-	    (barrier[x][y] != 1))
-	{
-	  prevState[x][y] = i;
-	  done = true;
-	}
-      }
-    }
+    mcGenClustStart (ctx, prevState, suitability, barrier, nrClusters, threshold);
     /*
     ** Save the initial state matrix.
     */
-    sprintf (fileName, "%s0.asc", *outBaseName);
-    if (writeMat (fileName, prevState) == -1)
+    if (mcFileName (fileName, sizeof (fileName), "%s0.asc", *outBaseName) == -1)
+    {
+      goto End_of_Routine;
+    }
+    if ((writeMat (ctx, fileName, prevState) == -1) ||
+	((*store == 1) && (mcStoreWrite (ctx, &results, 1, 0, prevState) == -1)))
     {
       goto End_of_Routine;
     }
@@ -160,105 +404,69 @@ void genClust (int *nrow, int *ncol, int *ncls, int *niter, int *thrs,
     */
     if (iter > 1)
     {
-      sprintf (fileName, "%s%d.asc", *suitBaseName, iter);
-      if (readMat (fileName, suitability) == -1)
+      if (mcFileName (fileName, sizeof (fileName), "%s%d.asc", *suitBaseName, iter) == -1)
+      {
+	goto End_of_Routine;
+      }
+      if (readMat (ctx, fileName, suitability) == -1)
       {
 	goto End_of_Routine;
       }
-      sprintf (fileName, "%s%d.asc", *barrBaseName, iter);
-      if (readMat (fileName, barrier) == -1)
+      if (mcFileName (fileName, sizeof (fileName), "%s%d.asc", *barrBaseName, iter) == -1)
+      {
+	goto End_of_Routine;
+      }
+      if (readMat (ctx, fileName, barrier) == -1)
       {
 	goto End_of_Routine;
       }
     }
 
     /*
-    ** For each suitable cell in the current state, find the nearest occupied
-    ** cell in the previous state and copy the cluster number to the current
-    ** cell.
+    ** Compute the current state.
     */
-    for (i = 0; i < nrRows; i++)
+    if (mcGenClustStep (ctx, prevState, curState, suitability, barrier, threshold,
+			*geodesic, nearest) == -1)
     {
-      for (j = 0; j < nrCols; j++)
-      {
-	if (suitability[i][j] == noData)
-	{
-	  curState[i][j] = noData;
-	}
-	else
-	{
-	  curState[i][j] = 0;
-	}
-	/*
-	** Check if the current cell is suitable.
-	*/
-	if ((curState[i][j] == 0) && (suitability[i][j] >= threshold) &&
-	    (barrier[i][j] != 1))
-	{
-	  if (prevState[i][j] > 0)
-	  {
-	    /*
-	    ** If the current cell was already occupied, keep the cluster
-	    ** number.
-	    */
-	    curState[i][j] = prevState[i][j];
-	  }
-	  else
-	  {
-	    /*
-	    ** Find the closest occupied cell in the previous state and copy
-	    ** its cluster number to the current cell.
-	    */
-	    minDist = nrRows + nrCols;
-	    for (x = 0; x < nrRows; x++)
-	    {
-	      for (y = 0; y < nrCols; y++)
-	      {
-		if (prevState[x][y] > 0)
-		{
-		  dist = sqrt ((x-i)*(x-i) + (y-j)*(y-j));
-		  if (dist < minDist)
-		  {
-		    curState[i][j] = prevState[x][y];
-		    minDist = dist;
-		  }
-		}
-	      }
-	    }
-	  }
-	}
-      }
+      goto End_of_Routine;
     }
 
     /*
     ** Write the current state matrix to file.
     */
-    sprintf (fileName, "%s%d.asc", *outBaseName, iter);
-    if (writeMat (fileName, curState) == -1)
+    if (mcFileName (fileName, sizeof (fileName), "%s%d.asc", *outBaseName, iter) == -1)
+    {
+      goto End_of_Routine;
+    }
+    if ((writeMat (ctx, fileName, curState) == -1) ||
+	((*store == 1) && (mcStoreWrite (ctx, &results, 1, iter, curState) == -1)))
     {
       goto End_of_Routine;
     }
 
     /*
-    ** Replace the previous state with the current state.
+    ** The current state becomes the previous state (every cell of the new
+    ** current state is set in the next iteration, so the buffers are simply
+    ** swapped).
     */
-    for (i = 0; i < nrRows; i++)
-    {
-      for (j = 0; j < nrCols; j++)
-      {
-	prevState[i][j] = curState[i][j];
-      }
-    }
+    tmpState = prevState;
+    prevState = curState;
+    curState = tmpState;
   }
   Rprintf ("done.\n");
   
  End_of_Routine:
+  /*
+  ** Write the index of the result store.
+  */
+  mcStoreClose (ctx, &results);
+
   /*
   ** Free the allocated memory.
   */
   if (curState != NULL)
   {
-    for (i = 0; i < nrRows; i++)
+    for (i = 0; i < ctx->nrRows; i++)
     {
       free (curState[i]);
     }
@@ -266,7 +474,7 @@ void genClust (int *nrow, int *ncol, int *ncls, int *niter, int *thrs,
   }
   if (prevState != NULL)
   {
-    for (i = 0; i < nrRows; i++)
+    for (i = 0; i < ctx->nrRows; i++)
     {
       free (prevState[i]);
     }
@@ -274,7 +482,7 @@ void genClust (int *nrow, int *ncol, int *ncls, int *niter, int *thrs,
   }
   if (suitability != NULL)
   {
-    for (i = 0; i < nrRows; i++)
+    for (i = 0; i < ctx->nrRows; i++)
     {
       free (suitability[i]);
     }
@@ -282,12 +490,16 @@ void genClust (int *nrow, int *ncol, int *ncls, int *niter, int *thrs,
   }
   if (barrier != NULL)
   {
-    for (i = 0; i < nrRows; i++)
+    for (i = 0; i < ctx->nrRows; i++)
     {
       free (barrier[i]);
     }
     free (barrier);
   }
+  if (nearest != NULL)
+  {
+    free (nearest);
+  }
 }    
 
 
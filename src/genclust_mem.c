@@ -0,0 +1,279 @@
+/*
+** genclust_mem.c: An in-memory variant of the genetic clusters migration
+**                 simulation, called through '.Call'. The suitability and
+**                 barrier layers are passed as R arrays and the cluster
+**                 distributions are returned as an R array, so that nothing
+**                 is written to or read from disk. The result can also be
+**                 scored directly against observed cluster data.
+*/
+
+#include "migclim.h"
+#define R_NO_REMAP
+#include <Rinternals.h>
+
+
+/*
+** GC_MEM_NODATA: The value used for NA cells in the C matrices.
+*/
+#define GC_MEM_NODATA -9999
+
+
+/*
+** gcLayerToMat: Copy one layer of an R integer array (by column) into a
+**               matrix (by row), replacing NA values by the NoData value.
+*/
+
+static void gcLayerToMat (mcContext *ctx, int *layer, int **mat)
+{
+  int i, j;
+
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      mat[i][j] = (layer[i + j * ctx->nrRows] == NA_INTEGER) ? GC_MEM_NODATA :
+	layer[i + j * ctx->nrRows];
+    }
+  }
+}
+
+
+/*
+** gcMatToLayer: Copy a matrix into one layer of an R integer array,
+**               replacing the NoData value by NA.
+*/
+
+static void gcMatToLayer (mcContext *ctx, int **mat, int *layer)
+{
+  int i, j;
+
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      layer[i + j * ctx->nrRows] = (mat[i][j] == GC_MEM_NODATA) ? NA_INTEGER :
+	mat[i][j];
+    }
+  }
+}
+
+
+/*
+** genClustMem: Run the genetic clusters migration simulation in memory.
+**
+** Parameters (all R objects):
+**   - suit:     An integer array (rows x columns x iterations) with the
+**               habitat suitability of each iteration (NA = no data).
+**   - barr:     An integer array of the same dimensions with the barriers.
+**   - ncls:     The number of genetic clusters.
+**   - thrs:     The suitability threshold.
+**   - init:     An integer matrix with the initial cluster distribution, or
+**               NULL to pick random starting points.
+**   - geodesic: If 1, use the geodesic propagation (see 'genClust').
+**   - allIter:  If 1, return the distributions of all iterations (including
+**               the initial one, as iteration 0), otherwise only the last.
+**   - obsX, obsY, obsCl: The coordinates and cluster numbers of observed
+**               points to score the last iteration against (see 'validate'),
+**               or NULL.
+**   - georef:   The lower left corner (x, y) and the cell size of the
+**               layers, used to locate the observed points.
+**
+** Returns:
+**   A list with the cluster distributions ('clusters', an array or a
+**   matrix) and the total and average scores ('score', NULL if there are no
+**   observed points), or NULL if something went wrong.
+*/
+
+SEXP genClustMem (SEXP suit, SEXP barr, SEXP ncls, SEXP thrs, SEXP init,
+		  SEXP geodesic, SEXP allIter, SEXP obsX, SEXP obsY,
+		  SEXP obsCl, SEXP georef)
+{
+  int      i, iter, nrIterations, nrClusters, threshold, nrLayers, status,
+           nrProtected, *dims, **curState, **prevState, **suitability, **barrier,
+           **tmpState, *nearest, *out;
+  double   score[2];
+  SEXP     result, clusters, scores, names;
+  mcObs    obs;
+  mcGrid   grid;
+  mcKdTree tree;
+  mcContext context, *ctx;
+
+  /*
+  ** Initialize the variables.
+  */
+  ctx = &context;
+  mcInitContext (ctx);
+  status = -1;
+  nrProtected = 0;
+  result = R_NilValue;
+  dims = INTEGER (Rf_getAttrib (suit, R_DimSymbol));
+  ctx->nrRows = dims[0];
+  ctx->nrCols = dims[1];
+  nrIterations = dims[2];
+  nrClusters = Rf_asInteger (ncls);
+  threshold = Rf_asInteger (thrs);
+  ctx->noData = GC_MEM_NODATA;
+  curState = NULL;
+  prevState = NULL;
+  suitability = NULL;
+  barrier = NULL;
+  nearest = NULL;
+  obs.x = obs.y = NULL;
+  obs.cluster = obs.points = NULL;
+  tree.pts = NULL;
+  tree.size = 0;
+  mcSeedRandom (ctx, (uint64_t)time (NULL));
+
+  /*
+  ** Allocate the necessary memory.
+  */
+  curState = mcAllocMat (ctx);
+  prevState = mcAllocMat (ctx);
+  suitability = mcAllocMat (ctx);
+  barrier = mcAllocMat (ctx);
+  nearest = (int *)malloc (ctx->nrRows * ctx->nrCols * sizeof (int));
+  if ((curState == NULL) || (prevState == NULL) || (suitability == NULL) ||
+      (barrier == NULL) || (nearest == NULL))
+  {
+    Rprintf ("Not enough memory for the genetic clusters simulation.\n");
+    goto End_of_Routine;
+  }
+  nrLayers = (Rf_asInteger (allIter) == 1) ? nrIterations + 1 : 1;
+  PROTECT (clusters = (nrLayers > 1) ?
+	   Rf_alloc3DArray (INTSXP, ctx->nrRows, ctx->nrCols, nrLayers) :
+	   Rf_allocMatrix (INTSXP, ctx->nrRows, ctx->nrCols));
+  nrProtected++;
+  out = INTEGER (clusters);
+
+  /*
+  ** Initialize the state from the first layer and the initial distribution
+  ** (or random starting points).
+  */
+  gcLayerToMat (ctx, INTEGER (suit), suitability);
+  gcLayerToMat (ctx, INTEGER (barr), barrier);
+  if (!Rf_isNull (init))
+  {
+    gcLayerToMat (ctx, INTEGER (init), prevState);
+  }
+  else
+  {
+    for (i = 0; i < ctx->nrRows * ctx->nrCols; i++)
+    {
+      prevState[i / ctx->nrCols][i % ctx->nrCols] =
+	(suitability[i / ctx->nrCols][i % ctx->nrCols] == ctx->noData) ? ctx->noData : 0;
+    }
+    mcGenClustStart (ctx, prevState, suitability, barrier, nrClusters, threshold);
+  }
+  if (nrLayers > 1)
+  {
+    gcMatToLayer (ctx, prevState, out);
+  }
+
+  /*
+  ** Iterate the migration simulation.
+  */
+  for (iter = 1; iter <= nrIterations; iter++)
+  {
+    if (iter > 1)
+    {
+      gcLayerToMat (ctx, INTEGER (suit) + (iter-1) * ctx->nrRows * ctx->nrCols, suitability);
+      gcLayerToMat (ctx, INTEGER (barr) + (iter-1) * ctx->nrRows * ctx->nrCols, barrier);
+    }
+    if (mcGenClustStep (ctx, prevState, curState, suitability, barrier, threshold,
+			Rf_asInteger (geodesic), nearest) == -1)
+    {
+      goto End_of_Routine;
+    }
+    if ((nrLayers > 1) || (iter == nrIterations))
+    {
+      gcMatToLayer (ctx, curState, out + ((nrLayers > 1) ? iter * ctx->nrRows * ctx->nrCols : 0));
+    }
+    tmpState = prevState;
+    prevState = curState;
+    curState = tmpState;
+  }
+
+  /*
+  ** Score the last iteration against the observed points, if any (the last
+  ** state is in 'prevState' after the swap).
+  */
+  scores = R_NilValue;
+  if (!Rf_isNull (obsCl))
+  {
+    obs.nrPoints = Rf_length (obsCl);
+    obs.nrClusters = nrClusters;
+    obs.x = (double *)malloc (obs.nrPoints * sizeof (double));
+    obs.y = (double *)malloc (obs.nrPoints * sizeof (double));
+    obs.cluster = (int *)malloc (obs.nrPoints * sizeof (int));
+    obs.points = (int *)calloc (nrClusters + 1, sizeof (int));
+    if ((obs.x == NULL) || (obs.y == NULL) || (obs.cluster == NULL) ||
+	(obs.points == NULL))
+    {
+      Rprintf ("Not enough memory for the observed cluster data.\n");
+      goto End_of_Routine;
+    }
+    obs.points[0] = obs.nrPoints;
+    for (i = 0; i < obs.nrPoints; i++)
+    {
+      obs.x[i] = REAL (obsX)[i];
+      obs.y[i] = REAL (obsY)[i];
+      obs.cluster[i] = INTEGER (obsCl)[i];
+      if ((obs.cluster[i] < 1) || (obs.cluster[i] > nrClusters))
+      {
+	Rprintf ("Invalid observed cluster number %d.\n", obs.cluster[i]);
+	goto End_of_Routine;
+      }
+      obs.points[obs.cluster[i]]++;
+    }
+    grid.nrRows = ctx->nrRows;
+    grid.nrCols = ctx->nrCols;
+    grid.noData = ctx->noData;
+    grid.xllCorner = REAL (georef)[0];
+    grid.yllCorner = REAL (georef)[1];
+    grid.cellSize = REAL (georef)[2];
+    if (mcScoreSim (&obs, prevState, &grid, &tree, score) == -1)
+    {
+      Rprintf ("Not enough memory to validate the simulation.\n");
+      goto End_of_Routine;
+    }
+    PROTECT (scores = Rf_allocVector (REALSXP, 2));
+    nrProtected++;
+    REAL (scores)[0] = score[0];
+    REAL (scores)[1] = score[1];
+  }
+
+  /*
+  ** Put the results in a list.
+  */
+  PROTECT (result = Rf_allocVector (VECSXP, 2));
+  PROTECT (names = Rf_allocVector (STRSXP, 2));
+  SET_VECTOR_ELT (result, 0, clusters);
+  SET_VECTOR_ELT (result, 1, scores);
+  SET_STRING_ELT (names, 0, Rf_mkChar ("clusters"));
+  SET_STRING_ELT (names, 1, Rf_mkChar ("score"));
+  Rf_setAttrib (result, R_NamesSymbol, names);
+  nrProtected += 2;
+  status = 0;
+
+ End_of_Routine:
+  /*
+  ** Release the R objects and free the allocated memory.
+  */
+  UNPROTECT (nrProtected);
+  mcFreeMat (ctx, curState);
+  mcFreeMat (ctx, prevState);
+  mcFreeMat (ctx, suitability);
+  mcFreeMat (ctx, barrier);
+  if (nearest != NULL)
+  {
+    free (nearest);
+  }
+  mcFreeObs (&obs);
+  mcKdFree (&tree);
+  return ((status == 0) ? result : R_NilValue);
+}
+
+
+/*
+** EoF: genclust_mem.c
+*/
@@ -0,0 +1,199 @@
+/*
+** geodesic.c: Barrier-aware propagation of genetic cluster labels. Instead of
+**             taking the straight-line nearest occupied cell (which may lie
+**             across a barrier), every cell gets the label of the occupied
+**             cell it can be reached from along the shortest path through
+**             suitable, non-barrier cells.
+**
+** The paths are 8-connected, with the chamfer weights 5 (orthogonal step) and
+** 7 (diagonal step), which approximate Euclidean path lengths well (Borgefors
+** 1986). As the weights are small integers, the wavefront is expanded from all
+** occupied cells at once with a bucketed priority queue (Dial's algorithm),
+** which takes time linear in the number of cells.
+*/
+
+#include "migclim.h"
+
+#define GEO_ORTHO    5
+#define GEO_DIAG     7
+#define GEO_BUCKETS  8   /* Must be larger than the largest step weight. */
+
+
+/*
+** A FIFO bucket of cell indices.
+*/
+typedef struct _geoBucket
+{
+  int *cells, nrCells, size;
+} geoBucket;
+
+
+/*
+** geoPush: Add a cell to a bucket.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - If out of memory:        -1.
+*/
+
+static int geoPush (geoBucket *bucket, int cell)
+{
+  int *cells;
+
+  if (bucket->nrCells == bucket->size)
+  {
+    bucket->size = (bucket->size == 0) ? 1024 : 2 * bucket->size;
+    if ((cells = (int *)realloc (bucket->cells, bucket->size * sizeof (int))) == NULL)
+    {
+      return (-1);
+    }
+    bucket->cells = cells;
+  }
+  bucket->cells[bucket->nrCells++] = cell;
+  return (0);
+}
+
+
+/*
+** mcGeodesicLabels: Propagate the labels of the occupied cells of a state
+**                   matrix over the suitable, non-barrier cells.
+**
+** Parameters:
+**   - state:       The (previous) state matrix. Cells with a value > 0 are
+**                  the sources of the propagation.
+**   - suitability: The habitat suitability matrix.
+**   - barrier:     The barrier matrix (1 = barrier).
+**   - threshold:   The suitability threshold.
+**   - label:       An array of nrRows x nrCols elements, which will contain
+**                  the label of the nearest source along a path of suitable
+**                  non-barrier cells, or 0 if no source can be reached. The
+**                  sources keep their own label (even if they are no longer
+**                  suitable). A diagonal step is not allowed between two
+**                  barrier cells, so that barriers drawn as diagonal lines
+**                  can not be crossed.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - If out of memory:        -1.
+*/
+
+int mcGeodesicLabels (mcContext *ctx, int **state, int **suitability, int **barrier,
+		      int threshold, int *label)
+{
+  int        i, j, k, c, n, b, r, q, s, cur, nd, pending, status, *dist;
+  static int dRow[8] = {-1, 1, 0, 0, -1, -1, 1, 1};
+  static int dCol[8] = {0, 0, -1, 1, -1, 1, -1, 1};
+  geoBucket  bucket[GEO_BUCKETS];
+
+  status = -1;
+  for (b = 0; b < GEO_BUCKETS; b++)
+  {
+    bucket[b].cells = NULL;
+    bucket[b].nrCells = 0;
+    bucket[b].size = 0;
+  }
+  if ((dist = (int *)malloc (ctx->nrRows * ctx->nrCols * sizeof (int))) == NULL)
+  {
+    goto End_of_Routine;
+  }
+
+  /*
+  ** All occupied cells are sources at distance 0.
+  */
+  pending = 0;
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      c = i * ctx->nrCols + j;
+      if (state[i][j] > 0)
+      {
+	dist[c] = 0;
+	label[c] = state[i][j];
+	if (geoPush (&bucket[0], c) == -1)
+	{
+	  goto End_of_Routine;
+	}
+	pending++;
+      }
+      else
+      {
+	dist[c] = INT_MAX;
+	label[c] = 0;
+      }
+    }
+  }
+
+  /*
+  ** Expand the wavefront in order of increasing distance. Cells can be
+  ** queued more than once; entries whose distance has improved since are
+  ** skipped.
+  */
+  for (cur = 0; pending > 0; cur++)
+  {
+    b = cur % GEO_BUCKETS;
+    for (k = 0; k < bucket[b].nrCells; k++)
+    {
+      c = bucket[b].cells[k];
+      pending--;
+      if (dist[c] != cur)
+      {
+	continue;
+      }
+      i = c / ctx->nrCols;
+      j = c % ctx->nrCols;
+      for (s = 0; s < 8; s++)
+      {
+	r = i + dRow[s];
+	q = j + dCol[s];
+	if ((r < 0) || (r >= ctx->nrRows) || (q < 0) || (q >= ctx->nrCols) ||
+	    (suitability[r][q] == ctx->noData) || (suitability[r][q] < threshold) ||
+	    (barrier[r][q] == 1))
+	{
+	  continue;
+	}
+	if ((s >= 4) && (barrier[i][q] == 1) && (barrier[r][j] == 1))
+	{
+	  continue;
+	}
+	n = r * ctx->nrCols + q;
+	nd = cur + ((s < 4) ? GEO_ORTHO : GEO_DIAG);
+	if (nd < dist[n])
+	{
+	  dist[n] = nd;
+	  label[n] = label[c];
+	  if (geoPush (&bucket[nd % GEO_BUCKETS], n) == -1)
+	  {
+	    goto End_of_Routine;
+	  }
+	  pending++;
+	}
+      }
+    }
+    bucket[b].nrCells = 0;
+  }
+  status = 0;
+
+ End_of_Routine:
+  if (status == -1)
+  {
+    Rprintf ("Not enough memory for the geodesic cluster propagation.\n");
+  }
+  if (dist != NULL)
+  {
+    free (dist);
+  }
+  for (b = 0; b < GEO_BUCKETS; b++)
+  {
+    if (bucket[b].cells != NULL)
+    {
+      free (bucket[b].cells);
+    }
+  }
+  return (status);
+}
+
+
+/*
+** EoF: geodesic.c
+*/
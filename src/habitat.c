@@ -0,0 +1,514 @@
+/*
+** habitat.c: Functions for loading the habitat suitability layers of the
+**            environmental change steps.
+**
+** In the delta mode ('deltaLayers'), the reclassified and filtered layers
+** are prepared once per scenario: the first layer is kept in full, and each
+** following layer as the list of cells whose value differs from the
+** previous layer (cells that became unsuitable or suitable, and changes of
+** the suitability value). A step then only updates the cells in its list,
+** and a step without changes does nothing at all.
+**
+** With key layers ('hsKeySteps'), only the layers of the key steps exist on
+** disk, and the layer of any other step is interpolated linearly between the
+** two key layers around it. These two layers are kept in memory, so each key
+** layer is read only once while the steps advance.
+*/
+
+#include "migclim.h"
+
+
+/*
+** hbGetKey: Get a key layer, reading it into memory if it is not there yet.
+**           Each set of habitat suitability layers holds at most two key
+**           layers in memory: a new one replaces the one that is not
+**           'keep'.
+**
+** Parameters:
+**   - hsMapName: The base name of the habitat suitability layers.
+**   - key:       The step of the key layer.
+**   - keep:      The file name of the key layer that must stay in memory.
+**   - cache:     Whether to read the layer through the layer cache.
+**
+** Returns:
+**   - The cells of the key layer, or NULL if it could not be read.
+*/
+
+static int **hbGetKey (mcContext *ctx, char *hsMapName, int key, char *keep, bool cache)
+{
+  int         i, k;
+  char        fileName[512];
+  mcKeyLayer *layer;
+
+  mcLayerName (fileName, hsMapName, key);
+  for (k = 0; k < ctx->nrKeyLayers; k++)
+  {
+    if (strcmp (ctx->keyLayers[k].name, fileName) == 0)
+    {
+      return (ctx->keyLayers[k].cells);
+    }
+  }
+
+  /*
+  ** Replace the other key layer of these layers, or add a new one.
+  */
+  for (k = 0; k < ctx->nrKeyLayers; k++)
+  {
+    if ((strcmp (ctx->keyLayers[k].hsMap, hsMapName) == 0) &&
+	(strcmp (ctx->keyLayers[k].name, keep) != 0))
+    {
+      break;
+    }
+  }
+  if (k == ctx->nrKeyLayers)
+  {
+    if ((layer = (mcKeyLayer *)realloc (ctx->keyLayers, (ctx->nrKeyLayers + 1) *
+					sizeof (mcKeyLayer))) == NULL)
+    {
+      Rprintf ("Not enough memory for key layer %s.\n", fileName);
+      return (NULL);
+    }
+    ctx->keyLayers = layer;
+    layer = &ctx->keyLayers[ctx->nrKeyLayers];
+    if ((layer->cells = (int **)calloc (ctx->nrRows, sizeof (int *))) == NULL)
+    {
+      Rprintf ("Not enough memory for key layer %s.\n", fileName);
+      return (NULL);
+    }
+    ctx->nrKeyLayers++;
+    for (i = 0; i < ctx->nrRows; i++)
+    {
+      if ((layer->cells[i] = (int *)malloc (ctx->nrCols * sizeof (int))) == NULL)
+      {
+	strcpy (layer->name, "");
+	strcpy (layer->hsMap, "");
+	Rprintf ("Not enough memory for key layer %s.\n", fileName);
+	return (NULL);
+      }
+    }
+  }
+  layer = &ctx->keyLayers[k];
+  strcpy (layer->name, "");
+  strncpy (layer->hsMap, hsMapName, 255);
+  layer->hsMap[255] = '\0';
+  if (mcReadLayer (ctx, fileName, layer->cells, cache) == -1)
+  {
+    return (NULL);
+  }
+  strcpy (layer->name, fileName);
+  return (layer->cells);
+}
+
+
+/*
+** mcReadHabitat: Read the (unfiltered) habitat suitability layer of an
+**                environmental change step. With key layers, the layer of a
+**                step between two key steps 'a' and 'b' is the linear blend
+**                ((b - step) * A + (step - a) * B) / (b - a) of their layers,
+**                rounded to the nearest integer. Cells with NoData in either
+**                key layer get NoData.
+**
+** Parameters:
+**   - hsMapName: The base name of the habitat suitability layers.
+**   - step:      The environmental change step.
+**   - habSuit:   The matrix to put the layer in.
+**   - cache:     Whether to read the layer(s) through the layer cache.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+int mcReadHabitat (mcContext *ctx, char *hsMapName, int step, int **habSuit, bool cache)
+{
+  int   i, j, k, a, b, wa, wb, span, *ra, *rb, *out, **keyA, **keyB;
+  char  fileName[512], keepA[512], keepB[512];
+
+  if (ctx->nrKeySteps == 0)
+  {
+    mcLayerName (fileName, hsMapName, step);
+    return (mcReadLayer (ctx, fileName, habSuit, cache));
+  }
+
+  /*
+  ** The key steps around the step (see 'mcInit' for the spanning check).
+  */
+  for (k = 0; (k < ctx->nrKeySteps - 1) && (ctx->hsKeySteps[k + 1] <= step); k++);
+  a = ctx->hsKeySteps[k];
+  b = (a == step) ? a : ctx->hsKeySteps[k + 1];
+  mcLayerName (keepA, hsMapName, a);
+  mcLayerName (keepB, hsMapName, b);
+  if (((keyA = hbGetKey (ctx, hsMapName, a, keepB, cache)) == NULL) ||
+      ((keyB = hbGetKey (ctx, hsMapName, b, keepA, cache)) == NULL))
+  {
+    return (-1);
+  }
+  if (a == b)
+  {
+    for (i = 0; i < ctx->nrRows; i++)
+    {
+      memcpy (habSuit[i], keyA[i], ctx->nrCols * sizeof (int));
+    }
+    return (0);
+  }
+
+  /*
+  ** Blend the two key layers (all integer arithmetic on non-negative
+  ** values, so the rounding is exact).
+  */
+  span = b - a;
+  wa = b - step;
+  wb = step - a;
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    ra = keyA[i];
+    rb = keyB[i];
+    out = habSuit[i];
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      out[j] = ((ra[j] | rb[j]) < 0) ? ((ra[j] < 0) ? ra[j] : rb[j]) :
+	(ra[j] * wa + rb[j] * wb + span / 2) / span;
+    }
+  }
+  return (0);
+}
+
+
+/*
+** mcClearKeyLayers: Free the key layers kept in memory by 'mcReadHabitat'.
+*/
+
+void mcClearKeyLayers (mcContext *ctx)
+{
+  int i, k;
+
+  for (k = 0; k < ctx->nrKeyLayers; k++)
+  {
+    for (i = 0; i < ctx->nrRows; i++)
+    {
+      free (ctx->keyLayers[k].cells[i]);
+    }
+    free (ctx->keyLayers[k].cells);
+  }
+  free (ctx->keyLayers);
+  ctx->keyLayers = NULL;
+  ctx->nrKeyLayers = 0;
+}
+
+
+/*
+** mcLoadHabitat: Read (or interpolate) the habitat suitability layer of an
+**                environmental change step, reclassify it with 'rcThreshold'
+**                and filter it with the barriers.
+**
+** Parameters:
+**   - step:     The environmental change step.
+**   - habSuit:  The matrix to put the layer in.
+**   - barriers: The (filtered) barrier matrix.
+**   - cache:    Whether to read the layer through the layer cache.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+int mcLoadHabitat (mcContext *ctx, int step, int **habSuit, int **barriers, bool cache)
+{
+  int     i, j;
+  int64_t t0;
+
+  /*
+  ** Read the layer.
+  */
+  t0 = 0;
+  PRF_START(t0);
+  if (mcReadHabitat (ctx, ctx->hsMap, step, habSuit, cache) == -1)
+  {
+    return (-1);
+  }
+  PRF_STOP(PRF_LOAD, t0);
+  PRF_START(t0);
+
+  /*
+  ** If rcThreshold > 0, reclass the habitat suitability into 0 or 1000
+  ** (otherwise the values are left unchanged).
+  */
+  if (ctx->rcThreshold > 0)
+  {
+    for (i = 0; i < ctx->nrRows; i++)
+    {
+      for (j = 0; j < ctx->nrCols; j++)
+      {
+	habSuit[i][j] = (habSuit[i][j] < ctx->rcThreshold) ? 0 : 1000;
+      }
+    }
+  }
+
+  /*
+  ** Filter the layer: remove NoData, set the suitability to 0 on barriers
+  ** and to NoData where the barriers are NoData.
+  */
+  mcFilterMatrix (ctx, habSuit, barriers, true, true, true);
+  PRF_STOP(PRF_FILTER, t0);
+  return (0);
+}
+
+
+/*
+** mcBuildDelta: Prepare the habitat suitability layers of all environmental
+**               change steps for the delta mode.
+**
+** Parameters:
+**   - barriers: The (filtered) barrier matrix.
+**   - cache:    Whether to read the layers through the layer cache.
+**   - delta:    The delta layers to build (free them with 'mcFreeDelta').
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+int mcBuildDelta (mcContext *ctx, int **barriers, bool cache, mcHabDelta *delta)
+{
+  int   i, j, k, n, status, **prev, **next, **tmp;
+
+  status = 0;
+  prev = NULL;
+  next = NULL;
+  delta->first = NULL;
+  delta->cells = NULL;
+  delta->values = NULL;
+  if (((delta->nrChanges = (int *)calloc (ctx->envChgSteps + 1, sizeof (int))) == NULL) ||
+      ((delta->cells = (int **)calloc (ctx->envChgSteps + 1, sizeof (int *))) == NULL) ||
+      ((delta->values = (int **)calloc (ctx->envChgSteps + 1, sizeof (int *))) == NULL) ||
+      ((delta->first = (int **)calloc (ctx->nrRows, sizeof (int *))) == NULL) ||
+      ((prev = (int **)calloc (ctx->nrRows, sizeof (int *))) == NULL) ||
+      ((next = (int **)calloc (ctx->nrRows, sizeof (int *))) == NULL))
+  {
+    status = -1;
+    goto End_of_Routine;
+  }
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    if (((delta->first[i] = (int *)malloc (ctx->nrCols * sizeof (int))) == NULL) ||
+	((prev[i] = (int *)malloc (ctx->nrCols * sizeof (int))) == NULL) ||
+	((next[i] = (int *)malloc (ctx->nrCols * sizeof (int))) == NULL))
+    {
+      status = -1;
+      goto End_of_Routine;
+    }
+  }
+
+  /*
+  ** The first layer.
+  */
+  if (mcLoadHabitat (ctx, 1, delta->first, barriers, cache) == -1)
+  {
+    status = -2;
+    goto End_of_Routine;
+  }
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    memcpy (prev[i], delta->first[i], ctx->nrCols * sizeof (int));
+  }
+
+  /*
+  ** The cells that change at each following step (counted first, then
+  ** recorded by row).
+  */
+  for (k = 2; k <= ctx->envChgSteps; k++)
+  {
+    if (mcLoadHabitat (ctx, k, next, barriers, cache) == -1)
+    {
+      status = -2;
+      goto End_of_Routine;
+    }
+    n = 0;
+    for (i = 0; i < ctx->nrRows; i++)
+    {
+      for (j = 0; j < ctx->nrCols; j++)
+      {
+	n += (next[i][j] != prev[i][j]);
+      }
+    }
+    delta->nrChanges[k] = n;
+    if (n > 0)
+    {
+      if (((delta->cells[k] = (int *)malloc (n * sizeof (int))) == NULL) ||
+	  ((delta->values[k] = (int *)malloc (n * sizeof (int))) == NULL))
+      {
+	status = -1;
+	goto End_of_Routine;
+      }
+      n = 0;
+      for (i = 0; i < ctx->nrRows; i++)
+      {
+	for (j = 0; j < ctx->nrCols; j++)
+	{
+	  if (next[i][j] != prev[i][j])
+	  {
+	    delta->cells[k][n] = i * ctx->nrCols + j;
+	    delta->values[k][n] = next[i][j];
+	    n++;
+	  }
+	}
+      }
+    }
+    tmp = prev;
+    prev = next;
+    next = tmp;
+  }
+
+ End_of_Routine:
+  if (prev != NULL)
+  {
+    for (i = 0; i < ctx->nrRows; i++)
+    {
+      free (prev[i]);
+    }
+    free (prev);
+  }
+  if (next != NULL)
+  {
+    for (i = 0; i < ctx->nrRows; i++)
+    {
+      free (next[i]);
+    }
+    free (next);
+  }
+  if (status == -1)
+  {
+    Rprintf ("Not enough memory for the delta habitat suitability layers.\n");
+  }
+  if (status != 0)
+  {
+    mcFreeDelta (ctx, delta);
+    status = -1;
+  }
+  return (status);
+}
+
+
+/*
+** mcFreeDelta: Free the delta layers built by 'mcBuildDelta'.
+**
+** Parameters:
+**   - delta: The delta layers.
+*/
+
+void mcFreeDelta (mcContext *ctx, mcHabDelta *delta)
+{
+  int i;
+
+  if (delta->first != NULL)
+  {
+    for (i = 0; i < ctx->nrRows; i++)
+    {
+      free (delta->first[i]);
+    }
+    free (delta->first);
+  }
+  if (delta->cells != NULL)
+  {
+    for (i = 0; i <= ctx->envChgSteps; i++)
+    {
+      free (delta->cells[i]);
+    }
+    free (delta->cells);
+  }
+  if (delta->values != NULL)
+  {
+    for (i = 0; i <= ctx->envChgSteps; i++)
+    {
+      free (delta->values[i]);
+    }
+    free (delta->values);
+  }
+  if (delta->nrChanges != NULL)
+  {
+    free (delta->nrChanges);
+  }
+  delta->first = NULL;
+  delta->cells = NULL;
+  delta->values = NULL;
+  delta->nrChanges = NULL;
+}
+
+
+/*
+** mcDeltaLayer: Set a matrix to the full habitat suitability layer of an
+**               environmental change step (the first layer with the changes
+**               of the following steps up to 'step' applied to it).
+**
+** Parameters:
+**   - delta:   The delta layers.
+**   - step:    The environmental change step.
+**   - habSuit: The matrix to put the layer in.
+*/
+
+void mcDeltaLayer (mcContext *ctx, mcHabDelta *delta, int step, int **habSuit)
+{
+  int i, k, n;
+
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    memcpy (habSuit[i], delta->first[i], ctx->nrCols * sizeof (int));
+  }
+  for (k = 2; k <= step; k++)
+  {
+    for (n = 0; n < delta->nrChanges[k]; n++)
+    {
+      i = delta->cells[k][n];
+      habSuit[i / ctx->nrCols][i % ctx->nrCols] = delta->values[k][n];
+    }
+  }
+}
+
+
+/*
+** mcApplyDelta: Update the habitat suitability layer of the previous
+**               environmental change step to the next step, together with
+**               the no-dispersal matrix and count and the universal
+**               dispersal count (see 'updateNoDispMat' and 'mcUnivDispCnt'),
+**               visiting only the cells that changed.
+**
+** Parameters:
+**   - delta:         The delta layers.
+**   - step:          The environmental change step to update to.
+**   - habSuit:       The habitat suitability matrix of the previous step.
+**   - noDispMat:     The no-dispersal matrix.
+**   - noDispCount:   A pointer to the no-dispersal count.
+**   - univDispCount: A pointer to the universal dispersal count.
+*/
+
+void mcApplyDelta (mcContext *ctx, mcHabDelta *delta, int step, int **habSuit, int **noDispMat,
+		   int *noDispCount, int *univDispCount)
+{
+  int i, j, n, value;
+
+  for (n = 0; n < delta->nrChanges[step]; n++)
+  {
+    i = delta->cells[step][n] / ctx->nrCols;
+    j = delta->cells[step][n] % ctx->nrCols;
+    value = delta->values[step][n];
+    if ((habSuit[i][j] > 0) && (value <= 0))
+    {
+      (*univDispCount)--;
+    }
+    else if ((habSuit[i][j] <= 0) && (value > 0))
+    {
+      (*univDispCount)++;
+    }
+    if ((value == 0) && (noDispMat[i][j] == 1))
+    {
+      noDispMat[i][j] = 0;
+      (*noDispCount)--;
+    }
+    habSuit[i][j] = value;
+  }
+}
+
+
+/*
+** EoF: habitat.c
+*/
@@ -0,0 +1,209 @@
+/*
+** kdtree.c: A static 2-d tree over the occupied cells of a matrix, to find
+**           the nearest occupied cell of arbitrary (x, y) locations in
+**           logarithmic time instead of scanning the whole matrix.
+**
+** The tree is stored implicitly: the nodes of a range [lo, hi) of the points
+** array are split on the median point (lo + hi) / 2, alternately on the x
+** and the y coordinate.
+*/
+
+#include "migclim.h"
+
+
+/*
+** kdCmpX, kdCmpY: Compare two points on their x or y coordinate (for qsort).
+*/
+
+static int kdCmpX (const void *a, const void *b)
+{
+  double d;
+
+  d = ((mcKdPoint *)a)->x - ((mcKdPoint *)b)->x;
+  return ((d < 0) ? -1 : ((d > 0) ? 1 : 0));
+}
+
+static int kdCmpY (const void *a, const void *b)
+{
+  double d;
+
+  d = ((mcKdPoint *)a)->y - ((mcKdPoint *)b)->y;
+  return ((d < 0) ? -1 : ((d > 0) ? 1 : 0));
+}
+
+
+/*
+** kdSplit: Recursively sort a range of points into the implicit tree.
+*/
+
+static void kdSplit (mcKdPoint *pts, int lo, int hi, int depth)
+{
+  if (hi - lo < 2)
+  {
+    return;
+  }
+  qsort (pts + lo, hi - lo, sizeof (mcKdPoint), (depth % 2 == 0) ? kdCmpX : kdCmpY);
+  kdSplit (pts, lo, (lo + hi) / 2, depth + 1);
+  kdSplit (pts, (lo + hi) / 2 + 1, hi, depth + 1);
+}
+
+
+/*
+** mcKdBuild: Build the tree over the cell centres of the occupied cells
+**            (value > 0) of a matrix.
+**
+** Parameters:
+**   - mat:  The matrix.
+**   - grid: The dimensions and georeference of the matrix.
+**   - tree: The tree to build. Its 'pts' must be NULL (and 'size' 0) the
+**           first time; after that, the same tree can be rebuilt for other
+**           matrices, reusing its memory. It must be freed with 'mcKdFree'.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - If out of memory:        -1 (nothing is printed, as this function may
+**                              be called from several threads).
+*/
+
+int mcKdBuild (int **mat, mcGrid *grid, mcKdTree *tree)
+{
+  int        i, j, n;
+  mcKdPoint *pts;
+
+  tree->nrPoints = 0;
+  n = 0;
+  for (i = 0; i < grid->nrRows; i++)
+  {
+    for (j = 0; j < grid->nrCols; j++)
+    {
+      if (mat[i][j] > 0)
+      {
+	n++;
+      }
+    }
+  }
+  if (n > tree->size)
+  {
+    if ((pts = (mcKdPoint *)realloc (tree->pts, n * sizeof (mcKdPoint))) == NULL)
+    {
+      return (-1);
+    }
+    tree->pts = pts;
+    tree->size = n;
+  }
+
+  /*
+  ** The cell centres are rounded to single precision, as they always were
+  ** in 'validate', so that the distances (and the results) do not change.
+  */
+  for (i = 0; i < grid->nrRows; i++)
+  {
+    for (j = 0; j < grid->nrCols; j++)
+    {
+      if (mat[i][j] > 0)
+      {
+	tree->pts[tree->nrPoints].x = (float)(grid->xllCorner + (j*grid->cellSize) + (grid->cellSize/2.0));
+	tree->pts[tree->nrPoints].y = (float)(grid->yllCorner + ((grid->nrRows-1-i)*grid->cellSize) + (grid->cellSize/2.0));
+	tree->pts[tree->nrPoints].label = mat[i][j];
+	tree->pts[tree->nrPoints].index = i * grid->nrCols + j;
+	tree->nrPoints++;
+      }
+    }
+  }
+  kdSplit (tree->pts, 0, tree->nrPoints, 0);
+
+  return (0);
+}
+
+
+/*
+** kdSearch: Recursively search a range of the tree for the nearest point.
+*/
+
+static void kdSearch (mcKdPoint *pts, int lo, int hi, int depth, double x,
+		      double y, mcKdPoint **best, double *bestDist)
+{
+  int        mid;
+  double     d, diff;
+  mcKdPoint *p;
+
+  if (lo >= hi)
+  {
+    return;
+  }
+  mid = (lo + hi) / 2;
+  p = &pts[mid];
+  d = (x - p->x) * (x - p->x) + (y - p->y) * (y - p->y);
+  if ((*best == NULL) || (d < *bestDist) ||
+      ((d == *bestDist) && (p->index < (*best)->index)))
+  {
+    *best = p;
+    *bestDist = d;
+  }
+  diff = (depth % 2 == 0) ? (x - p->x) : (y - p->y);
+  if (diff < 0)
+  {
+    kdSearch (pts, lo, mid, depth + 1, x, y, best, bestDist);
+    if (diff * diff <= *bestDist)
+    {
+      kdSearch (pts, mid + 1, hi, depth + 1, x, y, best, bestDist);
+    }
+  }
+  else
+  {
+    kdSearch (pts, mid + 1, hi, depth + 1, x, y, best, bestDist);
+    if (diff * diff <= *bestDist)
+    {
+      kdSearch (pts, lo, mid, depth + 1, x, y, best, bestDist);
+    }
+  }
+}
+
+
+/*
+** mcKdNearest: Find the label of the nearest point in the tree. Ties are
+**              broken in favour of the first cell in row-major order, as
+**              with a scan of the matrix. The tree is only read, so queries
+**              can run in parallel.
+**
+** Parameters:
+**   - tree: The tree.
+**   - x:    The x coordinate of the location.
+**   - y:    The y coordinate of the location.
+**
+** Returns:
+**   The label of the nearest point, or 0 if the tree is empty.
+*/
+
+int mcKdNearest (mcKdTree *tree, double x, double y)
+{
+  mcKdPoint *best;
+  double     bestDist;
+
+  best = NULL;
+  bestDist = 0.0;
+  kdSearch (tree->pts, 0, tree->nrPoints, 0, x, y, &best, &bestDist);
+
+  return ((best == NULL) ? 0 : best->label);
+}
+
+
+/*
+** mcKdFree: Free the memory of a tree.
+*/
+
+void mcKdFree (mcKdTree *tree)
+{
+  if (tree->pts != NULL)
+  {
+    free (tree->pts);
+  }
+  tree->pts = NULL;
+  tree->nrPoints = 0;
+  tree->size = 0;
+}
+
+
+/*
+** EoF: kdtree.c
+*/
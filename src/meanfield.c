@@ -0,0 +1,567 @@
+/*
+** meanfield.c: A deterministic "mean-field" MigClim engine, which propagates
+**              the probability that each cell is occupied (and the
+**              distribution of its age) instead of simulating replicates.
+**
+** Each dispersal step follows the rules of 'mcMigrate'. A source cell
+** colonizes a sink with a probability that is linear in its (age dependent)
+** propagule production, so the probability for a single source is the
+** kernel value times the expected production of the source. The sources are
+** then taken to be independent, and an empty sink escapes colonization with
+** the product of their survival probabilities (one minus their colonization
+** probability). Long-distance dispersal is treated in the same way, with the
+** exact distribution of the LDD landing cell of 'mcRandomPixel'. The ages are
+** kept as a distribution over 0 to the full maturity age (older ages are
+** merged into the last class), which is all the rules depend on.
+**
+** The independence of the sources makes this an approximation: in a
+** replicate, nearby cells are occupied together. The results are written as
+** expected counts in the usual statistics and summary files, and the final
+** occupancy probabilities (times 1000) in a "probability" raster.
+*/
+
+#include "migclim.h"
+
+
+/*
+** MF_LDD_SAMPLES: The number of quadrature points per cell of distance and
+**                 of circumference for the LDD landing distribution.
+*/
+#define MF_LDD_SAMPLES 16
+
+
+/*
+** An offset from a source to a sink cell, with its probability of
+** colonization (excluding the production and the suitability factors).
+*/
+typedef struct _mfOffset
+{
+  int    row, col;
+  double prob;
+} mfOffset;
+
+
+/*
+** mfDispOffsets: Make the list of the offsets within the dispersal distance,
+**                with the kernel value of their distance (see 'mcSrcCell').
+**
+** Returns:
+**   - The list of offsets (and its length in *nrOffsets).
+**   - If out of memory: NULL.
+*/
+
+static mfOffset *mfDispOffsets (mcContext *ctx, int *nrOffsets)
+{
+  int       k, l, realDist;
+  mfOffset *offsets;
+
+  *nrOffsets = 0;
+  offsets = (mfOffset *)malloc ((2*ctx->dispDist+1) * (2*ctx->dispDist+1) * sizeof (mfOffset));
+  if (offsets == NULL)
+  {
+    return (NULL);
+  }
+  for (k = -ctx->dispDist; k <= ctx->dispDist; k++)
+  {
+    for (l = -ctx->dispDist; l <= ctx->dispDist; l++)
+    {
+      realDist = (int)round (sqrt (k*k + l*l));
+      if ((realDist > 0) && (realDist <= ctx->dispDist))
+      {
+	offsets[*nrOffsets].row = k;
+	offsets[*nrOffsets].col = l;
+	offsets[*nrOffsets].prob = ctx->dispKernel[realDist-1];
+	(*nrOffsets)++;
+      }
+    }
+  }
+  return (offsets);
+}
+
+
+/*
+** mfLddOffsets: Make the list of the offsets an LDD event can land on, with
+**               their probability. 'mcRandomPixel' draws a uniform distance
+**               and angle and truncates the resulting offset, so the
+**               probabilities are integrated numerically over a fine grid of
+**               distances and angles.
+**
+** Returns:
+**   - The list of offsets (and its length in *nrOffsets).
+**   - If out of memory: NULL.
+*/
+
+static mfOffset *mfLddOffsets (mcContext *ctx, int *nrOffsets)
+{
+  int       i, j, k, size, nrDist, nrAngle;
+  double    dist, angle, *weight;
+  mfOffset *offsets;
+
+  *nrOffsets = 0;
+  offsets = NULL;
+  size = 2 * ctx->lddMaxDist + 1;
+  if ((weight = (double *)calloc (size * size, sizeof (double))) == NULL)
+  {
+    return (NULL);
+  }
+  nrDist = MF_LDD_SAMPLES * (ctx->lddMaxDist - ctx->lddMinDist + 1);
+  nrAngle = MF_LDD_SAMPLES * (int)ceil (6.283185 * ctx->lddMaxDist);
+  for (i = 0; i < nrDist; i++)
+  {
+    dist = ((i + 0.5) / nrDist) * (ctx->lddMaxDist - ctx->lddMinDist) + ctx->lddMinDist;
+    for (j = 0; j < nrAngle; j++)
+    {
+      angle = ((j + 0.5) / nrAngle) * 6.283185;
+      weight[((int)(dist * cos (angle)) + ctx->lddMaxDist) * size +
+	     (int)(dist * sin (angle)) + ctx->lddMaxDist] += 1.0 / nrDist / nrAngle;
+    }
+  }
+  offsets = (mfOffset *)malloc (size * size * sizeof (mfOffset));
+  if (offsets != NULL)
+  {
+    for (k = 0; k < size * size; k++)
+    {
+      if ((weight[k] > 0.0) && (k != ctx->lddMaxDist * size + ctx->lddMaxDist))
+      {
+	offsets[*nrOffsets].row = k / size - ctx->lddMaxDist;
+	offsets[*nrOffsets].col = k % size - ctx->lddMaxDist;
+	offsets[*nrOffsets].prob = weight[k];
+	(*nrOffsets)++;
+      }
+    }
+  }
+  free (weight);
+  return (offsets);
+}
+
+
+/*
+** mfSpread: Multiply the survival probabilities (of not being colonized) of
+**           all the suitable sinks by those of each source.
+**
+** Parameters:
+**   - prod:      The expected propagule production of each cell.
+**   - habSuit:   The habitat suitability matrix.
+**   - barriers:  The barriers matrix (or NULL to ignore the barriers).
+**   - offsets:   The offsets from a source to its sinks.
+**   - nrOffsets: The number of offsets.
+**   - surv:      The survival probability of each cell, to update.
+*/
+
+static void mfSpread (mcContext *ctx, double *prod, int **habSuit, int **barriers,
+		      mfOffset *offsets, int nrOffsets, double *surv)
+{
+  int    i, j, k, r, q;
+  double p;
+
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      if (prod[i * ctx->nrCols + j] <= 0.0)
+      {
+	continue;
+      }
+      for (k = 0; k < nrOffsets; k++)
+      {
+	r = i + offsets[k].row;
+	q = j + offsets[k].col;
+	if ((r < 0) || (r >= ctx->nrRows) || (q < 0) || (q >= ctx->nrCols) ||
+	    (habSuit[r][q] <= 0))
+	{
+	  continue;
+	}
+	if ((barriers != NULL) && mcIntersectsBarrier (ctx, r, q, i, j, barriers))
+	{
+	  continue;
+	}
+	p = offsets[k].prob * prod[i * ctx->nrCols + j] * (habSuit[r][q] / 1000.0);
+	surv[r * ctx->nrCols + q] *= (p >= 1.0) ? 0.0 : 1.0 - p;
+      }
+    }
+  }
+}
+
+
+/*
+** mcMeanField: Run the mean-field simulation with the current parameters,
+**              and write the expected statistics and summary to the
+**              'simulName_stats.txt' and 'simulName_summary.txt' files, and
+**              the final occupancy probabilities to a
+**              'simulName_probability.asc' raster.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+int mcMeanField (mcContext *ctx)
+{
+  int       i, j, a, c, status, nrAges, envChgStep, dispStep, loopID,
+            nrDispOffsets, nrLddOffsets, simulTime, nrInitial, nrNoDispersal,
+            nrUnivDispersal, **iniMat, **barriers, **habSuit, **noDisp;
+  double    occ, colonized, absent, totColonized, totDecolonized,
+            totLDDSuccess, stepColonized, stepDecolonized, stepLDDSuccess,
+            *ageProb, *prod, *surv, *survLdd, *fresh, *factor;
+  char      fileName[512];
+  FILE     *fp;
+  time_t    startTime;
+  mfOffset *dispOffsets, *lddOffsets;
+
+  status = -1;
+  fp = NULL;
+  ageProb = prod = surv = survLdd = fresh = factor = NULL;
+  dispOffsets = lddOffsets = NULL;
+  nrLddOffsets = 0;
+  iniMat = barriers = habSuit = noDisp = NULL;
+  startTime = time (NULL);
+  if ((ctx->checkpointFreq > 0) || ctx->resumeSimul || ctx->fullOutput || ctx->resultStore || ctx->bitSliced ||
+      (strlen (ctx->sweepFile) > 0))
+  {
+    Rprintf ("Checkpoints, full output, result stores, sweeps and the bit-sliced engine are not supported by the mean-field engine.\n");
+    goto End_of_Routine;
+  }
+
+  /*
+  ** Allocate the necessary memory. The age distribution of a cell is stored
+  ** in 'nrAges' consecutive elements, and 'factor' holds the production of
+  ** each age class.
+  */
+  nrAges = ctx->fullMatAge + 1;
+  ageProb = (double *)calloc (ctx->nrRows * ctx->nrCols * nrAges, sizeof (double));
+  prod = (double *)malloc (ctx->nrRows * ctx->nrCols * sizeof (double));
+  surv = (double *)malloc (ctx->nrRows * ctx->nrCols * sizeof (double));
+  survLdd = (double *)malloc (ctx->nrRows * ctx->nrCols * sizeof (double));
+  fresh = (double *)malloc (ctx->nrRows * ctx->nrCols * sizeof (double));
+  factor = (double *)calloc (nrAges, sizeof (double));
+  dispOffsets = mfDispOffsets (ctx, &nrDispOffsets);
+  if (ctx->lddFreq > 0.0)
+  {
+    lddOffsets = mfLddOffsets (ctx, &nrLddOffsets);
+  }
+  iniMat = (int **)calloc (ctx->nrRows, sizeof (int *));
+  barriers = (int **)calloc (ctx->nrRows, sizeof (int *));
+  habSuit = (int **)calloc (ctx->nrRows, sizeof (int *));
+  noDisp = (int **)calloc (ctx->nrRows, sizeof (int *));
+  if ((ageProb == NULL) || (prod == NULL) || (surv == NULL) ||
+      (survLdd == NULL) || (fresh == NULL) || (factor == NULL) ||
+      (dispOffsets == NULL) || ((ctx->lddFreq > 0.0) && (lddOffsets == NULL)) ||
+      (iniMat == NULL) || (barriers == NULL) || (habSuit == NULL) || (noDisp == NULL))
+  {
+    Rprintf ("Not enough memory for the mean-field simulation.\n");
+    goto End_of_Routine;
+  }
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    iniMat[i] = (int *)malloc (ctx->nrCols * sizeof (int));
+    barriers[i] = (int *)malloc (ctx->nrCols * sizeof (int));
+    habSuit[i] = (int *)malloc (ctx->nrCols * sizeof (int));
+    noDisp[i] = (int *)malloc (ctx->nrCols * sizeof (int));
+    if ((iniMat[i] == NULL) || (barriers[i] == NULL) || (habSuit[i] == NULL) ||
+	(noDisp[i] == NULL))
+    {
+      Rprintf ("Not enough memory for the mean-field simulation.\n");
+      goto End_of_Routine;
+    }
+  }
+  for (a = ctx->iniMatAge; a < nrAges; a++)
+  {
+    factor[a] = (a >= ctx->fullMatAge) ? 1.0 : ctx->propaguleProd[a - ctx->iniMatAge];
+  }
+
+  /*
+  ** Load and filter the initial distribution and barriers (see 'mcMigrate').
+  ** The initially occupied cells have the full maturity age.
+  */
+  if (mcFileName (fileName, sizeof (fileName), "%s.asc", ctx->iniDist) == -1)
+  {
+    goto End_of_Routine;
+  }
+  if (readMat (ctx, fileName, iniMat) == -1)
+  {
+    goto End_of_Routine;
+  }
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      barriers[i][j] = 0;
+    }
+  }
+  if (ctx->useBarrier)
+  {
+    if (mcFileName (fileName, sizeof (fileName), "%s.asc", ctx->barrier) == -1)
+    {
+      goto End_of_Routine;
+    }
+    if (readMat (ctx, fileName, barriers) == -1)
+    {
+      goto End_of_Routine;
+    }
+  }
+  mcFilterMatrix (ctx, barriers, iniMat, true, false, true);
+  if (ctx->useBarrier)
+  {
+    mcFilterMatrix (ctx, iniMat, barriers, false, true, false);
+  }
+  nrInitial = 0;
+  absent = 0.0;
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      noDisp[i][j] = iniMat[i][j];
+      if (iniMat[i][j] == 1)
+      {
+	ageProb[(i * ctx->nrCols + j) * nrAges + ctx->fullMatAge] = 1.0;
+	nrInitial++;
+      }
+      if (iniMat[i][j] == 0)
+      {
+	absent += 1.0;
+      }
+    }
+  }
+  nrNoDispersal = nrInitial;
+  nrUnivDispersal = nrInitial;
+  colonized = nrInitial;
+  totColonized = totDecolonized = totLDDSuccess = 0.0;
+  stepDecolonized = 0.0;
+
+  if (mcFileName (fileName, sizeof (fileName), "%s/%s_stats.txt", ctx->simulName,
+		  ctx->simulName) == -1)
+  {
+    goto End_of_Routine;
+  }
+  if ((fp = fopen (fileName, "w")) == NULL)
+  {
+    Rprintf ("Could not open statistics file for writing.\n");
+    goto End_of_Routine;
+  }
+  fprintf (fp, "envChgStep\tdispStep\tstepID\tunivDispersal\tNoDispersal\toccupied\tabsent\tstepColonized\tstepDecolonized\tstepLDDsuccess\n");
+  fprintf (fp, "0\t0\t1\t%d\t%d\t%d\t%.2f\t0\t0\t0\n", nrUnivDispersal,
+	   nrNoDispersal, nrInitial, absent);
+
+  Rprintf ("Running MigClim simulation %s (mean-field).\n", ctx->simulName);
+  for (envChgStep = 1; envChgStep <= ctx->envChgSteps; envChgStep++)
+  {
+    Rprintf ("  %d...\n", envChgStep);
+
+    /*
+    ** Load, reclassify and filter the habitat suitability.
+    */
+    if (mcReadHabitat (ctx, ctx->hsMap, envChgStep, habSuit, false) == -1)
+    {
+      goto End_of_Routine;
+    }
+    if (ctx->rcThreshold > 0)
+    {
+      for (i = 0; i < ctx->nrRows; i++)
+      {
+	for (j = 0; j < ctx->nrCols; j++)
+	{
+	  habSuit[i][j] = (habSuit[i][j] < ctx->rcThreshold) ? 0 : 1000;
+	}
+      }
+    }
+    mcFilterMatrix (ctx, habSuit, barriers, true, true, true);
+    nrUnivDispersal = mcUnivDispCnt (ctx, habSuit);
+    updateNoDispMat (ctx, habSuit, noDisp, &nrNoDispersal);
+    loopID = envChgStep * 100;
+
+    /*
+    ** Occupied cells that became unsuitable are temporarily resilient: they
+    ** are counted as decolonized now, but stay occupied (and keep
+    ** dispersing) until the end of this environmental change step.
+    */
+    stepDecolonized = 0.0;
+    for (c = 0; c < ctx->nrRows * ctx->nrCols; c++)
+    {
+      if (habSuit[c / ctx->nrCols][c % ctx->nrCols] == 0)
+      {
+	for (a = 0; a < nrAges; a++)
+	{
+	  stepDecolonized += ageProb[c * nrAges + a];
+	}
+      }
+    }
+
+    for (dispStep = 1; dispStep <= ctx->dispSteps; dispStep++)
+    {
+      loopID++;
+      if (dispStep > 1)
+      {
+	stepDecolonized = 0.0;
+      }
+
+      /*
+      ** The expected production of every cell at the start of the step
+      ** (cells colonized during the step have age 0 and do not disperse).
+      */
+      for (c = 0; c < ctx->nrRows * ctx->nrCols; c++)
+      {
+	prod[c] = 0.0;
+	for (a = ctx->iniMatAge; a < nrAges; a++)
+	{
+	  prod[c] += ageProb[c * nrAges + a] * factor[a];
+	}
+	surv[c] = 1.0;
+	survLdd[c] = 1.0;
+      }
+
+      /*
+      ** Dispersal within the dispersal distance, then LDD towards the cells
+      ** that are still empty.
+      */
+      mfSpread (ctx, prod, habSuit, ctx->useBarrier ? barriers : NULL, dispOffsets,
+		nrDispOffsets, surv);
+      if (ctx->lddFreq > 0.0)
+      {
+	for (c = 0; c < ctx->nrRows * ctx->nrCols; c++)
+	{
+	  prod[c] *= ctx->lddFreq;
+	}
+	mfSpread (ctx, prod, habSuit, NULL, lddOffsets, nrLddOffsets, survLdd);
+      }
+      stepColonized = 0.0;
+      stepLDDSuccess = 0.0;
+      for (c = 0; c < ctx->nrRows * ctx->nrCols; c++)
+      {
+	occ = 0.0;
+	for (a = 0; a < nrAges; a++)
+	{
+	  occ += ageProb[c * nrAges + a];
+	}
+	fresh[c] = (1.0 - occ) * (1.0 - surv[c]);
+	stepColonized += fresh[c];
+	if (ctx->lddFreq > 0.0)
+	{
+	  occ = (1.0 - occ - fresh[c]) * (1.0 - survLdd[c]);
+	  fresh[c] += occ;
+	  stepColonized += occ;
+	  stepLDDSuccess += occ;
+	}
+      }
+
+      /*
+      ** Age all occupied cells (the newly colonized ones go from 0 to 1).
+      */
+      for (c = 0; c < ctx->nrRows * ctx->nrCols; c++)
+      {
+	ageProb[c * nrAges + nrAges - 1] += ageProb[c * nrAges + nrAges - 2];
+	for (a = nrAges - 2; a > 0; a--)
+	{
+	  ageProb[c * nrAges + a] = ageProb[c * nrAges + a - 1];
+	}
+	ageProb[c * nrAges] = 0.0;
+	ageProb[c * nrAges + 1] += fresh[c];
+      }
+
+      /*
+      ** Update the expected counters and write them to the statistics file.
+      */
+      colonized = colonized + stepColonized - stepDecolonized;
+      absent = absent - stepColonized + stepDecolonized;
+      totColonized += stepColonized;
+      totDecolonized += stepDecolonized;
+      totLDDSuccess += stepLDDSuccess;
+      fprintf (fp, "%d\t%d\t%d\t%d\t%d\t%.2f\t%.2f\t%.2f\t%.2f\t%.2f\n", envChgStep,
+	       dispStep, loopID, nrUnivDispersal, nrNoDispersal, colonized, absent,
+	       stepColonized, stepDecolonized, stepLDDSuccess);
+    }
+
+    /*
+    ** The temporarily resilient cells are decolonized.
+    */
+    for (c = 0; c < ctx->nrRows * ctx->nrCols; c++)
+    {
+      if (habSuit[c / ctx->nrCols][c % ctx->nrCols] == 0)
+      {
+	for (a = 0; a < nrAges; a++)
+	{
+	  ageProb[c * nrAges + a] = 0.0;
+	}
+      }
+    }
+  }
+  fclose (fp);
+  fp = NULL;
+
+  /*
+  ** Write the summary and the occupancy probability raster (NoData where the
+  ** last habitat suitability layer has NoData). The initial distribution
+  ** matrix is reused for the raster.
+  */
+  simulTime = time (NULL) - startTime;
+  if (mcFileName (fileName, sizeof (fileName), "%s/%s_summary.txt", ctx->simulName,
+		  ctx->simulName) == -1)
+  {
+    goto End_of_Routine;
+  }
+  if ((fp = fopen (fileName, "w")) == NULL)
+  {
+    Rprintf ("Could not write summary output to file.\n");
+    goto End_of_Routine;
+  }
+  fprintf (fp, "simulName\tiniCount\tnoDispCount\tunivDispCount\toccupiedCount\tabsentCount\ttotColonized\ttotDecolonized\ttotLDDsuccess\trunTime\n");
+  fprintf (fp, "%s\t%d\t%d\t%d\t%.2f\t%.2f\t%.2f\t%.2f\t%.2f\t%d\n", ctx->simulName, nrInitial,
+	   nrNoDispersal, nrUnivDispersal, colonized, absent, totColonized,
+	   totDecolonized, totLDDSuccess, simulTime);
+  fclose (fp);
+  fp = NULL;
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      c = i * ctx->nrCols + j;
+      occ = 0.0;
+      for (a = 0; a < nrAges; a++)
+      {
+	occ += ageProb[c * nrAges + a];
+      }
+      iniMat[i][j] = (habSuit[i][j] == -9999) ? -9999 : (int)round (1000.0 * occ);
+    }
+  }
+  if (mcFileName (fileName, sizeof (fileName), "%s/%s_probability.asc", ctx->simulName,
+		  ctx->simulName) == -1)
+  {
+    goto End_of_Routine;
+  }
+  if (writeMat (ctx, fileName, iniMat) == -1)
+  {
+    goto End_of_Routine;
+  }
+  status = 0;
+
+ End_of_Routine:
+  if (fp != NULL)
+  {
+    fclose (fp);
+  }
+  if (ageProb != NULL) free (ageProb);
+  if (prod != NULL) free (prod);
+  if (surv != NULL) free (surv);
+  if (survLdd != NULL) free (survLdd);
+  if (fresh != NULL) free (fresh);
+  if (factor != NULL) free (factor);
+  if (dispOffsets != NULL) free (dispOffsets);
+  if (lddOffsets != NULL) free (lddOffsets);
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    if (iniMat != NULL) free (iniMat[i]);
+    if (barriers != NULL) free (barriers[i]);
+    if (habSuit != NULL) free (habSuit[i]);
+    if (noDisp != NULL) free (noDisp[i]);
+  }
+  if (iniMat != NULL) free (iniMat);
+  if (barriers != NULL) free (barriers);
+  if (habSuit != NULL) free (habSuit);
+  if (noDisp != NULL) free (noDisp);
+
+  return (status);
+}
+
+
+/*
+** EoF: meanfield.c
+*/
@@ -10,6 +10,8 @@
 ** Include files.
 */
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -21,46 +23,323 @@
 /*
 ** Defines.
 **
-** UNIF01:         Draw a uniform random number in [0;1]. Note that 'random'
-**                 does not work on Windows %-/  so we use 'rand' instead.
-** WEAK_BARRIER:   Weak barrier type.
-** STRONG_BARRIER: Strong barrier type.
+** UNIF01:            Draw a uniform random number in [0;1[. Note that 'random'
+**                    does not work on Windows %-/  and the state of 'rand'
+**                    cannot be saved, so we use our own generator instead
+**                    (see random.c), with its state in the simulation
+**                    context 'ctx'.
+** WEAK_BARRIER:      Weak barrier type.
+** STRONG_BARRIER:    Strong barrier type.
+** MC_RNG_STATE_SIZE: The number of 64-bit words in the generator state.
+** MC_NR_COUNTERS:    The number of pixel counters saved in a checkpoint.
+** MC_STORE_FINAL:    The step under which the final state of a replicate is
+**                    kept in a result store.
+** MC_IS_SINK:        Whether cell c is listed in a candidate sink index.
+** MC_SET_SINK:       Set the bit of cell c in the mask of a sink index.
+** MC_CLR_SINK:       Clear the bit of cell c in the mask of a sink index.
+** mcCtz:             The index of the lowest set bit of a non-zero word.
 */
-#define UNIF01         ((double)rand () / RAND_MAX)
-#define WEAK_BARRIER   1
-#define STRONG_BARRIER 2
+#define UNIF01            (mcUnif01 (ctx))
+#define WEAK_BARRIER      1
+#define STRONG_BARRIER    2
+#define MC_RNG_STATE_SIZE 4
+#define MC_NR_COUNTERS    11
+#define MC_STORE_FINAL    -1
+#define MC_IS_SINK(sinks, c)  (((sinks)->mask[(c) >> 6] >> ((c) & 63)) & 1)
+#define MC_SET_SINK(sinks, c) ((sinks)->mask[(c) >> 6] |= (uint64_t)1 << ((c) & 63))
+#define MC_CLR_SINK(sinks, c) ((sinks)->mask[(c) >> 6] &= ~((uint64_t)1 << ((c) & 63)))
+#if defined(__GNUC__)
+#define mcCtz(x)              __builtin_ctzll (x)
+#else
+int mcCtz (uint64_t x);
+#endif
 
 
 /*
-** Global variables (we just use many global var's here to avoid passing too
-** many arguments all the time).
+** Profiling.
+**
+** PRF_*:     The phases of a simulation step that are timed when profiling.
+** PRF_COUNT: Increment a profiling counter (only when profiling is enabled,
+**            so that the overhead is a single, well predicted, branch).
+**            Like the other PRF_* macros, it uses the profile of the
+**            simulation context 'ctx'.
+** PRF_START: Start timing a phase (store the clock value in t0).
+** PRF_STOP:  Add the time elapsed since t0 to the timer of a phase.
+*/
+#define PRF_LOAD      0
+#define PRF_FILTER    1
+#define PRF_SINK      2
+#define PRF_LDD       3
+#define PRF_AGING     4
+#define PRF_STATS     5
+#define PRF_OUTPUT    6
+#define PRF_NR_PHASES 7
+#define PRF_COUNT(counter, n) do { if (ctx->profiling) ctx->prf.counter += (n); } while (0)
+#define PRF_START(t0)         do { if (ctx->profiling) t0 = mcClockNs (); } while (0)
+#define PRF_STOP(phase, t0)   do { if (ctx->profiling) ctx->prf.phaseNs[phase] += mcClockNs () - t0; } while (0)
+
+typedef struct _mcProfile
+{
+  int64_t   phaseNs[PRF_NR_PHASES];
+  long long srcCellCalls, cellsProbed, randomDraws, barrierCalls, raysWalked;
+} mcProfile;
+
+
+/*
+** The spatial index (a 2-d tree) over the occupied cells of a matrix.
+*/
+typedef struct _mcKdPoint
+{
+  double x, y;
+  int    label, index;
+} mcKdPoint;
+
+typedef struct _mcKdTree
+{
+  int        nrPoints, size;
+  mcKdPoint *pts;
+} mcKdTree;
+
+
+/*
+** The properties of a grid file (see 'mcReadGrid').
+*/
+typedef struct _mcGrid
+{
+  int    nrRows, nrCols, noData;
+  double xllCorner, yllCorner, cellSize;
+} mcGrid;
+
+
+/*
+** An open NetCDF cube, with its parsed header (see netcdf.c).
+*/
+typedef struct _mcCube mcCube;
+
+
+/*
+** The habitat suitability layers of all environmental change steps in the
+** delta mode (see habitat.c): the first layer, and for each following step
+** the cells (row * nrCols + col) that change and their new values.
+*/
+typedef struct _mcHabDelta
+{
+  int  **first, *nrChanges, **cells, **values;
+} mcHabDelta;
+
+
+/*
+** The index of the candidate sink cells of the dispersal sweep (see
+** sinks.c): the listed cells (row * nrCols + col) in increasing order, and
+** a mask with the bits of the listed cells set.
+*/
+typedef struct _mcSinkIndex
+{
+  int      *cells, nrCells;
+  uint64_t *mask;
+} mcSinkIndex;
+
+
+/*
+** The buffers of the dilation fast path (see dilate.c): the plane of the
+** mature source cells, the reached cells of a row, and, for dispersal
+** distances up to maxDist, the half widths of the disc and the source rows
+** dilated by segments of all these half widths.
 */
+typedef struct _mcDilateBuf
+{
+  int      *halfWidth, maxDist;
+  uint64_t *src, *reach, *seg;
+} mcDilateBuf;
+
+
+/*
+** A result store opened for writing (see store.c): its file, the offset of
+** its index, and the replicate and step of each of its records.
+*/
+typedef struct _mcStore
+{
+  FILE    *fp;
+  int      nrRecords, maxRecords, *index;
+  int64_t  idxOffset;
+} mcStore;
+
 
-extern int     nrRows, nrCols, envChgSteps, dispSteps, dispDist, iniMatAge,
-               fullMatAge, rcThreshold, barrierType, lddMinDist, lddMaxDist, 
-               noData, replicateNb;
-extern double *dispKernel, *propaguleProd, lddFreq, xllCorner, yllCorner,
-               cellSize;
-extern char    iniDist[128], hsMap[128], simulName[128], barrier[128];
-extern bool    useBarrier, fullOutput;
+/*
+** An observed genetic cluster distribution (see 'validate').
+*/
+typedef struct _mcObs
+{
+  int     nrPoints, nrClusters, *cluster, *points;
+  double *x, *y;
+} mcObs;
+
+
+/*
+** A scenario of a parameter sweep, or a species of a community (see
+** 'mcReadSweep').
+*/
+typedef struct _mcScenario
+{
+  char    name[64], iniDist[128], hsMap[128];
+  int     rcThreshold, iniMatAge, fullMatAge, dispDist, nrPropProd;
+  double  lddFreq, *dispKernel, *propaguleProd;
+} mcScenario;
+
+
+/*
+** A layer in the layer cache (see 'mcReadLayer'): the name of the file it
+** was read from, its cells (by row) and the georeference and NoData value of
+** the file.
+*/
+typedef struct _mcCachedLayer
+{
+  char   name[512];
+  int   *cells;
+  mcGrid grid;
+} mcCachedLayer;
+
+
+/*
+** A key layer kept in memory (see 'mcReadHabitat'): the name of the file it
+** was read from, the base name of the habitat suitability layers it belongs
+** to, and its cells.
+*/
+typedef struct _mcKeyLayer
+{
+  char   name[512], hsMap[256];
+  int  **cells;
+} mcKeyLayer;
+
+
+/*
+** The context of a simulation: its parameters (see 'mcInit'), the
+** georeference of its grids (see 'readMat'), the state of its random number
+** generator, its profile, its layer caches and the NetCDF cube it reads the
+** habitat suitability layers from. All the functions that need
+** any of these get the context as their first argument, so independent
+** simulations (each with its own context) can run in the same process at the
+** same time.
+*/
+typedef struct _mcContext
+{
+  int            nrRows, nrCols, envChgSteps, dispSteps, dispDist, iniMatAge,
+                 fullMatAge, rcThreshold, barrierType, lddMinDist, lddMaxDist,
+                 noData, replicateNb, checkpointFreq, *hsKeySteps, nrKeySteps;
+  double        *dispKernel, *propaguleProd, lddFreq, xllCorner, yllCorner,
+                 cellSize;
+  char           iniDist[256], hsMap[256], simulName[128], barrier[256],
+                 sweepFile[128], communityFile[128];
+  bool           useBarrier, fullOutput, resumeSimul, profiling, bitSliced,
+                 meanField, useDilation, compressOutput, resultStore,
+                 deltaLayers;
+  mcProfile      prf;
+  uint64_t       rngState[MC_RNG_STATE_SIZE];
+  mcCachedLayer *layerCache;
+  int            nrCachedLayers;
+  mcKeyLayer    *keyLayers;
+  int            nrKeyLayers;
+  mcCube        *cube;
+} mcContext;
 
 
 /*
 ** Function prototypes.
 */
 void mcMigrate           (char **paramFile, int *nrFiles);
-bool mcSrcCell           (int i, int j, int **curState, int **pxlAge,
-			  int loopID, int habSuit, int **barriers);
-int  mcUnivDispCnt       (int **habSuit);
-void updateNoDispMat     (int **hsMat, int **noDispMat, int *noDispCount);
-void mcFilterMatrix      (int **inMatrix, int **filterMatrix, bool filterNoData, bool filterOnes, bool insertNoData);
-bool mcIntersectsBarrier (int snkX, int snkY, int srcX, int srcY, int **barriers);
-int  mcInit              (char *paramFile);
-int  readMat             (char *fName, int **mat);
-int  writeMat            (char *fName, int **mat);
+bool mcSrcCell           (mcContext *ctx, int i, int j, uint64_t *sources, int **pxlAge,
+			  int habSuit, int **barriers);
+void mcBuildSources      (mcContext *ctx, uint64_t *sources, int **curState, int **pxlAge, int loopID);
+int  mcLddDispersal      (mcContext *ctx, int **curState, int **pxlAge, int **habSuit, int loopID,
+			  mcSinkIndex *sinks);
+int  mcUnivDispCnt       (mcContext *ctx, int **habSuit);
+void updateNoDispMat     (mcContext *ctx, int **hsMat, int **noDispMat, int *noDispCount);
+void mcFilterMatrix      (mcContext *ctx, int **inMatrix, int **filterMatrix, bool filterNoData, bool filterOnes, bool insertNoData);
+bool mcIntersectsBarrier (mcContext *ctx, int snkX, int snkY, int srcX, int srcY, int **barriers);
+void mcInitContext       (mcContext *ctx);
+void mcFreeContext       (mcContext *ctx);
+int  **mcAllocMat        (mcContext *ctx);
+void mcFreeMat           (mcContext *ctx, int **mat);
+int  mcInit              (mcContext *ctx, char *paramFile);
+int  mcReadGrid          (char *fName, int **mat, mcGrid *grid, mcCube **cube, char *errMsg);
+int  mcReadTiff          (char *fName, int **mat, mcGrid *grid, char *errMsg);
+int  mcReadCube          (char *fName, char *varName, int step, int **mat, mcGrid *grid,
+			  mcCube **cube, char *errMsg);
+void mcCloseCube         (mcCube **cube);
+void mcLayerName         (char *fileName, char *hsMapName, int step);
+int  mcFileName          (char *fileName, size_t size, const char *format, ...);
+int  readMat             (mcContext *ctx, char *fName, int **mat);
+int  mcReadSweep         (mcContext *ctx, char *fName, bool withLayers, mcScenario **scenarios, int *nrScenarios);
+void mcFreeSweep         (mcScenario *scenarios, int nrScenarios);
+int  mcSetScenario       (mcContext *ctx, mcScenario *scenario);
+int  mcReadLayer         (mcContext *ctx, char *fName, int **mat, bool cache);
+void mcClearLayerCache   (mcContext *ctx);
+int  mcWriteSweepSummary (mcContext *ctx, mcScenario *scenarios, int nrScenarios, char *tableName, char *keyName);
+void mcCommunity         (char **paramFile, int *nrFiles);
+int  mcBitSliced         (mcContext *ctx);
+int  mcMeanField         (mcContext *ctx);
+bool mcDilationCase      (mcContext *ctx);
+int  mcInitDilate        (mcContext *ctx, mcDilateBuf *buf);
+void mcFreeDilate        (mcDilateBuf *buf);
+int  mcDilateStep        (mcContext *ctx, mcDilateBuf *buf, int **curState, int **pxlAge, int **habSuit,
+                          int **barriers, int loopID);
+int  mcReadHabitat       (mcContext *ctx, char *hsMapName, int step, int **habSuit, bool cache);
+void mcClearKeyLayers    (mcContext *ctx);
+int  mcLoadHabitat       (mcContext *ctx, int step, int **habSuit, int **barriers, bool cache);
+int  mcBuildDelta        (mcContext *ctx, int **barriers, bool cache, mcHabDelta *delta);
+void mcFreeDelta         (mcContext *ctx, mcHabDelta *delta);
+void mcDeltaLayer        (mcContext *ctx, mcHabDelta *delta, int step, int **habSuit);
+void mcApplyDelta        (mcContext *ctx, mcHabDelta *delta, int step, int **habSuit, int **noDispMat, int *noDispCount,
+                          int *univDispCount);
+int  mcInitSinks         (mcContext *ctx, mcSinkIndex *sinks);
+void mcFreeSinks         (mcSinkIndex *sinks);
+void mcBuildSinks        (mcContext *ctx, mcSinkIndex *sinks, int **curState, int **habSuit);
+void mcAddSinks          (mcContext *ctx, mcSinkIndex *sinks, int *cells, int nrCells, int **curState,
+                          int **habSuit);
+int  writeMat            (mcContext *ctx, char *fName, int **mat);
 void genClust            (int *nrow, int *ncol, int *ncls, int *niter, int *thrs, char **suitBaseName,
-                          char **barrBaseName, char **outBaseName, char **initFile);
+                          char **barrBaseName, char **outBaseName, char **initFile, int *geodesic,
+                          int *store);
+void mcGenClustStart     (mcContext *ctx, int **state, int **suitability, int **barrier, int nrClusters, int threshold);
+int  mcGenClustStep      (mcContext *ctx, int **prevState, int **curState, int **suitability, int **barrier, int threshold,
+                          int geodesic, int *nearest);
+int  mcGeodesicLabels    (mcContext *ctx, int **state, int **suitability, int **barrier, int threshold, int *label);
+int  mcFeatureTransform  (mcContext *ctx, int **mat, int *nearest);
+int  mcKdBuild           (int **mat, mcGrid *grid, mcKdTree *tree);
+int  mcKdNearest         (mcKdTree *tree, double x, double y);
+void mcKdFree            (mcKdTree *tree);
+double mcBestMatch       (double *weight, int n, int *match);
+int  mcReadObs           (char *fName, int nrPoints, int nrClusters, mcObs *obs);
+void mcFreeObs           (mcObs *obs);
+int  mcScoreSim          (mcObs *obs, int **simCluster, mcGrid *grid, mcKdTree *tree, double *score);
 void validate            (char **obsFileName, int *npts, char **simFileName, int *ncls, double *bestScore);
+void validateBatch       (char **obsFileName, int *npts, char **simFileNames, int *nfiles, int *ncls,
+                          double *scores);
+void     mcSeedRandom      (mcContext *ctx, uint64_t seed);
+uint64_t mcRandom          (mcContext *ctx);
+double   mcUnif01          (mcContext *ctx);
+void     mcGetRandomState  (mcContext *ctx, uint64_t *state);
+void     mcSetRandomState  (mcContext *ctx, uint64_t *state);
+int  mcWriteCheckpoint   (mcContext *ctx, char *fName, int repLoop, int nextStep, int *counters, int nrCounters,
+                          long statsOffset, int elapsed, int **curState, int **pxlAge, int **noDispMat);
+int  mcReadCheckpoint    (mcContext *ctx, char *fName, int *repLoop, int *nextStep, int *counters, int nrCounters,
+                          long *statsOffset, int *elapsed, int **curState, int **pxlAge, int **noDispMat);
+int  mcTruncateFile      (char *fName, long length);
+int  mcStoreOpen         (mcContext *ctx, char *fName, bool append, mcStore *store);
+int  mcStoreWrite        (mcContext *ctx, mcStore *store, int replicate, int step, int **mat);
+int  mcStoreClose        (mcContext *ctx, mcStore *store);
+void mcStoreInfo         (char **fName, int *dims, double *georef, int *nrRecords, int *replicates,
+                          int *steps, int *status);
+void mcStoreRead         (char **fName, int *replicate, int *step, int *window, int *values,
+                          int *status);
+int64_t  mcClockNs         (void);
+void mcProfileReset      (mcContext *ctx);
+long mcPeakMemory        (void);
+void mcProfileHeader     (FILE *fp);
+void mcProfileWrite      (mcContext *ctx, FILE *fp, int envChgStep, int dispStep, int loopID);
+void mcSynthLandscape    (mcContext *ctx, int **hsMat, int **iniMat, int **barMat, int step, double barDens, double occup);
+void mcBenchmark         (char **outFile, int *sizes, int *nrSizes, int *dists, int *nrDists, double *barDens,
+                          int *nrBarDens, double *occup, int *nrOccup, int *nrReps, int *status);
 
 
 
@@ -4,29 +4,52 @@
 */
 
 #include "migclim.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 /*
-** Global variables, so we won't have to pass too many arguments all the time.
+** A cell of the grid.
 */
-int     nrRows, nrCols, envChgSteps, dispSteps, dispDist, iniMatAge,
-        fullMatAge, rcThreshold, barrierType, lddMinDist, lddMaxDist,
-        replicateNb;
-double *dispKernel, *propaguleProd, lddFreq;
-char    iniDist[128], hsMap[128], simulName[128], barrier[128];
-bool    useBarrier, fullOutput;
 typedef struct _pixel
 {
   int row, col;
 } pixel;
-pixel rndPixel;
+
+
+/*
+** The work matrices of a simulation (see 'mcAllocWork'). In a parameter
+** sweep, every thread has its own.
+**   - currentState:   Values in [-32768;32767]. NoData values are represented by -9999
+**   - habSuitability: Values in [0;1000].
+**   - barriers:       Values in [0;255].
+**   - pixelAge:       Values in [0;255].
+**   - noDispersal:    Values in [0;255].
+**   - resilient:      The temporarily resilient pixels of a step (delta mode only).
+**   - sources:        One bit per pixel, set for the mature source pixels (see 'mcBuildSources').
+**   - sinks:          The candidate sink cells (see sinks.c).
+**   - dilate:         The buffers of the dilation fast path (see dilate.c).
+*/
+typedef struct _mcWork
+{
+  int         **currentState, **habSuitability, **barriers, **pixelAge, **noDispersal, *resilient;
+  uint64_t     *sources;
+  mcSinkIndex   sinks;
+  mcDilateBuf   dilate;
+} mcWork;
 
 
 /*
 ** Function prototypes.
 */
-void mcRandomPixel   (pixel *pix);
-bool mcSinkCellCheck (pixel pix, int **curState, int **habSuit);
+void mcRandomPixel   (mcContext *ctx, pixel *pix);
+bool mcSinkCellCheck (mcContext *ctx, pixel pix, int **curState, int **habSuit, mcSinkIndex *sinks);
+static int  mcAllocWork    (mcContext *ctx, mcWork *work);
+static void mcFreeWork     (mcContext *ctx, mcWork *work);
+static int  mcCacheLayers  (mcContext *ctx, int **mat);
+static int  mcRunScenario  (mcContext *ctx, mcWork *work, char *scenName, char *repSep, bool cache,
+                            bool verbose);
 
 
 /*
@@ -34,18 +57,334 @@ bool mcSinkCellCheck (pixel pix, int **curState, int **habSuit);
 **            Parameter values are read from a file.
 **
 ** Parameters:
-**   - paramFile: The name of the parameter file.
+**   - paramFile: The name of the parameter file. If it names a sweep file,
+**                the simulation is run for each of the scenarios in it (see
+**                sweep.c), reading the input layers only once. The scenarios
+**                are run in parallel, each thread with its own context and
+**                work matrices.
 **   - nrFiles:   A pointer to an integer to contain the number of output
 **                files created. A value of -1 is returned if an error occurred.
 */
 
 void mcMigrate (char **paramFile, int *nrFiles)
 {
-  int     i, j, RepLoop, envChgStep, dispStep, loopID, simulTime;  
-  bool    advOutput, habIsSuitable, cellInDispDist, tempResilience;
-  char    fileName[128], simulName2[128];
-  FILE   *fp=NULL, *fp2=NULL;
-  double  lddSeedProb;
+  int         s, nrScenarios;
+  bool        sweeping;
+  char       *failed=NULL;
+  uint64_t   *seeds=NULL;
+  mcScenario *scenarios=NULL;
+  mcWork      work;
+  mcContext   context, *ctx;
+
+  
+  /* Initialize the variables. The simulation state lives in its own context. */
+  ctx = &context;
+  mcInitContext(ctx);
+  memset(&work, 0, sizeof(mcWork));
+  nrScenarios = 0;
+  
+  if(mcInit(ctx, *paramFile) == -1){ /* Reads the "_param.txt" file */
+    *nrFiles = -1;
+    goto End_of_Routine;
+  }
+  
+  /* In a parameter sweep, every scenario is run replicateNb times. */
+  sweeping = (strlen(ctx->sweepFile) > 0);
+  if(sweeping && (mcReadSweep(ctx, ctx->sweepFile, false, &scenarios, &nrScenarios) == -1)){
+    *nrFiles = -1;
+    goto End_of_Routine;
+  }
+  
+  /* Seed our own generator ('srandom' and 'random' do not work on Windows :-( and
+  ** the state of 'rand' cannot be saved in a checkpoint). When resuming, the
+  ** generator state is restored from the checkpoint instead. */
+  mcSeedRandom (ctx, (uint64_t)time (NULL));
+  
+  /* The bit-sliced engine runs all the replicates by itself (see bitslice.c). */
+  if(ctx->bitSliced){
+    *nrFiles = (mcBitSliced(ctx) == -1) ? -1 : ctx->envChgSteps;
+    goto End_of_Routine;
+  }
+  
+  /* The mean-field engine replaces the replicates by a single deterministic run (see meanfield.c). */
+  if(ctx->meanField){
+    *nrFiles = (mcMeanField(ctx) == -1) ? -1 : ctx->envChgSteps;
+    goto End_of_Routine;
+  }
+
+  /* Allocate the necessary memory. */
+  if(mcAllocWork(ctx, &work) == -1){
+    *nrFiles = -1;
+    goto End_of_Routine;
+  }
+  
+  /* Without a sweep, run the replicates of the simulation. Their output names are
+  ** "simulName" or, if replicateNb > 1, "simulName1", "simulName2", etc... */
+  if(!sweeping){
+    if(mcRunScenario(ctx, &work, ctx->simulName, "", false, true) == -1){
+      *nrFiles = -1;
+      goto End_of_Routine;
+    }
+    *nrFiles = ctx->envChgSteps;
+    goto End_of_Routine;
+  }
+  
+  /* In a sweep, read all the input layers into the layer cache first: from then on,
+  ** the threads only copy layers out of it, so they can share it. */
+  if(mcCacheLayers(ctx, work.habSuitability) == -1){
+    *nrFiles = -1;
+    goto End_of_Routine;
+  }
+  
+  /* Draw the seed of every scenario from the main generator, so that the results
+  ** of a scenario do not depend on the thread that runs it. */
+  seeds = (uint64_t *)malloc (nrScenarios * sizeof (uint64_t));
+  failed = (char *)calloc (nrScenarios, sizeof (char));
+  if((seeds == NULL) || (failed == NULL)){
+    *nrFiles = -1;
+    Rprintf ("Not enough memory for the scenarios.\n");
+    goto End_of_Routine;
+  }
+  for(s = 0; s < nrScenarios; s++) seeds[s] = mcRandom(ctx);
+  
+  /* Run the scenarios in parallel, with output names "simulName_scenario1",
+  ** "simulName_scenario2", etc... Every thread has its own context, a copy of the
+  ** main one (sharing its layer cache and key steps, which are only read), and
+  ** its own work matrices. Errors are only recorded here, and only the main
+  ** thread prints its progress, as R's output functions must not be called
+  ** from other threads. */
+#pragma omp parallel
+  {
+    int       t;
+    bool      ready;
+    char      scenName[256];
+    mcContext scenCtx;
+    mcWork    scenWork;
+    
+    scenCtx = *ctx;
+    scenCtx.dispKernel = NULL;
+    scenCtx.propaguleProd = NULL;
+    scenCtx.keyLayers = NULL;
+    scenCtx.nrKeyLayers = 0;
+    scenCtx.cube = NULL;
+    t = 0;
+#ifdef _OPENMP
+    t = omp_get_thread_num();
+#endif
+    ready = (mcAllocWork(&scenCtx, &scenWork) == 0);
+    
+#pragma omp for schedule(dynamic)
+    for(s = 0; s < nrScenarios; s++){
+      mcSeedRandom(&scenCtx, seeds[s]);
+      if(!ready || (mcSetScenario(&scenCtx, &scenarios[s]) == -1) ||
+         (mcFileName(scenName, sizeof(scenName), "%s_%s", ctx->simulName, scenarios[s].name) == -1) ||
+         (mcRunScenario(&scenCtx, &scenWork, scenName, "_", true, t == 0) == -1)){
+        failed[s] = 1;
+      }
+    }
+    
+    mcFreeWork(&scenCtx, &scenWork);
+    free(scenCtx.dispKernel);
+    free(scenCtx.propaguleProd);
+    mcClearKeyLayers(&scenCtx);
+    mcCloseCube(&scenCtx.cube);
+  }
+  
+  /* Report the scenarios that failed. */
+  *nrFiles = ctx->envChgSteps;
+  for(s = 0; s < nrScenarios; s++){
+    if(failed[s]){
+      *nrFiles = -1;
+      Rprintf("MigClim scenario %s failed.\n", scenarios[s].name);
+    }
+  }
+  if(*nrFiles == -1) goto End_of_Routine;
+  
+  /* Collect the summaries of all scenarios of a sweep into one table. */
+  if(mcWriteSweepSummary(ctx, scenarios, nrScenarios, "sweep", "scenario") == -1){
+    *nrFiles = -1;
+    goto End_of_Routine;
+  }
+ 
+  
+ 
+ End_of_Routine:
+  
+  /* Free the allocated memory. */
+  mcFreeWork(ctx, &work);
+  mcFreeSweep(scenarios, nrScenarios);
+  if (seeds != NULL) free(seeds);
+  if (failed != NULL) free(failed);
+  mcFreeContext(ctx);
+
+  
+  /* If an error occured, display failure message to the user... */
+  if(*nrFiles == -1) Rprintf("MigClim simulation aborted...\n");
+  
+}
+
+
+/*
+** mcAllocWork: Allocate the work matrices of a simulation.
+**
+** Parameters:
+**   - work: The work matrices.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - If there is not enough memory (after printing a message): -1.
+*/
+
+static int mcAllocWork (mcContext *ctx, mcWork *work)
+{
+  int i;
+  
+  memset(work, 0, sizeof(mcWork));
+  work->currentState = (int **)calloc (ctx->nrRows, sizeof (int *));
+  work->habSuitability = (int **)calloc (ctx->nrRows, sizeof (int *));
+  work->barriers = (int **)calloc (ctx->nrRows, sizeof (int *));
+  work->pixelAge = (int **)calloc (ctx->nrRows, sizeof (int *));
+  work->noDispersal = (int **)calloc (ctx->nrRows, sizeof (int *));
+  if((work->currentState == NULL) || (work->habSuitability == NULL) || (work->barriers == NULL) ||
+     (work->pixelAge == NULL) || (work->noDispersal == NULL)){
+    Rprintf ("Not enough memory for the simulation matrices.\n");
+    goto End_of_Routine;
+  }
+  for(i = 0; i < ctx->nrRows; i++){
+    if(((work->currentState[i] = (int *)malloc (ctx->nrCols * sizeof (int))) == NULL) ||
+       ((work->habSuitability[i] = (int *)malloc (ctx->nrCols * sizeof (int))) == NULL) ||
+       ((work->barriers[i] = (int *)malloc (ctx->nrCols * sizeof (int))) == NULL) ||
+       ((work->pixelAge[i] = (int *)malloc (ctx->nrCols * sizeof (int))) == NULL) ||
+       ((work->noDispersal[i] = (int *)malloc (ctx->nrCols * sizeof (int))) == NULL)){
+      Rprintf ("Not enough memory for the simulation matrices.\n");
+      goto End_of_Routine;
+    }
+  }
+  
+  /* In the delta mode, the temporarily resilient pixels of a step are listed. */
+  if(ctx->deltaLayers && ((work->resilient = (int *)malloc (ctx->nrRows * ctx->nrCols * sizeof (int))) == NULL)){
+    Rprintf ("Not enough memory for the delta habitat suitability layers.\n");
+    goto End_of_Routine;
+  }
+  
+  /* The sweep only visits the candidate sink cells (see sinks.c). */
+  if(mcInitSinks(ctx, &work->sinks) == -1){
+    goto End_of_Routine;
+  }
+  
+  /* The source cell search only visits the mature source cells, which are kept in a plane of bits. */
+  if((work->sources = (uint64_t *)calloc (ctx->nrRows * ((ctx->nrCols + 63) / 64), sizeof (uint64_t))) == NULL){
+    Rprintf ("Not enough memory for the source cell plane.\n");
+    goto End_of_Routine;
+  }
+  
+  /* The dilation fast path keeps its buffers over all the dispersal steps (see dilate.c). */
+  if(mcInitDilate(ctx, &work->dilate) == -1){
+    goto End_of_Routine;
+  }
+  return (0);
+  
+ End_of_Routine:
+  mcFreeWork(ctx, work);
+  return (-1);
+}
+
+
+/*
+** mcFreeWork: Free the work matrices of a simulation (see 'mcAllocWork').
+*/
+
+static void mcFreeWork (mcContext *ctx, mcWork *work)
+{
+  int i;
+  
+  for(i = 0; i < ctx->nrRows; i++){
+    if(work->currentState != NULL) free(work->currentState[i]);
+    if(work->habSuitability != NULL) free(work->habSuitability[i]);
+    if(work->barriers != NULL) free(work->barriers[i]);
+    if(work->pixelAge != NULL) free(work->pixelAge[i]);
+    if(work->noDispersal != NULL) free(work->noDispersal[i]);
+  }
+  free(work->currentState);
+  free(work->habSuitability);
+  free(work->barriers);
+  free(work->pixelAge);
+  free(work->noDispersal);
+  free(work->resilient);
+  free(work->sources);
+  mcFreeSinks(&work->sinks);
+  mcFreeDilate(&work->dilate);
+  memset(work, 0, sizeof(mcWork));
+}
+
+
+/*
+** mcCacheLayers: Read all the input layers of a simulation into the layer
+**                cache: the initial distribution, the barriers and the
+**                habitat suitability layers (or key layers) of all steps.
+**
+** Parameters:
+**   - mat: A matrix to read the layers into.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+static int mcCacheLayers (mcContext *ctx, int **mat)
+{
+  int  step;
+  char fileName[512];
+  
+  if((mcFileName(fileName, sizeof(fileName), "%s.asc", ctx->iniDist) == -1) ||
+     (mcReadLayer(ctx, fileName, mat, true) == -1)){
+    return (-1);
+  }
+  if(ctx->useBarrier && ((mcFileName(fileName, sizeof(fileName), "%s.asc", ctx->barrier) == -1) ||
+                         (mcReadLayer(ctx, fileName, mat, true) == -1))){
+    return (-1);
+  }
+  for(step = 1; step <= ctx->envChgSteps; step++){
+    if(mcReadHabitat(ctx, ctx->hsMap, step, mat, true) == -1) return (-1);
+  }
+  return (0);
+}
+
+
+/*
+** mcRunScenario: Run all the replicates of a simulation (or of a scenario of a
+**                parameter sweep, see 'mcSetScenario'). If replicateNb > 1
+**                then the output names are "scenName1", "scenName2", etc...
+**                (or "scenName_1", "scenName_2", etc... for a scenario).
+**
+** Parameters:
+**   - work:     The work matrices (see 'mcAllocWork').
+**   - scenName: The name of the simulation or scenario.
+**   - repSep:   The separator between the name and the replicate number: ""
+**               for a simulation, "_" for a scenario (whose name may end with
+**               a digit, e.g. "a1" replicate 11 and "a11" replicate 1).
+**   - cache:    Whether to read the input layers through the layer cache.
+**   - verbose:  Whether to print the progress of the simulation.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+static int mcRunScenario (mcContext *ctx, mcWork *work, char *scenName, char *repSep, bool cache,
+			  bool verbose)
+{
+  int     i, j, RepLoop, envChgStep, dispStep, loopID, simulTime, firstStep,
+          ckptRep, ckptStatus, elapsed, counters[MC_NR_COUNTERS],
+         *counterPtr[MC_NR_COUNTERS], *resilient, nrResilient, k, c, n, nrWords, status;
+  bool    habIsSuitable, cellInDispDist, tempResilience;
+  char    fileName[512], simulName2[256], ckptName[512];
+  FILE   *fp=NULL, *fp2=NULL, *fp3=NULL;
+  mcStore store;
+  mcHabDelta delta;
+  mcSinkIndex *sinks;
+  long    statsOffset;
+  int64_t prfT0 = 0;
   time_t  startTime;
   /*
   ** These variables are not (yet) used.
@@ -122,95 +461,111 @@ void mcMigrate (char **paramFile, int *nrFiles)
   **     nrStepSeedBank, nrVegResilient, nrStepSeedBankRecover,
   **     nrStepVegResRecover, nrSeedBank, nrDecolonized; */
 
-  
-  /* Matrices:
-  **   - currentState:   Values in [-32768;32767]. NoData values are represented by -9999
-  **   - habSuitability: Values in [0;1000].
-  **   - barriers:       Values in [0;255].
-  **   - pixelAge:       Values in [0;255].
-  **   - noDispersal:    Values in [0;255].
-  */
+
+  /* The work matrices (see 'mcWork'). */
   int **currentState, **habSuitability, **barriers, **pixelAge, **noDispersal;
+  uint64_t *sources, word;
 
   
   /* Initialize the variables. */
-  advOutput = false;
-  currentState = NULL;
-  habSuitability = NULL;
-  barriers = NULL;
-  pixelAge = NULL;
-  noDispersal = NULL;
-  propaguleProd = NULL;
-  dispKernel = NULL;
-  if(mcInit(*paramFile) == -1){ /* Reads the "_param.txt" file */
-    *nrFiles = -1;
-    goto End_of_Routine;
-  }
+  status = -1;
+  currentState = work->currentState;
+  habSuitability = work->habSuitability;
+  barriers = work->barriers;
+  pixelAge = work->pixelAge;
+  noDispersal = work->noDispersal;
+  resilient = work->resilient;
+  nrResilient = 0;
+  sources = work->sources;
+  sinks = &work->sinks;
+  nrWords = (ctx->nrCols + 63) / 64;
+  store.fp = NULL;
+  store.index = NULL;
+  delta.first = NULL;
+  delta.cells = NULL;
+  delta.values = NULL;
+  delta.nrChanges = NULL;
   
-  /* We'll use 'srand' and 'rand' here, as 'srandom' and 'random' do not work on Windows :-( */
-  srand (time (NULL));
-
-  /* Allocate the necessary memory. */
-  currentState = (int **)malloc (nrRows * sizeof (int *));
-  habSuitability = (int **)malloc (nrRows * sizeof (int *));
-  barriers = (int **)malloc (nrRows * sizeof (int *));
-  pixelAge = (int **)malloc (nrRows * sizeof (int *));
-  noDispersal = (int **)malloc (nrRows * sizeof (int *));
-  for(i = 0; i < nrRows; i++){
-    currentState[i] = (int *)malloc (nrCols * sizeof (int));
-    habSuitability[i] = (int *)malloc (nrCols * sizeof (int));
-    barriers[i] = (int *)malloc (nrCols * sizeof (int));
-    pixelAge[i] = (int *)malloc (nrCols * sizeof (int));
-    noDispersal[i] = (int *)malloc (nrCols * sizeof (int));
+  /* The counters saved in (and restored from) checkpoints. */
+  counterPtr[0] = &nrInitial;
+  counterPtr[1] = &nrColonized;
+  counterPtr[2] = &nrAbsent;
+  counterPtr[3] = &nrNoDispersal;
+  counterPtr[4] = &nrUnivDispersal;
+  counterPtr[5] = &nrTotColonized;
+  counterPtr[6] = &nrTotDecolonized;
+  counterPtr[7] = &nrTotLDDSuccess;
+  counterPtr[8] = &nrStepColonized;
+  counterPtr[9] = &nrStepDecolonized;
+  counterPtr[10] = &nrStepLDDSuccess;
+  
+  /* The rasters of all the replicates are kept in a single result store (when
+  ** resuming, the records written before the interruption are kept). */
+  if(ctx->resultStore){
+    if(mcFileName(fileName, sizeof(fileName), "%s/%s_results.mcs", ctx->simulName,
+                  scenName) == -1){
+      goto End_of_Routine;
+    }
+    if(mcStoreOpen(ctx, fileName, ctx->resumeSimul, &store) == -1){
+      goto End_of_Routine;
+    }
   }
   
-  /* Replicate the simulation replicateNb times. If replicateNb > 1 then the
-  ** simulation's output names are "simulName1", "simulName2", etc... */
-  for(RepLoop = 1; RepLoop <= replicateNb; RepLoop++){
+  /* Replicate the simulation replicateNb times. */
+  for(RepLoop = 1; RepLoop <= ctx->replicateNb; RepLoop++){
     
 	/* Remember the current time */
     startTime = time(NULL);
 
     /* If replicateNb > 1 then we need to change the simulation name */	  
-    if(replicateNb == 1){
-      strcpy(simulName2, simulName);
+    if(ctx->replicateNb == 1){
+      strcpy(simulName2, scenName);
     }
-    else if(replicateNb > 1){
-      sprintf(simulName2, "%s%d", simulName, RepLoop);           /* sprinf(): puts a string into variable simulName2 */
+    else if(ctx->replicateNb > 1){
+      if(mcFileName(simulName2, sizeof(simulName2), "%s%s%d", scenName, repSep, RepLoop) == -1){
+        goto End_of_Routine;
+      }
     }
 
     
     /* Load and prepare the data. */
+    mcProfileReset(ctx);
+    PRF_START(prfT0);
     
     /* Species initial distribution */
-    sprintf(fileName, "%s.asc", iniDist);                        /* sprinf(): puts a string into variable fileName */
-    if(readMat(fileName, currentState) == -1){
-      *nrFiles = -1;
+    if(mcFileName(fileName, sizeof(fileName), "%s.asc", ctx->iniDist) == -1){
+      goto End_of_Routine;
+    }
+    if(mcReadLayer(ctx, fileName, currentState, cache) == -1){
       goto End_of_Routine;
     }
     
     /* Barrier options */
-    for(i = 0; i < nrRows; i++){
-      for(j = 0; j < nrCols; j++){
+    for(i = 0; i < ctx->nrRows; i++){
+      for(j = 0; j < ctx->nrCols; j++){
 	    barriers[i][j] = 0;
       }
     }
-    if(useBarrier){
-      sprintf(fileName, "%s.asc", barrier);
-      if(readMat(fileName, barriers) == -1){
-	    *nrFiles = -1;                                           /* if readMat() return -1, an error occured  */
+    if(ctx->useBarrier){
+      if(mcFileName(fileName, sizeof(fileName), "%s.asc", ctx->barrier) == -1){
+        goto End_of_Routine;
+      }
+      if(mcReadLayer(ctx, fileName, barriers, cache) == -1){
 	    goto End_of_Routine;
       }
     } 
+    PRF_STOP(PRF_LOAD, prfT0);
+    PRF_START(prfT0);
+    
     /* Filter the barrier matrix in two ways:
     **  -> reclass any value < 0 as 0 (this is to remove NoData values of -9999).
     **  -> set the cells with NoData in 'currentState' to NoData in 'barriers'
     **     so that the NoData in 'currentState' and 'barriers' are identical */
-    mcFilterMatrix(barriers, currentState, true, false, true);
+    mcFilterMatrix(ctx, barriers, currentState, true, false, true);
     
     /* Filter the values of current state matrix by the barriers matrix
     ** (when barriers = 1 we set currentState = 0) */
-    if(useBarrier) mcFilterMatrix(currentState, barriers, false, true, false);
+    if(ctx->useBarrier) mcFilterMatrix(ctx, currentState, barriers, false, true, false);
     
     
     
@@ -226,10 +581,10 @@ void mcMigrate (char **paramFile, int *nrFiles)
     ** Fill the "age" to reflect the initial distribution of the species:
     ** where the species is present, pixels get a value of 'FullMaturity', where
     ** the species is absent, pixels get a value of 0. */
-    for(i = 0; i < nrRows; i++){
-      for(j = 0; j < nrCols; j++){
+    for(i = 0; i < ctx->nrRows; i++){
+      for(j = 0; j < ctx->nrCols; j++){
 	    if(currentState[i][j] == 1){
-		  pixelAge[i][j] = fullMatAge;
+		  pixelAge[i][j] = ctx->fullMatAge;
 	    }
 	    else{
 	      pixelAge[i][j] = 0;
@@ -241,8 +596,8 @@ void mcMigrate (char **paramFile, int *nrFiles)
     /* The "no dispersal" matrix.
     ** This Matrix will keep track of the species distribution under the
     ** "no dispersal" scenario. */  
-    for(i = 0; i < nrRows; i++){
-      for (j = 0; j < nrCols; j++){
+    for(i = 0; i < ctx->nrRows; i++){
+      for (j = 0; j < ctx->nrCols; j++){
 	    noDispersal[i][j] = currentState[i][j];
       }
     }
@@ -271,8 +626,8 @@ void mcMigrate (char **paramFile, int *nrFiles)
     
     /* Count the number of initially colonized pixels (i.e. initial species distribution)
     ** as well as the number of empty (absence) cells. */
-    for(i = 0; i < nrRows; i++){
-      for(j = 0; j < nrCols; j++){
+    for(i = 0; i < ctx->nrRows; i++){
+      for(j = 0; j < ctx->nrCols; j++){
 	    if(currentState[i][j] == 1) nrInitial++;
         if(currentState[i][j] == 0) nrAbsent++;
       }
@@ -280,62 +635,115 @@ void mcMigrate (char **paramFile, int *nrFiles)
     nrColonized = nrInitial;
     nrNoDispersal = nrInitial;
     nrUnivDispersal = nrInitial;
+    PRF_STOP(PRF_FILTER, prfT0);
 
     
+    /* If the user asked to resume the simulation, restore the state of this
+    ** replicate from its last checkpoint (if there is one). */
+    firstStep = 1;
+    elapsed = 0;
+    ckptStatus = 1;
+    if(mcFileName(ckptName, sizeof(ckptName), "%s/%s_checkpoint.bin", ctx->simulName,
+                  simulName2) == -1){
+      goto End_of_Routine;
+    }
+    if(mcFileName(fileName, sizeof(fileName), "%s/%s_stats.txt", ctx->simulName, simulName2) == -1){
+      goto End_of_Routine;
+    }
+    if(ctx->resumeSimul){
+      ckptStatus = mcReadCheckpoint(ctx, ckptName, &ckptRep, &firstStep, counters, MC_NR_COUNTERS,
+                                    &statsOffset, &elapsed, currentState, pixelAge, noDispersal);
+      if((ckptStatus == -1) || ((ckptStatus == 0) && (ckptRep != RepLoop))){
+        Rprintf ("Could not resume simulation %s from its checkpoint.\n", simulName2);
+        goto End_of_Routine;
+      }
+    }
+    if(ckptStatus == 0){
+      for(i = 0; i < MC_NR_COUNTERS; i++) *counterPtr[i] = counters[i];
+      
+      /* This replicate was already completed before the interruption. */
+      if(firstStep > ctx->envChgSteps){
+        if(verbose) Rprintf("MigClim simulation %s already completed.\n", simulName2);
+        continue;
+      }
+      
+      /* Discard the statistics written after the checkpoint and append from there. */
+      if((mcTruncateFile(fileName, statsOffset) == -1) || ((fp = fopen (fileName, "a")) == NULL)){
+        Rprintf ("Could not open statistics file for appending.\n");
+        goto End_of_Routine;
+      }
+      startTime = time(NULL) - elapsed;
+      if(verbose) Rprintf("Resuming MigClim simulation %s at step %d.\n", simulName2, firstStep);
+    }
+    
     /* Write the initial state to the data file. */
-    sprintf(fileName, "%s/%s_stats.txt", simulName, simulName2);
-    if((fp = fopen (fileName, "w")) != NULL){
+    else if((fp = fopen (fileName, "w")) != NULL){
       fprintf (fp, "envChgStep\tdispStep\tstepID\tunivDispersal\tNoDispersal\toccupied\tabsent\tstepColonized\tstepDecolonized\tstepLDDsuccess\n");
       fprintf (fp, "0\t0\t1\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", nrUnivDispersal, nrNoDispersal,
 	           nrColonized, nrAbsent, nrStepColonized, nrStepDecolonized, nrStepLDDSuccess);
     }
     else{
-      *nrFiles = -1;
       Rprintf ("Could not open statistics file for writing.\n");
       goto End_of_Routine;
     }
     
+    /* If profiling was requested, open the profile file as well (when resuming,
+    ** the profile of the steps that are run again is simply appended). */
+    if(ctx->profiling){
+      if(mcFileName(fileName, sizeof(fileName), "%s/%s_profile.txt", ctx->simulName,
+                    simulName2) == -1){
+        goto End_of_Routine;
+      }
+      if((fp3 = fopen (fileName, (ckptStatus == 0) ? "a" : "w")) == NULL){
+        Rprintf ("Could not open profile file for writing.\n");
+        goto End_of_Routine;
+      }
+      if(ckptStatus != 0){
+        mcProfileHeader(fp3);
+        mcProfileWrite(ctx, fp3, 0, 0, 1);
+      }
+      mcProfileReset(ctx);
+    }
+    
     
     
     /* **************************************************************** */
     /* Simulate plant dispersal and migration (the core of the method). */
     /* **************************************************************** */
-    Rprintf("Running MigClim simulation %s.\n", simulName2);
+    /* In the delta mode, prepare the habitat suitability layers of all steps once per
+    ** scenario (the barriers, and hence the filtered layers, are the same for all replicates). */
+    if(ctx->deltaLayers && (delta.first == NULL)){
+      if(mcBuildDelta(ctx, barriers, cache, &delta) == -1){
+        goto End_of_Routine;
+      }
+    }
+    
+    if(verbose) Rprintf("Running MigClim simulation %s.\n", simulName2);
     
     /* Start of environmental change step loop (if simulation is run without change in environment this loop runs only once). */
-    for(envChgStep = 1; envChgStep <= envChgSteps; envChgStep++){
+    for(envChgStep = firstStep; envChgStep <= ctx->envChgSteps; envChgStep++){
 	  
       /* Print the current environmental change iteration. */
-      Rprintf ("  %d...\n", envChgStep);
+      if(verbose) Rprintf ("  %d...\n", envChgStep);
 
-      /* Load the habitat suitability layer for the current envChgStep. */
-      sprintf (fileName, "%s%d.asc", hsMap, envChgStep);
-      if (readMat (fileName, habSuitability) == -1){
-	    *nrFiles = -1;
-	    goto End_of_Routine;
+      /* Load the habitat suitability layer for the current envChgStep, reclassified with
+      ** rcThreshold and filtered with the barriers (see 'mcLoadHabitat'). In the delta mode,
+      ** the layer of the previous step is updated instead, and with it the no-dispersal
+      ** matrix and the universal dispersal count. */
+      if(!ctx->deltaLayers){
+        if(mcLoadHabitat(ctx, envChgStep, habSuitability, barriers, cache) == -1){
+	      goto End_of_Routine;
+        }
       }
-      
-      /* if the user chose a rcThreshold > 0, reclass the habitat suitability into 0 or 1000
-      ** if rcThreshold == 0 then suitability values are left unchanged. */
-      if(rcThreshold > 0){
-	    for(i = 0; i < nrRows; i++){
-	      for(j = 0; j < nrCols; j++){
-	        if(habSuitability[i][j] < rcThreshold){
-	          habSuitability[i][j] = 0;
-	        }
-	        else{
-	          habSuitability[i][j] = 1000;
-	        }
-	      }
-	    }
+      else if(envChgStep == firstStep){
+        mcDeltaLayer(ctx, &delta, envChgStep, habSuitability);
       }
-      
-      /* Filter the habitat suitability matrix in three ways:
-      **  -> replace any value < 0 by 0 (this removes NoData).
-      **  -> set habitat suitability to 0 where barrier = 1.
-      **  -> set habitat suitability values to NoData where barrier = NoData. 
-      ** and also  */
-      mcFilterMatrix(habSuitability, barriers, true, true, true);
+      else{
+        PRF_START(prfT0);
+        mcApplyDelta(ctx, &delta, envChgStep, habSuitability, noDispersal, &nrNoDispersal, &nrUnivDispersal);
+        PRF_STOP(PRF_FILTER, prfT0);
+      }
+      PRF_START(prfT0);
       
       
       /* Set the values that will keep track of pixels colonized during the next
@@ -361,15 +769,39 @@ void mcMigrate (char **paramFile, int *nrFiles)
       /* "Unlimited" and "no dispersal" scenario pixel count. Here we compute the number of pixels
       ** that would be colonized if dispersal was unlimited or null. This is simply the sum of all
       ** potentially suitable habitats */
-      nrUnivDispersal = mcUnivDispCnt(habSuitability);
-      updateNoDispMat(habSuitability, noDispersal, &nrNoDispersal);
+      if(!ctx->deltaLayers || (envChgStep == firstStep)){
+        nrUnivDispersal = mcUnivDispCnt(ctx, habSuitability);
+        updateNoDispMat(ctx, habSuitability, noDispersal, &nrNoDispersal);
+      }
 
       /* Reset number of decolonized cells within current dispersal step pixel counter */
 	  nrStepDecolonized = 0;
+	  nrResilient = 0;
 	    
       /* Update for temporarily resilient pixels. */
-      for(i = 0; i < nrRows; i++){
-	    for(j = 0; j < nrCols; j++){
+      if(ctx->deltaLayers && (envChgStep > firstStep)){
+        
+        /* In the delta mode, only the pixels that changed can have turned unsuitable (at the end
+        ** of a step, all the colonized pixels are suitable). */
+        for(k = 0; k < delta.nrChanges[envChgStep]; k++){
+          i = delta.cells[envChgStep][k] / ctx->nrCols;
+          j = delta.cells[envChgStep][k] % ctx->nrCols;
+          if((habSuitability[i][j] == 0) && (currentState[i][j] > 0)){
+            if(tempResilience == true){
+              currentState[i][j] = 29900;
+              resilient[nrResilient++] = delta.cells[envChgStep][k];
+            }
+            else{
+              currentState[i][j] = -1 - loopID;
+              pixelAge[i][j] = 0;
+              sources[i * nrWords + j / 64] &= ~((uint64_t)1 << (j % 64));
+            }
+            nrStepDecolonized++;
+          }
+        }
+      }
+      else for(i = 0; i < ctx->nrRows; i++){
+	    for(j = 0; j < ctx->nrCols; j++){
 	      
 	      /* Udate non-suitable pixels. If a pixel turned unsuitable, we update its status to "Temporarily Resilient". */
 	      if((habSuitability[i][j] == 0) && (currentState[i][j] > 0)){
@@ -377,11 +809,13 @@ void mcMigrate (char **paramFile, int *nrFiles)
 	        /* If the user selected TemporaryResilience==T, then the pixel is set to "Temporary Resilient" status. */
 	        if(tempResilience == true){
 	          currentState[i][j] = 29900;
+	          if(ctx->deltaLayers) resilient[nrResilient++] = i * ctx->nrCols + j;
 	        }
 	        else{
 	          /* If not temporary resilience was specified, then the pixel is set to "decolonized" status. */
 	          currentState[i][j] = -1 - loopID;
 	          pixelAge[i][j] = 0;
+	          sources[i * nrWords + j / 64] &= ~((uint64_t)1 << (j % 64));
 	          /* NOTE: Later we can add "Vegetative" and "SeedBank" resilience options at this location. */
 	        }
 	        
@@ -390,15 +824,29 @@ void mcMigrate (char **paramFile, int *nrFiles)
 	      }
 	    }
       }
+      
+      /* Update the candidate sink cells for the new layer. In the delta mode, the only
+      ** new sinks are among the pixels that changed. */
+      if(ctx->deltaLayers && (envChgStep > firstStep)){
+        mcAddSinks(ctx, sinks, delta.cells[envChgStep], delta.nrChanges[envChgStep], currentState, habSuitability);
+      }
+      else{
+        mcBuildSinks(ctx, sinks, currentState, habSuitability);
+      }
+      PRF_STOP(PRF_FILTER, prfT0);
 
       
       /* *************************************** */
       /* Dispersal event step loop starts here.  */
       /* *************************************** */
-      for(dispStep = 1; dispStep <= dispSteps; dispStep++){
+      for(dispStep = 1; dispStep <= ctx->dispSteps; dispStep++){
 	    
 	    /* Set the value of "loopID" for the current iteration of the dispersal loop. */
 	    loopID++;
+	    
+	    /* Set the mature source cells at the start of a replicate (or of a resumed one). From
+	    ** then on, the aging pass below keeps them up to date. */
+	    if((envChgStep == firstStep) && (dispStep == 1)) mcBuildSources(ctx, sources, currentState, pixelAge, loopID);
           
 	    /* Reset pixel counters that count pixels within the current loop. */
 	    nrStepColonized = 0;
@@ -422,8 +870,24 @@ void mcMigrate (char **paramFile, int *nrFiles)
 	    **      pixel).
 	    **
 	    ** Loop through the cellular automaton. */
-	    for(i = 0; i < nrRows; i++){
-	      for(j = 0; j < nrCols; j++){
+	    PRF_START(prfT0);
+	    if(ctx->useDilation){
+	      /* All colonization probabilities are 1.0: colonize every sink within the dispersal
+	      ** distance of a mature source at once (see dilate.c). */
+	      nrStepColonized = mcDilateStep(ctx, &work->dilate, currentState, pixelAge, habSuitability, barriers, loopID);
+	      if(nrStepColonized == -1){
+	        goto End_of_Routine;
+	      }
+	    }
+	    else{
+	      /* Loop through the candidate sink cells only, in the same order as the
+	      ** cellular automaton. The cells that are no longer sinks, including the
+	      ** ones colonized here, are dropped from the list as we go (see sinks.c). */
+	      n = 0;
+	      for(k = 0; k < sinks->nrCells; k++){
+	        c = sinks->cells[k];
+	        i = c / ctx->nrCols;
+	        j = c % ctx->nrCols;
 	        
 		    /* Reset variables. */
 	        habIsSuitable = false;
@@ -444,7 +908,7 @@ void mcMigrate (char **paramFile, int *nrFiles)
 	        **    function). */
 	        if(habIsSuitable){
 		      /* Now we search if there is a suitable source cell to colonize the sink cell. */
-	          if (mcSrcCell (i, j, currentState, pixelAge, loopID, habSuitability[i][j], barriers)) cellInDispDist = true;
+	          if (mcSrcCell (ctx, i, j, sources, pixelAge, habSuitability[i][j], barriers)) cellInDispDist = true;
 	        }
 	        
 	        /* Update pixel status. */
@@ -462,60 +926,27 @@ void mcMigrate (char **paramFile, int *nrFiles)
 	          ** to determine whether a pixel was in "Decolonized" or "SeedBank resilience" status. */
 	          pixelAge[i][j] = 0;
 	        }
+	        
+	        /* Keep the pixel in the list only if it is still a sink. */
+	        if(habIsSuitable && !cellInDispDist){
+	          sinks->cells[n++] = c;
+	        }
+	        else{
+	          MC_CLR_SINK(sinks, c);
+	        }
 	      }
+	      sinks->nrCells = n;
 	    }
         
+	    PRF_STOP(PRF_SINK, prfT0);
+        
 	    /* If the LDD frequence is larger than zero, perform it. */
-	    if(lddFreq > 0.0){
-	      
-		  /* Loop through the entire cellular automaton. */
-	      for(i = 0; i < nrRows; i++){
-	        for(j = 0; j < nrCols; j++){
-	          
-		      /* Check if the pixel is a source cell (i.e. is it colonised since at least 1 dispersal Loop) 
-	          ** and check if the pixel has reached dispersal maturity. */
-	          if((currentState[i][j]) > 0 && (currentState[i][j] != loopID)){
-	    	    if(pixelAge[i][j] >= iniMatAge){
-	    	  
-		    	  /* Set the probability of generating an LDD event. This
-	    	      ** probability is weighted by the age of the cell. */
-	    	      if(pixelAge[i][j] >= fullMatAge){
-	    	        lddSeedProb = lddFreq;
-	    	      }
-	    	      else{
-	    	        lddSeedProb = lddFreq * propaguleProd[pixelAge[i][j] - iniMatAge];
-	    	      }
-	    	  
-	    	      /* Now we can try to generate a LDD event with the calculated probability. */
-	    	      if(UNIF01 < lddSeedProb || lddSeedProb == 1.0){
-	    	        
-		    	    /* Randomly select a pixel within the distance "lddMinDist - lddMaxDist". */
-	    	        mcRandomPixel (&rndPixel);
-	    	        rndPixel.row = rndPixel.row + i;
-	    	        rndPixel.col = rndPixel.col + j;
-	    	        
-	    	        /* Now we check if this random cell is a suitable sink cell.*/
-	    	        if(mcSinkCellCheck (rndPixel, currentState, habSuitability)){
-	    	          
-		    	      /* if condition is true, the pixel gets colonized.*/
-	    	          currentState[rndPixel.row][rndPixel.col] = loopID;
-	    	          nrStepColonized++;
-	    	          nrStepLDDSuccess++;
-	    	          
-	    	          /* If the pixel was in seed bank resilience state, then we
-	    	          ** update the corresponding counter. Currently not used.
-	    	          ** if (pixelAge[rndPixel.row][rndPixel.col] == 255) nrStepSeedBank--;  */
-	    	    
-	    	          /* Reset pixel age. */
-	    	          pixelAge[rndPixel.row][rndPixel.col] = 0;
-	    	        }
-	    	      }
-	    	      
-	    	    }
-	          }
-	        }
-	      }
+	    PRF_START(prfT0);
+	    if(ctx->lddFreq > 0.0){
+	      nrStepLDDSuccess = mcLddDispersal(ctx, currentState, pixelAge, habSuitability, loopID, sinks);
+	      nrStepColonized += nrStepLDDSuccess;
 	    }
+	    PRF_STOP(PRF_LDD, prfT0);
             
 	    /* Update pixel age: At the end of a dispersal loop we want to
 	    ** increase the "age" of each colonized pixel.
@@ -526,9 +957,15 @@ void mcMigrate (char **paramFile, int *nrFiles)
 	    **   1 to 250 = Pixel is in "Colonized" or "Temporarily Resilient"
 	    **       status. The value indicates the number of "dispersal events
 	    **       (usually years) since when the pixel was colonized.
-	    **   255 = Pixel is in "SeedBank Resilience" state. */
-	    for(i = 0; i < nrRows; i++){
-	      for(j = 0; j < nrCols; j++){
+	    **   255 = Pixel is in "SeedBank Resilience" state.
+	    **
+	    ** The mature source cells of the next dispersal loop are set at the same time, one word
+	    ** of the source plane at a time: all the pixels colonized so far are older than the
+	    ** next loop. */
+	    PRF_START(prfT0);
+	    for(i = 0; i < ctx->nrRows; i++){
+	      word = 0;
+	      for(j = 0; j < ctx->nrCols; j++){
 	        
 		    /* If the pixel is in "Colonized" or "Temporarily Resilient" state, update it's age value. */
 	        if(currentState[i][j] > 0) pixelAge[i][j] += 1;
@@ -537,10 +974,17 @@ void mcMigrate (char **paramFile, int *nrFiles)
 	        ** so that the pixels gains 1 year of "Temporarily Resilience" age. */
 	        if (currentState[i][j] >= 29900) currentState[i][j] += 1;
 
+	        word |= (uint64_t)((currentState[i][j] > 0) && (pixelAge[i][j] >= ctx->iniMatAge)) << (j % 64);
+	        if((j % 64 == 63) || (j == ctx->nrCols - 1)){
+	          sources[i * nrWords + j / 64] = word;
+	          word = 0;
+	        }
 	      }
 	    }
+	    PRF_STOP(PRF_AGING, prfT0);
         
 	    /* Update pixel counters. */
+	    PRF_START(prfT0);
 	    nrColonized = nrColonized + nrStepColonized - nrStepDecolonized;
 	    nrAbsent = nrAbsent - nrStepColonized + nrStepDecolonized;
 	    nrTotColonized += nrStepColonized;
@@ -553,54 +997,99 @@ void mcMigrate (char **paramFile, int *nrFiles)
 	    /* Write current iteration data to the statistics file. */
 	    fprintf(fp, "%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", envChgStep, dispStep, loopID, nrUnivDispersal,
 	    	    nrNoDispersal, nrColonized, nrAbsent, nrStepColonized, nrStepDecolonized, nrStepLDDSuccess);
+	    PRF_STOP(PRF_STATS, prfT0);
 	    	 
 	    /* If the user has requested full output, also write the current state matrix to file. */
-	    if(fullOutput){
-	      sprintf (fileName, "%s/%s_step_%d.asc", simulName, simulName2, loopID);
-	      if(writeMat (fileName, currentState) == -1){
-	        *nrFiles = -1;
+	    PRF_START(prfT0);
+	    if(ctx->fullOutput){
+	      if(mcFileName(fileName, sizeof(fileName), "%s/%s_step_%d.asc%s", ctx->simulName, simulName2,
+	                    loopID, ctx->compressOutput ? ".gz" : "") == -1){
+	        goto End_of_Routine;
+	      }
+	      if(writeMat (ctx, fileName, currentState) == -1){
+	        goto End_of_Routine;
+	      }
+	      if(ctx->resultStore && (mcStoreWrite(ctx, &store, RepLoop, loopID, currentState) == -1)){
 	        goto End_of_Routine;
 	      }
 	    }
+	    PRF_STOP(PRF_OUTPUT, prfT0);
+	    
+	    /* Write the profile of the current step. */
+	    if(ctx->profiling) mcProfileWrite(ctx, fp3, envChgStep, dispStep, loopID);
       } /* END OF: dispStep */
     
       
       /* Update temporarily resilient pixels.
       ** Temporarily resilient pixels can be distinguished by:
       **   -> CurrentState_Matrix = 29'900 to 29'999. Increases by 1 at each year.
-      **   -> Age_Matrix has a positive value. */
-      for (i = 0; i < nrRows; i++){
-	    for (j = 0; j < nrCols; j++){
+      **   -> Age_Matrix has a positive value.
+      ** In the delta mode, they are the pixels listed at the start of the step. */
+      PRF_START(prfT0);
+      if(ctx->deltaLayers){
+        for(k = 0; k < nrResilient; k++){
+          i = resilient[k] / ctx->nrCols;
+          j = resilient[k] % ctx->nrCols;
+          currentState[i][j] = ctx->dispSteps - loopID - 1;
+          pixelAge[i][j] = 0;
+          sources[i * nrWords + j / 64] &= ~((uint64_t)1 << (j % 64));
+        }
+      }
+      else for (i = 0; i < ctx->nrRows; i++){
+	    for (j = 0; j < ctx->nrCols; j++){
 	      if (currentState[i][j] >= 29900){
-	        currentState[i][j] = dispSteps - loopID - 1;
+	        currentState[i][j] = ctx->dispSteps - loopID - 1;
 	        pixelAge[i][j] = 0;
+	        sources[i * nrWords + j / 64] &= ~((uint64_t)1 << (j % 64));
 	      }
 	    }
       }
+      PRF_STOP(PRF_AGING, prfT0);
+      
+      /* Save a checkpoint every 'checkpointFreq' environmental change steps (there
+      ** is no need for one after the last step, as the final output follows). */
+      if((ctx->checkpointFreq > 0) && (envChgStep < ctx->envChgSteps) && (envChgStep % ctx->checkpointFreq == 0)){
+        for(i = 0; i < MC_NR_COUNTERS; i++) counters[i] = *counterPtr[i];
+        fflush(fp);
+        statsOffset = ftell(fp);
+        if(mcWriteCheckpoint(ctx, ckptName, RepLoop, envChgStep + 1, counters, MC_NR_COUNTERS, statsOffset,
+                             time(NULL) - startTime, currentState, pixelAge, noDispersal) == -1){
+          goto End_of_Routine;
+        }
+      }
     
     } /* END OF: envChgStep loop */
-    Rprintf("All dispersal steps completed. Final output in progress...\n");
+    if(verbose) Rprintf("All dispersal steps completed. Final output in progress...\n");
   
     
     /* Update currentState matrix for pixels that are suitable but
     ** could not be colonized due to dispersal limitations.
     ** These pixels are assigned a value of 30'000 */
-    for(i = 0; i < nrRows; i++){
-      for(j = 0; j < nrCols; j++){
+    PRF_START(prfT0);
+    for(i = 0; i < ctx->nrRows; i++){
+      for(j = 0; j < ctx->nrCols; j++){
 	    if((habSuitability[i][j] > 0) && (currentState[i][j] <= 0)) currentState[i][j] = 30000;
       }
     }
   
     /* Write the final state matrix to file. */
-    sprintf(fileName, "%s/%s_raster.asc", simulName, simulName2);
-    if(writeMat (fileName, currentState) == -1){
-      *nrFiles = -1;
+    if(mcFileName(fileName, sizeof(fileName), "%s/%s_raster.asc", ctx->simulName,
+                  simulName2) == -1){
+      goto End_of_Routine;
+    }
+    if(writeMat (ctx, fileName, currentState) == -1){
+      goto End_of_Routine;
+    }
+    if(ctx->resultStore && (mcStoreWrite(ctx, &store, RepLoop, MC_STORE_FINAL, currentState) == -1)){
       goto End_of_Routine;
     }
   
     /* Write summary output to file. */
     simulTime = time (NULL) - startTime;
-    sprintf(fileName, "%s/%s_summary.txt", simulName, simulName2);
+    if(mcFileName(fileName, sizeof(fileName), "%s/%s_summary.txt", ctx->simulName,
+                  simulName2) == -1){
+      goto End_of_Routine;
+    }
     if((fp2 = fopen (fileName, "w")) != NULL){
       fprintf(fp2, "simulName\tiniCount\tnoDispCount\tunivDispCount\toccupiedCount\tabsentCount\ttotColonized\ttotDecolonized\ttotLDDsuccess\trunTime\n");
       fprintf(fp2, "%s\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", simulName2, nrInitial, nrNoDispersal, nrUnivDispersal,
@@ -608,7 +1097,6 @@ void mcMigrate (char **paramFile, int *nrFiles)
       fclose (fp2);
     }
     else{
-      *nrFiles = -1;
       Rprintf ("Could not write summary output to file.\n");
       goto End_of_Routine;
     }  
@@ -617,54 +1105,130 @@ void mcMigrate (char **paramFile, int *nrFiles)
     if (fp != NULL) fclose (fp);
     fp = NULL;
     
+    /* Write the profile of the final output and close the profile file. */
+    PRF_STOP(PRF_OUTPUT, prfT0);
+    if(fp3 != NULL){
+      mcProfileWrite(ctx, fp3, -1, -1, -1);
+      fclose (fp3);
+      fp3 = NULL;
+    }
+    
+    /* Mark the replicate as completed in its checkpoint, so that a resumed run
+    ** skips it (the generator state is saved too, for the next replicates). */
+    if(ctx->checkpointFreq > 0){
+      for(i = 0; i < MC_NR_COUNTERS; i++) counters[i] = *counterPtr[i];
+      if(mcWriteCheckpoint(ctx, ckptName, RepLoop, ctx->envChgSteps + 1, counters, MC_NR_COUNTERS, 0,
+                           simulTime, currentState, pixelAge, noDispersal) == -1){
+        goto End_of_Routine;
+      }
+    }
+    
   } /* end of "RepLoop" */
   
-  
-  /* Set the number of output files created. */
-  *nrFiles = envChgSteps;
+  /* Write the index of the result store. */
+  if(mcStoreClose(ctx, &store) == -1){
+    goto End_of_Routine;
+  }
+  status = 0;
  
   
  
  End_of_Routine:
   
-  /* Close the data file. */
+  /* Close the data files. */
   if(fp != NULL) fclose (fp);
+  if(fp3 != NULL) fclose (fp3);
+  mcStoreClose(ctx, &store);
+  mcFreeDelta(ctx, &delta);
+  return (status);
+}
 
-  /* Free the allocated memory. */
-  if(currentState != NULL){
-    for (i = 0; i < nrRows; i++) free(currentState[i]);
-    free(currentState);
-  }
-  if(habSuitability != NULL){
-    for(i = 0; i < nrRows; i++) free(habSuitability[i]);
-    free(habSuitability);
-  }
-  if(barriers != NULL){
-    for(i = 0; i < nrRows; i++) free(barriers[i]);
-    free(barriers);
-  }
-  if(pixelAge != NULL){
-    for(i = 0; i < nrRows; i++) free(pixelAge[i]);
-    free(pixelAge);
-  }
-  if(noDispersal != NULL){
-    for (i = 0; i < nrRows; i++) free(noDispersal[i]);
-    free(noDispersal);
+
+
+
+
+
+/*
+** mcLddDispersal: Perform the long-distance dispersal (LDD) events of one
+**                 dispersal step. Every mature source cell generates an LDD
+**                 event with a probability of 'lddFreq' (weighted by its
+**                 propagule production) towards a random cell within the
+**                 "lddMinDist - lddMaxDist" distance.
+**
+** Parameters:
+**   - curState: A pointer to the current state matrix.
+**   - pxlAge:   A pointer to the pixel age matrix.
+**   - habSuit:  A pointer to the habitat suitability matrix.
+**   - loopID:   The ID of the current dispersal loop.
+**   - sinks:    The candidate sink index (see sinks.c), or NULL if there is
+**               none.
+**
+** Returns:
+**   The number of cells that were colonized through LDD.
+*/
+
+int mcLddDispersal (mcContext *ctx, int **curState, int **pxlAge, int **habSuit, int loopID,
+		    mcSinkIndex *sinks)
+{
+  int    i, j, nrLDDSuccess;
+  double lddSeedProb;
+  pixel  rndPixel;
+
+  nrLDDSuccess = 0;
+
+  /* Loop through the entire cellular automaton. */
+  for(i = 0; i < ctx->nrRows; i++){
+    for(j = 0; j < ctx->nrCols; j++){
+      
+      /* Check if the pixel is a source cell (i.e. is it colonised since at least 1 dispersal Loop) 
+      ** and check if the pixel has reached dispersal maturity. */
+      if((curState[i][j]) > 0 && (curState[i][j] != loopID)){
+        if(pxlAge[i][j] >= ctx->iniMatAge){
+          
+          /* Set the probability of generating an LDD event. This
+          ** probability is weighted by the age of the cell. */
+          if(pxlAge[i][j] >= ctx->fullMatAge){
+            lddSeedProb = ctx->lddFreq;
+          }
+          else{
+            lddSeedProb = ctx->lddFreq * ctx->propaguleProd[pxlAge[i][j] - ctx->iniMatAge];
+          }
+          
+          /* Now we can try to generate a LDD event with the calculated probability. */
+          if(UNIF01 < lddSeedProb || lddSeedProb == 1.0){
+            
+            /* Randomly select a pixel within the distance "lddMinDist - lddMaxDist". */
+            mcRandomPixel (ctx, &rndPixel);
+            rndPixel.row = rndPixel.row + i;
+            rndPixel.col = rndPixel.col + j;
+            
+            /* Now we check if this random cell is a suitable sink cell.*/
+            if(mcSinkCellCheck (ctx, rndPixel, curState, habSuit, sinks)){
+              
+              /* if condition is true, the pixel gets colonized.*/
+              curState[rndPixel.row][rndPixel.col] = loopID;
+              nrLDDSuccess++;
+              
+              /* If the pixel was in seed bank resilience state, then we
+              ** update the corresponding counter. Currently not used.
+              ** if (pxlAge[rndPixel.row][rndPixel.col] == 255) nrStepSeedBank--;  */
+              
+              /* Reset pixel age. */
+              pxlAge[rndPixel.row][rndPixel.col] = 0;
+            }
+          }
+        }
+      }
+    }
   }
-  if (dispKernel != NULL) free(dispKernel);
-  if (propaguleProd != NULL) free(propaguleProd);
 
-  
-  /* If an error occured, display failure message to the user... */
-  if(*nrFiles == -1) Rprintf("MigClim simulation aborted...\n");
-  
+  return (nrLDDSuccess);
 }
 
 
 
 
 
-
 /*
 ** mcRandomPixel: Select a random pixel from a central point (0;0) and within a
 **                radius of at least lddMinDist and at most lddMaxDist.
@@ -673,7 +1237,7 @@ void mcMigrate (char **paramFile, int *nrFiles)
 **   - pix:     A pointer to the pixel data structure to put the row and col in.
 */
 
-void mcRandomPixel (pixel *pix)
+void mcRandomPixel (mcContext *ctx, pixel *pix)
 {
   double rndDist, rndAngle;
   
@@ -681,7 +1245,7 @@ void mcRandomPixel (pixel *pix)
   ** Select a random distance between lddMinDist and lddMaxDist, and a random
   ** angle between 0 and 2*pi.
   */
-  rndDist = (UNIF01 * (lddMaxDist - lddMinDist)) + lddMinDist;
+  rndDist = (UNIF01 * (ctx->lddMaxDist - ctx->lddMinDist)) + ctx->lddMinDist;
   rndAngle = UNIF01 * 6.283185;
     
   /*
@@ -708,20 +1272,26 @@ void mcRandomPixel (pixel *pix)
 **   -> pix: The cell/pixel to consider.
 **   -> curState: A pointer to the current state matrix.
 **   -> habSuit:  A pointer to the habitat suitability matrix.
+**   -> sinks:    The candidate sink index, or NULL if there is none.
 **
 ** Returns:
 **   If the cell is suitable: true.
 **   Otherwise:               false.
 */
 
-bool mcSinkCellCheck (pixel pix, int **curState, int **habSuit)
+bool mcSinkCellCheck (mcContext *ctx, pixel pix, int **curState, int **habSuit, mcSinkIndex *sinks)
 {
   bool suitable;
   double rnd;
   suitable = false;
 
   /* 1. Verify the cell is within the limits of the cellular automaton. */
-  if((pix.row < 0) || (pix.row >= nrRows) || (pix.col < 0) || (pix.col >= nrCols)) return(suitable);
+  if((pix.row < 0) || (pix.row >= ctx->nrRows) || (pix.col < 0) || (pix.col >= ctx->nrCols)) return(suitable);
+
+  /* A cell that is not in the candidate sink index is either occupied or unsuitable. NoData
+  ** cells are left to the checks below, which draw a random number for them. */
+  if((sinks != NULL) && !MC_IS_SINK(sinks, pix.row * ctx->nrCols + pix.col) &&
+     (habSuit[pix.row][pix.col] >= 0)) return(suitable);
 
   /* 2. Verify the cell is empty. */
   if(curState[pix.row][pix.col] > 0) return(suitable);
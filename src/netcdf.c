@@ -0,0 +1,633 @@
+/*
+** netcdf.c: Read the habitat suitability layers of the environmental change
+**           steps from a single NetCDF cube (time, y, x), instead of from one
+**           ascii grid file per step.
+**
+** The NetCDF classic formats (CDF-1, CDF-2 "64-bit offset" and CDF-5) are
+** supported. In these formats, the layer of a time step is stored as one
+** contiguous block of values (or one record, if time is the unlimited
+** dimension), so it is read with a single seek, row by row, without reading
+** the other layers. The file is kept open, with its parsed header, in an
+** 'mcCube' handle between the reads of successive steps (see 'mcReadCube'),
+** so only the first read of a cube parses its header. A handle belongs to a
+** single simulation context (or thread).
+**
+** NetCDF-4 files are HDF5 files, which are not read here (there is no
+** netCDF or HDF5 library on all the platforms the package builds on); they
+** can be converted with 'nccopy -k cdf5'.
+**
+** A layer is named "cube.nc#step" or "cube.nc:variable#step" (see
+** 'mcLayerName'), where step counts from 1. Without a variable name, the
+** first variable with three dimensions is used. The georeference is taken
+** from the coordinate variables of the x and y dimensions (cell centres);
+** rows are flipped if y increases with the row index, as is usual for
+** NetCDF files. The values are scaled by the 'scale_factor' and 'add_offset'
+** attributes and rounded, and cells equal to the '_FillValue' (or
+** 'missing_value') attribute or NaN get the NoData value -9999.
+*/
+
+#include "migclim.h"
+
+
+/*
+** The tags and types of the NetCDF classic formats.
+*/
+#define NC_DIMENSION  10
+#define NC_VARIABLE   11
+#define NC_ATTRIBUTE  12
+#define NC_NODATA     -9999
+#define NC_MAX_DIMS   64
+
+
+/*
+** A variable of a NetCDF file: its dimensions, type, position in the file
+** and the attributes that are used.
+*/
+typedef struct _ncVar
+{
+  char     name[128];
+  int      nrDims, dimIds[NC_MAX_DIMS], type;
+  int64_t  begin;
+  bool     hasFill;
+  double   fill, scale, offset;
+} ncVar;
+
+
+/*
+** The header of a NetCDF file.
+*/
+typedef struct _ncFile
+{
+  FILE    *fp;
+  int      version, nrDims, nrVars, recDim;
+  int64_t  dimLen[NC_MAX_DIMS], recSize;
+  char     dimName[NC_MAX_DIMS][128];
+  ncVar   *vars;
+} ncFile;
+
+
+/*
+** An open cube: the name of its file and its header (see 'mcReadCube').
+*/
+struct _mcCube
+{
+  char     fName[1024];
+  ncFile   nc;
+};
+
+
+/*
+** ncTypeSize: The size in bytes of a value of a NetCDF type (0 if the type
+**             is not supported).
+*/
+
+static int ncTypeSize (int type)
+{
+  switch (type)
+  {
+  case 1: case 2: case 7:  return (1);   /* byte, char, ubyte   */
+  case 3: case 8:          return (2);   /* short, ushort       */
+  case 4: case 5: case 9:  return (4);   /* int, float, uint    */
+  case 6: case 10: case 11: return (8);  /* double, int64, uint64 */
+  }
+  return (0);
+}
+
+
+/*
+** ncValue: Convert a big-endian value of a NetCDF type to a double.
+*/
+
+static double ncValue (unsigned char *p, int type)
+{
+  int      k, size;
+  uint64_t u;
+  union { uint32_t u; float f; } f32;
+  union { uint64_t u; double d; } f64;
+
+  size = ncTypeSize (type);
+  for (u = 0, k = 0; k < size; k++)
+  {
+    u = (u << 8) | p[k];
+  }
+  switch (type)
+  {
+  case 1:  return ((double)(int8_t)u);
+  case 3:  return ((double)(int16_t)u);
+  case 4:  return ((double)(int32_t)u);
+  case 5:  f32.u = (uint32_t)u; return ((double)f32.f);
+  case 6:  f64.u = u; return (f64.d);
+  case 10: return ((double)(int64_t)u);
+  }
+  return ((double)u);
+}
+
+
+/*
+** ncGet: Read a big-endian unsigned integer of 'size' bytes from the file.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - At the end of the file:  -1.
+*/
+
+static int ncGet (FILE *fp, int size, int64_t *v)
+{
+  int           k;
+  unsigned char b[8];
+
+  if (fread (b, 1, size, fp) != (size_t)size)
+  {
+    return (-1);
+  }
+  for (*v = 0, k = 0; k < size; k++)
+  {
+    *v = (*v << 8) | b[k];
+  }
+  return (0);
+}
+
+
+/*
+** ncGetName: Read a name (its length and its padded characters) into a
+**            buffer of 128 characters (longer names are truncated).
+*/
+
+static int ncGetName (ncFile *nc, char *name)
+{
+  int64_t n;
+  int     k, c;
+
+  if (ncGet (nc->fp, (nc->version == 5) ? 8 : 4, &n) == -1)
+  {
+    return (-1);
+  }
+  for (k = 0; k < (n + 3) / 4 * 4; k++)
+  {
+    if ((c = fgetc (nc->fp)) == EOF)
+    {
+      return (-1);
+    }
+    if (k < 127)
+    {
+      name[k] = (k < n) ? (char)c : '\0';
+    }
+  }
+  name[(n < 127) ? n : 127] = '\0';
+  return (0);
+}
+
+
+/*
+** ncGetAttributes: Read an attribute list, keeping the attributes of a
+**                  variable that are used ('var' is NULL for the global
+**                  attributes).
+*/
+
+static int ncGetAttributes (ncFile *nc, ncVar *var)
+{
+  int64_t        tag, n, type, nrValues;
+  int            a, size, nonNeg;
+  char           name[128];
+  unsigned char *values;
+  double         v;
+
+  nonNeg = (nc->version == 5) ? 8 : 4;
+  if ((ncGet (nc->fp, 4, &tag) == -1) || (ncGet (nc->fp, nonNeg, &n) == -1) ||
+      ((tag != NC_ATTRIBUTE) && ((tag != 0) || (n != 0))))
+  {
+    return (-1);
+  }
+  for (a = 0; a < n; a++)
+  {
+    if ((ncGetName (nc, name) == -1) || (ncGet (nc->fp, 4, &type) == -1) ||
+	(ncGet (nc->fp, nonNeg, &nrValues) == -1))
+    {
+      return (-1);
+    }
+    size = (type == 2) ? 1 : ncTypeSize ((int)type);
+    if ((size == 0) ||
+	((values = (unsigned char *)malloc ((nrValues * size + 3) / 4 * 4 + 1)) == NULL))
+    {
+      return (-1);
+    }
+    if (fread (values, 1, (nrValues * size + 3) / 4 * 4, nc->fp) !=
+	(size_t)((nrValues * size + 3) / 4 * 4))
+    {
+      free (values);
+      return (-1);
+    }
+    if ((var != NULL) && (type != 2) && (nrValues > 0))
+    {
+      v = ncValue (values, (int)type);
+      if ((strcmp (name, "_FillValue") == 0) ||
+	  ((strcmp (name, "missing_value") == 0) && !var->hasFill))
+      {
+	var->fill = v;
+	var->hasFill = true;
+      }
+      else if (strcmp (name, "scale_factor") == 0)
+      {
+	var->scale = v;
+      }
+      else if (strcmp (name, "add_offset") == 0)
+      {
+	var->offset = v;
+      }
+    }
+    free (values);
+  }
+  return (0);
+}
+
+
+/*
+** ncReadHeader: Read the header of a NetCDF classic file.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1 (with a message in 'errMsg').
+*/
+
+static int ncReadHeader (ncFile *nc, char *fName, char *errMsg)
+{
+  unsigned char magic[4];
+  int64_t       tag, n, v, vsize, firstRecSize;
+  int           i, k, nonNeg, nrRecVars;
+  ncVar        *var;
+
+  if ((fread (magic, 1, 4, nc->fp) != 4) || (memcmp (magic, "CDF", 3) != 0) ||
+      ((magic[3] != 1) && (magic[3] != 2) && (magic[3] != 5)))
+  {
+    snprintf (errMsg, 256, "%s is not a NetCDF classic file (NetCDF-4 files must be converted with 'nccopy -k cdf5')\n", fName);
+    return (-1);
+  }
+  nc->version = magic[3];
+  nonNeg = (nc->version == 5) ? 8 : 4;
+  nc->recDim = -1;
+
+  /*
+  ** The number of records, and the dimensions.
+  */
+  if ((ncGet (nc->fp, nonNeg, &n) == -1) || (ncGet (nc->fp, 4, &tag) == -1) ||
+      (ncGet (nc->fp, nonNeg, &v) == -1) ||
+      ((tag != NC_DIMENSION) && ((tag != 0) || (v != 0))) || (v > NC_MAX_DIMS))
+  {
+    snprintf (errMsg, 256, "Invalid NetCDF dimensions in data file %s\n", fName);
+    return (-1);
+  }
+  nc->nrDims = (int)v;
+  for (i = 0; i < nc->nrDims; i++)
+  {
+    if ((ncGetName (nc, nc->dimName[i]) == -1) ||
+	(ncGet (nc->fp, nonNeg, &nc->dimLen[i]) == -1))
+    {
+      snprintf (errMsg, 256, "Invalid NetCDF dimensions in data file %s\n", fName);
+      return (-1);
+    }
+    if (nc->dimLen[i] == 0)
+    {
+      nc->recDim = i;
+      nc->dimLen[i] = n;
+    }
+  }
+
+  /*
+  ** The global attributes, and the variables.
+  */
+  if ((ncGetAttributes (nc, NULL) == -1) || (ncGet (nc->fp, 4, &tag) == -1) ||
+      (ncGet (nc->fp, nonNeg, &v) == -1) ||
+      ((tag != NC_VARIABLE) && ((tag != 0) || (v != 0))))
+  {
+    snprintf (errMsg, 256, "Invalid NetCDF header in data file %s\n", fName);
+    return (-1);
+  }
+  nc->nrVars = (int)v;
+  if ((nc->vars = (ncVar *)calloc ((nc->nrVars > 0) ? nc->nrVars : 1, sizeof (ncVar))) == NULL)
+  {
+    snprintf (errMsg, 256, "Not enough memory to read data file %s\n", fName);
+    return (-1);
+  }
+  nc->recSize = 0;
+  firstRecSize = 0;
+  nrRecVars = 0;
+  for (i = 0; i < nc->nrVars; i++)
+  {
+    var = &nc->vars[i];
+    var->scale = 1.0;
+    if ((ncGetName (nc, var->name) == -1) || (ncGet (nc->fp, nonNeg, &v) == -1) ||
+	(v > NC_MAX_DIMS))
+    {
+      snprintf (errMsg, 256, "Invalid NetCDF variable in data file %s\n", fName);
+      return (-1);
+    }
+    var->nrDims = (int)v;
+    for (k = 0; k < var->nrDims; k++)
+    {
+      if ((ncGet (nc->fp, nonNeg, &v) == -1) || (v >= nc->nrDims))
+      {
+	snprintf (errMsg, 256, "Invalid NetCDF variable in data file %s\n", fName);
+	return (-1);
+      }
+      var->dimIds[k] = (int)v;
+    }
+    if ((ncGetAttributes (nc, var) == -1) || (ncGet (nc->fp, 4, &v) == -1) ||
+	(ncGet (nc->fp, nonNeg, &vsize) == -1) ||
+	(ncGet (nc->fp, (nc->version == 1) ? 4 : 8, &var->begin) == -1))
+    {
+      snprintf (errMsg, 256, "Invalid NetCDF variable in data file %s\n", fName);
+      return (-1);
+    }
+    var->type = (int)v;
+
+    /*
+    ** The size of a record is that of the records of all record variables
+    ** (padded to 4 bytes, unless there is a single record variable).
+    */
+    if ((var->nrDims > 0) && (var->dimIds[0] == nc->recDim))
+    {
+      for (vsize = ncTypeSize (var->type), k = 1; k < var->nrDims; k++)
+      {
+	vsize *= nc->dimLen[var->dimIds[k]];
+      }
+      nc->recSize += (vsize + 3) / 4 * 4;
+      nrRecVars++;
+      if (nrRecVars == 1)
+      {
+	firstRecSize = vsize;
+      }
+    }
+  }
+  if (nrRecVars == 1)
+  {
+    nc->recSize = firstRecSize;
+  }
+  return (0);
+}
+
+
+/*
+** ncCoords: Get the first and last values (and the count) of the
+**           coordinate variable of a dimension.
+**
+** Returns:
+**   - If the dimension has a coordinate variable:  0.
+**   - Otherwise:                                  -1.
+*/
+
+static int ncCoords (ncFile *nc, int dim, double *first, double *last)
+{
+  int            i, size;
+  unsigned char  b[8];
+
+  for (i = 0; i < nc->nrVars; i++)
+  {
+    if ((nc->vars[i].nrDims == 1) && (nc->vars[i].dimIds[0] == dim) &&
+	(strcmp (nc->vars[i].name, nc->dimName[dim]) == 0) &&
+	((size = ncTypeSize (nc->vars[i].type)) > 0) && (nc->vars[i].type != 2) &&
+	(nc->dimLen[dim] > 1) && (dim != nc->recDim))
+    {
+      if ((fseek (nc->fp, (long)nc->vars[i].begin, SEEK_SET) != 0) ||
+	  (fread (b, 1, size, nc->fp) != (size_t)size))
+      {
+	return (-1);
+      }
+      *first = ncValue (b, nc->vars[i].type);
+      if ((fseek (nc->fp, (long)(nc->vars[i].begin + (nc->dimLen[dim] - 1) * size),
+		  SEEK_SET) != 0) ||
+	  (fread (b, 1, size, nc->fp) != (size_t)size))
+      {
+	return (-1);
+      }
+      *last = ncValue (b, nc->vars[i].type);
+      return (0);
+    }
+  }
+  return (-1);
+}
+
+
+/*
+** mcReadCube: Read the layer of one time step of a NetCDF cube (see
+**             'mcReadGrid', which calls this function for layers named
+**             "cube.nc[:variable]#step", for the other parameters and the
+**             result). Like 'mcReadGrid', this function does not use a
+**             simulation context and does not print anything.
+**
+** Parameters:
+**   - fName:   The name of the NetCDF file.
+**   - varName: The name of the variable (or "" for the first variable with
+**              three dimensions).
+**   - step:    The time step (from 1).
+**   - cube:    The cube kept open from a previous read, or NULL. If it is
+**              the same file, its header is used as it is; otherwise it is
+**              closed, and the file is opened and left open in its place.
+**              If NULL, the file is closed after reading.
+*/
+
+int mcReadCube (char *fName, char *varName, int step, int **mat, mcGrid *grid,
+		mcCube **cube, char *errMsg)
+{
+  int            i, j, v, row, size, nrY, nrX, status;
+  bool           flip;
+  double         first, last, val, cs;
+  int64_t        pos;
+  unsigned char *buf;
+  mcCube        *cb;
+  ncFile        *nc;
+  ncVar         *var;
+
+  status = -1;
+  buf = NULL;
+  errMsg[0] = '\0';
+
+  /*
+  ** Use the open cube if it is the same file, otherwise open the file and
+  ** parse its header.
+  */
+  cb = (cube != NULL) ? *cube : NULL;
+  if ((cb != NULL) && (strcmp (cb->fName, fName) != 0))
+  {
+    mcCloseCube (cube);
+    cb = NULL;
+  }
+  if (cb == NULL)
+  {
+    if ((cb = (mcCube *)calloc (1, sizeof (mcCube))) == NULL)
+    {
+      snprintf (errMsg, 256, "Not enough memory to read data file %s\n", fName);
+      goto End_of_Routine;
+    }
+    strncpy (cb->fName, fName, 1023);
+    cb->fName[1023] = '\0';
+    if ((cb->nc.fp = fopen (fName, "rb")) == NULL)
+    {
+      snprintf (errMsg, 256, "Can't open data file %s\n", fName);
+      goto End_of_Routine;
+    }
+    if (ncReadHeader (&cb->nc, fName, errMsg) == -1)
+    {
+      goto End_of_Routine;
+    }
+  }
+  nc = &cb->nc;
+
+  /*
+  ** Find the variable and check the time step.
+  */
+  for (v = 0; v < nc->nrVars; v++)
+  {
+    if ((varName[0] == '\0') ? (nc->vars[v].nrDims == 3) :
+	(strcmp (nc->vars[v].name, varName) == 0))
+    {
+      break;
+    }
+  }
+  if ((v == nc->nrVars) || (nc->vars[v].nrDims != 3))
+  {
+    snprintf (errMsg, 256, "No variable with (time, y, x) dimensions %s%s in data file %s\n",
+	      (varName[0] == '\0') ? "" : "named ", varName, fName);
+    goto End_of_Routine;
+  }
+  var = &nc->vars[v];
+  if (((size = ncTypeSize (var->type)) == 0) || (var->type == 2))
+  {
+    snprintf (errMsg, 256, "Unsupported type of variable %s in data file %s\n", var->name, fName);
+    goto End_of_Routine;
+  }
+  if ((step < 1) || (step > nc->dimLen[var->dimIds[0]]))
+  {
+    snprintf (errMsg, 256, "Time step %d is not in data file %s (%d steps)\n", step,
+	      fName, (int)nc->dimLen[var->dimIds[0]]);
+    goto End_of_Routine;
+  }
+  nrY = (int)nc->dimLen[var->dimIds[1]];
+  nrX = (int)nc->dimLen[var->dimIds[2]];
+  if (mat == NULL)
+  {
+    grid->nrRows = nrY;
+    grid->nrCols = nrX;
+  }
+  else if ((nrY != grid->nrRows) || (nrX != grid->nrCols))
+  {
+    snprintf (errMsg, 256, "Invalid number of rows or columns in data file %s\n", fName);
+    goto End_of_Routine;
+  }
+
+  /*
+  ** The georeference, from the cell centres of the coordinate variables.
+  */
+  flip = false;
+  grid->xllCorner = 0.0;
+  grid->yllCorner = 0.0;
+  grid->cellSize = 1.0;
+  if (ncCoords (nc, var->dimIds[2], &first, &last) == 0)
+  {
+    cs = (last - first) / (nrX - 1);
+    grid->cellSize = fabs (cs);
+    grid->xllCorner = ((cs > 0) ? first : last) - grid->cellSize / 2.0;
+  }
+  if (ncCoords (nc, var->dimIds[1], &first, &last) == 0)
+  {
+    flip = (last > first);
+    grid->yllCorner = (flip ? first : last) - grid->cellSize / 2.0;
+  }
+  grid->noData = NC_NODATA;
+  if (mat == NULL)
+  {
+    status = 0;
+    goto End_of_Routine;
+  }
+
+  /*
+  ** Read the layer, row by row, straight from its place in the file.
+  */
+  if ((buf = (unsigned char *)malloc ((size_t)nrX * size)) == NULL)
+  {
+    snprintf (errMsg, 256, "Not enough memory to read data file %s\n", fName);
+    goto End_of_Routine;
+  }
+  if (var->dimIds[0] == nc->recDim)
+  {
+    pos = var->begin + (int64_t)(step - 1) * nc->recSize;
+  }
+  else
+  {
+    pos = var->begin + (int64_t)(step - 1) * nrY * nrX * size;
+  }
+  if (fseek (nc->fp, (long)pos, SEEK_SET) != 0)
+  {
+    snprintf (errMsg, 256, "Can't read time step %d of data file %s\n", step, fName);
+    goto End_of_Routine;
+  }
+  for (i = 0; i < nrY; i++)
+  {
+    if (fread (buf, size, nrX, nc->fp) != (size_t)nrX)
+    {
+      snprintf (errMsg, 256, "Can't read time step %d of data file %s\n", step, fName);
+      goto End_of_Routine;
+    }
+    row = flip ? nrY - 1 - i : i;
+    for (j = 0; j < nrX; j++)
+    {
+      val = ncValue (buf + (size_t)j * size, var->type);
+      mat[row][j] = (isnan (val) || (var->hasFill && (val == var->fill))) ?
+	NC_NODATA : (int)round (val * var->scale + var->offset);
+    }
+  }
+  status = 0;
+
+ End_of_Routine:
+  /*
+  ** Keep the cube open for the next read, unless there is nowhere to keep
+  ** it or something went wrong, and free the allocated memory.
+  */
+  if ((cube != NULL) && (status == 0))
+  {
+    *cube = cb;
+  }
+  else
+  {
+    mcCloseCube (&cb);
+    if (cube != NULL)
+    {
+      *cube = NULL;
+    }
+  }
+  if (buf != NULL)
+  {
+    free (buf);
+  }
+  return (status);
+}
+
+
+/*
+** mcCloseCube: Close a cube kept open by 'mcReadCube' (if any).
+**
+** Parameters:
+**   - cube: The cube, which is set to NULL.
+*/
+
+void mcCloseCube (mcCube **cube)
+{
+  if (*cube == NULL)
+  {
+    return;
+  }
+  if ((*cube)->nc.fp != NULL)
+  {
+    fclose ((*cube)->nc.fp);
+  }
+  if ((*cube)->nc.vars != NULL)
+  {
+    free ((*cube)->nc.vars);
+  }
+  free (*cube);
+  *cube = NULL;
+}
+
+
+/*
+** EoF: netcdf.c
+*/
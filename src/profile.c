@@ -0,0 +1,99 @@
+/*
+** profile.c: Functions for profiling a MigClim simulation. When profiling is
+**            enabled, 'mcMigrate' times the different phases of each step and
+**            counts the calls to the most expensive functions, and writes
+**            these values per step into a "_profile.txt" file next to the
+**            "_stats.txt" file.
+*/
+
+#ifdef _WIN32
+#include <windows.h>   /* Must come before R.h (see "Writing R Extensions"). */
+#else
+#include <sys/resource.h>
+#endif
+
+#include "migclim.h"
+
+
+/*
+** mcProfileReset: Reset the timers and counters.
+*/
+
+void mcProfileReset (mcContext *ctx)
+{
+  memset (&ctx->prf, 0, sizeof (mcProfile));
+}
+
+
+/*
+** mcPeakMemory: Get the peak memory use (resident set size) of the process.
+**
+** Returns:
+**   The peak memory use in kilobytes, or -1 if it is not available.
+*/
+
+long mcPeakMemory (void)
+{
+#ifdef _WIN32
+  return (-1);
+#else
+  struct rusage usage;
+
+  if (getrusage (RUSAGE_SELF, &usage) != 0)
+  {
+    return (-1);
+  }
+#ifdef __APPLE__
+  return ((long)(usage.ru_maxrss / 1024));   /* In bytes on macOS. */
+#else
+  return ((long)usage.ru_maxrss);
+#endif
+#endif
+}
+
+
+/*
+** mcProfileHeader: Write the header line of a profile file.
+**
+** Parameters:
+**   - fp: The profile file.
+*/
+
+void mcProfileHeader (FILE *fp)
+{
+  fprintf (fp, "envChgStep\tdispStep\tstepID\tloadNs\tfilterNs\tsinkNs\tlddNs\tagingNs\tstatsNs\toutputNs\t"
+	   "srcCellCalls\tcellsProbed\trandomDraws\tbarrierCalls\traysWalked\tpeakMemKb\n");
+}
+
+
+/*
+** mcProfileWrite: Write the profiling data of one step to the profile file,
+**                 and reset the timers and counters for the next step.
+**
+** Parameters:
+**   - fp:         The profile file.
+**   - envChgStep: The environmental change step (-1 for the final output).
+**   - dispStep:   The dispersal step (-1 for the final output).
+**   - loopID:     The ID of the step (-1 for the final output).
+*/
+
+void mcProfileWrite (mcContext *ctx, FILE *fp, int envChgStep, int dispStep, int loopID)
+{
+  int i;
+
+  fprintf (fp, "%d\t%d\t%d", envChgStep, dispStep, loopID);
+  for (i = 0; i < PRF_NR_PHASES; i++)
+  {
+    fprintf (fp, "\t%.0f", (double)ctx->prf.phaseNs[i]);
+  }
+  fprintf (fp, "\t%.0f\t%.0f\t%.0f\t%.0f\t%.0f\t%ld\n",
+	   (double)ctx->prf.srcCellCalls, (double)ctx->prf.cellsProbed,
+	   (double)ctx->prf.randomDraws, (double)ctx->prf.barrierCalls,
+	   (double)ctx->prf.raysWalked, mcPeakMemory ());
+  mcProfileReset (ctx);
+}
+
+
+/*
+** EoF: profile.c
+*/
@@ -0,0 +1,99 @@
+/*
+** random.c: A small, portable random number generator for MigClim.
+**
+** We used to rely on 'rand', but its state cannot be saved and restored,
+** which we need to be able to resume a simulation from a checkpoint and
+** get exactly the same results as an uninterrupted run. This is the
+** xoshiro256** generator of Blackman & Vigna, seeded through splitmix64.
+** Its state is part of the simulation context.
+*/
+
+#include "migclim.h"
+
+
+/*
+** mcRotl: Rotate a 64-bit word left by k bits.
+*/
+
+static uint64_t mcRotl (uint64_t x, int k)
+{
+  return ((x << k) | (x >> (64 - k)));
+}
+
+
+/*
+** mcSeedRandom: Initialize the generator state from a single seed value.
+**
+** Parameters:
+**   - seed: The seed value (e.g. 'time (NULL)').
+*/
+
+void mcSeedRandom (mcContext *ctx, uint64_t seed)
+{
+  int      i;
+  uint64_t z;
+
+  for (i = 0; i < MC_RNG_STATE_SIZE; i++)
+  {
+    seed += 0x9E3779B97F4A7C15ULL;
+    z = seed;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    ctx->rngState[i] = z ^ (z >> 31);
+  }
+}
+
+
+/*
+** mcRandom: Draw the next 64 random bits.
+*/
+
+uint64_t mcRandom (mcContext *ctx)
+{
+  uint64_t result, t;
+
+  PRF_COUNT (randomDraws, 1);
+  result = mcRotl (ctx->rngState[1] * 5, 7) * 9;
+  t = ctx->rngState[1] << 17;
+  ctx->rngState[2] ^= ctx->rngState[0];
+  ctx->rngState[3] ^= ctx->rngState[1];
+  ctx->rngState[1] ^= ctx->rngState[2];
+  ctx->rngState[0] ^= ctx->rngState[3];
+  ctx->rngState[2] ^= t;
+  ctx->rngState[3] = mcRotl (ctx->rngState[3], 45);
+
+  return (result);
+}
+
+
+/*
+** mcUnif01: Draw a uniform random number in [0;1).
+*/
+
+double mcUnif01 (mcContext *ctx)
+{
+  return ((mcRandom (ctx) >> 11) * (1.0 / 9007199254740992.0));
+}
+
+
+/*
+** mcGetRandomState / mcSetRandomState: Save or restore the generator state.
+**
+** Parameters:
+**   - state: An array of MC_RNG_STATE_SIZE words.
+*/
+
+void mcGetRandomState (mcContext *ctx, uint64_t *state)
+{
+  memcpy (state, ctx->rngState, sizeof (ctx->rngState));
+}
+
+void mcSetRandomState (mcContext *ctx, uint64_t *state)
+{
+  memcpy (ctx->rngState, state, sizeof (ctx->rngState));
+}
+
+
+/*
+** EoF: random.c
+*/
@@ -0,0 +1,162 @@
+/*
+** sinks.c: The index of the candidate sink cells of the dispersal sweep,
+**          i.e., the cells that are suitable and unoccupied.
+**
+** Most cells of the grid are unsuitable, NoData or already occupied, so the
+** sweep over all cells spends most of its time on cells that fail the sink
+** test straight away. The index lists the cells (row * nrCols + col) that
+** may be sinks in row-major order, so the sweep visits them in the same
+** order as before, together with a mask of one bit per cell that tells
+** whether a cell is listed.
+**
+** The index is rebuilt when a habitat suitability layer is applied (in the
+** delta mode, only the changed cells are merged into it). Within an
+** environmental change step cells can only stop being sinks, so the sweep
+** drops the cells it colonizes, and the listed cells that stopped being
+** sinks in another way (e.g., colonized through LDD), from the list as it
+** goes. The list always holds all the sinks, but may also hold a few cells
+** that are not sinks anymore, so a listed cell is still tested in full.
+*/
+
+#include "migclim.h"
+
+
+/*
+** mcInitSinks: Allocate the memory for a candidate sink index.
+**
+** Parameters:
+**   - sinks: The index.
+**
+** Returns:
+**   -  0 if everything went fine.
+**   - -1 if there is not enough memory.
+*/
+
+int mcInitSinks (mcContext *ctx, mcSinkIndex *sinks)
+{
+  int nrCells;
+
+  nrCells = ctx->nrRows * ctx->nrCols;
+  sinks->nrCells = 0;
+  sinks->cells = (int *)malloc (nrCells * sizeof (int));
+  sinks->mask = (uint64_t *)calloc ((nrCells + 63) / 64, sizeof (uint64_t));
+  if ((sinks->cells == NULL) || (sinks->mask == NULL))
+  {
+    Rprintf ("Not enough memory for the candidate sink index.\n");
+    mcFreeSinks (sinks);
+    return (-1);
+  }
+  return (0);
+}
+
+
+/*
+** mcFreeSinks: Free the memory of a candidate sink index.
+**
+** Parameters:
+**   - sinks: The index.
+*/
+
+void mcFreeSinks (mcSinkIndex *sinks)
+{
+  if (sinks->cells != NULL)
+  {
+    free (sinks->cells);
+  }
+  if (sinks->mask != NULL)
+  {
+    free (sinks->mask);
+  }
+  sinks->cells = NULL;
+  sinks->mask = NULL;
+  sinks->nrCells = 0;
+}
+
+
+/*
+** mcBuildSinks: Build the candidate sink index from scratch.
+**
+** Parameters:
+**   - sinks:    The index.
+**   - curState: The current state matrix.
+**   - habSuit:  The habitat suitability matrix.
+*/
+
+void mcBuildSinks (mcContext *ctx, mcSinkIndex *sinks, int **curState, int **habSuit)
+{
+  int i, j, c;
+
+  memset (sinks->mask, 0, ((ctx->nrRows * ctx->nrCols + 63) / 64) * sizeof (uint64_t));
+  sinks->nrCells = 0;
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      if ((habSuit[i][j] > 0) && (curState[i][j] <= 0))
+      {
+	c = i * ctx->nrCols + j;
+	sinks->cells[sinks->nrCells++] = c;
+	MC_SET_SINK (sinks, c);
+      }
+    }
+  }
+}
+
+
+/*
+** mcAddSinks: Merge the cells of a list that became sinks into the candidate
+**             sink index, keeping it in row-major order. The merge is done
+**             in place, from the end of the list backwards.
+**
+** Parameters:
+**   - sinks:    The index.
+**   - cells:    The cells to check, in increasing order (e.g., the cells
+**               that changed in a delta layer, see 'mcBuildDelta').
+**   - nrCells:  The number of cells in the list.
+**   - curState: The current state matrix.
+**   - habSuit:  The habitat suitability matrix.
+*/
+
+void mcAddSinks (mcContext *ctx, mcSinkIndex *sinks, int *cells, int nrCells, int **curState,
+		 int **habSuit)
+{
+  int k, n, w, c, nrNew;
+
+  /*
+  ** Count the new sinks (the cells that are sinks but not listed yet).
+  */
+  nrNew = 0;
+  for (k = 0; k < nrCells; k++)
+  {
+    c = cells[k];
+    nrNew += (!MC_IS_SINK (sinks, c) && (habSuit[c / ctx->nrCols][c % ctx->nrCols] > 0) &&
+	      (curState[c / ctx->nrCols][c % ctx->nrCols] <= 0));
+  }
+
+  /*
+  ** Merge them into the list.
+  */
+  n = sinks->nrCells - 1;
+  w = sinks->nrCells + nrNew - 1;
+  for (k = nrCells - 1; (k >= 0) && (w > n); k--)
+  {
+    c = cells[k];
+    if (MC_IS_SINK (sinks, c) || (habSuit[c / ctx->nrCols][c % ctx->nrCols] <= 0) ||
+	(curState[c / ctx->nrCols][c % ctx->nrCols] > 0))
+    {
+      continue;
+    }
+    while ((n >= 0) && (sinks->cells[n] > c))
+    {
+      sinks->cells[w--] = sinks->cells[n--];
+    }
+    sinks->cells[w--] = c;
+    MC_SET_SINK (sinks, c);
+  }
+  sinks->nrCells += nrNew;
+}
+
+
+/*
+** EoF: sinks.c
+*/
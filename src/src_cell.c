@@ -1,5 +1,5 @@
 /*
-** src_cell.c: Function for finding potential souce cells for a given sink cell.
+** src_cell.c: Functions for finding potential souce cells for a given sink cell.
 **
 ** Wim Hordijk    Last modified: 03 October 2011
 **
@@ -17,12 +17,10 @@
 ** Parameters:
 **   - i:        The row number of the sink pixel.
 **   - j:        The column number of the sink pixel.
-**   - curState: The matrix that contains the current state of the cellular
-**               automaton.
+**   - sources:  The mature source pixels of the current loop (see
+**               'mcBuildSources'). Only these pixels are visited: the window
+**               is scanned 64 pixels at a time, jumping to the set bits.
 **   - pxlAge:   A matrix giving the "age" of each colonized pixel.
-**   - loopID:   Indicates in which "loop" the simulation currently is. The
-**               'loopID' enables to retrieve the 'environmental change' loop
-**               and the 'dispersal' loop that the simulation is currently in.
 **   - habSuit:  The habitat suitability of the current pixel.
 **   - barriers: A pointer to the barriers matrix.
 **
@@ -31,12 +29,13 @@
 **   Otherwise:                           false.
 */
 
-bool mcSrcCell (int i, int j, int **curState, int **pxlAge, int loopID,
-		int habSuit, int **barriers)
+bool mcSrcCell (mcContext *ctx, int i, int j, uint64_t *sources, int **pxlAge, int habSuit,
+		int **barriers)
 {
-  int    k, l, realDist, pxlSizeFactor;
-  double probCol, rnd;
-  bool   sourceFound;
+  int       k, l, w, realDist, pxlSizeFactor, nrWords, lo, hi, nrProbed;
+  uint64_t  bits;
+  double    probCol, rnd;
+  bool      sourceFound;
 
   /*
   ** For now let's set these paramters to fixed values. Later we can implement
@@ -44,82 +43,91 @@ bool mcSrcCell (int i, int j, int **curState, int **pxlAge, int loopID,
   */
   pxlSizeFactor = 1;
   sourceFound = false;
+  nrProbed = 0;
+  PRF_COUNT (srcCellCalls, 1);
+  nrWords = (ctx->nrCols + 63) / 64;
+  lo = (j - ctx->dispDist < 0) ? 0 : j - ctx->dispDist;
+  hi = (j + ctx->dispDist >= ctx->nrCols) ? ctx->nrCols - 1 : j + ctx->dispDist;
         
   /*
   ** Search for a potential source cell. i and j are the coordinates of the
   ** sink cell. k and l are the coordinates of the potential source cell.
   */
-  for (k = i - dispDist; k <= i + dispDist; k++)
+  for (k = (i - ctx->dispDist < 0) ? 0 : i - ctx->dispDist;
+       (k <= i + ctx->dispDist) && (k < ctx->nrRows); k++)
   {
-    for (l = j - dispDist; l <= j + dispDist; l++)
+    for (w = lo / 64; w <= hi / 64; w++)
     {
       /*
-      ** 1. Test of basic conditions to see if a pixel could be a potential
-      **    source cell:
-      **    - The pixel must be within the limits of the matrix's extent.
-      **    - The pixel must be colonized, but not during the current loop.
-      **    - The pixel must have reached its age of "initial maturity"
-      **      (otherwise it cannot produce seeds).
+      ** 1. The potential source cells are the pixels of the window that are
+      **    colonized (but not during the current loop) and have reached
+      **    their age of "initial maturity" (otherwise they cannot produce
+      **    seeds), i.e., the set bits of the source plane.
       */
-      if ((k >= 0) && (k < nrRows) && (l >= 0) && (l < nrCols))
+      bits = sources[k * nrWords + w];
+      if (w == lo / 64)
+      {
+	bits &= ~(uint64_t)0 << (lo % 64);
+      }
+      if (w == hi / 64)
       {
-	if ((curState[k][l] > 0) &&
-	    (curState[k][l] != loopID))
+	bits &= ~(uint64_t)0 >> (63 - hi % 64);
+      }
+      for (; bits != 0; bits &= bits - 1)
+      {
+	l = w * 64 + mcCtz (bits);
+	nrProbed++;
+
+	/*
+	** 2. Compute the distance between sink and (potential) source pixel
+	**    and check if it is <= maximum dispersal distance. The distance
+	**    is computed in pixel units.
+	** realDist = Fix(Sqr((K - I) ^ 2 + (L - J) ^ 2) + 0.5)
+	*/
+	realDist = (int)round (sqrt ((k-i)*(k-i) + (l-j)*(l-j)));
+	if ((realDist > 0) && (realDist <= ctx->dispDist))
 	{
-	  if (pxlAge[k][l] >= iniMatAge)
+	  /*
+	  ** 3. Compute the probability of colonization of the sink pixel.
+	  **    This probability depends on several factors:
+	  **    - Disance between source and sink cells.
+	  **    - Age of the source cell.
+	  **    - "Invasability" of the sink cell.
+	  */
+	  if (pxlAge[k][l] >= ctx->fullMatAge)
+	  {
+	    probCol = ctx->dispKernel[realDist-1] * pxlSizeFactor *
+			(habSuit / 1000.0);
+	  }
+	  else
+	  {
+	    probCol = ctx->dispKernel[realDist-1] * pxlSizeFactor *
+			ctx->propaguleProd[pxlAge[k][l] - ctx->iniMatAge] *
+			(habSuit / 1000.0);
+	  }
+
+	  rnd = UNIF01;
+	  if (rnd < probCol || probCol == 1.0)
 	  {
 	    /*
-	    ** 2. Compute the distance between sink and (potential) source pixel
-	    **    and check if it is <= maximum dispersal distance. The distance
-	    **    is computed in pixel units.
-	    ** realDist = Fix(Sqr((K - I) ^ 2 + (L - J) ^ 2) + 0.5)
+	    ** When we reach this stage, the last thing we need to check for
+	    ** is whether there is a "barrier" obstacle between the source
+	    ** and sink pixel. We check this last as it requires significant
+	    ** computing time.
 	    */
-	    realDist = (int)round (sqrt ((k-i)*(k-i) + (l-j)*(l-j)));
-	    if ((realDist > 0) && (realDist <= dispDist))
+	    if (ctx->useBarrier)
 	    {
-	      /*
-	      ** 3. Compute the probability of colonization of the sink pixel.
-	      **    This probability depends on several factors:
-	      **    - Disance between source and sink cells.
-	      **    - Age of the source cell.
-	      **    - "Invasability" of the sink cell.
-	      */
-	      if (pxlAge[k][l] >= fullMatAge)
-	      {
-		probCol = dispKernel[realDist-1] * pxlSizeFactor *
-			    (habSuit / 1000.0);
-	      }
-	      else
-	      {
-		probCol = dispKernel[realDist-1] * pxlSizeFactor *
-			    propaguleProd[pxlAge[k][l] - iniMatAge] *
-			    (habSuit / 1000.0);
-	      }
-
-	      rnd = UNIF01;
-	      if (rnd < probCol || probCol == 1.0)
+	      if (!mcIntersectsBarrier (ctx, i, j, k, l, barriers))
 	      {
-		/*
-		** When we reach this stage, the last thing we need to check for
-		** is whether there is a "barrier" obstacle between the source
-		** and sink pixel. We check this last as it requires significant
-		** computing time.
-		*/
-		if (useBarrier)
-		{
-		  if (!mcIntersectsBarrier (i, j, k, l, barriers))
-		  {
-		    sourceFound = true;
-		    goto End_of_Routine;
-		  }
-		}
-		else
-		{
-		  sourceFound = true;
-		  goto End_of_Routine;
-		}
+		sourceFound = true;
+		goto End_of_Routine;
 	      }
 	    }
+	    else
+	    {
+	      sourceFound = true;
+	      goto End_of_Routine;
+	    }
 	  }
 	}
       }
@@ -127,6 +135,13 @@ bool mcSrcCell (int i, int j, int **curState, int **pxlAge, int loopID,
   }
     
  End_of_Routine:
+  /*
+  ** Count the cells that were probed, i.e., the source cells visited (the
+  ** window cells outside the grid, or skipped by the source plane, are not
+  ** probed).
+  */
+  PRF_COUNT (cellsProbed, nrProbed);
+
   /*
   ** Return the result.
   */
@@ -134,6 +149,62 @@ bool mcSrcCell (int i, int j, int **curState, int **pxlAge, int loopID,
 }
 
 
+/*
+** mcBuildSources: Set the source plane of a loop: one bit per pixel (in rows
+**                 of (nrCols + 63) / 64 words), set for the mature source
+**                 pixels, i.e., the pixels that are colonized (but not during
+**                 the loop) and have reached their age of initial maturity.
+**                 The plane is kept up to date by the aging pass in
+**                 'mcMigrate', so it is only built at the start of a
+**                 replicate.
+**
+** Parameters:
+**   - sources:  The source plane.
+**   - curState: The matrix that contains the current state of the cellular
+**               automaton.
+**   - pxlAge:   A matrix giving the "age" of each colonized pixel.
+**   - loopID:   The ID of the loop.
+*/
+
+void mcBuildSources (mcContext *ctx, uint64_t *sources, int **curState, int **pxlAge, int loopID)
+{
+  int i, j, nrWords;
+
+  nrWords = (ctx->nrCols + 63) / 64;
+  memset (sources, 0, ctx->nrRows * nrWords * sizeof (uint64_t));
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    for (j = 0; j < ctx->nrCols; j++)
+    {
+      if ((curState[i][j] > 0) && (curState[i][j] != loopID) &&
+	  (pxlAge[i][j] >= ctx->iniMatAge))
+      {
+	sources[i * nrWords + j / 64] |= (uint64_t)1 << (j % 64);
+      }
+    }
+  }
+}
+
+
+#if !defined(__GNUC__)
+/*
+** mcCtz: The index of the lowest set bit of a non-zero word (without the
+**        builtin of GCC, see migclim.h).
+*/
+
+int mcCtz (uint64_t x)
+{
+  int n;
+
+  for (n = 0; (x & 1) == 0; n++)
+  {
+    x >>= 1;
+  }
+  return (n);
+}
+#endif
+
+
 /*
 ** EoF: src_cell.c
 */
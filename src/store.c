@@ -0,0 +1,666 @@
+/*
+** store.c: Functions for the binary result store, a single file that holds
+**          all the state matrices written by a simulation (the rasters of
+**          every replicate and step), so that post-processing can read a
+**          small window or a few steps of it without parsing ascii grids.
+**
+** The store file has the following layout:
+**   - The magic string "MCSTORE1".
+**   - nrRows, nrCols, tileSize, noData (int32).
+**   - xllCorner, yllCorner, cellSize (double).
+**   - The offset of the index (int64; 0 while the store is being written).
+**   - The number of records (int64).
+**   - The records, each made of its replicate and step (int32) followed by
+**     the nrRows x nrCols cell values (int32). The cells are stored in
+**     tiles of tileSize x tileSize cells (smaller at the right and bottom
+**     edges), by row of tiles, and by row within each tile, so that a
+**     window only touches the pages of the tiles it overlaps.
+**   - The index: the replicate and step (int32) of each record, in order.
+**
+** All records have the same size, so the offset of a record follows from
+** its position in the index. If the same replicate and step were written
+** more than once (e.g. when a simulation is resumed from a checkpoint), the
+** last record is the valid one.
+**
+** As for checkpoints, the file is in native byte order, so a store is not
+** portable between machines of different byte order. The tile size (at most
+** 65535) doubles as a byte order marker: reading a store written with the
+** other byte order fails with a message that says so. The file is read by
+** memory-mapping the part of the file that holds the requested record, after
+** checking that the record is within the file (a record past the end of a
+** truncated file would otherwise raise SIGBUS when it is touched).
+*/
+
+#ifdef _WIN32
+#include <windows.h>   /* Must come before R.h (see "Writing R Extensions"). */
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+#include "migclim.h"
+
+#define MC_STORE_MAGIC  "MCSTORE1"
+#define MC_STORE_HEADER 64
+#define MC_STORE_TILE   64
+#define MC_STORE_SWAP(x) ((int)((((uint32_t)(x) & 0xFF) << 24) | (((uint32_t)(x) & 0xFF00) << 8) | \
+			       (((uint32_t)(x) >> 8) & 0xFF00) | ((uint32_t)(x) >> 24)))
+
+
+/*
+** stSeek: Set the position in a store file (which can be larger than what
+**         a 'long' can address on Windows).
+*/
+
+static int stSeek (FILE *fp, int64_t offset)
+{
+#ifdef _WIN32
+  return (_fseeki64 (fp, offset, SEEK_SET));
+#else
+  return (fseeko (fp, (off_t)offset, SEEK_SET));
+#endif
+}
+
+
+/*
+** stRecordSize: The size of a record, in bytes.
+*/
+
+static int64_t stRecordSize (int rows, int cols)
+{
+  return (2 * sizeof (int32_t) + (int64_t)rows * cols * sizeof (int32_t));
+}
+
+
+/*
+** stReadHeader: Read the header of a store file and check that it is one.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - If the store was written with the other byte order: -2.
+**   - Otherwise:               -1.
+*/
+
+static int stReadHeader (FILE *fp, int *dims, double *georef, int64_t *idxOffset,
+			 int64_t *nrRecords)
+{
+  char magic[8];
+
+  if ((fread (magic, 1, 8, fp) != 8) ||
+      (memcmp (magic, MC_STORE_MAGIC, 8) != 0) ||
+      (fread (dims, sizeof (int), 4, fp) != 4) ||
+      (fread (georef, sizeof (double), 3, fp) != 3) ||
+      (fread (idxOffset, sizeof (int64_t), 1, fp) != 1) ||
+      (fread (nrRecords, sizeof (int64_t), 1, fp) != 1))
+  {
+    return (-1);
+  }
+  if ((dims[2] <= 0) || (dims[2] > 65535))
+  {
+    return (((MC_STORE_SWAP (dims[2]) > 0) && (MC_STORE_SWAP (dims[2]) <= 65535)) ? -2 : -1);
+  }
+  if ((dims[0] <= 0) || (dims[1] <= 0))
+  {
+    return (-1);
+  }
+  return (0);
+}
+
+
+/*
+** stWriteHeader: Write the header of a store file, with the georeference
+**                of the current grid.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+static int stWriteHeader (mcContext *ctx, mcStore *store)
+{
+  int     dims[4];
+  double  georef[3];
+  int64_t nrRecords;
+
+  dims[0] = ctx->nrRows;
+  dims[1] = ctx->nrCols;
+  dims[2] = MC_STORE_TILE;
+  dims[3] = ctx->noData;
+  georef[0] = ctx->xllCorner;
+  georef[1] = ctx->yllCorner;
+  georef[2] = ctx->cellSize;
+  nrRecords = store->nrRecords;
+  if ((stSeek (store->fp, 0) != 0) ||
+      (fwrite (MC_STORE_MAGIC, 1, 8, store->fp) != 8) ||
+      (fwrite (dims, sizeof (int), 4, store->fp) != 4) ||
+      (fwrite (georef, sizeof (double), 3, store->fp) != 3) ||
+      (fwrite (&store->idxOffset, sizeof (int64_t), 1, store->fp) != 1) ||
+      (fwrite (&nrRecords, sizeof (int64_t), 1, store->fp) != 1))
+  {
+    return (-1);
+  }
+  return (0);
+}
+
+
+/*
+** stReadIndex: Read the index of a store file. If the index was never
+**              written (the simulation was interrupted), it is rebuilt from
+**              the headers of the complete records in the file.
+**
+** Parameters:
+**   - fp:        The store file, positioned after its header.
+**   - rows:      The number of rows of the grid.
+**   - cols:      The number of columns of the grid.
+**   - idxOffset: The offset of the index (0 if there is none).
+**   - nrRecords: The number of records in the index (updated if the index
+**                is rebuilt).
+**   - index:     A pointer to the replicate and step of each record (the
+**                memory is allocated here, and must be freed by the caller).
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+static int stReadIndex (FILE *fp, int rows, int cols, int64_t idxOffset,
+			int64_t *nrRecords, int **index)
+{
+  int64_t recSize, fileSize, n;
+
+  *index = NULL;
+  recSize = stRecordSize (rows, cols);
+  if (idxOffset == 0)
+  {
+    if (fseek (fp, 0, SEEK_END) != 0)
+    {
+      return (-1);
+    }
+#ifdef _WIN32
+    fileSize = _ftelli64 (fp);
+#else
+    fileSize = (int64_t)ftello (fp);
+#endif
+    *nrRecords = (fileSize - MC_STORE_HEADER) / recSize;
+  }
+  if ((*nrRecords < 0) || (*nrRecords > INT_MAX / 2))
+  {
+    return (-1);
+  }
+  if ((*index = (int *)malloc ((2 * *nrRecords + 1) * sizeof (int))) == NULL)
+  {
+    return (-1);
+  }
+  if (idxOffset != 0)
+  {
+    if ((stSeek (fp, idxOffset) != 0) ||
+	(fread (*index, sizeof (int), 2 * *nrRecords, fp) != (size_t)(2 * *nrRecords)))
+    {
+      return (-1);
+    }
+  }
+  else
+  {
+    for (n = 0; n < *nrRecords; n++)
+    {
+      if ((stSeek (fp, MC_STORE_HEADER + n * recSize) != 0) ||
+	  (fread (*index + 2 * n, sizeof (int), 2, fp) != 2))
+      {
+	return (-1);
+      }
+    }
+  }
+  return (0);
+}
+
+
+/*
+** mcStoreOpen: Open a result store for writing. A new store is created,
+**              unless 'append' is true and the store already exists, in
+**              which case new records are added after the existing ones
+**              (used when resuming a simulation).
+**
+** Parameters:
+**   - fName:  The name of the store file.
+**   - append: Whether to add to an existing store.
+**   - store:  The store to open.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+int mcStoreOpen (mcContext *ctx, char *fName, bool append, mcStore *store)
+{
+  int     status, dims[4];
+  double  georef[3];
+  int64_t idxOffset, nrRecords;
+
+  status = 0;
+  store->fp = NULL;
+  store->index = NULL;
+  store->nrRecords = 0;
+  store->maxRecords = 0;
+  store->idxOffset = 0;
+  if (append && ((store->fp = fopen (fName, "r+b")) != NULL))
+  {
+    /*
+    ** Keep the records of the existing store, and add the new ones from the
+    ** end of the last complete record (overwriting the old index).
+    */
+    if (((status = stReadHeader (store->fp, dims, georef, &idxOffset, &nrRecords)) != 0) ||
+	(dims[0] != ctx->nrRows) || (dims[1] != ctx->nrCols) || (dims[2] != MC_STORE_TILE) ||
+	(stReadIndex (store->fp, ctx->nrRows, ctx->nrCols, idxOffset, &nrRecords, &store->index) == -1))
+    {
+      Rprintf ((status == -2) ? "Can't resume writing result store %s (it was written with "
+	       "another byte order).\n" : "Can't resume writing result store %s.\n", fName);
+      status = -1;
+      goto End_of_Routine;
+    }
+    store->nrRecords = (int)nrRecords;
+    store->maxRecords = (int)nrRecords;
+  }
+  else if ((store->fp = fopen (fName, "w+b")) == NULL)
+  {
+    status = -1;
+    Rprintf ("Can't open result store %s for writing.\n", fName);
+    goto End_of_Routine;
+  }
+
+  /*
+  ** Mark the store as being written (no valid index).
+  */
+  if (stWriteHeader (ctx, store) == -1)
+  {
+    status = -1;
+    Rprintf ("Could not write result store %s.\n", fName);
+  }
+
+ End_of_Routine:
+  /*
+  ** On failure, close the file without writing an index into it.
+  */
+  if (status == -1)
+  {
+    if (store->fp != NULL)
+    {
+      fclose (store->fp);
+    }
+    if (store->index != NULL)
+    {
+      free (store->index);
+    }
+    store->fp = NULL;
+    store->index = NULL;
+  }
+  return (status);
+}
+
+
+/*
+** mcStoreWrite: Add a state matrix to a result store.
+**
+** Parameters:
+**   - store:     The store to write to.
+**   - replicate: The replicate the matrix belongs to.
+**   - step:      The step the matrix belongs to.
+**   - mat:       The state matrix.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+int mcStoreWrite (mcContext *ctx, mcStore *store, int replicate, int step, int **mat)
+{
+  int  i, tr, tc, h, w, key[2], *newIndex;
+
+  /*
+  ** Make room in the index.
+  */
+  if (store->nrRecords == store->maxRecords)
+  {
+    newIndex = (int *)realloc (store->index, (2 * (2 * store->maxRecords + 16)) * sizeof (int));
+    if (newIndex == NULL)
+    {
+      Rprintf ("Not enough memory for the result store index.\n");
+      return (-1);
+    }
+    store->index = newIndex;
+    store->maxRecords = 2 * store->maxRecords + 16;
+  }
+
+  /*
+  ** The georeference of the grid is known once the first layer was read, so
+  ** the header is written again with the first record (this keeps it valid
+  ** even if the index is never written).
+  */
+  if ((store->nrRecords == 0) && (stWriteHeader (ctx, store) == -1))
+  {
+    Rprintf ("Could not write to the result store.\n");
+    return (-1);
+  }
+
+  /*
+  ** Write the record, tile by tile.
+  */
+  key[0] = replicate;
+  key[1] = step;
+  if ((stSeek (store->fp, MC_STORE_HEADER + store->nrRecords * stRecordSize (ctx->nrRows, ctx->nrCols)) != 0) ||
+      (fwrite (key, sizeof (int), 2, store->fp) != 2))
+  {
+    Rprintf ("Could not write to the result store.\n");
+    return (-1);
+  }
+  for (tr = 0; tr < ctx->nrRows; tr += MC_STORE_TILE)
+  {
+    h = (ctx->nrRows - tr < MC_STORE_TILE) ? ctx->nrRows - tr : MC_STORE_TILE;
+    for (tc = 0; tc < ctx->nrCols; tc += MC_STORE_TILE)
+    {
+      w = (ctx->nrCols - tc < MC_STORE_TILE) ? ctx->nrCols - tc : MC_STORE_TILE;
+      for (i = tr; i < tr + h; i++)
+      {
+	if (fwrite (mat[i] + tc, sizeof (int), w, store->fp) != (size_t)w)
+	{
+	  Rprintf ("Could not write to the result store.\n");
+	  return (-1);
+	}
+      }
+    }
+  }
+  store->index[2 * store->nrRecords] = replicate;
+  store->index[2 * store->nrRecords + 1] = step;
+  store->nrRecords++;
+  return (0);
+}
+
+
+/*
+** mcStoreClose: Write the index of a result store and close it. Nothing is
+**               written if the store was not opened successfully.
+**
+** Parameters:
+**   - store: The store to close.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+int mcStoreClose (mcContext *ctx, mcStore *store)
+{
+  int status;
+
+  status = 0;
+  if (store->fp != NULL)
+  {
+    store->idxOffset = MC_STORE_HEADER + store->nrRecords * stRecordSize (ctx->nrRows, ctx->nrCols);
+    if ((stSeek (store->fp, store->idxOffset) != 0) ||
+	(fwrite (store->index, sizeof (int), 2 * store->nrRecords, store->fp) !=
+	 (size_t)(2 * store->nrRecords)) ||
+	(stWriteHeader (ctx, store) == -1))
+    {
+      status = -1;
+    }
+    if (fclose (store->fp) != 0)
+    {
+      status = -1;
+    }
+    if (status == -1)
+    {
+      Rprintf ("Could not write the index of the result store.\n");
+    }
+  }
+  if (store->index != NULL)
+  {
+    free (store->index);
+  }
+  store->fp = NULL;
+  store->index = NULL;
+  store->nrRecords = 0;
+  store->maxRecords = 0;
+  return (status);
+}
+
+
+/*
+** mcStoreInfo: Read the properties and the index of a result store. Called
+**              from R, first with *nrRecords = 0 to get the dimensions and
+**              the number of records, then with a large enough 'replicates'
+**              and 'steps' to get the index.
+**
+** Parameters:
+**   - fName:      The name of the store file.
+**   - dims:       A pointer to contain nrRows, nrCols and noData.
+**   - georef:     A pointer to contain xllCorner, yllCorner and cellSize.
+**   - nrRecords:  The number of records to return the index of. On return,
+**                 the number of records in the store.
+**   - replicates: A pointer to contain the replicate of each record.
+**   - steps:      A pointer to contain the step of each record.
+**   - status:     A pointer to contain 0 on success, -1 otherwise.
+*/
+
+void mcStoreInfo (char **fName, int *dims, double *georef, int *nrRecords,
+		  int *replicates, int *steps, int *status)
+{
+  int      i, hdr[4], *index;
+  int64_t  idxOffset, n;
+  FILE    *fp;
+
+  *status = 0;
+  index = NULL;
+  if ((fp = fopen (*fName, "rb")) == NULL)
+  {
+    *status = -1;
+    Rprintf ("Can't open result store %s.\n", *fName);
+    goto End_of_Routine;
+  }
+  if (((*status = stReadHeader (fp, hdr, georef, &idxOffset, &n)) != 0) ||
+      (stReadIndex (fp, hdr[0], hdr[1], idxOffset, &n, &index) == -1))
+  {
+    Rprintf ((*status == -2) ? "%s was written with another byte order (result stores are "
+	     "not portable).\n" : "%s is not a valid result store.\n", *fName);
+    *status = -1;
+    goto End_of_Routine;
+  }
+  for (i = 0; (i < *nrRecords) && (i < n); i++)
+  {
+    replicates[i] = index[2 * i];
+    steps[i] = index[2 * i + 1];
+  }
+  dims[0] = hdr[0];
+  dims[1] = hdr[1];
+  dims[2] = hdr[3];
+  *nrRecords = (int)n;
+
+ End_of_Routine:
+  if (fp != NULL)
+  {
+    fclose (fp);
+  }
+  if (index != NULL)
+  {
+    free (index);
+  }
+}
+
+
+/*
+** mcStoreRead: Read a window of a record of a result store. Only the part
+**              of the file that holds the record is memory-mapped, and only
+**              the tiles that overlap the window are touched. Called from R.
+**
+** Parameters:
+**   - fName:     The name of the store file.
+**   - replicate: The replicate to read.
+**   - step:      The step to read.
+**   - window:    The first row, last row, first column and last column of
+**                the window (starting from 0, rows from the top).
+**   - values:    A pointer to contain the values of the window, by column
+**                (as an R matrix).
+**   - status:    A pointer to contain 0 on success, -1 if the store can't
+**                be read, and -2 if the replicate and step are not in it.
+*/
+
+void mcStoreRead (char **fName, int *replicate, int *step, int *window,
+		  int *values, int *status)
+{
+  int      i, j, k, r, c, tr, tc, h, w, hdr[4], *index, *cells, nr;
+  double   georef[3];
+  int64_t  idxOffset, n, begin, mapOffset, mapLen, fileSize;
+  char    *map;
+  FILE    *fp;
+#ifdef _WIN32
+  HANDLE   file, mapping;
+  LARGE_INTEGER size;
+#else
+  int      fd;
+  struct stat st;
+#endif
+
+  *status = 0;
+  index = NULL;
+  map = NULL;
+  if ((fp = fopen (*fName, "rb")) == NULL)
+  {
+    *status = -1;
+    Rprintf ("Can't open result store %s.\n", *fName);
+    goto End_of_Routine;
+  }
+  if (((*status = stReadHeader (fp, hdr, georef, &idxOffset, &n)) != 0) ||
+      (stReadIndex (fp, hdr[0], hdr[1], idxOffset, &n, &index) == -1))
+  {
+    Rprintf ((*status == -2) ? "%s was written with another byte order (result stores are "
+	     "not portable).\n" : "%s is not a valid result store.\n", *fName);
+    *status = -1;
+    goto End_of_Routine;
+  }
+  fclose (fp);
+  fp = NULL;
+  if ((window[0] < 0) || (window[1] >= hdr[0]) || (window[0] > window[1]) ||
+      (window[2] < 0) || (window[3] >= hdr[1]) || (window[2] > window[3]))
+  {
+    *status = -1;
+    Rprintf ("The window is outside of the grid of result store %s.\n", *fName);
+    goto End_of_Routine;
+  }
+
+  /*
+  ** Find the (last) record of the replicate and step.
+  */
+  for (k = (int)n - 1; k >= 0; k--)
+  {
+    if ((index[2 * k] == *replicate) && (index[2 * k + 1] == *step))
+    {
+      break;
+    }
+  }
+  if (k < 0)
+  {
+    *status = -2;
+    goto End_of_Routine;
+  }
+
+  /*
+  ** Map the record (from an offset aligned on the allocation granularity,
+  ** which is a multiple of the page size on all systems), if it is within
+  ** the file.
+  */
+  fileSize = -1;
+  begin = MC_STORE_HEADER + k * stRecordSize (hdr[0], hdr[1]) + 2 * sizeof (int32_t);
+  mapOffset = begin - begin % 65536;
+  mapLen = begin - mapOffset + (int64_t)hdr[0] * hdr[1] * sizeof (int32_t);
+#ifdef _WIN32
+  file = CreateFileA (*fName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		      FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file != INVALID_HANDLE_VALUE)
+  {
+    fileSize = GetFileSizeEx (file, &size) ? (int64_t)size.QuadPart : -1;
+    mapping = (fileSize >= mapOffset + mapLen) ?
+      CreateFileMappingA (file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    if (mapping != NULL)
+    {
+      map = (char *)MapViewOfFile (mapping, FILE_MAP_READ, (DWORD)(mapOffset >> 32),
+				   (DWORD)(mapOffset & 0xFFFFFFFF), (SIZE_T)mapLen);
+      CloseHandle (mapping);
+    }
+    CloseHandle (file);
+  }
+#else
+  if ((fd = open (*fName, O_RDONLY)) != -1)
+  {
+    fileSize = (fstat (fd, &st) == 0) ? (int64_t)st.st_size : -1;
+    if (fileSize >= mapOffset + mapLen)
+    {
+      map = (char *)mmap (NULL, (size_t)mapLen, PROT_READ, MAP_SHARED, fd, (off_t)mapOffset);
+      if (map == (char *)MAP_FAILED)
+      {
+	map = NULL;
+      }
+    }
+    close (fd);
+  }
+#endif
+  if ((map == NULL) && (fileSize >= 0) && (fileSize < mapOffset + mapLen))
+  {
+    *status = -1;
+    Rprintf ("The record of replicate %d and step %d is past the end of result store %s.\n",
+	     *replicate, *step, *fName);
+    goto End_of_Routine;
+  }
+  if (map == NULL)
+  {
+    *status = -1;
+    Rprintf ("Can't map result store %s.\n", *fName);
+    goto End_of_Routine;
+  }
+  cells = (int *)(map + (begin - mapOffset));
+
+  /*
+  ** Copy the window, tile by tile, into the (column major) R matrix.
+  */
+  nr = window[1] - window[0] + 1;
+  for (tr = window[0] - window[0] % hdr[2]; tr <= window[1]; tr += hdr[2])
+  {
+    h = (hdr[0] - tr < hdr[2]) ? hdr[0] - tr : hdr[2];
+    for (tc = window[2] - window[2] % hdr[2]; tc <= window[3]; tc += hdr[2])
+    {
+      w = (hdr[1] - tc < hdr[2]) ? hdr[1] - tc : hdr[2];
+      for (i = (tr > window[0]) ? tr : window[0]; (i < tr + h) && (i <= window[1]); i++)
+      {
+	r = i - window[0];
+	for (j = (tc > window[2]) ? tc : window[2]; (j < tc + w) && (j <= window[3]); j++)
+	{
+	  c = j - window[2];
+	  values[c * nr + r] = cells[(int64_t)tr * hdr[1] + (int64_t)h * tc + (i - tr) * w + (j - tc)];
+	}
+      }
+    }
+  }
+
+ End_of_Routine:
+  if (map != NULL)
+  {
+#ifdef _WIN32
+    UnmapViewOfFile (map);
+#else
+    munmap (map, (size_t)mapLen);
+#endif
+  }
+  if (fp != NULL)
+  {
+    fclose (fp);
+  }
+  if (index != NULL)
+  {
+    free (index);
+  }
+}
+
+
+/*
+** EoF: store.c
+*/
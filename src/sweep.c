@@ -0,0 +1,458 @@
+/*
+** sweep.c: Run many parameter sets (scenarios) of a MigClim simulation over
+**          the same landscape in one call. The scenarios are read from a
+**          manifest file, the input layers are read from disk only once and
+**          kept in memory for all scenarios, and the summaries of all
+**          scenarios and replicates are collected into a single table.
+**
+** The manifest is a tab (or space) delimited text file with a header line and
+** one line per scenario, with the columns:
+**
+**   scenario  rcThreshold  iniMatAge  lddFreq  dispKernel  propaguleProd
+**
+** where 'dispKernel' and 'propaguleProd' are comma separated lists of values
+** (e.g. "1,0.4,0.1"). The scenario names are used in the output file names,
+** so they should not contain any spaces.
+**
+** The species of a community simulation (see community.c) are read from a
+** manifest of the same format, with the names of their initial distribution
+** and habitat suitability files in two extra columns:
+**
+**   species  iniDist  hsMap  rcThreshold  iniMatAge  lddFreq  dispKernel  propaguleProd
+*/
+
+#include "migclim.h"
+
+
+/*
+** swParseList: Parse a comma separated list of values into a new array.
+**
+** Returns:
+**   - The number of values, or -1 if the list is invalid (or out of memory).
+*/
+
+static int swParseList (char *str, double **values)
+{
+  int     n, i;
+  char   *s, *end;
+
+  n = 1;
+  for (s = str; *s != '\0'; s++)
+  {
+    if (*s == ',')
+    {
+      n++;
+    }
+  }
+  if ((*values = (double *)malloc (n * sizeof (double))) == NULL)
+  {
+    return (-1);
+  }
+  s = str;
+  for (i = 0; i < n; i++)
+  {
+    (*values)[i] = strtod (s, &end);
+    if ((end == s) || ((*end != ',') && (*end != '\0')))
+    {
+      return (-1);
+    }
+    s = end + 1;
+  }
+  return (n);
+}
+
+
+/*
+** mcReadSweep: Read the scenarios of a parameter sweep (or the species of a
+**              community) from a manifest file.
+**
+** Parameters:
+**   - fName:       The name of the manifest file.
+**   - withLayers:  Whether the manifest has the 'iniDist' and 'hsMap' columns
+**                  of a community manifest.
+**   - scenarios:   A pointer to the array of scenarios to be allocated. It
+**                  must be freed with 'mcFreeSweep' (also when an error
+**                  occurred).
+**   - nrScenarios: A pointer to the number of scenarios read.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+int mcReadSweep (mcContext *ctx, char *fName, bool withLayers, mcScenario **scenarios,
+		 int *nrScenarios)
+{
+  int         status, lineNr, size, nrFields;
+  char        line[4096], kernel[2048], prod[2048], *kind;
+  double      freq;
+  FILE       *fp;
+  mcScenario *s;
+
+  status = -1;
+  *scenarios = NULL;
+  *nrScenarios = 0;
+  size = 0;
+  kind = withLayers ? "community" : "sweep";
+  if ((fp = fopen (fName, "r")) == NULL)
+  {
+    Rprintf ("Can't open %s file %s\n", kind, fName);
+    goto End_of_Routine;
+  }
+
+  lineNr = 0;
+  while (fgets (line, 4096, fp) != NULL)
+  {
+    lineNr++;
+    if ((lineNr == 1) && ((strncmp (line, "scenario", 8) == 0) ||
+			  (strncmp (line, "species", 7) == 0)))
+    {
+      continue;
+    }
+    if (strspn (line, " \t\r\n") == strlen (line))
+    {
+      continue;
+    }
+    if (*nrScenarios == size)
+    {
+      size = (size == 0) ? 16 : 2 * size;
+      if ((s = (mcScenario *)realloc (*scenarios, size * sizeof (mcScenario))) == NULL)
+      {
+	Rprintf ("Not enough memory for the %s scenarios.\n", kind);
+	goto End_of_Routine;
+      }
+      *scenarios = s;
+    }
+    s = &(*scenarios)[*nrScenarios];
+    s->dispKernel = NULL;
+    s->propaguleProd = NULL;
+    (*nrScenarios)++;
+    if (withLayers)
+    {
+      nrFields = sscanf (line, "%63s %127s %127s %d %d %lf %2047s %2047s", s->name,
+			 s->iniDist, s->hsMap, &s->rcThreshold, &s->iniMatAge,
+			 &freq, kernel, prod) - 2;
+    }
+    else
+    {
+      nrFields = sscanf (line, "%63s %d %d %lf %2047s %2047s", s->name,
+			 &s->rcThreshold, &s->iniMatAge, &freq, kernel, prod);
+    }
+    if ((nrFields != 6) || (s->rcThreshold < 0) || (s->rcThreshold > 1000) ||
+	(s->iniMatAge < 1) || (freq < 0.0) || (freq > 1.0))
+    {
+      Rprintf ("Invalid scenario on line %d in %s file %s\n", lineNr, kind, fName);
+      goto End_of_Routine;
+    }
+    s->lddFreq = freq;
+    if ((s->dispDist = swParseList (kernel, &s->dispKernel)) == -1)
+    {
+      Rprintf ("Invalid dispersal kernel on line %d in %s file %s\n", lineNr, kind, fName);
+      goto End_of_Routine;
+    }
+    if ((s->nrPropProd = swParseList (prod, &s->propaguleProd)) == -1)
+    {
+      Rprintf ("Invalid propagule production on line %d in %s file %s\n", lineNr, kind, fName);
+      goto End_of_Routine;
+    }
+    s->fullMatAge = s->iniMatAge + s->nrPropProd;
+    if ((s->lddFreq > 0.0) && (ctx->lddMinDist <= s->dispDist))
+    {
+      Rprintf ("The dispersal kernel on line %d in %s file %s is longer than lddMinDist\n",
+	       lineNr, kind, fName);
+      goto End_of_Routine;
+    }
+  }
+  if (*nrScenarios == 0)
+  {
+    Rprintf ("No scenarios in %s file %s\n", kind, fName);
+    goto End_of_Routine;
+  }
+  status = 0;
+
+ End_of_Routine:
+  if (fp != NULL)
+  {
+    fclose (fp);
+  }
+  return (status);
+}
+
+
+/*
+** mcFreeSweep: Free the scenarios of a parameter sweep.
+*/
+
+void mcFreeSweep (mcScenario *scenarios, int nrScenarios)
+{
+  int i;
+
+  if (scenarios == NULL)
+  {
+    return;
+  }
+  for (i = 0; i < nrScenarios; i++)
+  {
+    if (scenarios[i].dispKernel != NULL)
+    {
+      free (scenarios[i].dispKernel);
+    }
+    if (scenarios[i].propaguleProd != NULL)
+    {
+      free (scenarios[i].propaguleProd);
+    }
+  }
+  free (scenarios);
+}
+
+
+/*
+** mcSetScenario: Set the parameter values of the context to those of a
+**                scenario. The dispersal kernel and propagule production are
+**                copied (the previous ones are freed), so that they can be
+**                freed as usual at the end of the simulation.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - If out of memory:        -1.
+*/
+
+int mcSetScenario (mcContext *ctx, mcScenario *scenario)
+{
+  if (ctx->dispKernel != NULL)
+  {
+    free (ctx->dispKernel);
+  }
+  if (ctx->propaguleProd != NULL)
+  {
+    free (ctx->propaguleProd);
+  }
+  ctx->dispKernel = (double *)malloc (scenario->dispDist * sizeof (double));
+  ctx->propaguleProd = (double *)malloc (scenario->nrPropProd * sizeof (double));
+  if ((ctx->dispKernel == NULL) || (ctx->propaguleProd == NULL))
+  {
+    Rprintf ("Not enough memory for scenario %s.\n", scenario->name);
+    return (-1);
+  }
+  memcpy (ctx->dispKernel, scenario->dispKernel, scenario->dispDist * sizeof (double));
+  memcpy (ctx->propaguleProd, scenario->propaguleProd, scenario->nrPropProd * sizeof (double));
+  ctx->dispDist = scenario->dispDist;
+  ctx->iniMatAge = scenario->iniMatAge;
+  ctx->fullMatAge = scenario->fullMatAge;
+  ctx->lddFreq = scenario->lddFreq;
+  ctx->rcThreshold = scenario->rcThreshold;
+  ctx->useDilation = mcDilationCase (ctx);
+  return (0);
+}
+
+
+/*
+** mcReadLayer: Read a data matrix from file (see 'readMat'), optionally
+**              through the layer cache. A cached layer is read from disk the
+**              first time only; after that, it is copied from memory.
+**
+** Parameters:
+**   - fName: The name of the file to read from.
+**   - mat:   The matrix to put the data in.
+**   - cache: Whether to use the layer cache.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+int mcReadLayer (mcContext *ctx, char *fName, int **mat, bool cache)
+{
+  int            i;
+  mcCachedLayer *layer;
+
+  if (!cache)
+  {
+    return (readMat (ctx, fName, mat));
+  }
+
+  /*
+  ** Look the layer up in the cache.
+  */
+  for (i = 0; i < ctx->nrCachedLayers; i++)
+  {
+    if (strcmp (ctx->layerCache[i].name, fName) == 0)
+    {
+      break;
+    }
+  }
+
+  /*
+  ** Not cached yet: read it from file and keep a copy.
+  */
+  if (i == ctx->nrCachedLayers)
+  {
+    if (readMat (ctx, fName, mat) == -1)
+    {
+      return (-1);
+    }
+    if ((layer = (mcCachedLayer *)realloc (ctx->layerCache, (ctx->nrCachedLayers + 1) *
+					   sizeof (mcCachedLayer))) == NULL)
+    {
+      Rprintf ("Not enough memory to cache layer %s.\n", fName);
+      return (-1);
+    }
+    ctx->layerCache = layer;
+    layer = &ctx->layerCache[ctx->nrCachedLayers];
+    if ((layer->cells = (int *)malloc (ctx->nrRows * ctx->nrCols * sizeof (int))) == NULL)
+    {
+      Rprintf ("Not enough memory to cache layer %s.\n", fName);
+      return (-1);
+    }
+    strncpy (layer->name, fName, 511);
+    layer->name[511] = '\0';
+    layer->grid.xllCorner = ctx->xllCorner;
+    layer->grid.yllCorner = ctx->yllCorner;
+    layer->grid.cellSize = ctx->cellSize;
+    layer->grid.noData = ctx->noData;
+    for (i = 0; i < ctx->nrRows; i++)
+    {
+      memcpy (layer->cells + i * ctx->nrCols, mat[i], ctx->nrCols * sizeof (int));
+    }
+    ctx->nrCachedLayers++;
+    return (0);
+  }
+
+  /*
+  ** Cached: copy it (and its georeference, as 'readMat' would set it).
+  */
+  layer = &ctx->layerCache[i];
+  for (i = 0; i < ctx->nrRows; i++)
+  {
+    memcpy (mat[i], layer->cells + i * ctx->nrCols, ctx->nrCols * sizeof (int));
+  }
+  ctx->xllCorner = layer->grid.xllCorner;
+  ctx->yllCorner = layer->grid.yllCorner;
+  ctx->cellSize = layer->grid.cellSize;
+  ctx->noData = layer->grid.noData;
+  return (0);
+}
+
+
+/*
+** mcClearLayerCache: Free all the layers in the cache.
+*/
+
+void mcClearLayerCache (mcContext *ctx)
+{
+  int i;
+
+  for (i = 0; i < ctx->nrCachedLayers; i++)
+  {
+    free (ctx->layerCache[i].cells);
+  }
+  if (ctx->layerCache != NULL)
+  {
+    free (ctx->layerCache);
+  }
+  ctx->layerCache = NULL;
+  ctx->nrCachedLayers = 0;
+}
+
+
+/*
+** mcWriteSweepSummary: Collect the summaries of all scenarios and replicates
+**                      of a parameter sweep (or of all species of a community)
+**                      into one table, with one line per scenario and
+**                      replicate, and the parameter values of the scenario in
+**                      the first columns.
+**
+** Parameters:
+**   - scenarios:   The scenarios.
+**   - nrScenarios: The number of scenarios.
+**   - tableName:   The name of the table, which is written to a file
+**                  'simulName/simulName_tableName.txt'.
+**   - keyName:     The name of the first column (the scenario names).
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+int mcWriteSweepSummary (mcContext *ctx, mcScenario *scenarios, int nrScenarios, char *tableName,
+			 char *keyName)
+{
+  int         i, rep, status;
+  char        fileName[512], name[256], line[1024], *values;
+  FILE       *fp, *fp2;
+  mcScenario *s;
+
+  status = -1;
+  fp = NULL;
+  fp2 = NULL;
+  if (mcFileName (fileName, sizeof (fileName), "%s/%s_%s.txt", ctx->simulName, ctx->simulName,
+		  tableName) == -1)
+  {
+    goto End_of_Routine;
+  }
+  if ((fp = fopen (fileName, "w")) == NULL)
+  {
+    Rprintf ("Could not open %s summary file for writing.\n", tableName);
+    goto End_of_Routine;
+  }
+  fprintf (fp, "%s\treplicate\trcThreshold\tiniMatAge\tfullMatAge\tlddFreq\tdispDist\t"
+	   "iniCount\tnoDispCount\tunivDispCount\toccupiedCount\tabsentCount\ttotColonized\t"
+	   "totDecolonized\ttotLDDsuccess\trunTime\n", keyName);
+  for (i = 0; i < nrScenarios; i++)
+  {
+    s = &scenarios[i];
+    for (rep = 1; rep <= ctx->replicateNb; rep++)
+    {
+      /*
+      ** The second line of the replicate's summary file holds its values
+      ** (after the simulation name).
+      */
+      if (ctx->replicateNb == 1)
+      {
+	if (mcFileName (name, sizeof (name), "%s_%s", ctx->simulName, s->name) == -1)
+	{
+	  goto End_of_Routine;
+	}
+      }
+      else
+      {
+	if (mcFileName (name, sizeof (name), "%s_%s_%d", ctx->simulName, s->name, rep) == -1)
+	{
+	  goto End_of_Routine;
+	}
+      }
+      if (mcFileName (fileName, sizeof (fileName), "%s/%s_summary.txt", ctx->simulName, name) == -1)
+      {
+	goto End_of_Routine;
+      }
+      if (((fp2 = fopen (fileName, "r")) == NULL) ||
+	  (fgets (line, 1024, fp2) == NULL) || (fgets (line, 1024, fp2) == NULL) ||
+	  ((values = strchr (line, '\t')) == NULL))
+      {
+	Rprintf ("Could not read summary file %s.\n", fileName);
+	goto End_of_Routine;
+      }
+      fclose (fp2);
+      fp2 = NULL;
+      fprintf (fp, "%s\t%d\t%d\t%d\t%d\t%g\t%d\t%s", s->name, rep, s->rcThreshold,
+	       s->iniMatAge, s->fullMatAge, s->lddFreq, s->dispDist, values + 1);
+    }
+  }
+  status = 0;
+
+ End_of_Routine:
+  if (fp != NULL)
+  {
+    fclose (fp);
+  }
+  if (fp2 != NULL)
+  {
+    fclose (fp2);
+  }
+  return (status);
+}
+
+
+/*
+** EoF: sweep.c
+*/
@@ -0,0 +1,1021 @@
+/*
+** tiff.c: Read single band (Geo)TIFF rasters directly, so that the input
+**         layers do not have to be converted to ascii grids first.
+**
+** The baseline TIFF format is supported (classic TIFF, little or big endian,
+** stripped or tiled), with 8, 16 or 32-bit integer or 32 or 64-bit floating
+** point samples, no compression, LZW, Deflate or PackBits compression and
+** the horizontal differencing predictor. The strips (or tiles) are decoded
+** one at a time straight into the matrix, so that no more than one of them
+** is held in memory. The georeference is taken from the GeoTIFF pixel scale
+** and tie point tags, and cells that are NaN or equal to the GDAL NoData tag
+** get the NoData value -9999 (the value the R code uses for ascii grids).
+**
+** If libtiff was found when the package was installed (see 'configure'), the
+** files are read with libtiff, which also reads the TIFF variants that are
+** not listed above (e.g., BigTIFF). The built-in decoder is the fallback: for
+** the files libtiff cannot read, and for the platforms without libtiff.
+*/
+
+#include "migclim.h"
+#include <zlib.h>
+#ifdef HAVE_LIBTIFF
+#include <tiffio.h>
+#ifdef TIFFLIB_AT_LEAST
+#if TIFFLIB_AT_LEAST(4, 5, 0)
+#define TF_OPEN_EXT         /* Per-file error and warning handlers. */
+#endif
+#endif
+#endif
+
+
+/*
+** The TIFF tags and values that are used.
+*/
+#define TF_IMAGE_WIDTH      256
+#define TF_IMAGE_LENGTH     257
+#define TF_BITS_PER_SAMPLE  258
+#define TF_COMPRESSION      259
+#define TF_STRIP_OFFSETS    273
+#define TF_SAMPLES_PER_PIX  277
+#define TF_ROWS_PER_STRIP   278
+#define TF_STRIP_BYTES      279
+#define TF_PLANAR_CONFIG    284
+#define TF_PREDICTOR        317
+#define TF_TILE_WIDTH       322
+#define TF_TILE_LENGTH      323
+#define TF_TILE_OFFSETS     324
+#define TF_TILE_BYTES       325
+#define TF_SAMPLE_FORMAT    339
+#define TF_PIXEL_SCALE      33550
+#define TF_TIE_POINT        33922
+#define TF_GDAL_NODATA      42113
+#define TF_NONE             1
+#define TF_LZW              5
+#define TF_DEFLATE          8
+#define TF_DEFLATE_OLD      32946
+#define TF_PACKBITS         32773
+#define TF_NODATA           -9999
+
+
+/*
+** The properties of a TIFF file. The image is made of chunks (strips or
+** tiles) of 'chunkWidth' x 'chunkHeight' samples.
+*/
+typedef struct _mcTiff
+{
+  FILE     *fp;
+  bool      bigEndian, hasNoData;
+  int       width, height, bits, format, compression, predictor,
+            chunkWidth, chunkHeight, nrChunks;
+  double   *offsets, *byteCounts, scale[3], tiePoint[6], noDataValue;
+} mcTiff;
+
+
+/*
+** tfGet: Get an unsigned integer of 'size' bytes from a buffer, in the byte
+**        order of the file.
+*/
+
+static uint64_t tfGet (mcTiff *tf, unsigned char *buf, int size)
+{
+  int      k;
+  uint64_t v;
+
+  v = 0;
+  for (k = 0; k < size; k++)
+  {
+    v |= (uint64_t)buf[tf->bigEndian ? size - 1 - k : k] << (8 * k);
+  }
+  return (v);
+}
+
+
+/*
+** tfValues: Read the values of an IFD entry (as doubles).
+**
+** Parameters:
+**   - tf:     The TIFF file.
+**   - entry:  The 12 bytes of the IFD entry.
+**   - values: An array to put the values in (NULL to allocate one).
+**   - max:    The maximum number of values to read into 'values'.
+**   - count:  A pointer to an integer to contain the number of values read.
+**
+** Returns:
+**   - The array of values.
+**   - If the entry has an unsupported type or could not be read: NULL.
+*/
+
+static double *tfValues (mcTiff *tf, unsigned char *entry, double *values,
+			 int max, int *count)
+{
+  int            k, type, size, n;
+  unsigned char *buf;
+  union { uint32_t u; float f; } f32;
+  union { uint64_t u; double d; } f64;
+
+  type = (int)tfGet (tf, entry + 2, 2);
+  n = (int)tfGet (tf, entry + 4, 4);
+  size = (type == 1) || (type == 2) || (type == 6) || (type == 7) ? 1 :
+    ((type == 3) || (type == 8) ? 2 : ((type == 4) || (type == 9) || (type == 11) ? 4 :
+				       ((type == 12) ? 8 : 0)));
+  if ((size == 0) || (n < 1) || ((values != NULL) && (type != 2) && (n > max)))
+  {
+    return (NULL);
+  }
+  if ((buf = (unsigned char *)malloc (n * size)) == NULL)
+  {
+    return (NULL);
+  }
+  if (n * size <= 4)
+  {
+    memcpy (buf, entry + 8, n * size);
+  }
+  else if ((fseek (tf->fp, (long)tfGet (tf, entry + 8, 4), SEEK_SET) != 0) ||
+	   (fread (buf, size, n, tf->fp) != (size_t)n))
+  {
+    free (buf);
+    return (NULL);
+  }
+  if ((values == NULL) &&
+      ((values = (double *)malloc (((type == 2) ? 1 : n) * sizeof (double))) == NULL))
+  {
+    free (buf);
+    return (NULL);
+  }
+  if (type == 2)
+  {
+    /*
+    ** An ASCII value (the GDAL NoData tag) is parsed as a number.
+    */
+    buf[n-1] = '\0';
+    values[0] = strtod ((char *)buf, NULL);
+    n = 1;
+  }
+  for (k = 0; (type != 2) && (k < n); k++)
+  {
+    switch (type)
+    {
+    case 6:
+      values[k] = (int8_t)buf[k];
+      break;
+    case 8:
+      values[k] = (int16_t)tfGet (tf, buf + 2 * k, 2);
+      break;
+    case 9:
+      values[k] = (int32_t)tfGet (tf, buf + 4 * k, 4);
+      break;
+    case 11:
+      f32.u = (uint32_t)tfGet (tf, buf + 4 * k, 4);
+      values[k] = f32.f;
+      break;
+    case 12:
+      f64.u = tfGet (tf, buf + 8 * k, 8);
+      values[k] = f64.d;
+      break;
+    default:
+      values[k] = (double)tfGet (tf, buf + size * k, size);
+    }
+  }
+  free (buf);
+  *count = n;
+  return (values);
+}
+
+
+/*
+** tfLzw: Decode a chunk compressed with the TIFF variant of LZW (codes of 9
+**        to 12 bits, most significant bit first, with "early change").
+**
+** Returns:
+**   The number of bytes decoded.
+*/
+
+static size_t tfLzw (unsigned char *src, size_t srcLen, unsigned char *dst,
+		     size_t dstLen)
+{
+  int           code, old, next, width, len, k, prefix[4096], length[4096];
+  unsigned char suffix[4096], first;
+  size_t        bitPos, out;
+
+  for (k = 0; k < 256; k++)
+  {
+    prefix[k] = -1;
+    suffix[k] = (unsigned char)k;
+    length[k] = 1;
+  }
+  width = 9;
+  next = 258;
+  old = -1;
+  out = 0;
+  first = 0;
+  bitPos = 0;
+  while (bitPos + width <= 8 * srcLen)
+  {
+    code = 0;
+    for (k = 0; k < width; k++)
+    {
+      code = (code << 1) |
+	((src[(bitPos + k) / 8] >> (7 - (bitPos + k) % 8)) & 1);
+    }
+    bitPos += width;
+    if (code == 257)
+    {
+      break;
+    }
+    if (code == 256)
+    {
+      width = 9;
+      next = 258;
+      old = -1;
+      continue;
+    }
+    if ((code > next) || ((code == next) && (old == -1)))
+    {
+      break;
+    }
+
+    /*
+    ** Add the string of the previous code plus the first character of the
+    ** current one (which is that of the previous code if the current code is
+    ** the one being added).
+    */
+    if (old != -1)
+    {
+      for (k = (code == next) ? old : code; prefix[k] != -1; k = prefix[k]);
+      first = suffix[k];
+      if (next < 4096)
+      {
+	prefix[next] = old;
+	suffix[next] = first;
+	length[next] = length[old] + 1;
+	next++;
+      }
+    }
+
+    /*
+    ** Write the string of the code (backwards, from its last character).
+    */
+    len = length[code];
+    for (k = code; k != -1; k = prefix[k])
+    {
+      len--;
+      if (out + len < dstLen)
+      {
+	dst[out + len] = suffix[k];
+      }
+    }
+    out += length[code];
+    if (out >= dstLen)
+    {
+      return (dstLen);
+    }
+    old = code;
+    if ((next >= (1 << width) - 1) && (width < 12))
+    {
+      width++;
+    }
+  }
+  return (out);
+}
+
+
+/*
+** tfPackBits: Decode a chunk compressed with PackBits.
+**
+** Returns:
+**   The number of bytes decoded.
+*/
+
+static size_t tfPackBits (unsigned char *src, size_t srcLen, unsigned char *dst,
+			  size_t dstLen)
+{
+  int    n;
+  size_t in, out;
+
+  in = out = 0;
+  while ((in < srcLen) && (out < dstLen))
+  {
+    n = (signed char)src[in++];
+    if (n >= 0)
+    {
+      for (n++; (n > 0) && (in < srcLen) && (out < dstLen); n--)
+      {
+	dst[out++] = src[in++];
+      }
+    }
+    else if ((n != -128) && (in < srcLen))
+    {
+      for (n = 1 - n; (n > 0) && (out < dstLen); n--)
+      {
+	dst[out++] = src[in];
+      }
+      in++;
+    }
+  }
+  return (out);
+}
+
+
+/*
+** tfSample: Get sample k of a decoded chunk as a double.
+*/
+
+static double tfSample (mcTiff *tf, unsigned char *buf, int k)
+{
+  union { uint32_t u; float f; } f32;
+  union { uint64_t u; double d; } f64;
+  int bytes;
+
+  bytes = tf->bits / 8;
+  if (tf->format == 3)
+  {
+    if (bytes == 4)
+    {
+      f32.u = (uint32_t)tfGet (tf, buf + 4 * k, 4);
+      return (f32.f);
+    }
+    f64.u = tfGet (tf, buf + 8 * k, 8);
+    return (f64.d);
+  }
+  if (tf->format == 2)
+  {
+    return ((bytes == 1) ? (double)(int8_t)buf[k] :
+	    ((bytes == 2) ? (double)(int16_t)tfGet (tf, buf + 2 * k, 2) :
+	     (double)(int32_t)tfGet (tf, buf + 4 * k, 4)));
+  }
+  return ((double)tfGet (tf, buf + bytes * k, bytes));
+}
+
+
+/*
+** tfUndoPredictor: Undo the horizontal differencing of the rows of a chunk
+**                  (the samples are integers, which wrap around).
+*/
+
+static void tfUndoPredictor (mcTiff *tf, unsigned char *buf, int nrRowsInChunk)
+{
+  int            i, j, k, bytes;
+  uint64_t       v, prev, mask;
+  unsigned char *p;
+
+  bytes = tf->bits / 8;
+  mask = (bytes == 8) ? ~(uint64_t)0 : (((uint64_t)1 << tf->bits) - 1);
+  for (i = 0; i < nrRowsInChunk; i++)
+  {
+    prev = tfGet (tf, buf + (size_t)i * tf->chunkWidth * bytes, bytes);
+    for (j = 1; j < tf->chunkWidth; j++)
+    {
+      p = buf + ((size_t)i * tf->chunkWidth + j) * bytes;
+      v = (tfGet (tf, p, bytes) + prev) & mask;
+      prev = v;
+      for (k = 0; k < bytes; k++)
+      {
+	p[tf->bigEndian ? bytes - 1 - k : k] = (unsigned char)(v >> (8 * k));
+      }
+    }
+  }
+}
+
+
+/*
+** tfReadHeader: Read the header and the first image file directory (IFD).
+**
+** Returns:
+**   - If everything went fine: 0.
+**   - Otherwise:              -1 (with a message in 'errMsg').
+*/
+
+static int tfReadHeader (mcTiff *tf, char *fName, char *errMsg)
+{
+  int           e, n, tag, count, spp, planar, tileWidth, tileHeight,
+                rowsPerStrip;
+  unsigned char head[8], entry[12];
+  double        v, *arr;
+
+  if (fread (head, 1, 8, tf->fp) != 8)
+  {
+    snprintf (errMsg, 256, "Invalid TIFF header in data file %s\n", fName);
+    return (-1);
+  }
+  tf->bigEndian = (head[0] == 'M');
+  if (tfGet (tf, head + 2, 2) != 42)
+  {
+    snprintf (errMsg, 256, "Only classic (not BigTIFF) TIFF files are supported (%s)\n", fName);
+    return (-1);
+  }
+  if ((fseek (tf->fp, (long)tfGet (tf, head + 4, 4), SEEK_SET) != 0) ||
+      (fread (head, 1, 2, tf->fp) != 2))
+  {
+    snprintf (errMsg, 256, "Invalid TIFF directory in data file %s\n", fName);
+    return (-1);
+  }
+  n = (int)tfGet (tf, head, 2);
+  tf->bits = 8;
+  tf->format = 1;
+  tf->compression = TF_NONE;
+  tf->predictor = 1;
+  spp = 1;
+  planar = 1;
+  tileWidth = tileHeight = 0;
+  rowsPerStrip = INT_MAX;
+  for (e = 0; e < n; e++)
+  {
+    if ((fseek (tf->fp, (long)tfGet (tf, head + 4, 4) + 2 + 12 * e, SEEK_SET) != 0) ||
+	(fread (entry, 1, 12, tf->fp) != 12))
+    {
+      snprintf (errMsg, 256, "Invalid TIFF directory in data file %s\n", fName);
+      return (-1);
+    }
+    tag = (int)tfGet (tf, entry, 2);
+    arr = NULL;
+    count = 0;
+    if ((tag == TF_STRIP_OFFSETS) || (tag == TF_TILE_OFFSETS))
+    {
+      arr = tf->offsets = tfValues (tf, entry, NULL, 0, &count);
+      tf->nrChunks = count;
+    }
+    else if ((tag == TF_STRIP_BYTES) || (tag == TF_TILE_BYTES))
+    {
+      arr = tf->byteCounts = tfValues (tf, entry, NULL, 0, &count);
+    }
+    else if (tag == TF_PIXEL_SCALE)
+    {
+      arr = tfValues (tf, entry, tf->scale, 3, &count);
+    }
+    else if (tag == TF_TIE_POINT)
+    {
+      arr = tfValues (tf, entry, tf->tiePoint, 6, &count);
+    }
+    else if ((tag == TF_IMAGE_WIDTH) || (tag == TF_IMAGE_LENGTH) ||
+	     (tag == TF_BITS_PER_SAMPLE) || (tag == TF_COMPRESSION) ||
+	     (tag == TF_SAMPLES_PER_PIX) || (tag == TF_ROWS_PER_STRIP) ||
+	     (tag == TF_PLANAR_CONFIG) || (tag == TF_PREDICTOR) ||
+	     (tag == TF_TILE_WIDTH) || (tag == TF_TILE_LENGTH) ||
+	     (tag == TF_SAMPLE_FORMAT) || (tag == TF_GDAL_NODATA))
+    {
+      if ((arr = tfValues (tf, entry, &v, 1, &count)) == NULL)
+      {
+	if (tfGet (tf, entry + 4, 4) > 1)
+	{
+	  snprintf (errMsg, 256, "Only single band TIFF files are supported (%s)\n", fName);
+	  return (-1);
+	}
+      }
+      switch (tag)
+      {
+      case TF_IMAGE_WIDTH:     tf->width = (int)v;       break;
+      case TF_IMAGE_LENGTH:    tf->height = (int)v;      break;
+      case TF_BITS_PER_SAMPLE: tf->bits = (int)v;        break;
+      case TF_COMPRESSION:     tf->compression = (int)v; break;
+      case TF_SAMPLES_PER_PIX: spp = (int)v;             break;
+      case TF_ROWS_PER_STRIP:  rowsPerStrip = (int)v;    break;
+      case TF_PLANAR_CONFIG:   planar = (int)v;          break;
+      case TF_PREDICTOR:       tf->predictor = (int)v;   break;
+      case TF_TILE_WIDTH:      tileWidth = (int)v;       break;
+      case TF_TILE_LENGTH:     tileHeight = (int)v;      break;
+      case TF_SAMPLE_FORMAT:   tf->format = (int)v;      break;
+      case TF_GDAL_NODATA:     tf->noDataValue = v;
+	                       tf->hasNoData = true;     break;
+      }
+    }
+    else
+    {
+      continue;
+    }
+    if (arr == NULL)
+    {
+      snprintf (errMsg, 256, "Invalid value of TIFF tag %d in data file %s\n", tag, fName);
+      return (-1);
+    }
+  }
+
+  /*
+  ** Check that the image is supported and set up its chunks.
+  */
+  if ((spp != 1) && (planar != 2))
+  {
+    snprintf (errMsg, 256, "Only single band TIFF files are supported (%s)\n", fName);
+    return (-1);
+  }
+  if ((tf->compression != TF_NONE) && (tf->compression != TF_LZW) &&
+      (tf->compression != TF_DEFLATE) && (tf->compression != TF_DEFLATE_OLD) &&
+      (tf->compression != TF_PACKBITS))
+  {
+    snprintf (errMsg, 256, "Unsupported TIFF compression (%d) in data file %s\n",
+	      tf->compression, fName);
+    return (-1);
+  }
+  if (!(((tf->format == 1) || (tf->format == 2)) &&
+	((tf->bits == 8) || (tf->bits == 16) || (tf->bits == 32))) &&
+      !((tf->format == 3) && ((tf->bits == 32) || (tf->bits == 64))))
+  {
+    snprintf (errMsg, 256, "Unsupported TIFF sample type in data file %s\n", fName);
+    return (-1);
+  }
+  if ((tf->predictor != 1) && ((tf->predictor != 2) || (tf->format == 3)))
+  {
+    snprintf (errMsg, 256, "Unsupported TIFF predictor in data file %s\n", fName);
+    return (-1);
+  }
+  if (tileWidth > 0)
+  {
+    tf->chunkWidth = tileWidth;
+    tf->chunkHeight = tileHeight;
+  }
+  else
+  {
+    tf->chunkWidth = tf->width;
+    tf->chunkHeight = (rowsPerStrip > tf->height) ? tf->height : rowsPerStrip;
+  }
+  if ((tf->width < 1) || (tf->height < 1) || (tf->chunkWidth < 1) ||
+      (tf->chunkHeight < 1) || (tf->offsets == NULL) || (tf->byteCounts == NULL))
+  {
+    snprintf (errMsg, 256, "Incomplete TIFF directory in data file %s\n", fName);
+    return (-1);
+  }
+  return (0);
+}
+
+
+/*
+** tfSetGrid: Check the dimensions of a TIFF file against those of the matrix
+**            (or set them, if there is no matrix) and set its georeference
+**            (the tie point is the upper left corner of cell (I, J)).
+**
+** Returns:
+**   - If everything went fine: 0.
+**   - Otherwise:              -1 (with a message in 'errMsg').
+*/
+
+static int tfSetGrid (mcTiff *tf, char *fName, int **mat, mcGrid *grid, char *errMsg)
+{
+  if (mat == NULL)
+  {
+    grid->nrRows = tf->height;
+    grid->nrCols = tf->width;
+  }
+  else if ((tf->height != grid->nrRows) || (tf->width != grid->nrCols))
+  {
+    snprintf (errMsg, 256, "Invalid number of rows or columns in data file %s\n", fName);
+    return (-1);
+  }
+  grid->cellSize = tf->scale[0];
+  grid->xllCorner = tf->tiePoint[3] - tf->tiePoint[0] * tf->scale[0];
+  grid->yllCorner = tf->tiePoint[4] + tf->tiePoint[1] * tf->scale[1] -
+    tf->height * tf->scale[1];
+  grid->noData = TF_NODATA;
+  return (0);
+}
+
+
+/*
+** tfPutChunk: Put the samples of decoded chunk c into the matrix.
+**
+** Parameters:
+**   - buf:         The decoded chunk.
+**   - c:           The index of the chunk.
+**   - nrChunkCols: The number of chunks across the image.
+**   - mat:         The matrix.
+*/
+
+static void tfPutChunk (mcTiff *tf, unsigned char *buf, int c, int nrChunkCols, int **mat)
+{
+  int    i, j, row, col;
+  double v;
+
+  for (i = 0; i < tf->chunkHeight; i++)
+  {
+    row = (c / nrChunkCols) * tf->chunkHeight + i;
+    for (j = 0; (j < tf->chunkWidth) && (row < tf->height); j++)
+    {
+      col = (c % nrChunkCols) * tf->chunkWidth + j;
+      if (col >= tf->width)
+      {
+	break;
+      }
+      v = tfSample (tf, buf, i * tf->chunkWidth + j);
+      mat[row][col] = (isnan (v) || (tf->hasNoData && (v == tf->noDataValue))) ?
+	TF_NODATA : (int)round (v);
+    }
+  }
+}
+
+
+/*
+** tfRead: Read a data matrix from a (Geo)TIFF file with the built-in decoder
+**         (see 'mcReadTiff').
+*/
+
+static int tfRead (char *fName, int **mat, mcGrid *grid, char *errMsg)
+{
+  int            c, nrChunkRows, nrChunkCols, status;
+  size_t         chunkSize, got;
+  uLongf         outLen;
+  unsigned char *src, *buf;
+  mcTiff         tf;
+
+  status = -1;
+  src = buf = NULL;
+  memset (&tf, 0, sizeof (mcTiff));
+  tf.scale[0] = tf.scale[1] = 1.0;
+  errMsg[0] = '\0';
+  if ((tf.fp = fopen (fName, "rb")) == NULL)
+  {
+    snprintf (errMsg, 256, "Can't open data file %s\n", fName);
+    goto End_of_Routine;
+  }
+  if (tfReadHeader (&tf, fName, errMsg) == -1)
+  {
+    goto End_of_Routine;
+  }
+
+  /*
+  ** The dimensions and georeference.
+  */
+  if (tfSetGrid (&tf, fName, mat, grid, errMsg) == -1)
+  {
+    goto End_of_Routine;
+  }
+  if (mat == NULL)
+  {
+    status = 0;
+    goto End_of_Routine;
+  }
+
+  /*
+  ** Decode the chunks one at a time into the matrix.
+  */
+  nrChunkCols = (tf.width + tf.chunkWidth - 1) / tf.chunkWidth;
+  nrChunkRows = (tf.height + tf.chunkHeight - 1) / tf.chunkHeight;
+  chunkSize = (size_t)tf.chunkWidth * tf.chunkHeight * (tf.bits / 8);
+  if (tf.nrChunks < nrChunkCols * nrChunkRows)
+  {
+    snprintf (errMsg, 256, "Missing TIFF strips or tiles in data file %s\n", fName);
+    goto End_of_Routine;
+  }
+  if ((buf = (unsigned char *)malloc (chunkSize)) == NULL)
+  {
+    snprintf (errMsg, 256, "Not enough memory to read data file %s\n", fName);
+    goto End_of_Routine;
+  }
+  for (c = 0; c < nrChunkCols * nrChunkRows; c++)
+  {
+    if ((src = (unsigned char *)malloc ((size_t)tf.byteCounts[c] + 1)) == NULL)
+    {
+      snprintf (errMsg, 256, "Not enough memory to read data file %s\n", fName);
+      goto End_of_Routine;
+    }
+    if ((fseek (tf.fp, (long)tf.offsets[c], SEEK_SET) != 0) ||
+	(fread (src, 1, (size_t)tf.byteCounts[c], tf.fp) != (size_t)tf.byteCounts[c]))
+    {
+      snprintf (errMsg, 256, "Can't read TIFF strip or tile %d of data file %s\n", c, fName);
+      goto End_of_Routine;
+    }
+    memset (buf, 0, chunkSize);
+    switch (tf.compression)
+    {
+    case TF_NONE:
+      got = ((size_t)tf.byteCounts[c] < chunkSize) ? (size_t)tf.byteCounts[c] : chunkSize;
+      memcpy (buf, src, got);
+      break;
+    case TF_LZW:
+      tfLzw (src, (size_t)tf.byteCounts[c], buf, chunkSize);
+      break;
+    case TF_PACKBITS:
+      tfPackBits (src, (size_t)tf.byteCounts[c], buf, chunkSize);
+      break;
+    default:
+      outLen = chunkSize;
+      if (uncompress (buf, &outLen, src, (uLong)tf.byteCounts[c]) == Z_DATA_ERROR)
+      {
+	snprintf (errMsg, 256, "Invalid Deflate data in data file %s\n", fName);
+	goto End_of_Routine;
+      }
+    }
+    free (src);
+    src = NULL;
+    if (tf.predictor == 2)
+    {
+      tfUndoPredictor (&tf, buf, tf.chunkHeight);
+    }
+    tfPutChunk (&tf, buf, c, nrChunkCols, mat);
+  }
+  status = 0;
+
+ End_of_Routine:
+  /*
+  ** Close the file and free the allocated memory.
+  */
+  if (tf.fp != NULL)
+  {
+    fclose (tf.fp);
+  }
+  if (tf.offsets != NULL)
+  {
+    free (tf.offsets);
+  }
+  if (tf.byteCounts != NULL)
+  {
+    free (tf.byteCounts);
+  }
+  if (src != NULL)
+  {
+    free (src);
+  }
+  if (buf != NULL)
+  {
+    free (buf);
+  }
+  return (status);
+}
+
+
+#ifdef HAVE_LIBTIFF
+/*
+** tfLibValues: Get the values of a double array tag with libtiff (the
+**              GeoTIFF tags are not known to libtiff, so they are read as
+**              anonymous tags, with a count).
+**
+** Parameters:
+**   - tif:    The TIFF file.
+**   - tag:    The tag.
+**   - values: An array to put the values in.
+**   - max:    The maximum number of values to put in 'values'.
+*/
+
+static void tfLibValues (TIFF *tif, uint32_t tag, double *values, int max)
+{
+  int              k, n;
+  uint16_t         count16;
+  uint32_t         count32;
+  double          *data;
+  const TIFFField *field;
+
+  if (((field = TIFFFindField (tif, tag, TIFF_ANY)) == NULL) ||
+      !TIFFFieldPassCount (field) || (TIFFFieldDataType (field) != TIFF_DOUBLE))
+  {
+    return;
+  }
+  n = 0;
+  if (TIFFFieldReadCount (field) == TIFF_VARIABLE2)
+  {
+    n = TIFFGetField (tif, tag, &count32, &data) ? (int)count32 : 0;
+  }
+  else
+  {
+    n = TIFFGetField (tif, tag, &count16, &data) ? (int)count16 : 0;
+  }
+  for (k = 0; (k < n) && (k < max); k++)
+  {
+    values[k] = data[k];
+  }
+}
+
+
+/*
+** tfLibNoData: Get the GDAL NoData tag (an ascii string) with libtiff.
+*/
+
+static void tfLibNoData (TIFF *tif, mcTiff *tf)
+{
+  int              ok;
+  uint16_t         count16;
+  uint32_t         count32;
+  char            *str, *end;
+  const TIFFField *field;
+
+  if ((field = TIFFFindField (tif, TF_GDAL_NODATA, TIFF_ANY)) == NULL)
+  {
+    return;
+  }
+  if (!TIFFFieldPassCount (field))
+  {
+    ok = TIFFGetField (tif, TF_GDAL_NODATA, &str);
+  }
+  else if (TIFFFieldReadCount (field) == TIFF_VARIABLE2)
+  {
+    ok = TIFFGetField (tif, TF_GDAL_NODATA, &count32, &str);
+  }
+  else
+  {
+    ok = TIFFGetField (tif, TF_GDAL_NODATA, &count16, &str);
+  }
+  if (ok && (str != NULL))
+  {
+    tf->noDataValue = strtod (str, &end);
+    tf->hasNoData = (end != str);
+  }
+}
+
+
+#ifdef TF_OPEN_EXT
+/*
+** tfQuiet: An error and warning handler of a file opened with libtiff, that
+**          keeps the messages from being printed (the caller reports the
+**          error itself).
+*/
+
+static int tfQuiet (TIFF *tif, void *userData, const char *module, const char *fmt, va_list ap)
+{
+  (void)tif;
+  (void)userData;
+  (void)module;
+  (void)fmt;
+  (void)ap;
+  return (1);
+}
+#endif
+
+
+/*
+** tfReadLib: Read a data matrix from a (Geo)TIFF file with libtiff (see
+**            'mcReadTiff'). The chunks are decoded by libtiff (which also
+**            undoes the predictor and puts the samples in the byte order of
+**            the machine), and are put into the matrix as by 'tfRead'.
+**
+** Note: libtiff's messages are kept quiet with handlers of the file itself
+**       (libtiff 4.5 and later), or otherwise by replacing the global
+**       handlers of the process for the time of the call, and restoring
+**       them afterwards (in which case 'mcReadTiff' does not call this
+**       function from more than one thread at a time).
+*/
+
+static int tfReadLib (char *fName, int **mat, mcGrid *grid, char *errMsg)
+{
+  int            c, nrChunkRows, nrChunkCols, status;
+  uint16_t       bits, format, spp, planar, one;
+  uint32_t       width, height, chunkWidth, chunkHeight;
+  tmsize_t       chunkSize;
+  unsigned char *buf;
+  TIFF          *tif;
+  mcTiff         tf;
+#ifdef TF_OPEN_EXT
+  TIFFOpenOptions *options;
+#else
+  TIFFErrorHandler oldError, oldWarning;
+#endif
+
+  status = -1;
+  buf = NULL;
+  tif = NULL;
+  memset (&tf, 0, sizeof (mcTiff));
+  tf.scale[0] = tf.scale[1] = 1.0;
+  one = 1;
+  errMsg[0] = '\0';
+
+  /*
+  ** Open the file (without libtiff's messages, as this function does not
+  ** print anything) and get its properties.
+  */
+#ifdef TF_OPEN_EXT
+  if ((options = TIFFOpenOptionsAlloc ()) == NULL)
+  {
+    snprintf (errMsg, 256, "Not enough memory to read data file %s\n", fName);
+    return (-1);
+  }
+  TIFFOpenOptionsSetErrorHandlerExtR (options, tfQuiet, NULL);
+  TIFFOpenOptionsSetWarningHandlerExtR (options, tfQuiet, NULL);
+  tif = TIFFOpenExt (fName, "r", options);
+  TIFFOpenOptionsFree (options);
+#else
+  oldError = TIFFSetErrorHandler (NULL);
+  oldWarning = TIFFSetWarningHandler (NULL);
+  tif = TIFFOpen (fName, "r");
+#endif
+  if (tif == NULL)
+  {
+    snprintf (errMsg, 256, "Can't open data file %s\n", fName);
+    goto End_of_Routine;
+  }
+  width = height = 0;
+  TIFFGetField (tif, TIFFTAG_IMAGEWIDTH, &width);
+  TIFFGetField (tif, TIFFTAG_IMAGELENGTH, &height);
+  TIFFGetFieldDefaulted (tif, TIFFTAG_BITSPERSAMPLE, &bits);
+  TIFFGetFieldDefaulted (tif, TIFFTAG_SAMPLEFORMAT, &format);
+  TIFFGetFieldDefaulted (tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+  TIFFGetFieldDefaulted (tif, TIFFTAG_PLANARCONFIG, &planar);
+  if (TIFFIsTiled (tif))
+  {
+    TIFFGetField (tif, TIFFTAG_TILEWIDTH, &chunkWidth);
+    TIFFGetField (tif, TIFFTAG_TILELENGTH, &chunkHeight);
+    chunkSize = TIFFTileSize (tif);
+  }
+  else
+  {
+    chunkWidth = width;
+    TIFFGetFieldDefaulted (tif, TIFFTAG_ROWSPERSTRIP, &chunkHeight);
+    chunkHeight = (chunkHeight > height) ? height : chunkHeight;
+    chunkSize = TIFFStripSize (tif);
+  }
+  tf.width = (int)width;
+  tf.height = (int)height;
+  tf.bits = bits;
+  tf.format = format;
+  tf.chunkWidth = (int)chunkWidth;
+  tf.chunkHeight = (int)chunkHeight;
+  tf.bigEndian = (*(unsigned char *)&one == 0);
+  if (((spp != 1) && (planar != PLANARCONFIG_SEPARATE)) ||
+      !((((format == 1) || (format == 2)) && ((bits == 8) || (bits == 16) || (bits == 32))) ||
+	((format == 3) && ((bits == 32) || (bits == 64)))) ||
+      (tf.width < 1) || (tf.height < 1) || (tf.chunkWidth < 1) || (tf.chunkHeight < 1) ||
+      (chunkSize < (tmsize_t)tf.chunkWidth * tf.chunkHeight * (bits / 8)))
+  {
+    snprintf (errMsg, 256, "Unsupported TIFF layout or sample type in data file %s\n", fName);
+    goto End_of_Routine;
+  }
+
+  /*
+  ** The dimensions and georeference.
+  */
+  tfLibValues (tif, TF_PIXEL_SCALE, tf.scale, 3);
+  tfLibValues (tif, TF_TIE_POINT, tf.tiePoint, 6);
+  tfLibNoData (tif, &tf);
+  if (tfSetGrid (&tf, fName, mat, grid, errMsg) == -1)
+  {
+    goto End_of_Routine;
+  }
+  if (mat == NULL)
+  {
+    status = 0;
+    goto End_of_Routine;
+  }
+
+  /*
+  ** Decode the chunks (of the first band) one at a time into the matrix.
+  */
+  nrChunkCols = (tf.width + tf.chunkWidth - 1) / tf.chunkWidth;
+  nrChunkRows = (tf.height + tf.chunkHeight - 1) / tf.chunkHeight;
+  if ((buf = (unsigned char *)malloc ((size_t)chunkSize)) == NULL)
+  {
+    snprintf (errMsg, 256, "Not enough memory to read data file %s\n", fName);
+    goto End_of_Routine;
+  }
+  for (c = 0; c < nrChunkCols * nrChunkRows; c++)
+  {
+    if ((TIFFIsTiled (tif) ? TIFFReadEncodedTile (tif, (uint32_t)c, buf, chunkSize) :
+	 TIFFReadEncodedStrip (tif, (uint32_t)c, buf, chunkSize)) == -1)
+    {
+      snprintf (errMsg, 256, "Can't read TIFF strip or tile %d of data file %s\n", c, fName);
+      goto End_of_Routine;
+    }
+    tfPutChunk (&tf, buf, c, nrChunkCols, mat);
+  }
+  status = 0;
+
+ End_of_Routine:
+  /*
+  ** Close the file, free the allocated memory and restore libtiff's
+  ** handlers.
+  */
+  if (tif != NULL)
+  {
+    TIFFClose (tif);
+  }
+  if (buf != NULL)
+  {
+    free (buf);
+  }
+#ifndef TF_OPEN_EXT
+  TIFFSetErrorHandler (oldError);
+  TIFFSetWarningHandler (oldWarning);
+#endif
+  return (status);
+}
+#endif
+
+
+/*
+** mcReadTiff: Read a data matrix from a (Geo)TIFF file (see 'mcReadGrid',
+**             which calls this function for TIFF files, for the parameters
+**             and the result). Like 'mcReadGrid', this function does not
+**             use a simulation context and does not print anything.
+*/
+
+int mcReadTiff (char *fName, int **mat, mcGrid *grid, char *errMsg)
+{
+#ifdef HAVE_LIBTIFF
+  int status;
+
+#ifdef TF_OPEN_EXT
+  status = tfReadLib (fName, mat, grid, errMsg);
+#else
+  /*
+  ** The handlers are swapped for the whole process (see 'tfReadLib'), so
+  ** the threads of 'validateBatch' must not do it at the same time.
+  */
+#pragma omp critical (mcTiffHandlers)
+  status = tfReadLib (fName, mat, grid, errMsg);
+#endif
+  if (status == 0)
+  {
+    return (0);
+  }
+#endif
+  return (tfRead (fName, mat, grid, errMsg));
+}
+
+
+/*
+** EoF: tiff.c
+*/
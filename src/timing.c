@@ -0,0 +1,39 @@
+/*
+** timing.c: High-resolution timing functions.
+*/
+
+#ifdef _WIN32
+#include <windows.h>   /* Must come before R.h (see "Writing R Extensions"). */
+#endif
+
+#include "migclim.h"
+
+
+/*
+** mcClockNs: Read a monotonic clock.
+**
+** Returns:
+**   The current value of the clock, in nanoseconds. Only differences between
+**   two values are meaningful.
+*/
+
+int64_t mcClockNs (void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER count, freq;
+
+  QueryPerformanceCounter (&count);
+  QueryPerformanceFrequency (&freq);
+  return ((int64_t)((double)count.QuadPart * 1.0e9 / (double)freq.QuadPart));
+#else
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+#endif
+}
+
+
+/*
+** EoF: timing.c
+*/
@@ -17,14 +17,14 @@
 **   The number of suitable and non-barrier pixels.
 */
 
-int mcUnivDispCnt (int **habSuit)
+int mcUnivDispCnt (mcContext *ctx, int **habSuit)
 {
   int i, j, count;
 
   /* Count the number of suitable and non-barrier pixels. */
   count = 0;
-  for (i = 0; i < nrRows; i++){
-    for (j = 0; j < nrCols; j++){
+  for (i = 0; i < ctx->nrRows; i++){
+    for (j = 0; j < ctx->nrCols; j++){
       if (habSuit[i][j] > 0) count++;
     }
   }
@@ -48,13 +48,13 @@ int mcUnivDispCnt (int **habSuit)
 **                  will be updated!).
 */
 
-void updateNoDispMat (int **hsMat, int **noDispMat, int *noDispCount)
+void updateNoDispMat (mcContext *ctx, int **hsMat, int **noDispMat, int *noDispCount)
 {                   
   int i, j;
 
   if (*noDispCount > 0){
-    for(i = 0; i < nrRows; i++){
-      for(j = 0; j < nrCols; j++){
+    for(i = 0; i < ctx->nrRows; i++){
+      for(j = 0; j < ctx->nrCols; j++){
 	    if((noDispMat[i][j] == 1) && (hsMat[i][j] == 0)){
 	      noDispMat[i][j] = 0;
 	      (*noDispCount)--;
@@ -10,239 +10,579 @@
 
 
 /*
-** validate: Compare a genetic clusters simulation result with an observed
-**           cluster and calculate a matching score. This score is the fraction
-**           of observed points that are closest to their own cluster in the
-**           simulated result (after the re-labeling of clusters).
+** mcBestMatch: Find the one-to-one matching of observed to simulated clusters
+**              with the largest total weight, with the Hungarian algorithm
+**              (in O(n^3) time, see e.g. Kuhn 1955, Munkres 1957).
 **
 ** Parameters:
-**   - obsFileName: The file name with the observed cluster data.
-**   - npts:        The number of points (locations) in the data file.
-**   - simFileName: The file name with the simulated cluster data.
-**   - ncls:        The number of genetic groups.
-**   - bestScore:   A pointer to a double array with at least 2 elements,
-**                  which will contains the scores (total and average).
+**   - weight: An n x n array (by row) with the weight of matching observed
+**             cluster i to simulated cluster j.
+**   - n:      The number of clusters.
+**   - match:  An array of n elements, which will contain the (0-based)
+**             simulated cluster matched to each observed cluster.
+**
+** Returns:
+**   The total weight of the best matching, or -1 if out of memory (nothing
+**   is printed, as this function may be called from several threads).
 */
 
-void validate (char **obsFileName, int *npts, char **simFileName, int *ncls,
-	       double *bestScore)
+double mcBestMatch (double *weight, int n, int *match)
 {
-  int     i, j, x, y, n, cl, *obsCluster[2], **simCluster, *match, obs, sim,
-          row, col, *points, nrPoints, nrClusters;
-  float   c0, c1;
-  double *coord[2], dist, minDist, *score, totScore, totScoreMax, avgScore,
-          avgScoreMax;
-  char    line[1024];
-  FILE   *fp;
-  
+  int     i, j, i0, j0, j1, *p, *way;
+  double *u, *v, *minv, cur, delta, total;
+  bool   *used;
+
   /*
-  ** Initialize the variables.
+  ** The classic potentials formulation, which minimizes the cost, so the
+  ** weights are negated. Rows and columns are numbered from 1 here, with
+  ** column 0 used as the starting point of the augmenting paths.
   */
-  nrPoints = *npts;
-  nrClusters = *ncls;
-  score = NULL;
-  points = NULL;
+  p = (int *)malloc ((n+1) * sizeof (int));
+  way = (int *)malloc ((n+1) * sizeof (int));
+  u = (double *)malloc ((n+1) * sizeof (double));
+  v = (double *)malloc ((n+1) * sizeof (double));
+  minv = (double *)malloc ((n+1) * sizeof (double));
+  used = (bool *)malloc ((n+1) * sizeof (bool));
+  total = -1;
+  if ((p == NULL) || (way == NULL) || (u == NULL) || (v == NULL) ||
+      (minv == NULL) || (used == NULL))
+  {
+    goto End_of_Routine;
+  }
+  for (j = 0; j <= n; j++)
+  {
+    p[j] = 0;
+    way[j] = 0;
+    u[j] = 0.0;
+    v[j] = 0.0;
+  }
+  for (i = 1; i <= n; i++)
+  {
+    p[0] = i;
+    j0 = 0;
+    for (j = 0; j <= n; j++)
+    {
+      minv[j] = HUGE_VAL;
+      used[j] = false;
+    }
+    do
+    {
+      used[j0] = true;
+      i0 = p[j0];
+      delta = HUGE_VAL;
+      j1 = 0;
+      for (j = 1; j <= n; j++)
+      {
+	if (!used[j])
+	{
+	  cur = -weight[(i0-1) * n + (j-1)] - u[i0] - v[j];
+	  if (cur < minv[j])
+	  {
+	    minv[j] = cur;
+	    way[j] = j0;
+	  }
+	  if (minv[j] < delta)
+	  {
+	    delta = minv[j];
+	    j1 = j;
+	  }
+	}
+      }
+      for (j = 0; j <= n; j++)
+      {
+	if (used[j])
+	{
+	  u[p[j]] += delta;
+	  v[j] -= delta;
+	}
+	else
+	{
+	  minv[j] -= delta;
+	}
+      }
+      j0 = j1;
+    } while (p[j0] != 0);
+    do
+    {
+      j1 = way[j0];
+      p[j0] = p[j1];
+      j0 = j1;
+    } while (j0 != 0);
+  }
+
+  total = 0.0;
+  for (j = 1; j <= n; j++)
+  {
+    match[p[j]-1] = j-1;
+    total += weight[(p[j]-1) * n + (j-1)];
+  }
+
+ End_of_Routine:
+  if (p != NULL)
+  {
+    free (p);
+  }
+  if (way != NULL)
+  {
+    free (way);
+  }
+  if (u != NULL)
+  {
+    free (u);
+  }
+  if (v != NULL)
+  {
+    free (v);
+  }
+  if (minv != NULL)
+  {
+    free (minv);
+  }
+  if (used != NULL)
+  {
+    free (used);
+  }
+  return (total);
+}
+
+
+/*
+** mcReadObs: Read an observed cluster distribution from file.
+**
+** Parameters:
+**   - fName:      The file name with the observed cluster data.
+**   - nrPoints:   The number of points (locations) in the data file.
+**   - nrClusters: The number of genetic groups.
+**   - obs:        The observed distribution. It must be freed with
+**                 'mcFreeObs', also if this function fails.
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - Otherwise:               -1.
+*/
+
+int mcReadObs (char *fName, int nrPoints, int nrClusters, mcObs *obs)
+{
+  int    i, n, cl, status;
+  float  c0, c1;
+  char   line[1024];
+  FILE  *fp;
+
+  status = -1;
   fp = NULL;
-  coord[0] = NULL;
-  coord[1] = NULL;
-  obsCluster[0] = NULL;
-  obsCluster[1] = NULL;
-  simCluster = NULL;
-  match = NULL;
-  bestScore[0] = -1;
-  bestScore[1] = -1;
-  
-  /*
-  ** Allocate the necessary memory.
-  */
-  coord[0] = (double *)malloc (nrPoints * sizeof (double));
-  coord[1] = (double *)malloc (nrPoints * sizeof (double));
-  obsCluster[0] = (int *)malloc (nrPoints * sizeof (int));
-  obsCluster[1] = (int *)malloc (nrPoints * sizeof (int));
-  simCluster = (int **)malloc (nrRows * sizeof (int *));
-  for (i = 0; i < nrRows; i++)
-  {
-    simCluster[i] = (int *)malloc (nrCols * sizeof (int));
-  }
-  match = (int *)malloc ((nrClusters+1) * sizeof (int));
-  points = (int *)malloc ((nrClusters+1) * sizeof (int));
-  score = (double *)malloc ((nrClusters+1) * sizeof (double));
-  points[0] = nrPoints;
+  obs->nrPoints = nrPoints;
+  obs->nrClusters = nrClusters;
+  obs->x = (double *)malloc (nrPoints * sizeof (double));
+  obs->y = (double *)malloc (nrPoints * sizeof (double));
+  obs->cluster = (int *)malloc (nrPoints * sizeof (int));
+  obs->points = (int *)malloc ((nrClusters+1) * sizeof (int));
+  if ((obs->x == NULL) || (obs->y == NULL) || (obs->cluster == NULL) ||
+      (obs->points == NULL))
+  {
+    Rprintf ("Not enough memory for the observed cluster data.\n");
+    goto End_of_Routine;
+  }
+  obs->points[0] = nrPoints;
   for (i = 1; i <= nrClusters; i++)
   {
-    points[i] = 0;
+    obs->points[i] = 0;
   }
   
-  /*
-  ** Read the observed cluster data.
-  */
-  if ((fp = fopen(*obsFileName, "r")) == NULL)
+  if ((fp = fopen(fName, "r")) == NULL)
   {
-    Rprintf ("Can't open data file %s.\n", obsFileName);
+    Rprintf ("Can't open data file %s.\n", fName);
     goto End_of_Routine;
   }
   if (fgets (line, 1024, fp) == NULL)
   {
-    Rprintf ("No data in file %s.\n", obsFileName);
+    Rprintf ("No data in file %s.\n", fName);
     goto End_of_Routine;
   }
   for (i = 0; i < nrPoints; i++)
   {
     if (fgets (line, 1024, fp) == NULL)
     {
-      Rprintf ("Invalid number of data points in file %s.\n", obsFileName);
+      Rprintf ("Invalid number of data points in file %s.\n", fName);
       goto End_of_Routine;
     }
     if (sscanf (line, "%d %g %g %d", &n, &c0, &c1, &cl) != 4)
     {
-      Rprintf ("Invalid data format in file %s.\n", obsFileName);
+      Rprintf ("Invalid data format in file %s.\n", fName);
+      goto End_of_Routine;
+    }
+    if ((cl < 1) || (cl > nrClusters))
+    {
+      Rprintf ("Invalid cluster number %d in file %s.\n", cl, fName);
       goto End_of_Routine;
     }
-    coord[0][i] = c0;
-    coord[1][i] = c1;
-    obsCluster[0][i] = cl;
-    points[cl]++;
+    obs->x[i] = c0;
+    obs->y[i] = c1;
+    obs->cluster[i] = cl;
+    obs->points[cl]++;
   }
-  fclose (fp);
-  fp = NULL;
+  status = 0;
 
-  /*
-  ** Read the simulated cluster data.
-  */
-  if (readMat (*simFileName, simCluster) == -1)
+ End_of_Routine:
+  if (fp != NULL)
+  {
+    fclose (fp);
+  }
+  return (status);
+}
+
+
+/*
+** mcFreeObs: Free the memory of an observed cluster distribution.
+*/
+
+void mcFreeObs (mcObs *obs)
+{
+  if (obs->x != NULL)
+  {
+    free (obs->x);
+  }
+  if (obs->y != NULL)
+  {
+    free (obs->y);
+  }
+  if (obs->cluster != NULL)
+  {
+    free (obs->cluster);
+  }
+  if (obs->points != NULL)
+  {
+    free (obs->points);
+  }
+  obs->x = obs->y = NULL;
+  obs->cluster = obs->points = NULL;
+}
+
+
+/*
+** mcScoreSim: Calculate the matching scores of a simulated cluster
+**             distribution with an observed one. This function does not use
+**             a simulation context and does not print anything, so that
+**             several simulations can be scored in parallel.
+**
+** Parameters:
+**   - obs:        The observed cluster distribution.
+**   - simCluster: The simulated cluster matrix.
+**   - grid:       The dimensions and georeference of the simulated matrix.
+**   - tree:       The spatial index to (re)build over the simulated matrix
+**                 (see 'mcKdBuild').
+**   - score:      An array of 2 elements, which will contain the scores
+**                 (total and average).
+**
+** Returns:
+**   - If everything went fine:  0.
+**   - If out of memory:        -1.
+*/
+
+int mcScoreSim (mcObs *obs, int **simCluster, mcGrid *grid, mcKdTree *tree,
+		double *score)
+{
+  int     i, j, n, sim, *table, *match, status;
+  double *weight, totScore, avgScore;
+
+  status = -1;
+  n = obs->nrClusters;
+  table = (int *)malloc (n * n * sizeof (int));
+  weight = (double *)malloc (n * n * sizeof (double));
+  match = (int *)malloc (n * sizeof (int));
+  if ((table == NULL) || (weight == NULL) || (match == NULL) ||
+      (mcKdBuild (simCluster, grid, tree) == -1))
   {
     goto End_of_Routine;
   }
 
   /*
-  ** For each observed cluster point, find the nearest simulated cluster point.
+  ** For each observed cluster point, find the nearest simulated cluster
+  ** point through the spatial index, and count how many points of each
+  ** observed cluster are nearest to each simulated cluster (the contingency
+  ** table). This is not parallelized here: the simulations themselves are
+  ** scored in parallel (see 'validateBatch').
   */
-  for (i = 0; i < nrPoints; i++)
+  for (i = 0; i < n * n; i++)
+  {
+    table[i] = 0;
+  }
+  for (i = 0; i < obs->nrPoints; i++)
   {
-    minDist = (nrRows + nrCols) * cellSize;
-    for (row = 0; row < nrRows; row++)
+    sim = mcKdNearest (tree, obs->x[i], obs->y[i]);
+    if ((sim >= 1) && (sim <= n))
     {
-      for (col = 0; col < nrCols; col++)
-      {
-	if (simCluster[row][col] > 0)
-	{
-	  x = col;
-	  y = (nrRows-1) - row;
-	  c0 = xllCorner + (x*cellSize) + (cellSize/2.0);
-	  c1 = yllCorner + (y*cellSize) + (cellSize/2.0);
-	  dist = sqrt ((coord[0][i]-c0)*(coord[0][i]-c0) +
-		       (coord[1][i]-c1)*(coord[1][i]-c1));
-	  if (dist < minDist)
-	  {
-	    obsCluster[1][i] = simCluster[row][col];
-	    minDist = dist;
-	  }
-	}
-      }
+      table[(obs->cluster[i]-1) * n + (sim-1)]++;
     }
   }
 
   /*
-  ** Create random matches and calculate scores.
+  ** Find the matches of observed to simulated clusters that maximize the
+  ** total score (the fraction of all points that are in their own cluster)
+  ** and the average score (the mean of these fractions per cluster).
   */
-  for (i = 1; i <= nrClusters; i++)
+  for (i = 0; i < n * n; i++)
   {
-    match[i] = i;
+    weight[i] = table[i];
   }
-  totScoreMax = 0.0;
-  avgScoreMax = 0.0;
-  for (i = 1; i <= 1000; i++)
+  if ((totScore = mcBestMatch (weight, n, match)) < 0)
   {
-    for (j = nrClusters; j > 1; j--)
-    {
-      x = (rand () % j) + 1;
-      y = match[j];
-      match[j] = match[x];
-      match[x] = y;
-    }
-    for (j = 0; j <= nrClusters; j++)
-    {
-      score[j] = 0.0;
-    }
-    for (j = 0; j <= nrPoints; j++)
-    {
-      obs = obsCluster[0][j];
-      sim = obsCluster[1][j];
-      if (sim == match[obs])
-      {
-	score[0]++;
-	score[obs]++;
-      }
-    }
-    for (j = 0; j <= nrClusters; j++)
-    {
-      score[j] /= points[j];
-    }
-    totScore = score[0];
-    avgScore = 0.0;
-    for (j = 1; j <= nrClusters; j++)
-    {
-      avgScore += (score[j]/nrClusters);
-    }
-    if (totScore > totScoreMax)
-    {
-      totScoreMax = totScore;
-    }
-    if (avgScore > avgScoreMax)
+    goto End_of_Routine;
+  }
+  for (i = 0; i < n; i++)
+  {
+    for (j = 0; j < n; j++)
     {
-      avgScoreMax = avgScore;
+      weight[i * n + j] = (obs->points[i+1] > 0) ?
+	((double)table[i * n + j] / obs->points[i+1]) : 0.0;
     }
   }
+  if ((avgScore = mcBestMatch (weight, n, match)) < 0)
+  {
+    goto End_of_Routine;
+  }
+  score[0] = totScore / obs->nrPoints;
+  score[1] = avgScore / n;
+  status = 0;
+
+ End_of_Routine:
+  if (table != NULL)
+  {
+    free (table);
+  }
+  if (weight != NULL)
+  {
+    free (weight);
+  }
+  if (match != NULL)
+  {
+    free (match);
+  }
+  return (status);
+}
+
+
+/*
+** validate: Compare a genetic clusters simulation result with an observed
+**           cluster and calculate a matching score. This score is the fraction
+**           of observed points that are closest to their own cluster in the
+**           simulated result (after the best re-labeling of clusters).
+**
+** Parameters:
+**   - obsFileName: The file name with the observed cluster data.
+**   - npts:        The number of points (locations) in the data file.
+**   - simFileName: The file name with the simulated cluster data.
+**   - ncls:        The number of genetic groups.
+**   - bestScore:   A pointer to a double array with at least 2 elements,
+**                  which will contains the scores (total and average).
+*/
+
+void validate (char **obsFileName, int *npts, char **simFileName, int *ncls,
+	       double *bestScore)
+{
+  int      i, **simCluster;
+  char     errMsg[256];
+  mcObs    obs;
+  mcGrid   grid;
+  mcKdTree tree;
+  
   /*
-  ** Set the best score that was found.
+  ** Initialize the variables.
   */
-  bestScore[0] = totScoreMax;
-  bestScore[1] = avgScoreMax;
+  simCluster = NULL;
+  grid.nrRows = 0;
+  tree.pts = NULL;
+  tree.size = 0;
+  bestScore[0] = -1;
+  bestScore[1] = -1;
   
- End_of_Routine:
   /*
-  ** Free the allocated memory and close the file, if necessary.
+  ** Read the observed cluster data.
+  */
+  if (mcReadObs (*obsFileName, *npts, *ncls, &obs) == -1)
+  {
+    goto End_of_Routine;
+  }
+
+  /*
+  ** Read the simulated cluster data (its dimensions first).
   */
-  if (coord[0] != NULL)
+  if (mcReadGrid (*simFileName, NULL, &grid, NULL, errMsg) == -1)
+  {
+    Rprintf ("%s", errMsg);
+    grid.nrRows = 0;
+    goto End_of_Routine;
+  }
+  simCluster = (int **)calloc (grid.nrRows, sizeof (int *));
+  for (i = 0; (simCluster != NULL) && (i < grid.nrRows); i++)
   {
-    free (coord[0]);
+    if ((simCluster[i] = (int *)malloc (grid.nrCols * sizeof (int))) == NULL)
+    {
+      break;
+    }
   }
-  if (coord[1] != NULL)
+  if ((simCluster == NULL) || (i < grid.nrRows))
   {
-    free (coord[1]);
+    Rprintf ("Not enough memory to validate %s.\n", *simFileName);
+    goto End_of_Routine;
   }
-  if (obsCluster[0] != NULL)
+  if (mcReadGrid (*simFileName, simCluster, &grid, NULL, errMsg) == -1)
   {
-    free (obsCluster[0]);
+    Rprintf ("%s", errMsg);
+    goto End_of_Routine;
   }
-  if (obsCluster[1] != NULL)
+
+  /*
+  ** Calculate the scores.
+  */
+  if (mcScoreSim (&obs, simCluster, &grid, &tree, bestScore) == -1)
   {
-    free (obsCluster[1]);
+    Rprintf ("Not enough memory to validate %s.\n", *simFileName);
   }
+  
+ End_of_Routine:
+  /*
+  ** Free the allocated memory.
+  */
+  mcFreeObs (&obs);
   if (simCluster != NULL)
   {
-    for (i = 0; i < nrRows; i++)
+    for (i = 0; i < grid.nrRows; i++)
     {
       free (simCluster[i]);
     }
     free (simCluster);
   }
-  if (match != NULL)
+  mcKdFree (&tree);
+}
+
+
+/*
+** validateBatch: Validate many genetic clusters simulation results against
+**                the same observed cluster distribution. The observed data
+**                is read only once, and the simulated files are read and
+**                scored in parallel, each thread reusing its own matrix and
+**                spatial index for all the files it processes.
+**
+** Parameters:
+**   - obsFileName:  The file name with the observed cluster data.
+**   - npts:         The number of points (locations) in the data file.
+**   - simFileNames: The file names with the simulated cluster data. They
+**                   must all have the same number of rows and columns.
+**   - nfiles:       The number of simulated files.
+**   - ncls:         The number of genetic groups.
+**   - scores:       An array of nfiles x 2 elements (by column), which will
+**                   contain the total scores of all files followed by the
+**                   average scores. The scores of files that could not be
+**                   read are -1.
+*/
+
+void validateBatch (char **obsFileName, int *npts, char **simFileNames,
+		    int *nfiles, int *ncls, double *scores)
+{
+  int      f, nrFiles, nrFailed;
+  char     errMsg[256];
+  mcObs    obs;
+  mcGrid   dims;
+
+  nrFiles = *nfiles;
+  nrFailed = 0;
+  for (f = 0; f < 2 * nrFiles; f++)
   {
-    free (match);
+    scores[f] = -1;
   }
-  if (points != NULL)
+  
+  /*
+  ** Read the observed cluster data, and the dimensions of the simulated
+  ** matrices from the first file.
+  */
+  if (mcReadObs (*obsFileName, *npts, *ncls, &obs) == -1)
   {
-    free (points);
+    goto End_of_Routine;
   }
-  if (score != NULL)
+  if (nrFiles < 1)
   {
-    free (score);
+    goto End_of_Routine;
   }
-  if (fp != NULL)
+  if (mcReadGrid (simFileNames[0], NULL, &dims, NULL, errMsg) == -1)
   {
-    fclose (fp);
+    Rprintf ("%s", errMsg);
+    goto End_of_Routine;
+  }
+
+  /*
+  ** Score the files in parallel. Errors are only counted here, as R's output
+  ** functions must not be called from other threads.
+  */
+#pragma omp parallel
+  {
+    int      i, g, **simCluster;
+    double   score[2];
+    char     threadMsg[256];
+    mcGrid   grid;
+    mcKdTree tree;
+
+    tree.pts = NULL;
+    tree.size = 0;
+    simCluster = (int **)calloc (dims.nrRows, sizeof (int *));
+    for (i = 0; (simCluster != NULL) && (i < dims.nrRows); i++)
+    {
+      if ((simCluster[i] = (int *)malloc (dims.nrCols * sizeof (int))) == NULL)
+      {
+	/*
+	** Out of memory: this thread fails all its files.
+	*/
+	for (i--; i >= 0; i--)
+	{
+	  free (simCluster[i]);
+	}
+	free (simCluster);
+	simCluster = NULL;
+      }
+    }
+
+#pragma omp for schedule(dynamic)
+    for (g = 0; g < nrFiles; g++)
+    {
+      grid.nrRows = dims.nrRows;
+      grid.nrCols = dims.nrCols;
+      if ((simCluster != NULL) &&
+	  (mcReadGrid (simFileNames[g], simCluster, &grid, NULL, threadMsg) == 0) &&
+	  (mcScoreSim (&obs, simCluster, &grid, &tree, score) == 0))
+      {
+	scores[g] = score[0];
+	scores[nrFiles + g] = score[1];
+      }
+      else
+      {
+#pragma omp atomic
+	nrFailed++;
+      }
+    }
+
+    if (simCluster != NULL)
+    {
+      for (i = 0; i < dims.nrRows; i++)
+      {
+	free (simCluster[i]);
+      }
+      free (simCluster);
+    }
+    mcKdFree (&tree);
+  }
+  
+  /*
+  ** Report the files that could not be scored.
+  */
+  for (f = 0; (nrFailed > 0) && (f < nrFiles); f++)
+  {
+    if (scores[f] < 0)
+    {
+      Rprintf ("Could not validate file %s.\n", simFileNames[f]);
+    }
   }
+
+ End_of_Routine:
+  mcFreeObs (&obs);
 }
 
 